@@ -0,0 +1,60 @@
+/* LHOS ADC engine
+ * Owns ADC1. Out of sampling it serves one-shot reads; `lhos_adc_start`
+ * hands the unit to the continuous (DMA) driver, aggregates the stream
+ * into frames on a dedicated task (see lhos_adc_window.h) and passes each
+ * frame to a callback. `lhos_adc_stop` returns the unit to one-shot mode.
+ */
+#ifndef LHOS_ADC_H
+#define LHOS_ADC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "lhos_adc_window.h"
+
+typedef struct
+{
+  int channel;       /* ADC1 channel */
+  uint32_t rate_hz;  /* sample rate */
+  uint32_t window;   /* samples per frame */
+  uint32_t decimate; /* samples per trace point, 0 for no trace */
+  bool simulate;     /* use the simulated source instead of the ADC */
+  /* simulated signal (see lhos_adc_sim_t) */
+  float sim_freq_hz;
+  float sim_amplitude;
+  uint16_t sim_offset;
+  uint16_t sim_noise;
+} lhos_adc_config_t;
+
+typedef struct
+{
+  uint32_t frames;    /* frames delivered to the callback */
+  uint32_t dropped;   /* frames the callback refused */
+  uint64_t samples;   /* samples aggregated */
+  uint32_t overruns;  /* DMA pool overflows (samples lost) */
+  bool running;
+} lhos_adc_stats_t;
+
+/* Return false to count the frame as dropped. Runs on the ADC task. */
+typedef bool (*lhos_adc_sink_t) (const lhos_adc_frame_t *frame, void *ctx);
+
+/* Set up one-shot mode on ADC1 with `channel` configured. */
+esp_err_t lhos_adc_init (int channel);
+
+/* One-shot read of a raw code. ESP_ERR_INVALID_STATE while sampling. */
+esp_err_t lhos_adc_read (int channel, int *raw);
+
+/* Convert a raw code to millivolts with the unit's calibration, or
+   ESP_ERR_NOT_SUPPORTED if the chip has no calibration data. */
+esp_err_t lhos_adc_raw_to_mv (int raw, int *mv);
+
+esp_err_t lhos_adc_start (const lhos_adc_config_t *cfg, lhos_adc_sink_t sink,
+                          void *ctx);
+/* ESP_ERR_TIMEOUT if the capture task did not finish within a second;
+   sampling is then still considered active and stop can be retried. */
+esp_err_t lhos_adc_stop (void);
+
+void lhos_adc_get_stats (lhos_adc_stats_t *out);
+
+#endif /* LHOS_ADC_H */
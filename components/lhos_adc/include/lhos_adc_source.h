@@ -0,0 +1,48 @@
+/* Sample sources for the ADC engine.
+ * The engine pulls 12-bit samples from a source without knowing whether
+ * they come from the DMA driver or from the simulator below, which is
+ * plain C and also used by the host tests.
+ */
+#ifndef LHOS_ADC_SOURCE_H
+#define LHOS_ADC_SOURCE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct lhos_adc_source lhos_adc_source_t;
+
+struct lhos_adc_source
+{
+  /* Prepare to deliver `rate_hz` samples per second from `channel`.
+     Returns 0 on success. */
+  int (*start) (lhos_adc_source_t *src, int channel, uint32_t rate_hz);
+  /* Copy up to `max` samples into `out`, waiting at most `timeout_ms`
+     for data. Returns the count (0 on timeout) or -1 on error. */
+  int (*read) (lhos_adc_source_t *src, uint16_t *out, size_t max,
+               uint32_t timeout_ms);
+  void (*stop) (lhos_adc_source_t *src);
+  /* false if `read` returns immediately and the caller must pace itself
+     to the sample rate */
+  bool realtime;
+};
+
+/* Simulated signal: offset + amplitude * sin(2 pi freq t) plus uniform
+   noise of +-noise codes, clamped to 12 bits. Deterministic for a given
+   seed. */
+typedef struct
+{
+  lhos_adc_source_t base;
+  float freq_hz;
+  float amplitude;
+  uint16_t offset;
+  uint16_t noise;
+  uint32_t rate_hz;
+  uint64_t n; /* samples generated */
+  uint32_t rng;
+} lhos_adc_sim_t;
+
+void lhos_adc_sim_init (lhos_adc_sim_t *sim, float freq_hz, float amplitude,
+                        uint16_t offset, uint16_t noise, uint32_t seed);
+
+#endif /* LHOS_ADC_SOURCE_H */
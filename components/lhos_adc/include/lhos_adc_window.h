@@ -0,0 +1,74 @@
+/* Windowed aggregation of ADC samples.
+ *
+ * Samples are folded into a frame as they arrive; once `samples` have been
+ * seen the frame (count, min, max, sum, sum of squares and an optional
+ * decimated trace) is handed to a callback and a new one starts. The
+ * decimated trace keeps one point per `decimate` samples, each point the
+ * rounded mean of its group (boxcar), so it doubles as a low-pass filter.
+ *
+ * Frames hold exactly `samples` samples and are numbered without gaps; a
+ * trace group never spans two frames, so one cut short by the end of a
+ * window is dropped. Feeding neither allocates nor blocks, which keeps it
+ * usable from the capture task at any sample rate.
+ */
+#ifndef LHOS_ADC_WINDOW_H
+#define LHOS_ADC_WINDOW_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Longest decimated trace carried by a frame. */
+#ifndef LHOS_ADC_MAX_POINTS
+#define LHOS_ADC_MAX_POINTS 64
+#endif
+
+typedef struct
+{
+  uint32_t samples;  /* samples per frame, > 0 */
+  uint32_t decimate; /* samples per trace point; 0 disables the trace */
+} lhos_adc_window_config_t;
+
+typedef struct
+{
+  uint32_t seq;   /* frame number since the window was initialized */
+  uint32_t count; /* samples folded in */
+  uint16_t min;
+  uint16_t max;
+  uint64_t sum;
+  uint64_t sum_sq;
+  int64_t t_us; /* left for the producer to stamp */
+  uint16_t npoints;
+  uint16_t points[LHOS_ADC_MAX_POINTS];
+} lhos_adc_frame_t;
+
+typedef struct
+{
+  lhos_adc_window_config_t cfg;
+  lhos_adc_frame_t cur;
+  uint32_t dec_sum;
+  uint32_t dec_n;
+  uint32_t seq;
+} lhos_adc_window_t;
+
+/* Called for every completed frame. The frame is reused afterwards. */
+typedef void (*lhos_adc_frame_cb_t) (const lhos_adc_frame_t *frame,
+                                     void *ctx);
+
+/* Returns false if the configuration is invalid: no samples, or a trace
+   longer than LHOS_ADC_MAX_POINTS points. */
+bool lhos_adc_window_init (lhos_adc_window_t *w,
+                           const lhos_adc_window_config_t *cfg);
+
+/* Fold `n` samples in, emitting each frame that completes. Returns the
+   number of frames emitted. */
+size_t lhos_adc_window_feed (lhos_adc_window_t *w, const uint16_t *samples,
+                             size_t n, lhos_adc_frame_cb_t cb, void *ctx);
+
+double lhos_adc_frame_mean (const lhos_adc_frame_t *f);
+/* Root mean square of the raw values (DC included). */
+double lhos_adc_frame_rms (const lhos_adc_frame_t *f);
+/* Standard deviation, i.e. the RMS of the AC component. */
+double lhos_adc_frame_stddev (const lhos_adc_frame_t *f);
+
+#endif /* LHOS_ADC_WINDOW_H */
@@ -0,0 +1,438 @@
+/* LHOS ADC engine: one-shot reads, and continuous DMA sampling aggregated
+ * into frames on a dedicated task.
+ *
+ * ADC1 cannot be driven by the one-shot and continuous drivers at the
+ * same time, so starting a (non-simulated) capture deletes the one-shot
+ * unit and stopping it creates the unit again with the channels that were
+ * configured before.
+ */
+
+#include "lhos_adc.h"
+#include "lhos_adc_source.h"
+#include "esp_adc/adc_cali.h"
+#include "esp_adc/adc_cali_scheme.h"
+#include "esp_adc/adc_continuous.h"
+#include "esp_adc/adc_oneshot.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include <string.h>
+
+/* Samples pulled from the source per read. */
+#define LHOS_ADC_READ_SAMPLES 256
+#define LHOS_ADC_DMA_FRAME (LHOS_ADC_READ_SAMPLES * SOC_ADC_DIGI_RESULT_BYTES)
+#define LHOS_ADC_ATTEN ADC_ATTEN_DB_12
+
+typedef struct
+{
+  lhos_adc_source_t base;
+  adc_continuous_handle_t handle;
+  int channel;
+  esp_err_t err; /* why the last dma_start() failed */
+  uint8_t raw[LHOS_ADC_DMA_FRAME];
+} dma_source_t;
+
+static const char *TAG = "lhos_adc";
+
+static SemaphoreHandle_t s_lock = NULL;
+static adc_oneshot_unit_handle_t s_oneshot = NULL;
+static uint32_t s_oneshot_channels = 0; /* bitmask of configured channels */
+static adc_cali_handle_t s_cali = NULL;
+
+static dma_source_t s_dma;
+static lhos_adc_sim_t s_sim;
+static lhos_adc_source_t *s_src = NULL;
+static lhos_adc_config_t s_cfg;
+static lhos_adc_window_t s_win;
+static lhos_adc_sink_t s_sink = NULL;
+static void *s_sink_ctx = NULL;
+static TaskHandle_t s_task = NULL;
+static SemaphoreHandle_t s_done = NULL;
+static volatile bool s_run = false;
+static lhos_adc_stats_t s_stats;
+static volatile uint32_t s_overruns = 0;
+
+/* ---- one-shot --------------------------------------------------------- */
+
+static esp_err_t
+oneshot_config_channel (int channel)
+{
+  adc_oneshot_chan_cfg_t cfg = {
+    .atten = LHOS_ADC_ATTEN,
+    .bitwidth = ADC_BITWIDTH_DEFAULT,
+  };
+  esp_err_t rc = adc_oneshot_config_channel (s_oneshot, channel, &cfg);
+  if (rc == ESP_OK)
+    s_oneshot_channels |= 1u << channel;
+  return rc;
+}
+
+static esp_err_t
+oneshot_create (void)
+{
+  adc_oneshot_unit_init_cfg_t init = {
+    .unit_id = ADC_UNIT_1,
+  };
+  esp_err_t rc = adc_oneshot_new_unit (&init, &s_oneshot);
+  if (rc != ESP_OK)
+    {
+      s_oneshot = NULL;
+      return rc;
+    }
+  for (int ch = 0; ch < 32; ch++)
+    {
+      if (s_oneshot_channels & (1u << ch))
+        oneshot_config_channel (ch);
+    }
+  return ESP_OK;
+}
+
+static void
+oneshot_delete (void)
+{
+  if (s_oneshot)
+    {
+      adc_oneshot_del_unit (s_oneshot);
+      s_oneshot = NULL;
+    }
+}
+
+esp_err_t
+lhos_adc_init (int channel)
+{
+  if (!s_lock)
+    {
+      s_lock = xSemaphoreCreateMutex ();
+      s_done = xSemaphoreCreateBinary ();
+      if (!s_lock || !s_done)
+        return ESP_ERR_NO_MEM;
+    }
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  esp_err_t rc = ESP_OK;
+  if (!s_oneshot && !s_run)
+    rc = oneshot_create ();
+  if (rc == ESP_OK && s_oneshot)
+    rc = oneshot_config_channel (channel);
+#if ADC_CALI_SCHEME_CURVE_FITTING_SUPPORTED
+  if (rc == ESP_OK && !s_cali)
+    {
+      adc_cali_curve_fitting_config_t cc = {
+        .unit_id = ADC_UNIT_1,
+        .chan = channel,
+        .atten = LHOS_ADC_ATTEN,
+        .bitwidth = ADC_BITWIDTH_DEFAULT,
+      };
+      if (adc_cali_create_scheme_curve_fitting (&cc, &s_cali) != ESP_OK)
+        s_cali = NULL;
+    }
+#endif
+  xSemaphoreGive (s_lock);
+  if (rc != ESP_OK)
+    ESP_LOGE (TAG, "one-shot init failed: %s", esp_err_to_name (rc));
+  return rc;
+}
+
+esp_err_t
+lhos_adc_read (int channel, int *raw)
+{
+  if (!s_lock || !raw || channel < 0 || channel >= 32)
+    return ESP_ERR_INVALID_ARG;
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  esp_err_t rc = ESP_ERR_INVALID_STATE;
+  if (s_oneshot)
+    {
+      rc = ESP_OK;
+      if (!(s_oneshot_channels & (1u << channel)))
+        rc = oneshot_config_channel (channel);
+      if (rc == ESP_OK)
+        rc = adc_oneshot_read (s_oneshot, channel, raw);
+    }
+  xSemaphoreGive (s_lock);
+  return rc;
+}
+
+esp_err_t
+lhos_adc_raw_to_mv (int raw, int *mv)
+{
+  if (!s_cali)
+    return ESP_ERR_NOT_SUPPORTED;
+  return adc_cali_raw_to_voltage (s_cali, raw, mv);
+}
+
+/* ---- DMA source ------------------------------------------------------- */
+
+static bool IRAM_ATTR
+dma_on_pool_ovf (adc_continuous_handle_t handle,
+                 const adc_continuous_evt_data_t *edata, void *user_data)
+{
+  (void)handle;
+  (void)edata;
+  (void)user_data;
+  s_overruns++;
+  return false;
+}
+
+static int
+dma_start (lhos_adc_source_t *src, int channel, uint32_t rate_hz)
+{
+  dma_source_t *d = (dma_source_t *)src;
+  /* results carry the channel as configured; one outside ADC1 would be
+     sampled under another number and every result filtered out */
+  if (channel < 0 || channel >= SOC_ADC_CHANNEL_NUM (ADC_UNIT_1)
+      || rate_hz < SOC_ADC_SAMPLE_FREQ_THRES_LOW
+      || rate_hz > SOC_ADC_SAMPLE_FREQ_THRES_HIGH)
+    {
+      d->err = ESP_ERR_INVALID_ARG;
+      return -1;
+    }
+  adc_continuous_handle_cfg_t hc = {
+    .max_store_buf_size = LHOS_ADC_DMA_FRAME * 4,
+    .conv_frame_size = LHOS_ADC_DMA_FRAME,
+  };
+  d->err = adc_continuous_new_handle (&hc, &d->handle);
+  if (d->err != ESP_OK)
+    return -1;
+  adc_digi_pattern_config_t pattern = {
+    .atten = LHOS_ADC_ATTEN,
+    .channel = (uint8_t)channel,
+    .unit = ADC_UNIT_1,
+    .bit_width = SOC_ADC_DIGI_MAX_BITWIDTH,
+  };
+  adc_continuous_config_t dc = {
+    .pattern_num = 1,
+    .adc_pattern = &pattern,
+    .sample_freq_hz = rate_hz,
+    .conv_mode = ADC_CONV_SINGLE_UNIT_1,
+    .format = ADC_DIGI_OUTPUT_FORMAT_TYPE2,
+  };
+  adc_continuous_evt_cbs_t cbs = {
+    .on_pool_ovf = dma_on_pool_ovf,
+  };
+  d->err = adc_continuous_config (d->handle, &dc);
+  if (d->err == ESP_OK)
+    d->err = adc_continuous_register_event_callbacks (d->handle, &cbs, NULL);
+  if (d->err == ESP_OK)
+    d->err = adc_continuous_start (d->handle);
+  if (d->err != ESP_OK)
+    {
+      adc_continuous_deinit (d->handle);
+      d->handle = NULL;
+      return -1;
+    }
+  d->channel = channel;
+  return 0;
+}
+
+static int
+dma_read (lhos_adc_source_t *src, uint16_t *out, size_t max,
+          uint32_t timeout_ms)
+{
+  dma_source_t *d = (dma_source_t *)src;
+  size_t bytes = max * SOC_ADC_DIGI_RESULT_BYTES;
+  if (bytes > sizeof (d->raw))
+    bytes = sizeof (d->raw);
+  uint32_t got = 0;
+  esp_err_t rc
+      = adc_continuous_read (d->handle, d->raw, bytes, &got, timeout_ms);
+  if (rc == ESP_ERR_TIMEOUT)
+    return 0;
+  if (rc != ESP_OK)
+    return -1;
+  int n = 0;
+  for (uint32_t i = 0; i + SOC_ADC_DIGI_RESULT_BYTES <= got;
+       i += SOC_ADC_DIGI_RESULT_BYTES)
+    {
+      const adc_digi_output_data_t *p
+          = (const adc_digi_output_data_t *)&d->raw[i];
+      if (p->type2.channel == (uint32_t)d->channel)
+        out[n++] = (uint16_t)p->type2.data;
+    }
+  return n;
+}
+
+static void
+dma_stop (lhos_adc_source_t *src)
+{
+  dma_source_t *d = (dma_source_t *)src;
+  if (d->handle)
+    {
+      adc_continuous_stop (d->handle);
+      adc_continuous_deinit (d->handle);
+      d->handle = NULL;
+    }
+}
+
+/* ---- capture task ----------------------------------------------------- */
+
+static void
+emit_frame (const lhos_adc_frame_t *frame, void *ctx)
+{
+  (void)ctx;
+  lhos_adc_frame_t *f = (lhos_adc_frame_t *)frame;
+  f->t_us = esp_timer_get_time ();
+  if (s_sink (f, s_sink_ctx))
+    s_stats.frames++;
+  else
+    s_stats.dropped++;
+}
+
+static void
+adc_task (void *pv)
+{
+  (void)pv;
+  static uint16_t buf[LHOS_ADC_READ_SAMPLES];
+  lhos_adc_source_t *src = s_src;
+  int64_t start_us = esp_timer_get_time ();
+  uint64_t produced = 0;
+  while (s_run)
+    {
+      size_t want = LHOS_ADC_READ_SAMPLES;
+      if (!src->realtime)
+        {
+          /* pace a simulated source to the configured rate */
+          uint64_t due = (uint64_t)(esp_timer_get_time () - start_us)
+                         * s_cfg.rate_hz / 1000000;
+          if (due <= produced)
+            {
+              vTaskDelay (pdMS_TO_TICKS (10));
+              continue;
+            }
+          if (due - produced < want)
+            want = (size_t)(due - produced);
+        }
+      int n = src->read (src, buf, want, 100);
+      if (n < 0)
+        {
+          ESP_LOGE (TAG, "source read failed, stopping");
+          break;
+        }
+      produced += n;
+      s_stats.samples += n;
+      lhos_adc_window_feed (&s_win, buf, n, emit_frame, NULL);
+    }
+  src->stop (src);
+  s_run = false;
+  xSemaphoreGive (s_done);
+  vTaskDelete (NULL);
+}
+
+esp_err_t
+lhos_adc_start (const lhos_adc_config_t *cfg, lhos_adc_sink_t sink, void *ctx)
+{
+  if (!cfg || !sink || cfg->rate_hz == 0)
+    return ESP_ERR_INVALID_ARG;
+  if (!s_lock)
+    {
+      esp_err_t rc = lhos_adc_init (cfg->channel);
+      if (rc != ESP_OK)
+        return rc;
+    }
+  lhos_adc_window_config_t wc = {
+    .samples = cfg->window,
+    .decimate = cfg->decimate,
+  };
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  if (s_task)
+    {
+      xSemaphoreGive (s_lock);
+      return ESP_ERR_INVALID_STATE;
+    }
+  if (!lhos_adc_window_init (&s_win, &wc))
+    {
+      xSemaphoreGive (s_lock);
+      return ESP_ERR_INVALID_ARG;
+    }
+  s_cfg = *cfg;
+  s_sink = sink;
+  s_sink_ctx = ctx;
+  memset (&s_stats, 0, sizeof (s_stats));
+  s_overruns = 0;
+
+  if (cfg->simulate)
+    {
+      lhos_adc_sim_init (&s_sim, cfg->sim_freq_hz, cfg->sim_amplitude,
+                         cfg->sim_offset, cfg->sim_noise,
+                         (uint32_t)esp_timer_get_time ());
+      s_src = &s_sim.base;
+    }
+  else
+    {
+      s_dma.base.start = dma_start;
+      s_dma.base.read = dma_read;
+      s_dma.base.stop = dma_stop;
+      s_dma.base.realtime = true;
+      s_src = &s_dma.base;
+      /* hand ADC1 over to the continuous driver */
+      oneshot_delete ();
+    }
+
+  esp_err_t rc = ESP_OK;
+  if (s_src->start (s_src, cfg->channel, cfg->rate_hz) != 0)
+    rc = cfg->simulate ? ESP_ERR_INVALID_ARG : s_dma.err;
+  else
+    {
+      s_run = true;
+      xSemaphoreTake (s_done, 0);
+      /* aggregation stays off the Lua core */
+      if (xTaskCreatePinnedToCore (adc_task, "lhos_adc", 3072, NULL,
+                                   tskIDLE_PRIORITY + 4, &s_task, 0)
+          != pdPASS)
+        {
+          s_run = false;
+          s_src->stop (s_src);
+          rc = ESP_ERR_NO_MEM;
+        }
+    }
+  if (rc != ESP_OK)
+    {
+      s_task = NULL;
+      if (!cfg->simulate)
+        oneshot_create ();
+    }
+  xSemaphoreGive (s_lock);
+  if (rc == ESP_OK)
+    ESP_LOGI (TAG, "sampling ch%d at %u Hz, %u samples/frame%s",
+              cfg->channel, (unsigned)cfg->rate_hz, (unsigned)cfg->window,
+              cfg->simulate ? " (simulated)" : "");
+  return rc;
+}
+
+esp_err_t
+lhos_adc_stop (void)
+{
+  if (!s_lock)
+    return ESP_ERR_INVALID_STATE;
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  if (!s_task)
+    {
+      xSemaphoreGive (s_lock);
+      return ESP_ERR_INVALID_STATE;
+    }
+  s_run = false;
+  if (xSemaphoreTake (s_done, pdMS_TO_TICKS (1000)) != pdTRUE)
+    {
+      /* the task still owns the unit: keep s_task, so start() refuses
+         and another stop() waits for it again */
+      xSemaphoreGive (s_lock);
+      return ESP_ERR_TIMEOUT;
+    }
+  s_task = NULL;
+  if (!s_cfg.simulate && !s_oneshot)
+    oneshot_create ();
+  xSemaphoreGive (s_lock);
+  return ESP_OK;
+}
+
+void
+lhos_adc_get_stats (lhos_adc_stats_t *out)
+{
+  if (!out)
+    return;
+  *out = s_stats;
+  out->overruns = s_overruns;
+  out->running = s_run;
+}
@@ -0,0 +1,73 @@
+#include "lhos_adc_source.h"
+
+#include <math.h>
+
+#define LHOS_ADC_CODE_MAX 4095
+
+static int
+sim_start (lhos_adc_source_t *src, int channel, uint32_t rate_hz)
+{
+  lhos_adc_sim_t *sim = (lhos_adc_sim_t *)src;
+  (void)channel;
+  if (rate_hz == 0)
+    return -1;
+  sim->rate_hz = rate_hz;
+  sim->n = 0;
+  return 0;
+}
+
+/* xorshift32: cheap and reproducible across platforms */
+static uint32_t
+sim_rand (lhos_adc_sim_t *sim)
+{
+  uint32_t x = sim->rng;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  sim->rng = x;
+  return x;
+}
+
+static int
+sim_read (lhos_adc_source_t *src, uint16_t *out, size_t max,
+          uint32_t timeout_ms)
+{
+  lhos_adc_sim_t *sim = (lhos_adc_sim_t *)src;
+  (void)timeout_ms;
+  const double w = 2.0 * M_PI * sim->freq_hz / sim->rate_hz;
+  for (size_t i = 0; i < max; i++, sim->n++)
+    {
+      double v = sim->offset + sim->amplitude * sin (w * (double)sim->n);
+      if (sim->noise)
+        v += (int32_t)(sim_rand (sim) % (2u * sim->noise + 1)) - sim->noise;
+      if (v < 0)
+        v = 0;
+      if (v > LHOS_ADC_CODE_MAX)
+        v = LHOS_ADC_CODE_MAX;
+      out[i] = (uint16_t)lround (v);
+    }
+  return (int)max;
+}
+
+static void
+sim_stop (lhos_adc_source_t *src)
+{
+  (void)src;
+}
+
+void
+lhos_adc_sim_init (lhos_adc_sim_t *sim, float freq_hz, float amplitude,
+                   uint16_t offset, uint16_t noise, uint32_t seed)
+{
+  sim->base.start = sim_start;
+  sim->base.read = sim_read;
+  sim->base.stop = sim_stop;
+  sim->base.realtime = false;
+  sim->freq_hz = freq_hz;
+  sim->amplitude = amplitude;
+  sim->offset = offset;
+  sim->noise = noise;
+  sim->rate_hz = 1;
+  sim->n = 0;
+  sim->rng = seed ? seed : 0x2545f491u;
+}
@@ -0,0 +1,96 @@
+#include "lhos_adc_window.h"
+
+#include <math.h>
+#include <string.h>
+
+static void
+frame_reset (lhos_adc_window_t *w)
+{
+  lhos_adc_frame_t *f = &w->cur;
+  f->count = 0;
+  f->min = UINT16_MAX;
+  f->max = 0;
+  f->sum = 0;
+  f->sum_sq = 0;
+  f->t_us = 0;
+  f->npoints = 0;
+  w->dec_sum = 0;
+  w->dec_n = 0;
+}
+
+bool
+lhos_adc_window_init (lhos_adc_window_t *w,
+                      const lhos_adc_window_config_t *cfg)
+{
+  if (!w || !cfg || cfg->samples == 0)
+    return false;
+  if (cfg->decimate && cfg->samples / cfg->decimate > LHOS_ADC_MAX_POINTS)
+    return false;
+  memset (w, 0, sizeof (*w));
+  w->cfg = *cfg;
+  frame_reset (w);
+  return true;
+}
+
+size_t
+lhos_adc_window_feed (lhos_adc_window_t *w, const uint16_t *samples,
+                      size_t n, lhos_adc_frame_cb_t cb, void *ctx)
+{
+  lhos_adc_frame_t *f = &w->cur;
+  const uint32_t dec = w->cfg.decimate;
+  size_t frames = 0;
+  for (size_t i = 0; i < n; i++)
+    {
+      uint32_t s = samples[i];
+      f->count++;
+      f->sum += s;
+      f->sum_sq += s * s;
+      if (s < f->min)
+        f->min = (uint16_t)s;
+      if (s > f->max)
+        f->max = (uint16_t)s;
+      if (dec)
+        {
+          w->dec_sum += s;
+          if (++w->dec_n == dec)
+            {
+              if (f->npoints < LHOS_ADC_MAX_POINTS)
+                f->points[f->npoints++]
+                    = (uint16_t)((w->dec_sum + dec / 2) / dec);
+              w->dec_sum = 0;
+              w->dec_n = 0;
+            }
+        }
+      if (f->count == w->cfg.samples)
+        {
+          f->seq = w->seq++;
+          if (cb)
+            cb (f, ctx);
+          frames++;
+          frame_reset (w);
+        }
+    }
+  return frames;
+}
+
+double
+lhos_adc_frame_mean (const lhos_adc_frame_t *f)
+{
+  return f->count ? (double)f->sum / f->count : 0.0;
+}
+
+double
+lhos_adc_frame_rms (const lhos_adc_frame_t *f)
+{
+  return f->count ? sqrt ((double)f->sum_sq / f->count) : 0.0;
+}
+
+double
+lhos_adc_frame_stddev (const lhos_adc_frame_t *f)
+{
+  if (!f->count)
+    return 0.0;
+  double mean = lhos_adc_frame_mean (f);
+  double var = (double)f->sum_sq / f->count - mean * mean;
+  return var > 0.0 ? sqrt (var) : 0.0;
+}
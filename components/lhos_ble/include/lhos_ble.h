@@ -6,10 +6,27 @@
 
 int lhos_ble_init (lua_State *L);
 int lhos_ble_scan (lua_State *L);
+int lhos_ble_stop_scan (lua_State *L);
+int lhos_ble_scan_stats (lua_State *L);
 int lhos_ble_connect (lua_State *L);
 int lhos_ble_disconnect (lua_State *L);
+int lhos_ble_connections (lua_State *L);
+int lhos_ble_on_disconnect (lua_State *L);
+int lhos_ble_on_gatt (lua_State *L);
 int lhos_ble_read (lua_State *L);
 int lhos_ble_write (lua_State *L);
+int lhos_ble_discover (lua_State *L);
+int lhos_ble_handle (lua_State *L);
+int lhos_ble_characteristics (lua_State *L);
+int lhos_ble_forget (lua_State *L);
+int lhos_ble_advertise (lua_State *L);
+int lhos_ble_stop_advertise (lua_State *L);
+int lhos_ble_on_connect (lua_State *L);
+int lhos_ble_mtu (lua_State *L);
+int lhos_ble_serve (lua_State *L);
+int lhos_ble_update (lua_State *L);
+int lhos_ble_flush (lua_State *L);
+int lhos_ble_on_write (lua_State *L);
 int lhos_ble_notify (lua_State *L);
 int lhos_ble_poll (lua_State *L);
 
@@ -0,0 +1,91 @@
+#ifndef LHOS_BLE_ADV_H
+#define LHOS_BLE_ADV_H
+
+/* BLE advertisement filtering and de-duplication for scans.
+ * Reports are checked against cheap filters first (report type, RSSI),
+ * then against the payload (local name prefix, 16-bit service UUID), and
+ * finally against a small open-addressing hash set of the devices already
+ * reported, so a device shows up once per scan (or once per refresh_ms).
+ *
+ * A device is keyed by address, address type and report kind, so its scan
+ * response is reported apart from its advertisement. The set is fixed at
+ * LHOS_BLE_SEEN_SLOTS and a lookup probes at most a few slots; when those
+ * are all taken the oldest is recycled. A crowded scan may thus report a
+ * device twice, but never hides one it has not reported.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Legacy advertising payload. */
+#define LHOS_BLE_ADV_MAX 31
+#define LHOS_BLE_NAME_MAX 30
+#ifndef LHOS_BLE_SEEN_SLOTS
+#define LHOS_BLE_SEEN_SLOTS 128 /* power of two */
+#endif
+
+/* AD types */
+#define LHOS_BLE_AD_UUID16_SOME 0x02
+#define LHOS_BLE_AD_UUID16_ALL 0x03
+#define LHOS_BLE_AD_NAME_SHORT 0x08
+#define LHOS_BLE_AD_NAME_COMPLETE 0x09
+
+/* Report types, as numbered by HCI */
+typedef enum
+{
+  LHOS_BLE_ADV_IND = 0,
+  LHOS_BLE_ADV_DIRECT_IND,
+  LHOS_BLE_ADV_SCAN_IND,
+  LHOS_BLE_ADV_NONCONN_IND,
+  LHOS_BLE_ADV_SCAN_RSP,
+  LHOS_BLE_ADV_KINDS,
+} lhos_ble_adv_kind_t;
+
+typedef struct
+{
+  int8_t rssi_min;     /* weaker reports are dropped; -128: no limit */
+  uint8_t kinds;       /* bit (1 << kind) per accepted type; 0: all */
+  uint32_t refresh_ms; /* report a known device again after; 0: never */
+  uint16_t uuid16;     /* required advertised service; 0: any */
+  char name[LHOS_BLE_NAME_MAX + 1]; /* local name prefix; "": any */
+} lhos_ble_scan_filter_t;
+
+typedef struct
+{
+  uint8_t key[8]; /* address, address type, scan response flag */
+  bool used;
+  uint32_t last_ms;
+} lhos_ble_seen_t;
+
+typedef struct
+{
+  lhos_ble_scan_filter_t filter;
+  lhos_ble_seen_t seen[LHOS_BLE_SEEN_SLOTS];
+  uint32_t received;   /* reports from the controller */
+  uint32_t filtered;   /* dropped by the filters */
+  uint32_t duplicates; /* dropped as already reported */
+  uint32_t reported;
+} lhos_ble_scan_state_t;
+
+/* Start a new scan with `filter` (NULL: accept everything once). */
+void lhos_ble_scan_reset (lhos_ble_scan_state_t *s,
+                          const lhos_ble_scan_filter_t *filter);
+
+/* Decide whether a report should reach the application; `addr` is in
+   NimBLE (little endian) order. */
+bool lhos_ble_scan_accept (lhos_ble_scan_state_t *s, const uint8_t addr[6],
+                           uint8_t addr_type, uint8_t kind, int8_t rssi,
+                           const uint8_t *data, size_t len, uint32_t now_ms);
+
+/* Drop the record of a reported device, e.g. when its report could not be
+   delivered, so that its next report passes again. */
+void lhos_ble_scan_forget (lhos_ble_scan_state_t *s, const uint8_t addr[6],
+                           uint8_t addr_type, uint8_t kind);
+
+/* Find AD structure `type` in advertising data; returns its payload and
+   length, or NULL. Malformed data ends the search. */
+const uint8_t *lhos_ble_adv_find (const uint8_t *data, size_t len,
+                                  uint8_t type, size_t *out_len);
+
+#endif /* LHOS_BLE_ADV_H */
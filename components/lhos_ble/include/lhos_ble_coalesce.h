@@ -0,0 +1,45 @@
+#ifndef LHOS_BLE_COALESCE_H
+#define LHOS_BLE_COALESCE_H
+
+/* Notification coalescer for the GATT server.
+ * Value updates are appended to a buffer and go out as one notification
+ * when the next update would not fit the link's payload (ATT MTU - 3),
+ * when the buffer is exactly full, or when the caller flushes (from a
+ * timer, so nothing waits longer than the characteristic's interval).
+ * Updates are never split: the receiver cuts a notification back into
+ * records of the size it knows. Pure C; the stack is reached through
+ * the emit callback. Not thread safe.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LHOS_BLE_COALESCE_MAX 244 /* payload of the largest MTU, 247 */
+#define LHOS_BLE_COALESCE_TOO_BIG (-1)
+
+/* Send `len` bytes; non-zero keeps them pending and is handed back. */
+typedef int (*lhos_ble_emit_fn) (void *ctx, const uint8_t *data,
+                                 size_t len);
+
+typedef struct
+{
+  uint16_t len;
+  uint16_t records; /* updates in data */
+  uint8_t data[LHOS_BLE_COALESCE_MAX];
+} lhos_ble_coalesce_t;
+
+void lhos_ble_coalesce_reset (lhos_ble_coalesce_t *c);
+
+/* Queue one update for notifications of at most `limit` bytes, emitting
+   what is pending first if it would not fit. Returns 0, the emit error
+   (the update is then not queued) or LHOS_BLE_COALESCE_TOO_BIG. */
+int lhos_ble_coalesce_add (lhos_ble_coalesce_t *c, const void *data,
+                           size_t len, size_t limit, lhos_ble_emit_fn emit,
+                           void *ctx);
+
+/* Emit whatever is pending; 0 if there was nothing. */
+int lhos_ble_coalesce_flush (lhos_ble_coalesce_t *c, lhos_ble_emit_fn emit,
+                             void *ctx);
+
+#endif /* LHOS_BLE_COALESCE_H */
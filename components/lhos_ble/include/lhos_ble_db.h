@@ -0,0 +1,89 @@
+#ifndef LHOS_BLE_DB_H
+#define LHOS_BLE_DB_H
+
+/* Attribute handle table of a peer's GATT database, as found by service
+ * discovery, and the UUID helpers to look things up in it.
+ *
+ * The table is a flat struct so it can be stored as an NVS blob as is;
+ * only the first lhos_ble_db_size() bytes are meaningful. A blob read back
+ * is trusted only after lhos_ble_db_valid() has checked its version,
+ * counts, size and service indexes, so LHOS_BLE_DB_VERSION must change
+ * with the layout. Entries keep discovery order and lookups return the
+ * first match.
+ *
+ * UUIDs are kept as 128-bit values in little-endian (on-air) order; 16
+ * and 32-bit ones are expanded with the Bluetooth base UUID.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LHOS_BLE_DB_VERSION 1
+#ifndef LHOS_BLE_DB_SVCS
+#define LHOS_BLE_DB_SVCS 16
+#endif
+#ifndef LHOS_BLE_DB_CHRS
+#define LHOS_BLE_DB_CHRS 48
+#endif
+#define LHOS_BLE_UUID_STR 37 /* 36 characters and NUL */
+
+typedef struct
+{
+  uint8_t uuid[16];
+  uint16_t start;
+  uint16_t end;
+} lhos_ble_svc_t;
+
+typedef struct
+{
+  uint8_t uuid[16];
+  uint16_t def_handle;
+  uint16_t val_handle;
+  uint16_t cccd_handle; /* 0: none */
+  uint8_t props;        /* BLE characteristic properties */
+  uint8_t svc;          /* index into svcs */
+} lhos_ble_chr_t;
+
+typedef struct
+{
+  uint8_t version;
+  uint8_t has_hash;
+  uint8_t nsvcs;
+  uint8_t nchrs;
+  uint8_t hash[16]; /* GATT Database Hash characteristic value */
+  lhos_ble_svc_t svcs[LHOS_BLE_DB_SVCS];
+  lhos_ble_chr_t chrs[LHOS_BLE_DB_CHRS];
+} lhos_ble_db_t;
+
+void lhos_ble_db_reset (lhos_ble_db_t *db);
+
+/* Append entries; false when the table is full. A characteristic belongs
+   to the service whose handle range holds it. */
+bool lhos_ble_db_add_svc (lhos_ble_db_t *db, const uint8_t uuid[16],
+                          uint16_t start, uint16_t end);
+bool lhos_ble_db_add_chr (lhos_ble_db_t *db, const uint8_t uuid[16],
+                          uint16_t def_handle, uint16_t val_handle,
+                          uint8_t props);
+
+/* Last handle that may hold descriptors of characteristic `i`. */
+uint16_t lhos_ble_db_chr_end (const lhos_ble_db_t *db, size_t i);
+
+/* First characteristic `chr`, inside service `svc` if not NULL. */
+const lhos_ble_chr_t *lhos_ble_db_find (const lhos_ble_db_t *db,
+                                        const uint8_t chr[16],
+                                        const uint8_t *svc);
+
+/* Bytes in use, and whether `len` bytes at `db` form a valid table. */
+size_t lhos_ble_db_size (const lhos_ble_db_t *db);
+bool lhos_ble_db_valid (const lhos_ble_db_t *db, size_t len);
+
+/* UUIDs: 16 and 32-bit values and strings ("180F", "0x180F",
+   "0000180F" or the 36-character form) to 128 bits, and back to the
+   shortest string. */
+void lhos_ble_uuid_from16 (uint8_t out[16], uint32_t value);
+bool lhos_ble_uuid_parse (const char *s, uint8_t out[16]);
+void lhos_ble_uuid_format (const uint8_t uuid[16],
+                           char out[LHOS_BLE_UUID_STR]);
+
+#endif /* LHOS_BLE_DB_H */
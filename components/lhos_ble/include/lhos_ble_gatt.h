@@ -0,0 +1,81 @@
+#ifndef LHOS_BLE_GATT_H
+#define LHOS_BLE_GATT_H
+
+/* Per-connection GATT client request queue.
+ * Requests are numbered, queued and handed to the stack one at a time
+ * (ATT allows a single outstanding request per link); the next one starts
+ * from the completion of the previous one, so the caller never waits for
+ * a round trip. Writes without response need no reply and go out
+ * back to back. The stack is reached only through lhos_gatt_ops_t, which
+ * keeps this module free of NimBLE and lets a stand-in drive it on the
+ * host. Not thread safe: callers serialise access to a queue.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef LHOS_GATT_QUEUE_LEN
+#define LHOS_GATT_QUEUE_LEN 8
+#endif
+
+typedef enum
+{
+  LHOS_GATT_READ = 0,
+  LHOS_GATT_READ_LONG, /* read blobs until the whole value is in */
+  LHOS_GATT_WRITE,
+  LHOS_GATT_WRITE_NO_RSP,
+  LHOS_GATT_DISCOVER, /* several procedures, one request to the queue */
+} lhos_gatt_op_t;
+
+typedef struct
+{
+  uint32_t id;
+  uint16_t conn;
+  uint16_t attr;
+  lhos_gatt_op_t op;
+  void *data; /* write payload, owned by the request until done */
+  uint16_t len;
+  int user; /* caller's tag */
+} lhos_gatt_req_t;
+
+typedef struct
+{
+  /* Hand `req` to the stack. Non-zero fails the request with that status;
+     a write without response is done as soon as this returns 0. The
+     callee may take `req->data` (set it to NULL). */
+  int (*start) (void *ctx, lhos_gatt_req_t *req);
+  /* `req` finished; `result` is whatever lhos_gatt_complete was given.
+     What is left in the request (data, user) is the callee's to free. */
+  void (*done) (void *ctx, lhos_gatt_req_t *req, int status, void *result);
+} lhos_gatt_ops_t;
+
+typedef struct
+{
+  const lhos_gatt_ops_t *ops;
+  void *ctx;
+  lhos_gatt_req_t reqs[LHOS_GATT_QUEUE_LEN];
+  uint8_t head;
+  uint8_t count;  /* queued, including the one in flight */
+  bool inflight;  /* reqs[head] is with the stack */
+  bool pumping;
+} lhos_gatt_queue_t;
+
+void lhos_gatt_queue_init (lhos_gatt_queue_t *q, const lhos_gatt_ops_t *ops,
+                           void *ctx);
+
+/* Queue a copy of `req` and start it if the link is idle. Returns false
+   when the queue is full; `req` is then untouched. */
+bool lhos_gatt_submit (lhos_gatt_queue_t *q, const lhos_gatt_req_t *req);
+
+/* The stack finished request `id`: report it and start the next one.
+   Returns false if `id` is not the request in flight. */
+bool lhos_gatt_complete (lhos_gatt_queue_t *q, uint32_t id, int status,
+                         void *result);
+
+/* Fail every request not yet handed to the stack with `status`. */
+void lhos_gatt_flush (lhos_gatt_queue_t *q, int status);
+
+/* True when nothing is queued or in flight. */
+bool lhos_gatt_idle (const lhos_gatt_queue_t *q);
+
+#endif /* LHOS_BLE_GATT_H */
@@ -2,56 +2,574 @@
 #include "esp_err.h"
 #include "esp_log.h"
 #include "freertos/FreeRTOS.h"
-#include "lhos_lua.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "lauxlib.h"
+#include "lhos_ble_adv.h"
+#include "lhos_ble_db.h"
+#include "lhos_ble_gatt.h"
+#include "lhos_ble_server.h"
+#include "lhos_lua_event.h"
+#include "lhos_lua_buffer.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 static const char *TAG = "lhos_ble";
 
+#define BLE_NOTIFY_EVENT "ble_notify"
+#define BLE_DISC_EVENT "ble_disc"
+#define BLE_GATT_EVENT "ble_gatt"
+#define BLE_CONN_EVENT "ble_conn"
+
 #ifdef CONFIG_BT_NIMBLE_ENABLED
 #include "host/ble_gap.h"
 #include "host/ble_gatt.h"
-#include "host/ble_gattc.h"
 #include "host/ble_hs.h"
+#include "host/util/util.h"
 #include "nimble/nimble_port.h"
+#include "nimble/nimble_port_freertos.h"
+#include "nvs.h"
+#include "services/gap/ble_svc_gap.h"
+
+#define BLE_SYNC_TIMEOUT_MS 2000
+#define BLE_SCAN_EVENT "ble_scan"
+#define BLE_SCAN_DONE 0xFF /* report kind of the end-of-scan event */
+#define BLE_NOTIFY_SLOTS 4   /* mbufs held for the Lua task at once */
+#define BLE_CONNECT_TIMEOUT_MS 5000
+#define BLE_ADV_INTERVAL_MS 100
+#define BLE_MAX_CONN CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+
+#define BLE_GATT_RESULTS (LHOS_EVENT_QUEUE_LEN + 1)
+#define BLE_DB_NAMESPACE "lhos_ble" /* NVS: one handle table per peer */
+#define BLE_UUID_DB_HASH 0x2B2A
+#define BLE_UUID_CCCD 0x2902
+
+/* Where a discovery is; see disc_next() */
+typedef enum
+{
+  DISC_HASH,
+  DISC_SVCS,
+  DISC_CHRS,
+  DISC_DSCS,
+} disc_phase_t;
+
+/* One entry per link. `handle` is NimBLE's connection handle, which is
+   what scripts see; slots are only touched by the host task except for
+   the `notify` flag. Each link has its own GATT request queue (under
+   s_gatt_lock), so links do not wait for each other; a slot is not reused
+   while its queue holds requests. */
+typedef struct
+{
+  uint16_t handle; /* BLE_HS_CONN_HANDLE_NONE: free */
+  ble_addr_t peer;
+  bool notify;     /* notifications go to notify_event, not the default */
+  char notify_event[16];
+  lhos_gatt_queue_t gatt;
+  struct os_mbuf *rx; /* long read collected so far */
+  lhos_ble_db_t *db;  /* allocated on first discovery, kept for the slot */
+  bool db_ready;      /* db describes this link's peer */
+  disc_phase_t disc_phase;
+  uint8_t disc_idx; /* service or characteristic being looked into */
+} ble_conn_t;
+
+/* A finished GATT request on its way to Lua, posted by reference */
+typedef struct
+{
+  uint32_t id;
+  uint16_t conn;
+  uint16_t attr;
+  int status;
+  struct os_mbuf *om; /* value read */
+  int buf;            /* registry ref of the buffer to read into */
+  uint8_t op;         /* lhos_gatt_op_t */
+  bool cached;        /* discovery answered from NVS */
+} gatt_result_t;
+
+static void gatt_done (void *ctx, lhos_gatt_req_t *req, int status,
+                       void *result);
+static int gatt_start (void *ctx, lhos_gatt_req_t *req);
+static const lhos_gatt_ops_t gatt_ops = { gatt_start, gatt_done };
+
+static ble_conn_t s_conns[BLE_MAX_CONN];
+static SemaphoreHandle_t s_gatt_lock; /* recursive: done() may submit */
+static uint32_t s_gatt_id;
+static gatt_result_t s_results[BLE_GATT_RESULTS];
+static atomic_uint s_results_used;
+/* Buffer references whose result never reached Lua; only the Lua task
+   may drop them, on its next request. */
+static int s_stale_bufs[BLE_MAX_CONN * LHOS_GATT_QUEUE_LEN];
+static int s_nstale;
+/* Peer of the ble.connect() in progress; its address is also the GAP
+   callback argument that tells our attempts from incoming links. */
+static ble_addr_t s_connect_peer;
+
+/* Connection or disconnection on its way to Lua. For a connection
+   `reason` is the status, non-zero when a ble.connect() failed. */
+typedef struct
+{
+  uint16_t conn_handle;
+  int reason;
+  uint8_t addr[6];
+} disc_event_t;
+
+static uint8_t s_own_addr_type;
+static bool s_started;
+/* ble.advertise() is in effect: advertising resumes whenever a link
+   slot is free */
+static volatile bool s_adv_wanted;
+static struct ble_gap_adv_params s_adv_params;
+static SemaphoreHandle_t s_synced;
+
+/* Scan state: owned by the NimBLE host task while a scan runs */
+static lhos_ble_scan_state_t s_scan;
+static volatile uint32_t s_scan_dropped;
 
-static int g_conn_handle = -1;
+/* One advertising report on its way to Lua */
+typedef struct
+{
+  uint8_t addr[6];
+  uint8_t addr_type;
+  uint8_t kind;
+  int8_t rssi;
+  uint8_t len;
+  uint8_t data[LHOS_BLE_ADV_MAX];
+} scan_report_t;
+
+/* A notification on its way to Lua. The mbuf NimBLE received it in is
+   kept and only flattened by the push function, straight into the Lua
+   string; slots come from a small pool so the host's mbuf pool cannot be
+   drained by a slow script. */
+typedef struct
+{
+  struct os_mbuf *om;
+  uint16_t conn_handle;
+  uint16_t attr_handle;
+  bool indication;
+} notify_ref_t;
+
+/* Fallback when every slot is taken: copied into the event queue */
+typedef struct
+{
+  uint16_t conn_handle;
+  uint16_t attr_handle;
+  bool indication;
+  uint8_t data[LHOS_EVENT_MAX - 6];
+} notify_copy_t;
+
+static notify_ref_t s_notify[BLE_NOTIFY_SLOTS];
+static atomic_uint s_notify_used; /* bit per slot */
 #endif
 
 #ifdef CONFIG_BT_NIMBLE_ENABLED
+/* NimBLE host errors are BLE_HS_* codes, not esp_err_t */
 static int
-gap_event_cb (struct ble_gap_event *event, void *arg)
+push_ble_error (lua_State *L, int rc)
 {
-  switch (event->type)
+  lua_pushnil (L);
+  lua_pushfstring (L, "ble error %d", rc);
+  return 2;
+}
+
+static void
+push_addr (lua_State *L, const uint8_t *a)
+{
+  char s[18];
+  snprintf (s, sizeof (s), "%02X:%02X:%02X:%02X:%02X:%02X", a[5], a[4],
+            a[3], a[2], a[1], a[0]);
+  lua_pushstring (L, s);
+}
+
+/* "AA:BB:CC:DD:EE:FF", most significant byte first */
+static bool
+parse_addr (const char *s, uint8_t type, ble_addr_t *out)
+{
+  unsigned int b[6];
+  char end;
+  if (sscanf (s, "%x:%x:%x:%x:%x:%x%c", &b[5], &b[4], &b[3], &b[2], &b[1],
+              &b[0], &end)
+      != 6)
+    return false;
+  out->type = type;
+  for (int i = 0; i < 6; i++)
     {
-    case BLE_GAP_EVENT_CONNECT:
-      if (event->connect.status == 0)
+      if (b[i] > 0xFF)
+        return false;
+      out->val[i] = (uint8_t)b[i];
+    }
+  return true;
+}
+
+static ble_conn_t *
+conn_find (uint16_t handle)
+{
+  for (int i = 0; i < BLE_MAX_CONN; i++)
+    if (s_conns[i].handle == handle && handle != BLE_HS_CONN_HANDLE_NONE)
+      return &s_conns[i];
+  return NULL;
+}
+
+/* Connection given as Lua argument `idx`, or NULL if it is not up. */
+static ble_conn_t *
+conn_arg (lua_State *L, int idx)
+{
+  lua_Integer h = luaL_checkinteger (L, idx);
+  return h >= 0 && h < BLE_HS_CONN_HANDLE_NONE ? conn_find ((uint16_t)h)
+                                               : NULL;
+}
+
+static int
+push_not_connected (lua_State *L)
+{
+  lua_pushnil (L);
+  lua_pushstring (L, "not connected");
+  return 2;
+}
+
+/* Take a free slot out of a pool of `n` tracked by the bits in `used`;
+   -1 if all are taken. Slots are freed with slot_free from any task. */
+static int
+slot_alloc (atomic_uint *used, unsigned n)
+{
+  unsigned cur = atomic_load (used);
+  for (;;)
+    {
+      unsigned free_bits = ~cur & ((1u << n) - 1);
+      if (!free_bits)
+        return -1;
+      unsigned bit = free_bits & -free_bits;
+      if (atomic_compare_exchange_weak (used, &cur, cur | bit))
+        return __builtin_ctz (bit);
+    }
+}
+
+static void
+slot_free (atomic_uint *used, int i)
+{
+  atomic_fetch_and (used, ~(1u << i));
+}
+
+static int
+push_notify_args (lua_State *L, uint16_t conn_handle, uint16_t attr_handle,
+                  bool indication)
+{
+  lua_pushinteger (L, attr_handle);
+  lua_pushinteger (L, conn_handle);
+  lua_pushboolean (L, indication);
+  return 4;
+}
+
+static int
+push_notify_ref (lua_State *L, const void *data, size_t len)
+{
+  const notify_ref_t *n = data;
+  const struct os_mbuf *om = n->om;
+  if (!SLIST_NEXT (om, om_next))
+    lua_pushlstring (L, (const char *)om->om_data, len);
+  else
+    {
+      /* chained mbuf: the one flattening copy goes into the Lua buffer */
+      luaL_Buffer b;
+      char *p = luaL_buffinitsize (L, &b, len);
+      os_mbuf_copydata (om, 0, (int)len, p);
+      luaL_pushresultsize (&b, len);
+    }
+  return push_notify_args (L, n->conn_handle, n->attr_handle,
+                           n->indication);
+}
+
+static void
+release_notify_ref (lua_State *L, void *data)
+{
+  notify_ref_t *n = data;
+  os_mbuf_free_chain (n->om);
+  n->om = NULL;
+  slot_free (&s_notify_used, n - s_notify);
+}
+
+static int
+push_notify_copy (lua_State *L, const void *data, size_t len)
+{
+  const notify_copy_t *n = data;
+  lua_pushlstring (L, (const char *)n->data,
+                   len - offsetof (notify_copy_t, data));
+  return push_notify_args (L, n->conn_handle, n->attr_handle,
+                           n->indication);
+}
+
+/* NOTIFY_RX on the host task. Taking the mbuf out of the event (om =
+   NULL) keeps NimBLE from freeing it after the callback returns. */
+static void
+on_notify_rx (struct ble_gap_event *event)
+{
+  /* a connection with its own handler gets its notifications there */
+  ble_conn_t *c = conn_find (event->notify_rx.conn_handle);
+  const char *name = c && c->notify ? c->notify_event : BLE_NOTIFY_EVENT;
+  if (!lhos_lua_has_event_handler (name))
+    return;
+  struct os_mbuf *om = event->notify_rx.om;
+  size_t len = OS_MBUF_PKTLEN (om);
+  int slot = slot_alloc (&s_notify_used, BLE_NOTIFY_SLOTS);
+  if (slot >= 0)
+    {
+      notify_ref_t *n = &s_notify[slot];
+      n->om = om;
+      n->conn_handle = event->notify_rx.conn_handle;
+      n->attr_handle = event->notify_rx.attr_handle;
+      n->indication = event->notify_rx.indication;
+      if (lhos_lua_post_event_ref (name, push_notify_ref,
+                                   release_notify_ref, n, len))
+        event->notify_rx.om = NULL;
+      else
+        {
+          n->om = NULL;
+          slot_free (&s_notify_used, slot);
+        }
+      return;
+    }
+
+  notify_copy_t copy;
+  if (len > sizeof (copy.data))
+    {
+      ESP_LOGW (TAG, "notification of %u bytes dropped", (unsigned)len);
+      return;
+    }
+  copy.conn_handle = event->notify_rx.conn_handle;
+  copy.attr_handle = event->notify_rx.attr_handle;
+  copy.indication = event->notify_rx.indication;
+  os_mbuf_copydata (om, 0, (int)len, copy.data);
+  lhos_lua_post_event (name, push_notify_copy, &copy,
+                       offsetof (notify_copy_t, data) + len);
+}
+
+static int
+push_disc_event (lua_State *L, const void *data, size_t len)
+{
+  const disc_event_t *d = data;
+  lua_pushinteger (L, d->conn_handle);
+  lua_pushinteger (L, d->reason);
+  push_addr (L, d->addr);
+  return 3;
+}
+
+static int
+push_conn_event (lua_State *L, const void *data, size_t len)
+{
+  const disc_event_t *d = data;
+  if (d->reason != 0)
+    {
+      lua_pushnil (L);
+      push_addr (L, d->addr);
+      lua_pushfstring (L, "ble error %d", d->reason);
+      return 3;
+    }
+  lua_pushinteger (L, d->conn_handle);
+  push_addr (L, d->addr);
+  return 2;
+}
+
+static int gap_event_cb (struct ble_gap_event *event, void *arg);
+
+/* Restart advertising if ble.advertise() asked for it and a slot is
+   free; host task or Lua task. */
+static void
+adv_resume (void)
+{
+  if (!s_adv_wanted || ble_gap_adv_active ())
+    return;
+  for (int i = 0; i < BLE_MAX_CONN; i++)
+    if (s_conns[i].handle == BLE_HS_CONN_HANDLE_NONE)
+      {
+        int rc = ble_gap_adv_start (s_own_addr_type, NULL, BLE_HS_FOREVER,
+                                    &s_adv_params, gap_event_cb, NULL);
+        if (rc != 0 && rc != BLE_HS_EALREADY)
+          ESP_LOGW (TAG, "advertising not resumed: %d", rc);
+        return;
+      }
+}
+
+static void
+on_connect (struct ble_gap_event *event, void *arg)
+{
+  uint16_t handle = event->connect.conn_handle;
+  int rc = event->connect.status;
+  if (rc == 0)
+    {
+      ble_conn_t *c = NULL;
+      for (int i = 0; i < BLE_MAX_CONN && !c; i++)
+        if (s_conns[i].handle == BLE_HS_CONN_HANDLE_NONE
+            && lhos_gatt_idle (&s_conns[i].gatt))
+          c = &s_conns[i];
+      struct ble_gap_conn_desc desc;
+      if (!c || ble_gap_conn_find (handle, &desc) != 0)
         {
-          g_conn_handle = event->connect.conn_handle;
-          ESP_LOGI (TAG, "Connected, conn_handle=%d", g_conn_handle);
+          ESP_LOGW (TAG, "no slot for connection %u", handle);
+          ble_gap_terminate (handle, BLE_ERR_REM_USER_CONN_TERM);
+          rc = BLE_HS_ENOMEM;
         }
       else
         {
-          ESP_LOGW (TAG, "Connection failed; status=%d",
-                    event->connect.status);
+          c->peer = desc.peer_id_addr;
+          c->notify = false;
+          c->db_ready = false;
+          c->handle = handle;
+          ESP_LOGI (TAG, "connected, handle=%u", handle);
+          /* ask for the preferred MTU right away, so notifications and
+             reads use large PDUs from the start */
+          ble_gattc_exchange_mtu (handle, NULL, NULL);
+          disc_event_t d = { .conn_handle = handle };
+          memcpy (d.addr, c->peer.val, sizeof (d.addr));
+          lhos_lua_post_event (BLE_CONN_EVENT, push_conn_event, &d,
+                               sizeof (d));
         }
+    }
+  else
+    ESP_LOGW (TAG, "connection failed; status=%d", rc);
+  /* a peripheral link stops advertising */
+  adv_resume ();
+  /* a failed ble.connect() is reported too, incoming links are not */
+  if (rc != 0 && arg == &s_connect_peer)
+    {
+      disc_event_t d = { .conn_handle = handle, .reason = rc };
+      memcpy (d.addr, s_connect_peer.val, sizeof (d.addr));
+      lhos_lua_post_event (BLE_CONN_EVENT, push_conn_event, &d,
+                           sizeof (d));
+    }
+}
+
+static void
+on_disconnect (struct ble_gap_event *event)
+{
+  disc_event_t d = { .conn_handle = event->disconnect.conn.conn_handle,
+                     .reason = event->disconnect.reason };
+  ESP_LOGI (TAG, "disconnected, handle=%u reason=%d", d.conn_handle,
+            d.reason);
+  ble_conn_t *c = conn_find (d.conn_handle);
+  if (c)
+    {
+      memcpy (d.addr, c->peer.val, sizeof (d.addr));
+      c->handle = BLE_HS_CONN_HANDLE_NONE;
+      c->notify = false;
+      xSemaphoreTakeRecursive (s_gatt_lock, portMAX_DELAY);
+      c->db_ready = false;
+      lhos_gatt_flush (&c->gatt, BLE_HS_ENOTCONN);
+      xSemaphoreGiveRecursive (s_gatt_lock);
+    }
+  lhos_ble_server_disconnect (d.conn_handle);
+  lhos_lua_post_event (BLE_DISC_EVENT, push_disc_event, &d, sizeof (d));
+  adv_resume ();
+}
+
+static int
+gap_event_cb (struct ble_gap_event *event, void *arg)
+{
+  switch (event->type)
+    {
+    case BLE_GAP_EVENT_CONNECT:
+      on_connect (event, arg);
       break;
     case BLE_GAP_EVENT_DISCONNECT:
-      ESP_LOGI (TAG, "Disconnected, reason=%d", event->disconnect.reason);
-      g_conn_handle = -1;
+      on_disconnect (event);
+      break;
+    case BLE_GAP_EVENT_NOTIFY_RX:
+      on_notify_rx (event);
+      break;
+    case BLE_GAP_EVENT_SUBSCRIBE:
+      lhos_ble_server_subscribe (event->subscribe.conn_handle,
+                                 event->subscribe.attr_handle,
+                                 event->subscribe.cur_notify,
+                                 event->subscribe.cur_indicate);
+      break;
+    case BLE_GAP_EVENT_MTU:
+      ESP_LOGI (TAG, "handle=%u mtu=%u", event->mtu.conn_handle,
+                event->mtu.value);
       break;
     default:
       break;
     }
   return 0;
 }
+
+static void
+on_sync (void)
+{
+  int rc = ble_hs_util_ensure_addr (0);
+  if (rc == 0)
+    rc = ble_hs_id_infer_auto (0, &s_own_addr_type);
+  if (rc != 0)
+    ESP_LOGE (TAG, "no usable address: %d", rc);
+  xSemaphoreGive (s_synced);
+}
+
+static void
+on_reset (int reason)
+{
+  ESP_LOGW (TAG, "host reset, reason=%d", reason);
+}
+
+static void
+host_task (void *arg)
+{
+  nimble_port_run ();
+  nimble_port_freertos_deinit ();
+}
 #endif
 
 int
 lhos_ble_init (lua_State *L)
 {
 #ifdef CONFIG_BT_NIMBLE_ENABLED
-  ESP_LOGI (TAG, "Initializing NimBLE stack...");
-  nimble_port_init ();
-  ESP_LOGI (TAG, "nimble_port_init called");
+  if (!s_started)
+    {
+      s_synced = xSemaphoreCreateBinary ();
+      s_gatt_lock = xSemaphoreCreateRecursiveMutex ();
+      if (!s_synced || !s_gatt_lock)
+        {
+          lua_pushnil (L);
+          lua_pushstring (L, esp_err_to_name (ESP_ERR_NO_MEM));
+          return 2;
+        }
+      esp_err_t err = nimble_port_init ();
+      if (err != ESP_OK)
+        {
+          vSemaphoreDelete (s_synced);
+          vSemaphoreDelete (s_gatt_lock);
+          s_synced = s_gatt_lock = NULL;
+          ESP_LOGE (TAG, "nimble_port_init: %s", esp_err_to_name (err));
+          lua_pushnil (L);
+          lua_pushstring (L, esp_err_to_name (err));
+          return 2;
+        }
+      for (int i = 0; i < BLE_MAX_CONN; i++)
+        {
+          s_conns[i].handle = BLE_HS_CONN_HANDLE_NONE;
+          lhos_gatt_queue_init (&s_conns[i].gatt, &gatt_ops, &s_conns[i]);
+          snprintf (s_conns[i].notify_event,
+                    sizeof (s_conns[i].notify_event), "%s%d",
+                    BLE_NOTIFY_EVENT, i + 1);
+        }
+      ble_hs_cfg.sync_cb = on_sync;
+      ble_hs_cfg.reset_cb = on_reset;
+      nimble_port_freertos_init (host_task);
+      s_started = true;
+      /* scans and connections need the host synced with the controller */
+      if (xSemaphoreTake (s_synced, pdMS_TO_TICKS (BLE_SYNC_TIMEOUT_MS))
+          != pdTRUE)
+        {
+          lua_pushnil (L);
+          lua_pushstring (L, esp_err_to_name (ESP_ERR_TIMEOUT));
+          return 2;
+        }
+    }
+  else if (!ble_hs_synced ())
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, esp_err_to_name (ESP_ERR_TIMEOUT));
+      return 2;
+    }
   lua_pushboolean (L, 1);
   return 1;
 #else
@@ -62,39 +580,168 @@ lhos_ble_init (lua_State *L)
 #endif
 }
 
+#ifdef CONFIG_BT_NIMBLE_ENABLED
+static int
+push_scan_report (lua_State *L, const void *data, size_t len)
+{
+  static const char *const kinds[] = { "adv_ind", "direct_ind", "scan_ind",
+                                       "nonconn_ind", "scan_rsp" };
+  const scan_report_t *r = data;
+  if (r->kind == BLE_SCAN_DONE)
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, "done");
+      return 2;
+    }
+  push_addr (L, r->addr);
+  lua_pushinteger (L, r->rssi);
+  lua_pushlstring (L, (const char *)r->data, r->len);
+  lua_pushstring (L, r->kind < LHOS_BLE_ADV_KINDS ? kinds[r->kind] : "?");
+  lua_pushinteger (L, r->addr_type);
+  return 5;
+}
+
+/* Runs on the NimBLE host task for every advertising report; only the
+   ones passing the filters and the duplicate check cross to the Lua task. */
+static int
+scan_cb (struct ble_gap_event *event, void *arg)
+{
+  scan_report_t r;
+  switch (event->type)
+    {
+    case BLE_GAP_EVENT_DISC:
+      {
+        const struct ble_gap_disc_desc *d = &event->disc;
+        uint8_t len = d->length_data < LHOS_BLE_ADV_MAX ? d->length_data
+                                                        : LHOS_BLE_ADV_MAX;
+        uint32_t now = (uint32_t)pdTICKS_TO_MS (xTaskGetTickCount ());
+        if (!lhos_ble_scan_accept (&s_scan, d->addr.val, d->addr.type,
+                                   d->event_type, d->rssi, d->data, len,
+                                   now))
+          break;
+        memcpy (r.addr, d->addr.val, 6);
+        r.addr_type = d->addr.type;
+        r.kind = d->event_type;
+        r.rssi = d->rssi;
+        r.len = len;
+        memcpy (r.data, d->data, len);
+        if (!lhos_lua_post_event (BLE_SCAN_EVENT, push_scan_report, &r,
+                                  offsetof (scan_report_t, data) + len))
+          {
+            /* report it again once the queue drains */
+            lhos_ble_scan_forget (&s_scan, d->addr.val, d->addr.type,
+                                  d->event_type);
+            s_scan_dropped++;
+          }
+        break;
+      }
+    case BLE_GAP_EVENT_DISC_COMPLETE:
+      ESP_LOGI (TAG, "scan done: %lu reports, %lu passed",
+                (unsigned long)s_scan.received,
+                (unsigned long)s_scan.reported);
+      memset (&r, 0, sizeof (r));
+      r.kind = BLE_SCAN_DONE;
+      lhos_lua_post_event (BLE_SCAN_EVENT, push_scan_report, &r,
+                           offsetof (scan_report_t, data));
+      break;
+    default:
+      break;
+    }
+  return 0;
+}
+
+static uint8_t
+check_kinds (lua_State *L, int t)
+{
+  static const char *const kinds[] = { "adv_ind", "direct_ind", "scan_ind",
+                                       "nonconn_ind", "scan_rsp", NULL };
+  uint8_t mask = 0;
+  lua_getfield (L, t, "types");
+  if (!lua_isnil (L, -1))
+    {
+      luaL_argcheck (L, lua_istable (L, -1), t, "types must be a list");
+      int list = lua_gettop (L);
+      for (lua_Integer i = 1; lua_rawgeti (L, list, i) != LUA_TNIL; i++)
+        {
+          mask |= 1u << luaL_checkoption (L, -1, NULL, kinds);
+          lua_pop (L, 1);
+        }
+      lua_pop (L, 1);
+    }
+  lua_pop (L, 1);
+  return mask;
+}
+
+static lua_Integer
+opt_field (lua_State *L, int t, const char *name, lua_Integer def)
+{
+  lua_getfield (L, t, name);
+  lua_Integer v = luaL_optinteger (L, -1, def);
+  lua_pop (L, 1);
+  return v;
+}
+#endif
+
+/* ble.scan([opts,] fn): fn(addr, rssi, data, type, addr_type) for each
+   report that passes the filters, then fn(nil, "done"). */
 int
 lhos_ble_scan (lua_State *L)
 {
 #ifdef CONFIG_BT_NIMBLE_ENABLED
-  ESP_LOGI (TAG, "Starting NimBLE scan (5s)...");
+  int opts = lua_istable (L, 1) ? 1 : 0;
+  int fn = opts + 1;
+  luaL_checktype (L, fn, LUA_TFUNCTION);
 
-  static int found_count = 0;
+  lhos_ble_scan_filter_t f = { 0 };
+  struct ble_gap_disc_params params = { 0 };
+  int32_t duration = 5000;
+  f.rssi_min = -128;
+  if (opts)
+    {
+      duration = (int32_t)opt_field (L, opts, "duration", duration);
+      luaL_argcheck (L, duration >= 0, opts, "duration must be >= 0");
+      lua_Integer rssi = opt_field (L, opts, "rssi", -128);
+      luaL_argcheck (L, rssi >= -128 && rssi <= 127, opts, "bad rssi");
+      f.rssi_min = (int8_t)rssi;
+      f.refresh_ms = (uint32_t)opt_field (L, opts, "refresh", 0);
+      f.uuid16 = (uint16_t)opt_field (L, opts, "uuid", 0);
+      f.kinds = check_kinds (L, opts);
+      lua_getfield (L, opts, "name");
+      const char *name = luaL_optstring (L, -1, "");
+      luaL_argcheck (L, strlen (name) <= LHOS_BLE_NAME_MAX, opts,
+                     "name too long");
+      strcpy (f.name, name);
+      lua_pop (L, 1);
+      lua_getfield (L, opts, "active");
+      params.passive = !lua_toboolean (L, -1);
+      lua_pop (L, 1);
+    }
+  else
+    params.passive = 1;
 
-  /* callback invoked by NimBLE for gap events during discovery */
-  int scan_cb (struct ble_gap_event * event, void *arg)
-  {
-    if (event->type == BLE_GAP_EVENT_DISC)
-      {
-        const uint8_t *addr = event->disc.addr.val;
-        ESP_LOGI (TAG, "Found device %02x:%02x:%02x:%02x:%02x:%02x", addr[5],
-                  addr[4], addr[3], addr[2], addr[1], addr[0]);
-        found_count++;
-      }
-    return 0;
-  }
+  if (!s_started || !ble_hs_synced ())
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, esp_err_to_name (ESP_ERR_INVALID_STATE));
+      return 2;
+    }
+  /* a new scan replaces the running one */
+  if (ble_gap_disc_active ())
+    ble_gap_disc_cancel ();
+  if (!lhos_lua_set_event_handler (L, BLE_SCAN_EVENT, fn))
+    return luaL_error (L, "too many event handlers");
+  lhos_ble_scan_reset (&s_scan, &f);
+  s_scan_dropped = 0;
 
-  found_count = 0;
-  int rc = ble_gap_disc (0 /*own addr type*/, 5 /*secs*/, scan_cb, NULL);
+  int rc = ble_gap_disc (s_own_addr_type,
+                         duration ? duration : BLE_HS_FOREVER, &params,
+                         scan_cb, NULL);
   if (rc != 0)
     {
       ESP_LOGW (TAG, "ble_gap_disc failed: %d", rc);
-      lua_pushboolean (L, 0);
-      lua_pushinteger (L, rc);
-      return 2;
+      return push_ble_error (L, rc);
     }
-
-  /* return number found so far (scan runs asynchronously) */
-  lua_pushinteger (L, found_count);
+  lua_pushboolean (L, 1);
   return 1;
 #else
   ESP_LOGW (TAG, "NimBLE not enabled; scan not supported");
@@ -104,41 +751,34 @@ lhos_ble_scan (lua_State *L)
 #endif
 }
 
-int
-lhos_ble_connect (lua_State *L)
-{
 #ifdef CONFIG_BT_NIMBLE_ENABLED
-  /* Expect address string as first arg: "AA:BB:CC:DD:EE:FF" */
-  const char *addr_str = luaL_checkstring (L, 1);
-  unsigned int b[6];
-  if (sscanf (addr_str, "%x:%x:%x:%x:%x:%x", &b[5], &b[4], &b[3], &b[2], &b[1],
-              &b[0])
-      != 6)
-    {
-      lua_pushboolean (L, 0);
-      lua_pushinteger (L, -1);
-      return 2;
-    }
-  struct ble_addr_t peer_addr;
-  for (int i = 0; i < 6; i++)
+static int
+scan_cancel (void)
+{
+  if (!s_started || !ble_gap_disc_active ())
+    return 0;
+  int rc = ble_gap_disc_cancel ();
+  if (rc == 0)
     {
-      peer_addr.val[i] = (uint8_t)b[i];
+      /* NimBLE reports no completion for a cancelled scan */
+      scan_report_t r = { .kind = BLE_SCAN_DONE };
+      lhos_lua_post_event (BLE_SCAN_EVENT, push_scan_report, &r,
+                           offsetof (scan_report_t, data));
     }
+  return rc;
+}
+#endif
 
-  int rc = ble_gap_connect (BLE_OWN_ADDR_PUBLIC, &peer_addr, 10000 /*ms*/,
-                            gap_event_cb, NULL);
+int
+lhos_ble_stop_scan (lua_State *L)
+{
+#ifdef CONFIG_BT_NIMBLE_ENABLED
+  int rc = scan_cancel ();
   if (rc != 0)
-    {
-      ESP_LOGW (TAG, "ble_gap_connect failed: %d", rc);
-      lua_pushboolean (L, 0);
-      lua_pushinteger (L, rc);
-      return 2;
-    }
-
+    return push_ble_error (L, rc);
   lua_pushboolean (L, 1);
   return 1;
 #else
-  ESP_LOGW (TAG, "NimBLE not enabled; connect not supported");
   lua_pushboolean (L, 0);
   lua_pushinteger (L, ESP_ERR_NOT_SUPPORTED);
   return 2;
@@ -146,141 +786,1008 @@ lhos_ble_connect (lua_State *L)
 }
 
 int
-lhos_ble_disconnect (lua_State *L)
+lhos_ble_scan_stats (lua_State *L)
 {
-  ESP_LOGW (TAG, "disconnect not implemented");
+#ifdef CONFIG_BT_NIMBLE_ENABLED
+  lua_createtable (L, 0, 6);
+  lua_pushboolean (L, s_started && ble_gap_disc_active ());
+  lua_setfield (L, -2, "active");
+  lua_pushinteger (L, s_scan.received);
+  lua_setfield (L, -2, "received");
+  lua_pushinteger (L, s_scan.filtered);
+  lua_setfield (L, -2, "filtered");
+  lua_pushinteger (L, s_scan.duplicates);
+  lua_setfield (L, -2, "duplicates");
+  lua_pushinteger (L, s_scan.reported);
+  lua_setfield (L, -2, "reported");
+  lua_pushinteger (L, s_scan_dropped);
+  lua_setfield (L, -2, "dropped");
+  return 1;
+#else
   lua_pushboolean (L, 0);
   lua_pushinteger (L, ESP_ERR_NOT_SUPPORTED);
   return 2;
+#endif
 }
 
+/* ble.connect(addr [, addr_type [, timeout_ms]]): starts connecting and
+   returns at once; the outcome arrives as a "ble_conn" event, fn(conn,
+   addr) or fn(nil, addr, err). */
 int
-lhos_ble_read (lua_State *L)
+lhos_ble_connect (lua_State *L)
 {
 #ifdef CONFIG_BT_NIMBLE_ENABLED
-  if (g_conn_handle < 0)
+  const char *addr_str = luaL_checkstring (L, 1);
+  lua_Integer type = luaL_optinteger (L, 2, 0);
+  lua_Integer timeout = luaL_optinteger (L, 3, BLE_CONNECT_TIMEOUT_MS);
+  luaL_argcheck (L, type >= 0 && type <= 3, 2, "bad address type");
+  luaL_argcheck (L, timeout > 0, 3, "timeout must be > 0");
+  ble_addr_t peer;
+  if (!parse_addr (addr_str, (uint8_t)type, &peer))
+    return luaL_argerror (L, 1, "expected \"AA:BB:CC:DD:EE:FF\"");
+
+  if (!s_started || !ble_hs_synced ())
     {
       lua_pushnil (L);
-      lua_pushinteger (L, -1);
+      lua_pushstring (L, esp_err_to_name (ESP_ERR_INVALID_STATE));
       return 2;
     }
-  uint16_t attr_handle = (uint16_t)luaL_checkinteger (L, 1);
-  uint8_t buf[512];
-  uint16_t len = sizeof (buf);
-  int rc = ble_gattc_read_flat (g_conn_handle, attr_handle, buf, &len);
+  /* one attempt at a time; s_connect_peer belongs to it */
+  if (ble_gap_conn_active ())
+    return push_ble_error (L, BLE_HS_EALREADY);
+  /* the controller cannot scan and initiate at once */
+  scan_cancel ();
+  s_connect_peer = peer;
+  /* NimBLE ends the attempt itself after `timeout`, with a CONNECT event
+     whose status is BLE_HS_ETIMEOUT */
+  int rc = ble_gap_connect (s_own_addr_type, &peer, (int32_t)timeout, NULL,
+                            gap_event_cb, &s_connect_peer);
   if (rc != 0)
     {
-      lua_pushnil (L);
-      lua_pushinteger (L, rc);
-      return 2;
+      ESP_LOGW (TAG, "ble_gap_connect failed: %d", rc);
+      return push_ble_error (L, rc);
     }
-  lua_pushlstring (L, (const char *)buf, len);
+  lua_pushboolean (L, 1);
   return 1;
 #else
-  ESP_LOGW (TAG, "read not implemented");
-  lua_pushnil (L);
+  ESP_LOGW (TAG, "NimBLE not enabled; connect not supported");
+  lua_pushboolean (L, 0);
   lua_pushinteger (L, ESP_ERR_NOT_SUPPORTED);
   return 2;
 #endif
 }
 
 int
-lhos_ble_write (lua_State *L)
+lhos_ble_disconnect (lua_State *L)
 {
 #ifdef CONFIG_BT_NIMBLE_ENABLED
-  if (g_conn_handle < 0)
-    {
-      lua_pushboolean (L, 0);
-      lua_pushinteger (L, -1);
-      return 2;
-    }
-  uint16_t attr_handle = (uint16_t)luaL_checkinteger (L, 1);
-  size_t data_len;
-  const char *data = luaL_checklstring (L, 2, &data_len);
-  int rc = ble_gattc_write_flat (g_conn_handle, attr_handle, (void *)data,
-                                 data_len, NULL, NULL);
+  ble_conn_t *c = conn_arg (L, 1);
+  if (!c)
+    return push_not_connected (L);
+  int rc = ble_gap_terminate (c->handle, BLE_ERR_REM_USER_CONN_TERM);
   if (rc != 0)
-    {
-      lua_pushboolean (L, 0);
-      lua_pushinteger (L, rc);
-      return 2;
-    }
+    return push_ble_error (L, rc);
   lua_pushboolean (L, 1);
   return 1;
 #else
-  ESP_LOGW (TAG, "write not implemented");
   lua_pushboolean (L, 0);
   lua_pushinteger (L, ESP_ERR_NOT_SUPPORTED);
   return 2;
 #endif
 }
 
+/* ble.connections(): {[handle] = "AA:BB:..", ...} */
 int
-lhos_ble_notify (lua_State *L)
+lhos_ble_connections (lua_State *L)
 {
-  /* If passed a function, register it in the Lua VM via lhos_lua.
-     If passed an integer, subscribe to the given characteristic handle. */
-  if (lua_isfunction (L, 1))
-    {
-      return lhos_lua_register_ble_callback (L);
-    }
-
+  lua_newtable (L);
 #ifdef CONFIG_BT_NIMBLE_ENABLED
-  if (!lua_isinteger (L, 1))
-    {
-      lua_pushboolean (L, 0);
-      lua_pushinteger (L, -1);
-      return 2;
-    }
-  if (g_conn_handle < 0)
+  for (int i = 0; i < BLE_MAX_CONN; i++)
     {
-      lua_pushboolean (L, 0);
-      lua_pushinteger (L, -1);
-      return 2;
+      ble_conn_t *c = &s_conns[i];
+      uint16_t handle = c->handle;
+      if (!s_started || handle == BLE_HS_CONN_HANDLE_NONE)
+        continue;
+      push_addr (L, c->peer.val);
+      lua_rawseti (L, -2, handle);
     }
+#endif
+  return 1;
+}
+
+/* ble.on_disconnect(fn): fn(conn, reason, addr) */
+int
+lhos_ble_on_disconnect (lua_State *L)
+{
+  if (!lua_isnoneornil (L, 1))
+    luaL_checktype (L, 1, LUA_TFUNCTION);
+  if (!lhos_lua_set_event_handler (L, BLE_DISC_EVENT, 1))
+    return luaL_error (L, "too many event handlers");
+  return 0;
+}
+
+/* ble.on_gatt(fn): fn(id, conn, attr_handle, err, data) when a request
+   finishes; err is nil on success, data is the value read. */
+int
+lhos_ble_on_gatt (lua_State *L)
+{
+  if (!lua_isnoneornil (L, 1))
+    luaL_checktype (L, 1, LUA_TFUNCTION);
+  if (!lhos_lua_set_event_handler (L, BLE_GATT_EVENT, 1))
+    return luaL_error (L, "too many event handlers");
+  return 0;
+}
 
-  uint16_t char_handle = (uint16_t)lua_tointeger (L, 1);
-  struct ble_gattc_subscribe_params params;
-  memset (&params, 0, sizeof (params));
-  params.ccc_handle = char_handle;
-
-  /* notification callback: forward data into lhos_lua dispatcher */
-  int notify_cb (uint16_t conn_handle, const struct ble_gatt_error *error,
-                 struct os_mbuf *om, void *arg)
-  {
-    if (!om)
-      return 0;
-    int len = OS_MBUF_PKTLEN (om);
-    if (len <= 0)
-      return 0;
-    uint8_t *buf = malloc (len);
-    if (!buf)
-      return 0;
-    int off = 0;
-    struct os_mbuf *m = om;
-    while (m && off < len)
-      {
-        int copy = m->om_len;
-        if (copy > len - off)
-          copy = len - off;
-        memcpy (buf + off, m->om_data, copy);
-        off += copy;
-        m = m->om_next;
-      }
-    lhos_lua_enqueue_notification (buf, len);
-    free (buf);
-    return 0;
-  }
-
-  int rc = ble_gattc_subscribe (g_conn_handle, &params, notify_cb, NULL);
+/* ble.on_connect(fn): fn(conn, addr) for every new link, including
+   clients connecting to us while advertising; fn(nil, addr, err) when a
+   ble.connect() fails or times out. */
+int
+lhos_ble_on_connect (lua_State *L)
+{
+  if (!lua_isnoneornil (L, 1))
+    luaL_checktype (L, 1, LUA_TFUNCTION);
+  if (!lhos_lua_set_event_handler (L, BLE_CONN_EVENT, 1))
+    return luaL_error (L, "too many event handlers");
+  return 0;
+}
+
+/* ble.advertise([name [, interval_ms]]): connectable advertising under
+   `name` (the GAP device name), kept up while link slots are free. */
+int
+lhos_ble_advertise (lua_State *L)
+{
+#ifdef CONFIG_BT_NIMBLE_ENABLED
+  size_t name_len = 0;
+  const char *name = luaL_optlstring (L, 1, NULL, &name_len);
+  lua_Integer interval = luaL_optinteger (L, 2, BLE_ADV_INTERVAL_MS);
+  /* flags take 3 of the 31 bytes, the name's header 2 */
+  luaL_argcheck (L, name_len <= 26, 1, "name too long");
+  luaL_argcheck (L, interval >= 20 && interval <= 10240, 2,
+                 "interval out of range");
+  if (!s_started || !ble_hs_synced ())
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, esp_err_to_name (ESP_ERR_INVALID_STATE));
+      return 2;
+    }
+  if (name && ble_svc_gap_device_name_set (name) != 0)
+    return push_ble_error (L, BLE_HS_EINVAL);
+  name = ble_svc_gap_device_name ();
+  name_len = strlen (name);
+  struct ble_hs_adv_fields fields = {
+    .flags = BLE_HS_ADV_F_DISC_GEN | BLE_HS_ADV_F_BREDR_UNSUP,
+    .name = (const uint8_t *)name,
+    .name_len = (uint8_t)(name_len > 26 ? 26 : name_len),
+    .name_is_complete = name_len <= 26,
+  };
+  s_adv_wanted = false;
+  if (ble_gap_adv_active ())
+    ble_gap_adv_stop ();
+  int rc = ble_gap_adv_set_fields (&fields);
   if (rc != 0)
+    return push_ble_error (L, rc);
+  /* in units of 0.625 ms */
+  uint16_t itvl = (uint16_t)(interval * 8 / 5);
+  s_adv_params = (struct ble_gap_adv_params){
+    .conn_mode = BLE_GAP_CONN_MODE_UND,
+    .disc_mode = BLE_GAP_DISC_MODE_GEN,
+    .itvl_min = itvl,
+    .itvl_max = itvl,
+  };
+  s_adv_wanted = true;
+  adv_resume ();
+  lua_pushboolean (L, 1);
+  return 1;
+#else
+  lua_pushnil (L);
+  lua_pushinteger (L, ESP_ERR_NOT_SUPPORTED);
+  return 2;
+#endif
+}
+
+int
+lhos_ble_stop_advertise (lua_State *L)
+{
+#ifdef CONFIG_BT_NIMBLE_ENABLED
+  s_adv_wanted = false;
+  if (s_started && ble_gap_adv_active ())
+    {
+      int rc = ble_gap_adv_stop ();
+      if (rc != 0)
+        return push_ble_error (L, rc);
+    }
+#endif
+  lua_pushboolean (L, 1);
+  return 1;
+}
+
+/* ble.mtu(conn): ATT MTU agreed with the peer (23 until exchanged). */
+int
+lhos_ble_mtu (lua_State *L)
+{
+#ifdef CONFIG_BT_NIMBLE_ENABLED
+  ble_conn_t *c = conn_arg (L, 1);
+  if (!c)
+    return push_not_connected (L);
+  lua_pushinteger (L, ble_att_mtu (c->handle));
+  return 1;
+#else
+  lua_pushnil (L);
+  lua_pushinteger (L, ESP_ERR_NOT_SUPPORTED);
+  return 2;
+#endif
+}
+
+#ifdef CONFIG_BT_NIMBLE_ENABLED
+static int
+push_gatt_result (lua_State *L, const void *data, size_t len)
+{
+  const gatt_result_t *r = data;
+  lua_pushinteger (L, r->id);
+  lua_pushinteger (L, r->conn);
+  lua_pushinteger (L, r->attr);
+  if (r->status != 0)
+    {
+      lua_pushfstring (L, "ble error %d", r->status);
+      return 4;
+    }
+  lua_pushnil (L);
+  if (r->op == LHOS_GATT_DISCOVER)
+    {
+      lua_pushstring (L, r->cached ? "cache" : "discovery");
+      return 5;
+    }
+  if (!r->om)
+    return 4;
+  size_t n = OS_MBUF_PKTLEN (r->om);
+  if (r->buf != LUA_NOREF)
+    {
+      /* read into the caller's buffer, cut to its capacity */
+      lua_rawgeti (L, LUA_REGISTRYINDEX, r->buf);
+      lhos_buffer_t *b = lhos_lua_buffer_test (L, -1);
+      if (b)
+        {
+          b->len = n < b->cap ? n : b->cap;
+          os_mbuf_copydata (r->om, 0, (int)b->len, b->data);
+        }
+      return 5;
+    }
+  luaL_Buffer lb;
+  char *p = luaL_buffinitsize (L, &lb, n);
+  os_mbuf_copydata (r->om, 0, (int)n, p);
+  luaL_pushresultsize (&lb, n);
+  return 5;
+}
+
+static void
+release_gatt_result (lua_State *L, void *data)
+{
+  gatt_result_t *r = data;
+  os_mbuf_free_chain (r->om);
+  r->om = NULL;
+  if (r->buf != LUA_NOREF)
+    luaL_unref (L, LUA_REGISTRYINDEX, r->buf);
+  slot_free (&s_results_used, r - s_results);
+}
+
+static void
+stale_buf (int ref)
+{
+  if (ref != LUA_NOREF && s_nstale < (int)(sizeof (s_stale_bufs)
+                                            / sizeof (s_stale_bufs[0])))
+    s_stale_bufs[s_nstale++] = ref;
+}
+
+/* lhos_gatt_ops_t: runs with s_gatt_lock held, on the host task or, when
+   a request fails to start, on the Lua task. Writes without response
+   report failures only, so a burst of them does not flood the queue.
+   A discovery's `result` is non-NULL when it came from the cache. */
+static void
+gatt_done (void *ctx, lhos_gatt_req_t *req, int status, void *result)
+{
+  bool discover = req->op == LHOS_GATT_DISCOVER;
+  struct os_mbuf *om = discover ? NULL : result;
+  os_mbuf_free_chain (req->data); /* a write that never started */
+  if (req->op == LHOS_GATT_WRITE_NO_RSP && status == 0)
+    return;
+  int slot = slot_alloc (&s_results_used, BLE_GATT_RESULTS);
+  if (slot >= 0)
+    {
+      gatt_result_t *r = &s_results[slot];
+      *r = (gatt_result_t){ .id = req->id, .conn = req->conn,
+                            .attr = req->attr, .status = status, .om = om,
+                            .buf = req->user, .op = (uint8_t)req->op,
+                            .cached = discover && result };
+      if (lhos_lua_post_event_ref (BLE_GATT_EVENT, push_gatt_result,
+                                   release_gatt_result, r, 0))
+        return;
+      slot_free (&s_results_used, slot);
+    }
+  os_mbuf_free_chain (om);
+  stale_buf (req->user);
+}
+
+/* Connection whose request in flight is `id`; s_gatt_lock held. */
+static ble_conn_t *
+conn_by_request (uint32_t id)
+{
+  for (int i = 0; i < BLE_MAX_CONN; i++)
+    {
+      lhos_gatt_queue_t *q = &s_conns[i].gatt;
+      if (q->inflight && q->reqs[q->head].id == id)
+        return &s_conns[i];
+    }
+  return NULL;
+}
+
+/* NimBLE completion of every request; `arg` carries the request id. A
+   long read calls back once per blob and then with BLE_HS_EDONE. */
+static int
+gatt_attr_cb (uint16_t conn_handle, const struct ble_gatt_error *error,
+              struct ble_gatt_attr *attr, void *arg)
+{
+  uint32_t id = (uint32_t)(uintptr_t)arg;
+  xSemaphoreTakeRecursive (s_gatt_lock, portMAX_DELAY);
+  ble_conn_t *c = conn_by_request (id);
+  if (c)
+    {
+      lhos_gatt_op_t op = c->gatt.reqs[c->gatt.head].op;
+      int status = error->status;
+      if (status == 0 && attr && attr->om
+          && (op == LHOS_GATT_READ || op == LHOS_GATT_READ_LONG))
+        {
+          /* keep the mbuf; NimBLE frees what is left in attr->om */
+          if (c->rx)
+            os_mbuf_concat (c->rx, attr->om);
+          else
+            c->rx = attr->om;
+          attr->om = NULL;
+        }
+      if (status == BLE_HS_EDONE)
+        status = 0;
+      else if (status == 0 && op == LHOS_GATT_READ_LONG)
+        c = NULL; /* more blobs to come */
+      if (c)
+        {
+          struct os_mbuf *om = c->rx;
+          c->rx = NULL;
+          if (status != 0)
+            {
+              os_mbuf_free_chain (om);
+              om = NULL;
+            }
+          lhos_gatt_complete (&c->gatt, id, status, om);
+        }
+    }
+  xSemaphoreGiveRecursive (s_gatt_lock);
+  return 0;
+}
+
+/* Discovery. The peer's handle table is cached in NVS under its identity
+   address, together with its Database Hash (GATT 5.1): a reconnect reads
+   the 16-byte hash, one round trip, and only walks the database again if
+   the hash changed. Peers without the hash characteristic are always
+   discovered, as nothing tells when their table goes stale. The steps
+   run on the host task, each started from the callback of the one
+   before; the queue sees a single request throughout. */
+
+static void
+db_key (const ble_conn_t *c, char key[16])
+{
+  const uint8_t *a = c->peer.val;
+  snprintf (key, 16, "%02x%02x%02x%02x%02x%02x%u", a[5], a[4], a[3], a[2],
+            a[1], a[0], c->peer.type);
+}
+
+/* Replace c->db with the stored table if its hash matches the one just
+   read from the peer. */
+static bool
+db_load (ble_conn_t *c)
+{
+  uint8_t hash[16];
+  memcpy (hash, c->db->hash, sizeof (hash));
+  char key[16];
+  db_key (c, key);
+  nvs_handle_t h;
+  if (nvs_open (BLE_DB_NAMESPACE, NVS_READONLY, &h) != ESP_OK)
+    return false;
+  size_t len = sizeof (*c->db);
+  esp_err_t err = nvs_get_blob (h, key, c->db, &len);
+  nvs_close (h);
+  if (err == ESP_OK && lhos_ble_db_valid (c->db, len) && c->db->has_hash
+      && memcmp (c->db->hash, hash, sizeof (hash)) == 0)
+    return true;
+  lhos_ble_db_reset (c->db);
+  memcpy (c->db->hash, hash, sizeof (hash));
+  c->db->has_hash = 1;
+  return false;
+}
+
+static void
+db_store (ble_conn_t *c)
+{
+  char key[16];
+  db_key (c, key);
+  nvs_handle_t h;
+  esp_err_t err = nvs_open (BLE_DB_NAMESPACE, NVS_READWRITE, &h);
+  if (err == ESP_OK)
+    {
+      err = nvs_set_blob (h, key, c->db, lhos_ble_db_size (c->db));
+      if (err == ESP_OK)
+        err = nvs_commit (h);
+      nvs_close (h);
+    }
+  if (err != ESP_OK)
+    ESP_LOGW (TAG, "GATT cache not saved: %s", esp_err_to_name (err));
+}
+
+static void
+uuid_from_ble (const ble_uuid_any_t *u, uint8_t out[16])
+{
+  if (u->u.type == BLE_UUID_TYPE_16)
+    lhos_ble_uuid_from16 (out, u->u16.value);
+  else if (u->u.type == BLE_UUID_TYPE_32)
+    lhos_ble_uuid_from16 (out, u->u32.value);
+  else
+    memcpy (out, u->u128.value, 16);
+}
+
+static int disc_svc_cb (uint16_t conn_handle,
+                        const struct ble_gatt_error *error,
+                        const struct ble_gatt_svc *service, void *arg);
+static int disc_chr_cb (uint16_t conn_handle,
+                        const struct ble_gatt_error *error,
+                        const struct ble_gatt_chr *chr, void *arg);
+static int disc_dsc_cb (uint16_t conn_handle,
+                        const struct ble_gatt_error *error,
+                        uint16_t chr_val_handle,
+                        const struct ble_gatt_dsc *dsc, void *arg);
+
+/* Start the next step of c's discovery; BLE_HS_EDONE when there is none
+   left. Descriptors are only looked for where a CCCD can be, under
+   characteristics that notify or indicate. */
+static int
+disc_next (ble_conn_t *c, void *arg)
+{
+  lhos_ble_db_t *db = c->db;
+  switch (c->disc_phase)
+    {
+    case DISC_HASH:
+      c->disc_phase = DISC_SVCS;
+      return ble_gattc_disc_all_svcs (c->handle, disc_svc_cb, arg);
+    case DISC_SVCS:
+      c->disc_phase = DISC_CHRS;
+      c->disc_idx = 0;
+      /* fall through */
+    case DISC_CHRS:
+      if (c->disc_idx < db->nsvcs)
+        {
+          const lhos_ble_svc_t *s = &db->svcs[c->disc_idx++];
+          return ble_gattc_disc_all_chrs (c->handle, s->start, s->end,
+                                          disc_chr_cb, arg);
+        }
+      c->disc_phase = DISC_DSCS;
+      c->disc_idx = 0;
+      /* fall through */
+    case DISC_DSCS:
+      while (c->disc_idx < db->nchrs)
+        {
+          size_t i = c->disc_idx++;
+          const lhos_ble_chr_t *ch = &db->chrs[i];
+          uint16_t end = lhos_ble_db_chr_end (db, i);
+          if ((ch->props
+               & (BLE_GATT_CHR_PROP_NOTIFY | BLE_GATT_CHR_PROP_INDICATE))
+              && ch->val_handle < end)
+            return ble_gattc_disc_all_dscs (c->handle, ch->val_handle, end,
+                                            disc_dsc_cb, arg);
+        }
+      break;
+    }
+  return BLE_HS_EDONE;
+}
+
+/* A step ended with `status`: go on with the next one, or finish. */
+static void
+disc_step (ble_conn_t *c, uint32_t id, int status)
+{
+  void *arg = (void *)(uintptr_t)id;
+  if (status == BLE_HS_EDONE)
+    status = disc_next (c, arg);
+  if (status == 0)
+    return;
+  if (status == BLE_HS_EDONE)
+    {
+      status = 0;
+      c->db_ready = true;
+      if (c->db->has_hash)
+        db_store (c);
+    }
+  lhos_gatt_complete (&c->gatt, id, status, NULL);
+}
+
+static int
+disc_hash_cb (uint16_t conn_handle, const struct ble_gatt_error *error,
+              struct ble_gatt_attr *attr, void *arg)
+{
+  uint32_t id = (uint32_t)(uintptr_t)arg;
+  xSemaphoreTakeRecursive (s_gatt_lock, portMAX_DELAY);
+  ble_conn_t *c = conn_by_request (id);
+  if (c && error->status == 0)
+    {
+      if (attr && OS_MBUF_PKTLEN (attr->om) == sizeof (c->db->hash))
+        {
+          os_mbuf_copydata (attr->om, 0, sizeof (c->db->hash),
+                            c->db->hash);
+          c->db->has_hash = 1;
+        }
+    }
+  else if (c && c->db->has_hash && db_load (c))
+    {
+      c->db_ready = true;
+      lhos_gatt_complete (&c->gatt, id, 0, c->db);
+    }
+  else if (c)
+    /* no hash (attribute not found) or a stale cache: walk the database */
+    disc_step (c, id, BLE_HS_EDONE);
+  xSemaphoreGiveRecursive (s_gatt_lock);
+  return 0;
+}
+
+static int
+disc_svc_cb (uint16_t conn_handle, const struct ble_gatt_error *error,
+             const struct ble_gatt_svc *service, void *arg)
+{
+  uint32_t id = (uint32_t)(uintptr_t)arg;
+  xSemaphoreTakeRecursive (s_gatt_lock, portMAX_DELAY);
+  ble_conn_t *c = conn_by_request (id);
+  if (c && error->status == 0)
+    {
+      uint8_t uuid[16];
+      uuid_from_ble (&service->uuid, uuid);
+      if (!lhos_ble_db_add_svc (c->db, uuid, service->start_handle,
+                                service->end_handle))
+        ESP_LOGW (TAG, "GATT table full, service 0x%04x left out",
+                  service->start_handle);
+    }
+  else if (c)
+    disc_step (c, id, error->status);
+  xSemaphoreGiveRecursive (s_gatt_lock);
+  return 0;
+}
+
+static int
+disc_chr_cb (uint16_t conn_handle, const struct ble_gatt_error *error,
+             const struct ble_gatt_chr *chr, void *arg)
+{
+  uint32_t id = (uint32_t)(uintptr_t)arg;
+  xSemaphoreTakeRecursive (s_gatt_lock, portMAX_DELAY);
+  ble_conn_t *c = conn_by_request (id);
+  if (c && error->status == 0)
+    {
+      uint8_t uuid[16];
+      uuid_from_ble (&chr->uuid, uuid);
+      if (!lhos_ble_db_add_chr (c->db, uuid, chr->def_handle,
+                                chr->val_handle, chr->properties))
+        ESP_LOGW (TAG, "GATT table full, characteristic 0x%04x left out",
+                  chr->val_handle);
+    }
+  else if (c)
+    disc_step (c, id, error->status);
+  xSemaphoreGiveRecursive (s_gatt_lock);
+  return 0;
+}
+
+static int
+disc_dsc_cb (uint16_t conn_handle, const struct ble_gatt_error *error,
+             uint16_t chr_val_handle, const struct ble_gatt_dsc *dsc,
+             void *arg)
+{
+  uint32_t id = (uint32_t)(uintptr_t)arg;
+  xSemaphoreTakeRecursive (s_gatt_lock, portMAX_DELAY);
+  ble_conn_t *c = conn_by_request (id);
+  if (c && error->status == 0)
+    {
+      if (dsc->uuid.u.type == BLE_UUID_TYPE_16
+          && dsc->uuid.u16.value == BLE_UUID_CCCD)
+        c->db->chrs[c->disc_idx - 1].cccd_handle = dsc->handle;
+    }
+  else if (c)
+    disc_step (c, id, error->status);
+  xSemaphoreGiveRecursive (s_gatt_lock);
+  return 0;
+}
+
+static int
+disc_start (ble_conn_t *c, void *arg)
+{
+  static const ble_uuid16_t hash_uuid = BLE_UUID16_INIT (BLE_UUID_DB_HASH);
+  if (!c->db && !(c->db = malloc (sizeof (*c->db))))
+    return BLE_HS_ENOMEM;
+  lhos_ble_db_reset (c->db);
+  c->db_ready = false;
+  c->disc_phase = DISC_HASH;
+  return ble_gattc_read_by_uuid (c->handle, 1, 0xFFFF, &hash_uuid.u,
+                                 disc_hash_cb, arg);
+}
+
+static int
+gatt_start (void *ctx, lhos_gatt_req_t *req)
+{
+  void *arg = (void *)(uintptr_t)req->id;
+  struct os_mbuf *om = req->data;
+  /* NimBLE consumes a write's mbuf whatever the outcome */
+  req->data = NULL;
+  switch (req->op)
     {
-      lua_pushboolean (L, 0);
-      lua_pushinteger (L, rc);
+    case LHOS_GATT_READ:
+      return ble_gattc_read (req->conn, req->attr, gatt_attr_cb, arg);
+    case LHOS_GATT_READ_LONG:
+      return ble_gattc_read_long (req->conn, req->attr, 0, gatt_attr_cb,
+                                  arg);
+    case LHOS_GATT_WRITE:
+      /* values that do not fit one PDU go out as prepared writes */
+      if (OS_MBUF_PKTLEN (om) > ble_att_mtu (req->conn) - 3)
+        return ble_gattc_write_long (req->conn, req->attr, 0, om,
+                                     gatt_attr_cb, arg);
+      return ble_gattc_write (req->conn, req->attr, om, gatt_attr_cb, arg);
+    case LHOS_GATT_WRITE_NO_RSP:
+      return ble_gattc_write_no_rsp (req->conn, req->attr, om);
+    case LHOS_GATT_DISCOVER:
+      return disc_start (ctx, arg);
+    }
+  os_mbuf_free_chain (om);
+  return BLE_HS_EINVAL;
+}
+
+/* Queue `req` on connection `c` and push its id, or nil and an error. */
+static int
+gatt_submit (lua_State *L, ble_conn_t *c, lhos_gatt_req_t *req)
+{
+  xSemaphoreTakeRecursive (s_gatt_lock, portMAX_DELAY);
+  while (s_nstale > 0)
+    luaL_unref (L, LUA_REGISTRYINDEX, s_stale_bufs[--s_nstale]);
+  if (++s_gatt_id == 0)
+    s_gatt_id = 1;
+  req->id = s_gatt_id;
+  req->conn = c->handle;
+  bool ok = lhos_gatt_submit (&c->gatt, req);
+  xSemaphoreGiveRecursive (s_gatt_lock);
+  if (!ok)
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, "busy");
+      return 2;
+    }
+  lua_pushinteger (L, req->id);
+  return 1;
+}
+#endif
+
+/* ble.read(conn, attr_handle [, opts]): queues a read and returns its id;
+   the value arrives at the ble.on_gatt handler. `opts` is a buffer to
+   read into or a table {long = bool, buffer = buf}. */
+int
+lhos_ble_read (lua_State *L)
+{
+#ifdef CONFIG_BT_NIMBLE_ENABLED
+  ble_conn_t *c = conn_arg (L, 1);
+  lhos_gatt_req_t req = { .attr = (uint16_t)luaL_checkinteger (L, 2),
+                          .op = LHOS_GATT_READ,
+                          .user = LUA_NOREF };
+  int buf = 0;
+  if (lua_istable (L, 3))
+    {
+      lua_getfield (L, 3, "long");
+      if (lua_toboolean (L, -1))
+        req.op = LHOS_GATT_READ_LONG;
+      lua_getfield (L, 3, "buffer");
+      if (!lua_isnil (L, -1))
+        {
+          lhos_lua_buffer_check (L, -1);
+          buf = lua_gettop (L);
+        }
+    }
+  else if (!lua_isnoneornil (L, 3))
+    {
+      lhos_lua_buffer_check (L, 3);
+      buf = 3;
+    }
+  if (!c)
+    return push_not_connected (L);
+  if (buf)
+    {
+      lua_pushvalue (L, buf);
+      req.user = luaL_ref (L, LUA_REGISTRYINDEX);
+    }
+  int n = gatt_submit (L, c, &req);
+  if (n == 2 && req.user != LUA_NOREF)
+    luaL_unref (L, LUA_REGISTRYINDEX, req.user);
+  return n;
+#else
+  ESP_LOGW (TAG, "read not implemented");
+  lua_pushnil (L);
+  lua_pushinteger (L, ESP_ERR_NOT_SUPPORTED);
+  return 2;
+#endif
+}
+
+/* ble.write(conn, attr_handle, data [, opts]): queues a write and returns
+   its id. opts.response = false writes without response. */
+int
+lhos_ble_write (lua_State *L)
+{
+#ifdef CONFIG_BT_NIMBLE_ENABLED
+  ble_conn_t *c = conn_arg (L, 1);
+  lhos_gatt_req_t req = { .attr = (uint16_t)luaL_checkinteger (L, 2),
+                          .op = LHOS_GATT_WRITE,
+                          .user = LUA_NOREF };
+  size_t data_len;
+  const uint8_t *data = lhos_lua_checkbytes (L, 3, &data_len);
+  luaL_argcheck (L, data_len <= UINT16_MAX, 3, "too long");
+  if (lua_istable (L, 4))
+    {
+      lua_getfield (L, 4, "response");
+      if (!lua_isnil (L, -1) && !lua_toboolean (L, -1))
+        req.op = LHOS_GATT_WRITE_NO_RSP;
+      lua_pop (L, 1);
+    }
+  if (!c)
+    return push_not_connected (L);
+  /* the one copy: straight into the mbuf NimBLE will send */
+  req.data = ble_hs_mbuf_from_flat (data, (uint16_t)data_len);
+  if (!req.data)
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, esp_err_to_name (ESP_ERR_NO_MEM));
+      return 2;
+    }
+  req.len = (uint16_t)data_len;
+  int n = gatt_submit (L, c, &req);
+  if (n == 2)
+    os_mbuf_free_chain (req.data);
+  return n;
+#else
+  ESP_LOGW (TAG, "write not implemented");
+  lua_pushboolean (L, 0);
+  lua_pushinteger (L, ESP_ERR_NOT_SUPPORTED);
+  return 2;
+#endif
+}
+
+/* ble.discover(conn): queues discovery of the peer's services and
+   returns its id. The ble.on_gatt handler gets attr_handle 0 and data
+   "cache" or "discovery", after which ble.handle() and
+   ble.characteristics() answer for `conn`. */
+int
+lhos_ble_discover (lua_State *L)
+{
+#ifdef CONFIG_BT_NIMBLE_ENABLED
+  ble_conn_t *c = conn_arg (L, 1);
+  lhos_gatt_req_t req = { .op = LHOS_GATT_DISCOVER, .user = LUA_NOREF };
+  if (!c)
+    return push_not_connected (L);
+  return gatt_submit (L, c, &req);
+#else
+  lua_pushnil (L);
+  lua_pushinteger (L, ESP_ERR_NOT_SUPPORTED);
+  return 2;
+#endif
+}
+
+#ifdef CONFIG_BT_NIMBLE_ENABLED
+static void
+check_uuid (lua_State *L, int idx, uint8_t out[16])
+{
+  if (lua_type (L, idx) == LUA_TNUMBER)
+    {
+      lua_Integer v = lua_tointeger (L, idx);
+      luaL_argcheck (L, v >= 0 && v <= UINT32_MAX, idx, "bad UUID");
+      lhos_ble_uuid_from16 (out, (uint32_t)v);
+    }
+  else if (!lhos_ble_uuid_parse (luaL_checkstring (L, idx), out))
+    luaL_argerror (L, idx, "bad UUID");
+}
+
+/* Discovered table of `c`, with s_gatt_lock held; NULL (lock released)
+   and the error pushed otherwise. */
+static const lhos_ble_db_t *
+db_acquire (lua_State *L, ble_conn_t *c)
+{
+  if (!c)
+    {
+      push_not_connected (L);
+      return NULL;
+    }
+  xSemaphoreTakeRecursive (s_gatt_lock, portMAX_DELAY);
+  if (c->db_ready)
+    return c->db;
+  xSemaphoreGiveRecursive (s_gatt_lock);
+  lua_pushnil (L);
+  lua_pushstring (L, "not discovered");
+  return NULL;
+}
+#endif
+
+/* ble.handle(conn, chr_uuid [, svc_uuid]): value handle, CCCD handle (nil
+   without one) and properties of a discovered characteristic. UUIDs are
+   numbers or strings such as "2A19" or the 128-bit form. */
+int
+lhos_ble_handle (lua_State *L)
+{
+#ifdef CONFIG_BT_NIMBLE_ENABLED
+  ble_conn_t *c = conn_arg (L, 1);
+  uint8_t chr[16], svc[16];
+  check_uuid (L, 2, chr);
+  bool in_svc = !lua_isnoneornil (L, 3);
+  if (in_svc)
+    check_uuid (L, 3, svc);
+  const lhos_ble_db_t *db = db_acquire (L, c);
+  if (!db)
+    return 2;
+  const lhos_ble_chr_t *ch = lhos_ble_db_find (db, chr, in_svc ? svc : NULL);
+  lhos_ble_chr_t found;
+  if (ch)
+    found = *ch;
+  xSemaphoreGiveRecursive (s_gatt_lock);
+  if (!ch)
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, "not found");
+      return 2;
+    }
+  lua_pushinteger (L, found.val_handle);
+  if (found.cccd_handle)
+    lua_pushinteger (L, found.cccd_handle);
+  else
+    lua_pushnil (L);
+  lua_pushinteger (L, found.props);
+  return 3;
+#else
+  lua_pushnil (L);
+  lua_pushinteger (L, ESP_ERR_NOT_SUPPORTED);
+  return 2;
+#endif
+}
+
+/* ble.characteristics(conn): {{uuid=, service=, handle=, cccd=, props=},
+   ...} in handle order. */
+int
+lhos_ble_characteristics (lua_State *L)
+{
+#ifdef CONFIG_BT_NIMBLE_ENABLED
+  ble_conn_t *c = conn_arg (L, 1);
+  lua_newtable (L);
+  const lhos_ble_db_t *db = db_acquire (L, c);
+  if (!db)
+    return 2;
+  char uuid[LHOS_BLE_UUID_STR];
+  for (int i = 0; i < db->nchrs; i++)
+    {
+      const lhos_ble_chr_t *ch = &db->chrs[i];
+      lua_createtable (L, 0, 5);
+      lhos_ble_uuid_format (ch->uuid, uuid);
+      lua_pushstring (L, uuid);
+      lua_setfield (L, -2, "uuid");
+      if (ch->svc < db->nsvcs)
+        {
+          lhos_ble_uuid_format (db->svcs[ch->svc].uuid, uuid);
+          lua_pushstring (L, uuid);
+          lua_setfield (L, -2, "service");
+        }
+      lua_pushinteger (L, ch->val_handle);
+      lua_setfield (L, -2, "handle");
+      if (ch->cccd_handle)
+        {
+          lua_pushinteger (L, ch->cccd_handle);
+          lua_setfield (L, -2, "cccd");
+        }
+      lua_pushinteger (L, ch->props);
+      lua_setfield (L, -2, "props");
+      lua_rawseti (L, -2, i + 1);
+    }
+  xSemaphoreGiveRecursive (s_gatt_lock);
+  return 1;
+#else
+  lua_pushnil (L);
+  lua_pushinteger (L, ESP_ERR_NOT_SUPPORTED);
+  return 2;
+#endif
+}
+
+/* ble.forget([addr [, addr_type]]): drops the cached table of one peer,
+   or of every peer. */
+int
+lhos_ble_forget (lua_State *L)
+{
+#ifdef CONFIG_BT_NIMBLE_ENABLED
+  ble_conn_t peer = { 0 };
+  bool all = lua_isnoneornil (L, 1);
+  if (!all)
+    {
+      lua_Integer type = luaL_optinteger (L, 2, 0);
+      luaL_argcheck (L, type >= 0 && type <= 3, 2, "bad address type");
+      if (!parse_addr (luaL_checkstring (L, 1), (uint8_t)type, &peer.peer))
+        return luaL_argerror (L, 1, "expected \"AA:BB:CC:DD:EE:FF\"");
+    }
+  nvs_handle_t h;
+  esp_err_t err = nvs_open (BLE_DB_NAMESPACE, NVS_READWRITE, &h);
+  if (err == ESP_OK)
+    {
+      char key[16];
+      db_key (&peer, key);
+      err = all ? nvs_erase_all (h) : nvs_erase_key (h, key);
+      if (err == ESP_ERR_NVS_NOT_FOUND)
+        err = ESP_OK;
+      if (err == ESP_OK)
+        err = nvs_commit (h);
+      nvs_close (h);
+    }
+  if (err != ESP_OK)
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, esp_err_to_name (err));
       return 2;
     }
   lua_pushboolean (L, 1);
   return 1;
+#else
+  lua_pushnil (L);
+  lua_pushinteger (L, ESP_ERR_NOT_SUPPORTED);
+  return 2;
+#endif
+}
+
+/* ble.notify(fn): fn(data, attr_handle, conn, indication) receives the
+   notifications and indications of every connection without a handler
+   of its own; ble.notify(conn, fn) installs one for `conn` until it
+   disconnects; ble.notify(conn, ccc_handle [, indicate]) queues the
+   subscribing write and returns its id, like ble.write. */
+int
+lhos_ble_notify (lua_State *L)
+{
+  if (lua_isfunction (L, 1) || lua_isnil (L, 1))
+    {
+      if (!lhos_lua_set_event_handler (L, BLE_NOTIFY_EVENT, 1))
+        return luaL_error (L, "too many event handlers");
+      lua_pushboolean (L, 1);
+      return 1;
+    }
+
+#ifdef CONFIG_BT_NIMBLE_ENABLED
+  ble_conn_t *c = conn_arg (L, 1);
+  if (lua_isfunction (L, 2) || lua_isnil (L, 2))
+    {
+      if (!c)
+        return push_not_connected (L);
+      if (!lhos_lua_set_event_handler (L, c->notify_event, 2))
+        return luaL_error (L, "too many event handlers");
+      c->notify = !lua_isnil (L, 2);
+      lua_pushboolean (L, 1);
+      return 1;
+    }
+
+  /* enable notifications (or indications) in the peer's CCCD */
+  uint16_t ccc_handle = (uint16_t)luaL_checkinteger (L, 2);
+  uint8_t value[2] = { lua_toboolean (L, 3) ? 0x02 : 0x01, 0x00 };
+  if (!c)
+    return push_not_connected (L);
+  /* an ordinary queued write: ATT allows one request per link, and the
+     outcome reaches ble.on_gatt under the returned id */
+  lhos_gatt_req_t req = { .attr = ccc_handle,
+                          .op = LHOS_GATT_WRITE,
+                          .user = LUA_NOREF };
+  req.data = ble_hs_mbuf_from_flat (value, sizeof (value));
+  if (!req.data)
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, esp_err_to_name (ESP_ERR_NO_MEM));
+      return 2;
+    }
+  req.len = sizeof (value);
+  int n = gatt_submit (L, c, &req);
+  if (n == 2)
+    os_mbuf_free_chain (req.data);
+  return n;
 #else
   ESP_LOGW (TAG, "NimBLE not enabled; notify subscribe not supported");
   lua_pushboolean (L, 0);
@@ -288,6 +1795,3 @@ lhos_ble_notify (lua_State *L)
   return 2;
 #endif
 }
-
-/* lhos_ble no longer exposes a poll API; notifications are forwarded into
-   the lhos_lua dispatcher via `lhos_lua_enqueue_notification`. */
@@ -0,0 +1,174 @@
+#include "lhos_ble_adv.h"
+
+#include <string.h>
+
+/* Slots probed before the oldest of them is recycled. */
+#define SEEN_PROBES 8
+/* Marks a forgotten entry in key[7]: never matches, reused first. */
+#define TOMBSTONE 0x80
+
+void
+lhos_ble_scan_reset (lhos_ble_scan_state_t *s,
+                     const lhos_ble_scan_filter_t *filter)
+{
+  memset (s, 0, sizeof (*s));
+  if (filter)
+    s->filter = *filter;
+  else
+    s->filter.rssi_min = -128;
+  s->filter.name[LHOS_BLE_NAME_MAX] = '\0';
+}
+
+const uint8_t *
+lhos_ble_adv_find (const uint8_t *data, size_t len, uint8_t type,
+                   size_t *out_len)
+{
+  size_t off = 0;
+  while (data && off + 1 < len)
+    {
+      size_t field = data[off];
+      if (field == 0 || off + 1 + field > len)
+        return NULL;
+      if (data[off + 1] == type)
+        {
+          *out_len = field - 1;
+          return data + off + 2;
+        }
+      off += 1 + field;
+    }
+  return NULL;
+}
+
+static bool
+has_name_prefix (const uint8_t *data, size_t len, const char *prefix)
+{
+  size_t plen = strlen (prefix), n = 0;
+  const uint8_t *name
+      = lhos_ble_adv_find (data, len, LHOS_BLE_AD_NAME_COMPLETE, &n);
+  if (!name)
+    name = lhos_ble_adv_find (data, len, LHOS_BLE_AD_NAME_SHORT, &n);
+  return name && n >= plen && memcmp (name, prefix, plen) == 0;
+}
+
+static bool
+has_uuid16 (const uint8_t *data, size_t len, uint16_t uuid)
+{
+  static const uint8_t types[]
+      = { LHOS_BLE_AD_UUID16_ALL, LHOS_BLE_AD_UUID16_SOME };
+  for (size_t t = 0; t < sizeof (types); t++)
+    {
+      size_t n = 0;
+      const uint8_t *p = lhos_ble_adv_find (data, len, types[t], &n);
+      for (size_t i = 0; p && i + 1 < n; i += 2)
+        if ((uint16_t)(p[i] | p[i + 1] << 8) == uuid)
+          return true;
+    }
+  return false;
+}
+
+static void
+make_key (uint8_t key[8], const uint8_t addr[6], uint8_t addr_type,
+          uint8_t kind)
+{
+  memcpy (key, addr, 6);
+  key[6] = addr_type;
+  key[7] = kind == LHOS_BLE_ADV_SCAN_RSP;
+}
+
+static uint32_t
+hash_key (const uint8_t *key)
+{
+  uint32_t h = 2166136261u; /* FNV-1a */
+  for (int i = 0; i < 8; i++)
+    h = (h ^ key[i]) * 16777619u;
+  return h;
+}
+
+/* True if the device was reported recently enough to drop this report;
+   otherwise it is (re)recorded as reported now. */
+static bool
+seen_recently (lhos_ble_scan_state_t *s, const uint8_t *key, uint32_t now)
+{
+  uint32_t h = hash_key (key);
+  lhos_ble_seen_t *victim = NULL;
+  for (int i = 0; i < SEEN_PROBES; i++)
+    {
+      lhos_ble_seen_t *e = &s->seen[(h + i) & (LHOS_BLE_SEEN_SLOTS - 1)];
+      if (!e->used)
+        {
+          victim = e;
+          break;
+        }
+      if (memcmp (e->key, key, sizeof (e->key)) == 0)
+        {
+          if (!s->filter.refresh_ms
+              || now - e->last_ms < s->filter.refresh_ms)
+            return true;
+          e->last_ms = now;
+          return false;
+        }
+      if (e->key[7] & TOMBSTONE)
+        {
+          if (!victim || !(victim->key[7] & TOMBSTONE))
+            victim = e;
+        }
+      else if (!victim
+               || (!(victim->key[7] & TOMBSTONE)
+                   && (int32_t)(e->last_ms - victim->last_ms) < 0))
+        victim = e;
+    }
+  memcpy (victim->key, key, sizeof (victim->key));
+  victim->used = true;
+  victim->last_ms = now;
+  return false;
+}
+
+bool
+lhos_ble_scan_accept (lhos_ble_scan_state_t *s, const uint8_t addr[6],
+                      uint8_t addr_type, uint8_t kind, int8_t rssi,
+                      const uint8_t *data, size_t len, uint32_t now_ms)
+{
+  const lhos_ble_scan_filter_t *f = &s->filter;
+  s->received++;
+  if ((f->kinds && (kind >= 8 || !(f->kinds & (1u << kind))))
+      || rssi < f->rssi_min
+      || (f->name[0] && !has_name_prefix (data, len, f->name))
+      || (f->uuid16 && !has_uuid16 (data, len, f->uuid16)))
+    {
+      s->filtered++;
+      return false;
+    }
+
+  uint8_t key[8];
+  make_key (key, addr, addr_type, kind);
+  if (seen_recently (s, key, now_ms))
+    {
+      s->duplicates++;
+      return false;
+    }
+  s->reported++;
+  return true;
+}
+
+void
+lhos_ble_scan_forget (lhos_ble_scan_state_t *s, const uint8_t addr[6],
+                      uint8_t addr_type, uint8_t kind)
+{
+  uint8_t key[8];
+  make_key (key, addr, addr_type, kind);
+  uint32_t h = hash_key (key);
+  for (int i = 0; i < SEEN_PROBES; i++)
+    {
+      lhos_ble_seen_t *e = &s->seen[(h + i) & (LHOS_BLE_SEEN_SLOTS - 1)];
+      if (!e->used)
+        return;
+      if (memcmp (e->key, key, sizeof (e->key)) == 0)
+        {
+          /* freeing the slot would cut the probe chain */
+          e->key[7] |= TOMBSTONE;
+          break;
+        }
+    }
+  if (s->reported)
+    s->reported--;
+}
@@ -0,0 +1,46 @@
+#include "lhos_ble_coalesce.h"
+
+#include <string.h>
+
+void
+lhos_ble_coalesce_reset (lhos_ble_coalesce_t *c)
+{
+  c->len = 0;
+  c->records = 0;
+}
+
+int
+lhos_ble_coalesce_add (lhos_ble_coalesce_t *c, const void *data,
+                       size_t len, size_t limit, lhos_ble_emit_fn emit,
+                       void *ctx)
+{
+  if (limit > LHOS_BLE_COALESCE_MAX)
+    limit = LHOS_BLE_COALESCE_MAX;
+  if (len == 0 || len > limit)
+    return LHOS_BLE_COALESCE_TOO_BIG;
+  if (c->len + len > limit)
+    {
+      int rc = lhos_ble_coalesce_flush (c, emit, ctx);
+      if (rc != 0)
+        return rc;
+    }
+  memcpy (c->data + c->len, data, len);
+  c->len = (uint16_t)(c->len + len);
+  c->records++;
+  /* nothing else fits: no point waiting for the timer */
+  if (c->len == limit)
+    lhos_ble_coalesce_flush (c, emit, ctx);
+  return 0;
+}
+
+int
+lhos_ble_coalesce_flush (lhos_ble_coalesce_t *c, lhos_ble_emit_fn emit,
+                         void *ctx)
+{
+  if (c->len == 0)
+    return 0;
+  int rc = emit (ctx, c->data, c->len);
+  if (rc == 0)
+    lhos_ble_coalesce_reset (c);
+  return rc;
+}
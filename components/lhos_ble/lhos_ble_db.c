@@ -0,0 +1,181 @@
+#include "lhos_ble_db.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+/* 00000000-0000-1000-8000-00805F9B34FB, little endian; bytes 12-15 hold
+   the 16 or 32-bit value */
+static const uint8_t k_base[16] = { 0xFB, 0x34, 0x9B, 0x5F, 0x80, 0x00,
+                                    0x00, 0x80, 0x00, 0x10, 0x00, 0x00,
+                                    0x00, 0x00, 0x00, 0x00 };
+
+void
+lhos_ble_db_reset (lhos_ble_db_t *db)
+{
+  memset (db, 0, offsetof (lhos_ble_db_t, svcs));
+  db->version = LHOS_BLE_DB_VERSION;
+}
+
+bool
+lhos_ble_db_add_svc (lhos_ble_db_t *db, const uint8_t uuid[16],
+                     uint16_t start, uint16_t end)
+{
+  if (db->nsvcs >= LHOS_BLE_DB_SVCS)
+    return false;
+  lhos_ble_svc_t *s = &db->svcs[db->nsvcs++];
+  memcpy (s->uuid, uuid, 16);
+  s->start = start;
+  s->end = end;
+  return true;
+}
+
+bool
+lhos_ble_db_add_chr (lhos_ble_db_t *db, const uint8_t uuid[16],
+                     uint16_t def_handle, uint16_t val_handle, uint8_t props)
+{
+  if (db->nchrs >= LHOS_BLE_DB_CHRS)
+    return false;
+  uint8_t svc = 0;
+  for (uint8_t i = 0; i < db->nsvcs; i++)
+    if (def_handle >= db->svcs[i].start && def_handle <= db->svcs[i].end)
+      svc = i;
+  lhos_ble_chr_t *c = &db->chrs[db->nchrs++];
+  memcpy (c->uuid, uuid, 16);
+  c->def_handle = def_handle;
+  c->val_handle = val_handle;
+  c->cccd_handle = 0;
+  c->props = props;
+  c->svc = svc;
+  return true;
+}
+
+uint16_t
+lhos_ble_db_chr_end (const lhos_ble_db_t *db, size_t i)
+{
+  const lhos_ble_chr_t *c = &db->chrs[i];
+  uint16_t end = c->svc < db->nsvcs ? db->svcs[c->svc].end : 0xFFFF;
+  /* up to the next declaration in the same service */
+  for (size_t j = 0; j < db->nchrs; j++)
+    if (db->chrs[j].def_handle > c->def_handle
+        && db->chrs[j].def_handle <= end)
+      end = db->chrs[j].def_handle - 1;
+  return end;
+}
+
+const lhos_ble_chr_t *
+lhos_ble_db_find (const lhos_ble_db_t *db, const uint8_t chr[16],
+                  const uint8_t *svc)
+{
+  for (uint8_t i = 0; i < db->nchrs; i++)
+    {
+      const lhos_ble_chr_t *c = &db->chrs[i];
+      if (memcmp (c->uuid, chr, 16) != 0)
+        continue;
+      if (!svc
+          || (c->svc < db->nsvcs
+              && memcmp (db->svcs[c->svc].uuid, svc, 16) == 0))
+        return c;
+    }
+  return NULL;
+}
+
+/* Tables are stored with every service slot but only the used
+   characteristics, which make up most of the size. */
+size_t
+lhos_ble_db_size (const lhos_ble_db_t *db)
+{
+  return offsetof (lhos_ble_db_t, chrs) + db->nchrs * sizeof (db->chrs[0]);
+}
+
+bool
+lhos_ble_db_valid (const lhos_ble_db_t *db, size_t len)
+{
+  if (len < offsetof (lhos_ble_db_t, chrs)
+      || db->version != LHOS_BLE_DB_VERSION || db->nsvcs > LHOS_BLE_DB_SVCS
+      || db->nchrs > LHOS_BLE_DB_CHRS || len != lhos_ble_db_size (db))
+    return false;
+  for (uint8_t i = 0; i < db->nchrs; i++)
+    if (db->chrs[i].svc >= db->nsvcs && db->nsvcs)
+      return false;
+  return true;
+}
+
+void
+lhos_ble_uuid_from16 (uint8_t out[16], uint32_t value)
+{
+  memcpy (out, k_base, 16);
+  out[12] = (uint8_t)value;
+  out[13] = (uint8_t)(value >> 8);
+  out[14] = (uint8_t)(value >> 16);
+  out[15] = (uint8_t)(value >> 24);
+}
+
+static int
+hex_digit (char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  c = (char)tolower ((unsigned char)c);
+  return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+bool
+lhos_ble_uuid_parse (const char *s, uint8_t out[16])
+{
+  if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+    s += 2;
+  size_t len = strlen (s);
+  if (len == 4 || len == 8)
+    {
+      uint32_t v = 0;
+      for (size_t i = 0; i < len; i++)
+        {
+          int d = hex_digit (s[i]);
+          if (d < 0)
+            return false;
+          v = v << 4 | (uint32_t)d;
+        }
+      lhos_ble_uuid_from16 (out, v);
+      return true;
+    }
+  if (len != 36)
+    return false;
+  /* most significant byte first in the string */
+  int byte = 15;
+  for (size_t i = 0; i < len; i += 2)
+    {
+      if (i == 8 || i == 13 || i == 18 || i == 23)
+        {
+          if (s[i] != '-')
+            return false;
+          i++;
+        }
+      int hi = hex_digit (s[i]), lo = hex_digit (s[i + 1]);
+      if (hi < 0 || lo < 0 || byte < 0)
+        return false;
+      out[byte--] = (uint8_t)(hi << 4 | lo);
+    }
+  return byte == -1;
+}
+
+void
+lhos_ble_uuid_format (const uint8_t uuid[16], char out[LHOS_BLE_UUID_STR])
+{
+  if (memcmp (uuid, k_base, 12) == 0)
+    {
+      uint32_t v = (uint32_t)uuid[12] | (uint32_t)uuid[13] << 8
+                   | (uint32_t)uuid[14] << 16 | (uint32_t)uuid[15] << 24;
+      snprintf (out, LHOS_BLE_UUID_STR, v > 0xFFFF ? "%08lX" : "%04lX",
+                (unsigned long)v);
+      return;
+    }
+  char *p = out;
+  for (int i = 15; i >= 0; i--)
+    {
+      p += sprintf (p, "%02X", uuid[i]);
+      if (i == 12 || i == 10 || i == 8 || i == 6)
+        *p++ = '-';
+    }
+  *p = '\0';
+}
@@ -0,0 +1,88 @@
+#include "lhos_ble_gatt.h"
+
+#include <string.h>
+
+void
+lhos_gatt_queue_init (lhos_gatt_queue_t *q, const lhos_gatt_ops_t *ops,
+                      void *ctx)
+{
+  memset (q, 0, sizeof (*q));
+  q->ops = ops;
+  q->ctx = ctx;
+}
+
+/* Pop the head request and report it. */
+static void
+finish (lhos_gatt_queue_t *q, int status, void *result)
+{
+  lhos_gatt_req_t r = q->reqs[q->head];
+  q->head = (uint8_t)((q->head + 1) % LHOS_GATT_QUEUE_LEN);
+  q->count--;
+  q->inflight = false;
+  q->ops->done (q->ctx, &r, status, result);
+}
+
+/* Start queued requests until one is left in flight. A completion that
+   arrives from inside start() only pops its request; the loop here goes
+   on with the next one. */
+static void
+pump (lhos_gatt_queue_t *q)
+{
+  if (q->pumping)
+    return;
+  q->pumping = true;
+  while (q->count && !q->inflight)
+    {
+      lhos_gatt_req_t *r = &q->reqs[q->head];
+      uint32_t id = r->id;
+      q->inflight = true;
+      int rc = q->ops->start (q->ctx, r);
+      if (!q->inflight || q->reqs[q->head].id != id)
+        continue; /* already completed */
+      if (rc != 0 || r->op == LHOS_GATT_WRITE_NO_RSP)
+        finish (q, rc, NULL);
+    }
+  q->pumping = false;
+}
+
+bool
+lhos_gatt_submit (lhos_gatt_queue_t *q, const lhos_gatt_req_t *req)
+{
+  if (q->count >= LHOS_GATT_QUEUE_LEN)
+    return false;
+  q->reqs[(q->head + q->count) % LHOS_GATT_QUEUE_LEN] = *req;
+  q->count++;
+  pump (q);
+  return true;
+}
+
+bool
+lhos_gatt_complete (lhos_gatt_queue_t *q, uint32_t id, int status,
+                    void *result)
+{
+  if (!q->inflight || q->reqs[q->head].id != id)
+    return false;
+  finish (q, status, result);
+  pump (q);
+  return true;
+}
+
+void
+lhos_gatt_flush (lhos_gatt_queue_t *q, int status)
+{
+  /* the request in flight, if any, is the stack's to complete */
+  uint8_t keep = q->inflight ? 1 : 0;
+  uint8_t n = (uint8_t)(q->count - keep);
+  lhos_gatt_req_t failed[LHOS_GATT_QUEUE_LEN];
+  for (uint8_t i = 0; i < n; i++)
+    failed[i] = q->reqs[(q->head + keep + i) % LHOS_GATT_QUEUE_LEN];
+  q->count = keep;
+  for (uint8_t i = 0; i < n; i++)
+    q->ops->done (q->ctx, &failed[i], status, NULL);
+}
+
+bool
+lhos_gatt_idle (const lhos_gatt_queue_t *q)
+{
+  return q->count == 0;
+}
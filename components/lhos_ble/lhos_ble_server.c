@@ -0,0 +1,595 @@
+#include "lhos_ble_server.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "lauxlib.h"
+#include "lhos_ble.h"
+#include "lhos_ble_coalesce.h"
+#include "lhos_ble_db.h"
+#include "lhos_lua_event.h"
+#include "lhos_lua_buffer.h"
+
+#include <stddef.h>
+#include <string.h>
+
+static const char *TAG = "lhos_ble_server";
+
+#define BLE_WRITE_EVENT "ble_write"
+
+#ifdef CONFIG_BT_NIMBLE_ENABLED
+#include "host/ble_hs.h"
+#include "services/gap/ble_svc_gap.h"
+#include "services/gatt/ble_svc_gatt.h"
+
+#define SRV_SVCS 4
+#define SRV_CHRS 12
+#define SRV_MAX_CONN CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+#define SRV_INTERVAL_MS 20 /* default wait for more updates to pack */
+#define SRV_RETRY_MS 10    /* when no subscriber took a notification */
+
+/* A served characteristic. Updates for subscribers collect in `out`
+   until the payload is full or `due_us` passes. */
+typedef struct
+{
+  ble_uuid_any_t uuid;
+  uint16_t handle; /* value handle, filled in by NimBLE */
+  uint16_t flags;  /* BLE_GATT_CHR_F_* */
+  uint16_t interval_ms;
+  uint16_t len;
+  uint8_t value[LHOS_BLE_COALESCE_MAX]; /* what reads return */
+  uint16_t subs[SRV_MAX_CONN];          /* BLE_HS_CONN_HANDLE_NONE: free */
+  bool indicate[SRV_MAX_CONN];
+  int64_t due_us;
+  lhos_ble_coalesce_t out;
+} srv_chr_t;
+
+/* The tables handed to NimBLE, which keeps pointers into them: a Lua
+   userdata anchored in the registry until the next ble.serve(). */
+typedef struct
+{
+  ble_uuid_any_t svc_uuids[SRV_SVCS];
+  struct ble_gatt_svc_def svcs[SRV_SVCS + 1];
+  /* each service's list ends with an empty entry */
+  struct ble_gatt_chr_def chr_defs[SRV_CHRS + SRV_SVCS];
+  srv_chr_t chrs[SRV_CHRS];
+  int nchrs;
+} srv_t;
+
+/* A write from a client on its way to Lua */
+typedef struct
+{
+  uint16_t handle;
+  uint16_t conn_handle;
+  uint16_t len;
+  uint8_t data[LHOS_BLE_COALESCE_MAX];
+} write_event_t;
+
+static srv_t *s_srv;
+static int s_srv_ref = LUA_NOREF;
+static SemaphoreHandle_t s_srv_lock;
+static esp_timer_handle_t s_flush_timer;
+
+static srv_chr_t *
+srv_find (uint16_t handle)
+{
+  for (int i = 0; s_srv && i < s_srv->nchrs; i++)
+    if (s_srv->chrs[i].handle == handle)
+      return &s_srv->chrs[i];
+  return NULL;
+}
+
+static bool
+srv_subscribed (const srv_chr_t *ch)
+{
+  for (int i = 0; i < SRV_MAX_CONN; i++)
+    if (ch->subs[i] != BLE_HS_CONN_HANDLE_NONE)
+      return true;
+  return false;
+}
+
+/* Largest notification every subscriber can take */
+static size_t
+srv_limit (const srv_chr_t *ch)
+{
+  size_t limit = LHOS_BLE_COALESCE_MAX;
+  for (int i = 0; i < SRV_MAX_CONN; i++)
+    {
+      if (ch->subs[i] == BLE_HS_CONN_HANDLE_NONE)
+        continue;
+      uint16_t mtu = ble_att_mtu (ch->subs[i]);
+      if (mtu > 3 && (size_t)(mtu - 3) < limit)
+        limit = mtu - 3;
+    }
+  return limit;
+}
+
+/* lhos_ble_emit_fn: one notification (or indication) per subscriber.
+   Fails only if no subscriber took it, so the data is retried. */
+static int
+srv_emit (void *ctx, const uint8_t *data, size_t len)
+{
+  srv_chr_t *ch = ctx;
+  int rc = BLE_HS_ENOTCONN;
+  for (int i = 0; i < SRV_MAX_CONN; i++)
+    {
+      uint16_t conn = ch->subs[i];
+      if (conn == BLE_HS_CONN_HANDLE_NONE)
+        continue;
+      /* NimBLE consumes the mbuf whatever the outcome */
+      struct os_mbuf *om = ble_hs_mbuf_from_flat (data, (uint16_t)len);
+      int r = !om               ? BLE_HS_ENOMEM
+              : ch->indicate[i] ? ble_gatts_indicate_custom (conn,
+                                                             ch->handle, om)
+                                : ble_gatts_notify_custom (conn, ch->handle,
+                                                           om);
+      if (r == 0 || rc != 0)
+        rc = r == 0 ? 0 : r;
+    }
+  return rc;
+}
+
+/* Arm the flush timer for the earliest deadline; s_srv_lock held. */
+static void
+srv_arm (int64_t now)
+{
+  int64_t next = INT64_MAX;
+  for (int i = 0; s_srv && i < s_srv->nchrs; i++)
+    if (s_srv->chrs[i].out.len && s_srv->chrs[i].due_us < next)
+      next = s_srv->chrs[i].due_us;
+  esp_timer_stop (s_flush_timer);
+  if (next != INT64_MAX)
+    esp_timer_start_once (s_flush_timer, next > now ? next - now : 1);
+}
+
+static void
+srv_flush_tick (void *arg)
+{
+  xSemaphoreTake (s_srv_lock, portMAX_DELAY);
+  int64_t now = esp_timer_get_time ();
+  for (int i = 0; s_srv && i < s_srv->nchrs; i++)
+    {
+      srv_chr_t *ch = &s_srv->chrs[i];
+      if (ch->out.len && ch->due_us <= now
+          && lhos_ble_coalesce_flush (&ch->out, srv_emit, ch) != 0)
+        ch->due_us = now + SRV_RETRY_MS * 1000;
+    }
+  srv_arm (now);
+  xSemaphoreGive (s_srv_lock);
+}
+
+static int
+push_write_event (lua_State *L, const void *data, size_t len)
+{
+  const write_event_t *w = data;
+  lua_pushinteger (L, w->handle);
+  lua_pushlstring (L, (const char *)w->data, w->len);
+  lua_pushinteger (L, w->conn_handle);
+  return 3;
+}
+
+/* NimBLE access callback of every served characteristic: reads get the
+   last value, writes replace it and go to the ble.on_write handler. */
+static int
+srv_access_cb (uint16_t conn_handle, uint16_t attr_handle,
+               struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+  srv_chr_t *ch = arg;
+  if (ctxt->op == BLE_GATT_ACCESS_OP_READ_CHR)
+    {
+      xSemaphoreTake (s_srv_lock, portMAX_DELAY);
+      int rc = os_mbuf_append (ctxt->om, ch->value, ch->len);
+      xSemaphoreGive (s_srv_lock);
+      return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+  if (ctxt->op != BLE_GATT_ACCESS_OP_WRITE_CHR)
+    return BLE_ATT_ERR_UNLIKELY;
+
+  write_event_t w = { .handle = attr_handle, .conn_handle = conn_handle };
+  if (OS_MBUF_PKTLEN (ctxt->om) > sizeof (w.data)
+      || ble_hs_mbuf_to_flat (ctxt->om, w.data, sizeof (w.data), &w.len)
+             != 0)
+    return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+  xSemaphoreTake (s_srv_lock, portMAX_DELAY);
+  memcpy (ch->value, w.data, w.len);
+  ch->len = w.len;
+  xSemaphoreGive (s_srv_lock);
+  lhos_lua_post_event (BLE_WRITE_EVENT, push_write_event, &w,
+                       offsetof (write_event_t, data) + w.len);
+  return 0;
+}
+
+void
+lhos_ble_server_subscribe (uint16_t conn_handle, uint16_t attr_handle,
+                           bool notify, bool indicate)
+{
+  if (!s_srv_lock)
+    return;
+  xSemaphoreTake (s_srv_lock, portMAX_DELAY);
+  srv_chr_t *ch = srv_find (attr_handle);
+  if (ch)
+    {
+      int at = -1, unused = -1;
+      for (int i = 0; i < SRV_MAX_CONN; i++)
+        if (ch->subs[i] == conn_handle)
+          at = i;
+        else if (ch->subs[i] == BLE_HS_CONN_HANDLE_NONE && unused < 0)
+          unused = i;
+      if (notify || indicate)
+        {
+          /* a subscriber with a smaller MTU: send what was packed for
+             the old limit first */
+          if (at < 0 && unused >= 0)
+            {
+              lhos_ble_coalesce_flush (&ch->out, srv_emit, ch);
+              at = unused;
+            }
+          if (at >= 0)
+            {
+              ch->subs[at] = conn_handle;
+              ch->indicate[at] = !notify;
+            }
+        }
+      else if (at >= 0)
+        {
+          ch->subs[at] = BLE_HS_CONN_HANDLE_NONE;
+          if (!srv_subscribed (ch))
+            lhos_ble_coalesce_reset (&ch->out);
+        }
+    }
+  xSemaphoreGive (s_srv_lock);
+}
+
+void
+lhos_ble_server_disconnect (uint16_t conn_handle)
+{
+  if (!s_srv_lock)
+    return;
+  xSemaphoreTake (s_srv_lock, portMAX_DELAY);
+  for (int i = 0; s_srv && i < s_srv->nchrs; i++)
+    {
+      srv_chr_t *ch = &s_srv->chrs[i];
+      for (int j = 0; j < SRV_MAX_CONN; j++)
+        if (ch->subs[j] == conn_handle)
+          ch->subs[j] = BLE_HS_CONN_HANDLE_NONE;
+      if (!srv_subscribed (ch))
+        lhos_ble_coalesce_reset (&ch->out);
+    }
+  xSemaphoreGive (s_srv_lock);
+}
+
+/* 16 and 32-bit UUIDs go to NimBLE in their short form */
+static void
+uuid_to_ble (const uint8_t u[16], ble_uuid_any_t *out)
+{
+  uint8_t base[16];
+  lhos_ble_uuid_from16 (base, 0);
+  uint32_t v = (uint32_t)u[12] | (uint32_t)u[13] << 8
+               | (uint32_t)u[14] << 16 | (uint32_t)u[15] << 24;
+  memset (out, 0, sizeof (*out));
+  if (memcmp (u, base, 12) != 0)
+    {
+      out->u.type = BLE_UUID_TYPE_128;
+      memcpy (out->u128.value, u, 16);
+    }
+  else if (v <= 0xFFFF)
+    {
+      out->u.type = BLE_UUID_TYPE_16;
+      out->u16.value = (uint16_t)v;
+    }
+  else
+    {
+      out->u.type = BLE_UUID_TYPE_32;
+      out->u32.value = v;
+    }
+}
+
+static void
+uuid_field (lua_State *L, int t, uint8_t u[16])
+{
+  lua_getfield (L, t, "uuid");
+  bool ok = false;
+  if (lua_type (L, -1) == LUA_TNUMBER)
+    {
+      lua_Integer v = lua_tointeger (L, -1);
+      ok = v >= 0 && v <= UINT32_MAX;
+      lhos_ble_uuid_from16 (u, (uint32_t)v);
+    }
+  else if (lua_type (L, -1) == LUA_TSTRING)
+    ok = lhos_ble_uuid_parse (lua_tostring (L, -1), u);
+  if (!ok)
+    luaL_error (L, "bad or missing uuid");
+  lua_pop (L, 1);
+}
+
+static bool
+bool_field (lua_State *L, int t, const char *name)
+{
+  lua_getfield (L, t, name);
+  bool v = lua_toboolean (L, -1);
+  lua_pop (L, 1);
+  return v;
+}
+
+/* Characteristic table at `t` into srv->chrs[srv->nchrs] */
+static void
+compile_chr (lua_State *L, int t, srv_t *srv, struct ble_gatt_chr_def *def)
+{
+  if (srv->nchrs >= SRV_CHRS)
+    luaL_error (L, "more than %d characteristics", SRV_CHRS);
+  srv_chr_t *ch = &srv->chrs[srv->nchrs++];
+  uint8_t u[16];
+  uuid_field (L, t, u);
+  uuid_to_ble (u, &ch->uuid);
+  bool enc = bool_field (L, t, "encrypted");
+  if (bool_field (L, t, "read"))
+    ch->flags |= BLE_GATT_CHR_F_READ | (enc ? BLE_GATT_CHR_F_READ_ENC : 0);
+  if (bool_field (L, t, "write"))
+    ch->flags |= BLE_GATT_CHR_F_WRITE | (enc ? BLE_GATT_CHR_F_WRITE_ENC : 0);
+  if (bool_field (L, t, "write_no_rsp"))
+    ch->flags |= BLE_GATT_CHR_F_WRITE_NO_RSP;
+  if (bool_field (L, t, "notify"))
+    ch->flags |= BLE_GATT_CHR_F_NOTIFY;
+  if (bool_field (L, t, "indicate"))
+    ch->flags |= BLE_GATT_CHR_F_INDICATE;
+  if (!ch->flags)
+    luaL_error (L, "characteristic without read, write or notify");
+
+  lua_getfield (L, t, "interval");
+  lua_Integer interval = SRV_INTERVAL_MS;
+  if (!lua_isnil (L, -1))
+    {
+      int isnum;
+      interval = lua_tointegerx (L, -1, &isnum);
+      if (!isnum || interval < 0 || interval > UINT16_MAX)
+        luaL_error (L, "bad interval");
+    }
+  ch->interval_ms = (uint16_t)interval;
+  lua_getfield (L, t, "value");
+  if (!lua_isnil (L, -1))
+    {
+      size_t len;
+      const char *value = lua_tolstring (L, -1, &len);
+      if (!value || len > sizeof (ch->value))
+        luaL_error (L, "bad value (at most %d bytes)",
+                    (int)sizeof (ch->value));
+      memcpy (ch->value, value, len);
+      ch->len = (uint16_t)len;
+    }
+  lua_pop (L, 2);
+
+  for (int i = 0; i < SRV_MAX_CONN; i++)
+    ch->subs[i] = BLE_HS_CONN_HANDLE_NONE;
+  *def = (struct ble_gatt_chr_def){ .uuid = &ch->uuid.u,
+                                    .access_cb = srv_access_cb,
+                                    .arg = ch,
+                                    .flags = ch->flags,
+                                    .val_handle = &ch->handle };
+}
+
+/* Service list at `t` into `srv`, which NimBLE will point into */
+static void
+compile (lua_State *L, int t, srv_t *srv)
+{
+  lua_Integer n = luaL_len (L, t);
+  if (n < 1 || n > SRV_SVCS)
+    luaL_error (L, "expected 1 to %d services", SRV_SVCS);
+  int d = 0;
+  for (lua_Integer i = 1; i <= n; i++)
+    {
+      lua_geti (L, t, i);
+      int s = lua_gettop (L);
+      luaL_checktype (L, s, LUA_TTABLE);
+      uint8_t u[16];
+      uuid_field (L, s, u);
+      uuid_to_ble (u, &srv->svc_uuids[i - 1]);
+      srv->svcs[i - 1] = (struct ble_gatt_svc_def){
+        .type = BLE_GATT_SVC_TYPE_PRIMARY,
+        .uuid = &srv->svc_uuids[i - 1].u,
+        .characteristics = &srv->chr_defs[d],
+      };
+      lua_getfield (L, s, "characteristics");
+      luaL_checktype (L, -1, LUA_TTABLE);
+      lua_Integer m = luaL_len (L, -1);
+      if (m < 1)
+        luaL_error (L, "service without characteristics");
+      for (lua_Integer j = 1; j <= m; j++)
+        {
+          lua_geti (L, -1, j);
+          luaL_checktype (L, -1, LUA_TTABLE);
+          compile_chr (L, lua_gettop (L), srv, &srv->chr_defs[d++]);
+          lua_pop (L, 1);
+        }
+      d++; /* the terminator, left zeroed */
+      lua_pop (L, 2);
+    }
+}
+
+static int
+srv_start (srv_t *srv)
+{
+  ble_svc_gap_init ();
+  ble_svc_gatt_init ();
+  int rc = ble_gatts_count_cfg (srv->svcs);
+  if (rc == 0)
+    rc = ble_gatts_add_svcs (srv->svcs);
+  if (rc == 0)
+    rc = ble_gatts_start ();
+  return rc;
+}
+#endif
+
+/* ble.serve(services): replaces the GATT server with `services`,
+   {{uuid = , characteristics = {{uuid = , read = , write = ,
+   write_no_rsp = , notify = , indicate = , encrypted = , value = ,
+   interval = }, ...}}, ...}, and returns {[uuid] = value_handle}. Needs
+   ble.init() and no connections or advertising. */
+int
+lhos_ble_serve (lua_State *L)
+{
+#ifdef CONFIG_BT_NIMBLE_ENABLED
+  luaL_checktype (L, 1, LUA_TTABLE);
+  srv_t *srv = lua_newuserdatauv (L, sizeof (srv_t), 0);
+  memset (srv, 0, sizeof (*srv));
+  compile (L, 1, srv);
+  if (!ble_hs_synced ())
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, esp_err_to_name (ESP_ERR_INVALID_STATE));
+      return 2;
+    }
+  if (!s_srv_lock)
+    {
+      esp_timer_create_args_t args = {
+        .callback = srv_flush_tick,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "lhos_ble_srv",
+      };
+      s_srv_lock = xSemaphoreCreateMutex ();
+      if (!s_srv_lock || esp_timer_create (&args, &s_flush_timer) != ESP_OK)
+        {
+          if (s_srv_lock)
+            vSemaphoreDelete (s_srv_lock);
+          s_srv_lock = NULL;
+          lua_pushnil (L);
+          lua_pushstring (L, esp_err_to_name (ESP_ERR_NO_MEM));
+          return 2;
+        }
+    }
+
+  xSemaphoreTake (s_srv_lock, portMAX_DELAY);
+  /* fails with BLE_HS_EBUSY while links or advertising are up */
+  int rc = ble_gatts_reset ();
+  if (rc == 0)
+    {
+      esp_timer_stop (s_flush_timer);
+      s_srv = NULL;
+      rc = srv_start (srv);
+      if (rc == 0)
+        s_srv = srv;
+      else
+        ble_gatts_reset ();
+    }
+  xSemaphoreGive (s_srv_lock);
+  if (rc != 0)
+    {
+      ESP_LOGW (TAG, "GATT server not registered: %d", rc);
+      lua_pushnil (L);
+      lua_pushfstring (L, "ble error %d", rc);
+      return 2;
+    }
+  luaL_unref (L, LUA_REGISTRYINDEX, s_srv_ref);
+  lua_pushvalue (L, -1);
+  s_srv_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+
+  lua_createtable (L, 0, srv->nchrs);
+  for (int i = 0; i < srv->nchrs; i++)
+    {
+      char uuid[LHOS_BLE_UUID_STR];
+      uint8_t u[16];
+      const ble_uuid_any_t *b = &srv->chrs[i].uuid;
+      if (b->u.type == BLE_UUID_TYPE_128)
+        memcpy (u, b->u128.value, 16);
+      else
+        lhos_ble_uuid_from16 (u, b->u.type == BLE_UUID_TYPE_16
+                                     ? b->u16.value
+                                     : b->u32.value);
+      lhos_ble_uuid_format (u, uuid);
+      lua_pushinteger (L, srv->chrs[i].handle);
+      lua_setfield (L, -2, uuid);
+    }
+  return 1;
+#else
+  lua_pushnil (L);
+  lua_pushinteger (L, ESP_ERR_NOT_SUPPORTED);
+  return 2;
+#endif
+}
+
+/* ble.update(handle, data): new value of a served characteristic, for
+   reads and for subscribers. Updates are packed into one notification up
+   to the MTU or the characteristic's interval, whichever comes first. */
+int
+lhos_ble_update (lua_State *L)
+{
+#ifdef CONFIG_BT_NIMBLE_ENABLED
+  lua_Integer handle = luaL_checkinteger (L, 1);
+  size_t len;
+  const uint8_t *data = lhos_lua_checkbytes (L, 2, &len);
+  luaL_argcheck (L, len > 0 && len <= LHOS_BLE_COALESCE_MAX, 2,
+                 "bad length");
+  if (!s_srv_lock)
+    return luaL_argerror (L, 1, "no GATT server");
+  xSemaphoreTake (s_srv_lock, portMAX_DELAY);
+  srv_chr_t *ch = srv_find ((uint16_t)handle);
+  int rc = 0;
+  if (ch)
+    {
+      memcpy (ch->value, data, len);
+      ch->len = (uint16_t)len;
+      if (srv_subscribed (ch))
+        rc = lhos_ble_coalesce_add (&ch->out, data, len, srv_limit (ch),
+                                    srv_emit, ch);
+      if (rc == 0 && ch->out.len && ch->interval_ms == 0)
+        rc = lhos_ble_coalesce_flush (&ch->out, srv_emit, ch);
+      else if (rc == 0 && ch->out.records == 1)
+        {
+          /* first update of a new notification starts its wait */
+          int64_t now = esp_timer_get_time ();
+          ch->due_us = now + ch->interval_ms * 1000;
+          srv_arm (now);
+        }
+    }
+  xSemaphoreGive (s_srv_lock);
+  if (!ch)
+    return luaL_argerror (L, 1, "not a served characteristic");
+  if (rc == LHOS_BLE_COALESCE_TOO_BIG)
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, "longer than the MTU");
+      return 2;
+    }
+  if (rc != 0)
+    {
+      lua_pushnil (L);
+      lua_pushfstring (L, "ble error %d", rc);
+      return 2;
+    }
+  lua_pushboolean (L, 1);
+  return 1;
+#else
+  lua_pushnil (L);
+  lua_pushinteger (L, ESP_ERR_NOT_SUPPORTED);
+  return 2;
+#endif
+}
+
+/* ble.flush(): sends every packed update now. */
+int
+lhos_ble_flush (lua_State *L)
+{
+#ifdef CONFIG_BT_NIMBLE_ENABLED
+  if (s_srv_lock)
+    {
+      xSemaphoreTake (s_srv_lock, portMAX_DELAY);
+      for (int i = 0; s_srv && i < s_srv->nchrs; i++)
+        s_srv->chrs[i].due_us = 0;
+      xSemaphoreGive (s_srv_lock);
+      srv_flush_tick (NULL);
+    }
+#endif
+  return 0;
+}
+
+/* ble.on_write(fn): fn(handle, data, conn) when a client writes a served
+   characteristic. */
+int
+lhos_ble_on_write (lua_State *L)
+{
+  if (!lua_isnoneornil (L, 1))
+    luaL_checktype (L, 1, LUA_TFUNCTION);
+  if (!lhos_lua_set_event_handler (L, BLE_WRITE_EVENT, 1))
+    return luaL_error (L, "too many event handlers");
+  return 0;
+}
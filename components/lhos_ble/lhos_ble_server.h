@@ -0,0 +1,16 @@
+#ifndef LHOS_BLE_SERVER_H
+#define LHOS_BLE_SERVER_H
+
+/* GATT server half of lhos_ble. lhos_ble.c owns the GAP side and hands
+ * the events the server cares about to these hooks, on the NimBLE host
+ * task.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+void lhos_ble_server_subscribe (uint16_t conn_handle, uint16_t attr_handle,
+                                bool notify, bool indicate);
+void lhos_ble_server_disconnect (uint16_t conn_handle);
+
+#endif /* LHOS_BLE_SERVER_H */
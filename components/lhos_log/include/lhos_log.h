@@ -0,0 +1,129 @@
+/* LHOS log subsystem
+ * Producers append records to a lock-free ring owned by the core they run
+ * on and return immediately; a background drainer task formats the records
+ * and writes them to the console. Logging never blocks the caller on
+ * console I/O: when a ring is full the record is dropped and counted.
+ *
+ * Records may be written from any task (not from ISRs).
+ */
+#ifndef LHOS_LOG_H
+#define LHOS_LOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/* Slots per core ring; must be a power of two. */
+#ifndef LHOS_LOG_RING_SLOTS
+#define LHOS_LOG_RING_SLOTS 64
+#endif
+/* Message bytes carried by each slot; longer messages span several. */
+#ifndef LHOS_LOG_SLOT_SIZE
+#define LHOS_LOG_SLOT_SIZE 64
+#endif
+/* Longest message accepted, in slots; longer ones are truncated. */
+#ifndef LHOS_LOG_MAX_SLOTS
+#define LHOS_LOG_MAX_SLOTS (LHOS_LOG_RING_SLOTS / 4)
+#endif
+/* Tag bytes stored per record, including the terminating NUL. */
+#ifndef LHOS_LOG_TAG_MAX
+#define LHOS_LOG_TAG_MAX 16
+#endif
+/* Drainer wake-up period when nothing urgent is pending. */
+#ifndef LHOS_LOG_DRAIN_MS
+#define LHOS_LOG_DRAIN_MS 50
+#endif
+/* Per-tag level overrides. */
+#ifndef LHOS_LOG_TAG_LEVELS
+#define LHOS_LOG_TAG_LEVELS 8
+#endif
+
+/* Same ordering and values as esp_log_level_t. */
+typedef enum
+{
+  LHOS_LOG_NONE = 0,
+  LHOS_LOG_ERROR,
+  LHOS_LOG_WARN,
+  LHOS_LOG_INFO,
+  LHOS_LOG_DEBUG,
+  LHOS_LOG_VERBOSE,
+} lhos_log_level_t;
+
+/* One piece of a message assembled by `lhos_log_writev`. */
+typedef struct
+{
+  const char *ptr;
+  size_t len;
+} lhos_log_iov_t;
+
+typedef struct
+{
+  uint32_t written;   /* records accepted into a ring */
+  uint32_t dropped;   /* records lost because a ring was full */
+  uint32_t truncated; /* records cut to LHOS_LOG_MAX_SLOTS */
+  uint32_t high_water; /* most slots ever in use in a single ring */
+} lhos_log_stats_t;
+
+/* Initialize the rings and start the drainer task. Idempotent. Records
+   written before initialization go straight to the console. */
+esp_err_t lhos_log_init (void);
+
+/* Global threshold; records above it are discarded by the producer. */
+void lhos_log_set_level (lhos_log_level_t level);
+lhos_log_level_t lhos_log_get_level (void);
+
+/* Override the threshold for one tag. LHOS_LOG_NONE silences the tag. */
+esp_err_t lhos_log_set_tag_level (const char *tag, lhos_log_level_t level);
+
+/* Returns true if a record with this level and tag would be kept. */
+bool lhos_log_enabled (lhos_log_level_t level, const char *tag);
+
+/* Append a record. Returns false if it was filtered or dropped. */
+bool lhos_log_write (lhos_log_level_t level, const char *tag, const char *msg,
+                     size_t len);
+
+/* Append a record made of `iovcnt` pieces, concatenated without copying
+   them into an intermediate buffer. */
+bool lhos_log_writev (lhos_log_level_t level, const char *tag,
+                      const lhos_log_iov_t *iov, int iovcnt);
+
+/* Wake the drainer and wait up to `timeout_ms` for the rings to empty.
+   Returns ESP_ERR_TIMEOUT if records are still pending. */
+esp_err_t lhos_log_flush (uint32_t timeout_ms);
+
+void lhos_log_get_stats (lhos_log_stats_t *out);
+
+/* A drained record as handed to a sink. `tag` and `msg` are only valid for
+   the duration of the call; `msg` is not NUL-terminated. */
+typedef struct
+{
+  uint32_t ts_ms; /* esp_log_timestamp() when the record was written */
+  lhos_log_level_t level;
+  const char *tag;
+  const char *msg;
+  size_t len;
+  bool truncated;
+} lhos_log_record_t;
+
+/* Secondary output run by the drainer task after the console write.
+   `write` is called once per record in timestamp order, `idle` once after
+   every drain pass (also when nothing was drained) so the sink can flush
+   on its own schedule. Either may be NULL. */
+typedef struct
+{
+  void (*write) (void *ctx, const lhos_log_record_t *rec);
+  void (*idle) (void *ctx);
+  void *ctx;
+} lhos_log_sink_t;
+
+/* Install `sink` (NULL removes it). The structure is referenced, not
+   copied, and must stay valid while installed. */
+void lhos_log_set_sink (const lhos_log_sink_t *sink);
+
+/* Single-letter name ("E", "W", ...) and lower-case name ("error", ...). */
+char lhos_log_level_letter (lhos_log_level_t level);
+const char *lhos_log_level_name (lhos_log_level_t level);
+
+#endif /* LHOS_LOG_H */
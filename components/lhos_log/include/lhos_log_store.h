@@ -0,0 +1,119 @@
+/* LHOS persistent log store
+ * A log sink that keeps records on the `storage` littlefs partition so
+ * field diagnostics survive without a serial console attached.
+ *
+ * Records are packed into binary frames (delta timestamps, per-frame tag
+ * dictionary) of up to LHOS_LOG_STORE_FRAME_SIZE bytes and LZ-compressed.
+ * Sealed frames are staged in RAM and appended to the current file in
+ * chunks that end on filesystem block boundaries, so littlefs commits
+ * whole blocks instead of one program per line. The staged data reaches
+ * flash when a block fills, every LHOS_LOG_STORE_FLUSH_MS, right after an
+ * error record, or on `lhos_log_store_sync`.
+ *
+ * Files rotate round-robin through LHOS_LOG_STORE_FILES slots of
+ * LHOS_LOG_STORE_FILE_SIZE bytes; the oldest file is reused once all slots
+ * are full.
+ */
+#ifndef LHOS_LOG_STORE_H
+#define LHOS_LOG_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "lhos_log.h"
+
+#ifndef LHOS_LOG_STORE_DIR
+#define LHOS_LOG_STORE_DIR "/storage/log"
+#endif
+/* Rotating files kept on flash. */
+#ifndef LHOS_LOG_STORE_FILES
+#define LHOS_LOG_STORE_FILES 8
+#endif
+/* Size at which the current file is closed and the next one started. */
+#ifndef LHOS_LOG_STORE_FILE_SIZE
+#define LHOS_LOG_STORE_FILE_SIZE (64 * 1024)
+#endif
+/* Uncompressed bytes of records per frame. */
+#ifndef LHOS_LOG_STORE_FRAME_SIZE
+#define LHOS_LOG_STORE_FRAME_SIZE 2048
+#endif
+/* Longest time records may stay in RAM before they are written. */
+#ifndef LHOS_LOG_STORE_FLUSH_MS
+#define LHOS_LOG_STORE_FLUSH_MS 10000
+#endif
+
+typedef struct
+{
+  uint32_t records;      /* records accepted by the store */
+  uint32_t frames;       /* frames sealed */
+  uint32_t bytes_raw;    /* record bytes before compression */
+  uint32_t bytes_stored; /* frame bytes written, headers included */
+  uint32_t writes;       /* write() calls issued to the filesystem */
+  uint32_t syncs;        /* fsync() calls */
+  uint32_t rotations;    /* files started */
+  uint32_t errors;       /* failed filesystem operations */
+} lhos_log_store_stats_t;
+
+/* Query for `lhos_log_store_iter_open`. Zeroed fields do not filter. */
+typedef struct
+{
+  int64_t since_ms;       /* keep records with ts >= since_ms */
+  int64_t until_ms;       /* keep records with ts < until_ms (0: no bound) */
+  lhos_log_level_t level; /* keep records at this level or more severe */
+  const char *tag;        /* keep records with exactly this tag */
+} lhos_log_store_query_t;
+
+typedef struct
+{
+  int64_t ts_ms; /* wall clock time in ms since the epoch */
+  lhos_log_level_t level;
+  const char *tag; /* NUL-terminated */
+  const char *msg; /* not NUL-terminated */
+  size_t len;
+} lhos_log_store_record_t;
+
+typedef struct lhos_log_store_iter lhos_log_store_iter_t;
+
+/* Mount the storage partition, recover the file ring and install the
+   store as the log sink. Idempotent. If the partition does not mount the
+   error is returned and records are not persisted; nothing is erased. */
+esp_err_t lhos_log_store_init (void);
+
+/* Erase the storage partition and start an empty store. For a partition
+   that lhos_log_store_init could not mount; ESP_ERR_INVALID_STATE while
+   the store is running. */
+esp_err_t lhos_log_store_format (void);
+
+/* Records above `level` are not persisted (default LHOS_LOG_INFO).
+   LHOS_LOG_NONE stops persisting without removing the sink. */
+void lhos_log_store_set_level (lhos_log_level_t level);
+lhos_log_level_t lhos_log_store_get_level (void);
+
+/* Seal the open frame and write and fsync everything staged in RAM.
+   Records still in the log rings are not included; call
+   `lhos_log_flush` first to push them through the drainer. */
+esp_err_t lhos_log_store_sync (void);
+
+/* Rewrite every closed file keeping only records at `level` or more
+   severe, to reclaim space taken by chatty levels. The current file is
+   left untouched. Blocks the drainer while a file is rewritten. */
+esp_err_t lhos_log_store_compact (lhos_log_level_t level);
+
+void lhos_log_store_get_stats (lhos_log_store_stats_t *out);
+
+/* Iterate stored records from oldest to newest. Only records already
+   written to flash are visible (see `lhos_log_store_sync`). Corrupted or
+   torn frames are skipped. */
+esp_err_t lhos_log_store_iter_open (const lhos_log_store_query_t *query,
+                                    lhos_log_store_iter_t **out);
+
+/* Fetch the next matching record. Returns false at the end. The record's
+   strings point into the iterator and are valid until the next call. */
+bool lhos_log_store_iter_next (lhos_log_store_iter_t *it,
+                               lhos_log_store_record_t *rec);
+
+void lhos_log_store_iter_close (lhos_log_store_iter_t *it);
+
+#endif /* LHOS_LOG_STORE_H */
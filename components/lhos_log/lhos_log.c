@@ -0,0 +1,479 @@
+/* LHOS log rings and drainer.
+ *
+ * Each core owns a bounded multi-producer ring of fixed-size slots. Every
+ * slot carries a sequence number: a producer claims a run of slots by
+ * advancing `head` with compare-and-swap once the last slot of the run is
+ * free, fills them and publishes each one by bumping its sequence. The
+ * drainer task is the only consumer; it releases slots by moving their
+ * sequence one lap ahead. The producer path takes no lock and never waits.
+ */
+
+#include "lhos_log.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#define RING_MASK (LHOS_LOG_RING_SLOTS - 1)
+#define LHOS_LOG_FLAG_TRUNCATED 0x01
+
+_Static_assert ((LHOS_LOG_RING_SLOTS & RING_MASK) == 0,
+                "LHOS_LOG_RING_SLOTS must be a power of two");
+_Static_assert (LHOS_LOG_SLOT_SIZE <= UINT8_MAX,
+                "LHOS_LOG_SLOT_SIZE must fit in a byte");
+_Static_assert (LHOS_LOG_MAX_SLOTS <= LHOS_LOG_RING_SLOTS,
+                "LHOS_LOG_MAX_SLOTS larger than a ring");
+
+static const char *TAG = "lhos_log";
+
+typedef struct
+{
+  _Atomic uint32_t seq;
+  uint8_t level;
+  uint8_t nslots; /* slots in the record; valid in its first slot */
+  uint8_t flags;
+  uint8_t fill; /* message bytes held by this slot */
+  uint32_t ts_ms;
+  char tag[LHOS_LOG_TAG_MAX];
+  char text[LHOS_LOG_SLOT_SIZE];
+} lhos_log_slot_t;
+
+typedef struct
+{
+  _Atomic uint32_t head; /* next position a producer may claim */
+  _Atomic uint32_t tail; /* next position the drainer reads */
+  lhos_log_slot_t slots[LHOS_LOG_RING_SLOTS];
+} lhos_log_ring_t;
+
+typedef struct
+{
+  char tag[LHOS_LOG_TAG_MAX];
+  _Atomic uint8_t level;
+} lhos_log_tag_level_t;
+
+static lhos_log_ring_t s_rings[portNUM_PROCESSORS];
+static TaskHandle_t s_drainer = NULL;
+static _Atomic bool s_ready = false;
+static _Atomic uint8_t s_level = LHOS_LOG_INFO;
+
+static lhos_log_tag_level_t s_tag_levels[LHOS_LOG_TAG_LEVELS];
+static _Atomic int s_tag_level_count = 0;
+static portMUX_TYPE s_tag_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static _Atomic uint32_t s_written = 0;
+static _Atomic uint32_t s_dropped = 0;
+static _Atomic uint32_t s_truncated = 0;
+static _Atomic uint32_t s_high_water = 0;
+
+static const lhos_log_sink_t *_Atomic s_sink = NULL;
+
+/* drainer-private line assembly buffer */
+static char s_line[LHOS_LOG_MAX_SLOTS * LHOS_LOG_SLOT_SIZE];
+
+char
+lhos_log_level_letter (lhos_log_level_t level)
+{
+  static const char letters[] = "NEWIDV";
+  return (level <= LHOS_LOG_VERBOSE) ? letters[level] : '?';
+}
+
+const char *
+lhos_log_level_name (lhos_log_level_t level)
+{
+  static const char *const names[] = {
+    "none", "error", "warn", "info", "debug", "verbose",
+  };
+  return (level <= LHOS_LOG_VERBOSE) ? names[level] : "unknown";
+}
+
+void
+lhos_log_set_level (lhos_log_level_t level)
+{
+  atomic_store (&s_level, (uint8_t)level);
+}
+
+lhos_log_level_t
+lhos_log_get_level (void)
+{
+  return (lhos_log_level_t)atomic_load (&s_level);
+}
+
+esp_err_t
+lhos_log_set_tag_level (const char *tag, lhos_log_level_t level)
+{
+  if (!tag || !tag[0])
+    return ESP_ERR_INVALID_ARG;
+  esp_err_t rc = ESP_OK;
+  portENTER_CRITICAL (&s_tag_lock);
+  int n = atomic_load_explicit (&s_tag_level_count, memory_order_relaxed);
+  int i;
+  for (i = 0; i < n; i++)
+    {
+      if (strncmp (s_tag_levels[i].tag, tag, LHOS_LOG_TAG_MAX - 1) == 0)
+        break;
+    }
+  if (i < n)
+    atomic_store (&s_tag_levels[i].level, (uint8_t)level);
+  else if (n < LHOS_LOG_TAG_LEVELS)
+    {
+      strncpy (s_tag_levels[n].tag, tag, LHOS_LOG_TAG_MAX - 1);
+      s_tag_levels[n].tag[LHOS_LOG_TAG_MAX - 1] = '\0';
+      atomic_store (&s_tag_levels[n].level, (uint8_t)level);
+      /* publish the entry only once it is complete */
+      atomic_store_explicit (&s_tag_level_count, n + 1, memory_order_release);
+    }
+  else
+    rc = ESP_ERR_NO_MEM;
+  portEXIT_CRITICAL (&s_tag_lock);
+  return rc;
+}
+
+bool
+lhos_log_enabled (lhos_log_level_t level, const char *tag)
+{
+  if (level == LHOS_LOG_NONE)
+    return false;
+  if (tag)
+    {
+      int n = atomic_load_explicit (&s_tag_level_count, memory_order_acquire);
+      for (int i = 0; i < n; i++)
+        {
+          if (strncmp (s_tag_levels[i].tag, tag, LHOS_LOG_TAG_MAX - 1) == 0)
+            return level <= atomic_load (&s_tag_levels[i].level);
+        }
+    }
+  return level <= atomic_load (&s_level);
+}
+
+static bool
+ring_reserve (lhos_log_ring_t *r, uint32_t n, uint32_t *pos_out)
+{
+  uint32_t pos = atomic_load_explicit (&r->head, memory_order_relaxed);
+  for (;;)
+    {
+      /* the drainer frees slots in order, so if the last slot of the run
+         is free for this lap, all the ones before it are too */
+      uint32_t last = pos + n - 1;
+      uint32_t seq = atomic_load_explicit (&r->slots[last & RING_MASK].seq,
+                                           memory_order_acquire);
+      int32_t diff = (int32_t)(seq - last);
+      if (diff == 0)
+        {
+          if (atomic_compare_exchange_weak_explicit (
+                  &r->head, &pos, pos + n, memory_order_relaxed,
+                  memory_order_relaxed))
+            {
+              *pos_out = pos;
+              return true;
+            }
+        }
+      else if (diff < 0)
+        return false; /* ring full */
+      else
+        pos = atomic_load_explicit (&r->head, memory_order_relaxed);
+    }
+}
+
+static void
+note_high_water (uint32_t used)
+{
+  uint32_t hw = atomic_load_explicit (&s_high_water, memory_order_relaxed);
+  while (used > hw
+         && !atomic_compare_exchange_weak_explicit (
+             &s_high_water, &hw, used, memory_order_relaxed,
+             memory_order_relaxed))
+    ;
+}
+
+static void
+write_console (lhos_log_level_t level, const char *tag, uint32_t ts_ms,
+               const char *msg, size_t len, bool truncated)
+{
+  esp_log_write ((esp_log_level_t)level, tag, "%c (%" PRIu32 ") %s: %.*s%s\n",
+                 lhos_log_level_letter (level), ts_ms, tag, (int)len, msg,
+                 truncated ? " [truncated]" : "");
+}
+
+bool
+lhos_log_writev (lhos_log_level_t level, const char *tag,
+                 const lhos_log_iov_t *iov, int iovcnt)
+{
+  if (!tag)
+    tag = "";
+  if (!lhos_log_enabled (level, tag))
+    return false;
+
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; i++)
+    total += iov[i].len;
+
+  if (!atomic_load_explicit (&s_ready, memory_order_acquire))
+    {
+      /* before init: no drainer yet, write synchronously */
+      esp_log_write ((esp_log_level_t)level, tag, "%c (%" PRIu32 ") %s: ",
+                     lhos_log_level_letter (level), esp_log_timestamp (),
+                     tag);
+      for (int i = 0; i < iovcnt; i++)
+        esp_log_write ((esp_log_level_t)level, tag, "%.*s", (int)iov[i].len,
+                       iov[i].ptr);
+      esp_log_write ((esp_log_level_t)level, tag, "\n");
+      return true;
+    }
+
+  uint8_t flags = 0;
+  const size_t max = (size_t)LHOS_LOG_MAX_SLOTS * LHOS_LOG_SLOT_SIZE;
+  if (total > max)
+    {
+      total = max;
+      flags |= LHOS_LOG_FLAG_TRUNCATED;
+      atomic_fetch_add_explicit (&s_truncated, 1, memory_order_relaxed);
+    }
+  uint32_t n = total ? (uint32_t)((total + LHOS_LOG_SLOT_SIZE - 1)
+                                  / LHOS_LOG_SLOT_SIZE)
+                     : 1;
+
+  lhos_log_ring_t *r = &s_rings[xPortGetCoreID ()];
+  uint32_t pos;
+  if (!ring_reserve (r, n, &pos))
+    {
+      atomic_fetch_add_explicit (&s_dropped, 1, memory_order_relaxed);
+      xTaskNotifyGive (s_drainer);
+      return false;
+    }
+
+  int piece = 0;
+  size_t poff = 0;
+  size_t left = total;
+  for (uint32_t k = 0; k < n; k++)
+    {
+      lhos_log_slot_t *s = &r->slots[(pos + k) & RING_MASK];
+      size_t fill = 0;
+      while (fill < LHOS_LOG_SLOT_SIZE && left > 0)
+        {
+          while (poff >= iov[piece].len)
+            {
+              piece++;
+              poff = 0;
+            }
+          size_t chunk = iov[piece].len - poff;
+          if (chunk > LHOS_LOG_SLOT_SIZE - fill)
+            chunk = LHOS_LOG_SLOT_SIZE - fill;
+          if (chunk > left)
+            chunk = left;
+          memcpy (s->text + fill, iov[piece].ptr + poff, chunk);
+          fill += chunk;
+          poff += chunk;
+          left -= chunk;
+        }
+      s->fill = (uint8_t)fill;
+      if (k == 0)
+        {
+          s->level = (uint8_t)level;
+          s->nslots = (uint8_t)n;
+          s->flags = flags;
+          s->ts_ms = esp_log_timestamp ();
+          strncpy (s->tag, tag, LHOS_LOG_TAG_MAX - 1);
+          s->tag[LHOS_LOG_TAG_MAX - 1] = '\0';
+        }
+    }
+  for (uint32_t k = 0; k < n; k++)
+    atomic_store_explicit (&r->slots[(pos + k) & RING_MASK].seq, pos + k + 1,
+                           memory_order_release);
+
+  atomic_fetch_add_explicit (&s_written, 1, memory_order_relaxed);
+  uint32_t used
+      = pos + n - atomic_load_explicit (&r->tail, memory_order_relaxed);
+  note_high_water (used);
+  /* the drainer polls on its own; only wake it for errors or pressure */
+  if (level <= LHOS_LOG_ERROR || used > LHOS_LOG_RING_SLOTS * 3 / 4)
+    xTaskNotifyGive (s_drainer);
+  return true;
+}
+
+bool
+lhos_log_write (lhos_log_level_t level, const char *tag, const char *msg,
+                size_t len)
+{
+  lhos_log_iov_t iov = { .ptr = msg, .len = msg ? len : 0 };
+  return lhos_log_writev (level, tag, &iov, 1);
+}
+
+/* Return the first slot of the oldest fully published record, or NULL. */
+static lhos_log_slot_t *
+ring_peek (lhos_log_ring_t *r)
+{
+  uint32_t pos = atomic_load_explicit (&r->tail, memory_order_relaxed);
+  lhos_log_slot_t *first = &r->slots[pos & RING_MASK];
+  if (atomic_load_explicit (&first->seq, memory_order_acquire) != pos + 1)
+    return NULL;
+  for (uint32_t k = 1; k < first->nslots; k++)
+    {
+      uint32_t p = pos + k;
+      if (atomic_load_explicit (&r->slots[p & RING_MASK].seq,
+                                memory_order_acquire)
+          != p + 1)
+        return NULL; /* producer still copying the tail of the record */
+    }
+  return first;
+}
+
+static void
+ring_release (lhos_log_ring_t *r, uint32_t n)
+{
+  uint32_t pos = atomic_load_explicit (&r->tail, memory_order_relaxed);
+  for (uint32_t k = 0; k < n; k++)
+    atomic_store_explicit (&r->slots[(pos + k) & RING_MASK].seq,
+                           pos + k + LHOS_LOG_RING_SLOTS,
+                           memory_order_release);
+  atomic_store_explicit (&r->tail, pos + n, memory_order_release);
+}
+
+static void
+emit_record (lhos_log_ring_t *r, lhos_log_slot_t *first)
+{
+  uint32_t pos = atomic_load_explicit (&r->tail, memory_order_relaxed);
+  size_t len = 0;
+  for (uint32_t k = 0; k < first->nslots; k++)
+    {
+      lhos_log_slot_t *s = &r->slots[(pos + k) & RING_MASK];
+      memcpy (s_line + len, s->text, s->fill);
+      len += s->fill;
+    }
+  bool truncated = first->flags & LHOS_LOG_FLAG_TRUNCATED;
+  write_console ((lhos_log_level_t)first->level, first->tag, first->ts_ms,
+                 s_line, len, truncated);
+  const lhos_log_sink_t *sink = atomic_load (&s_sink);
+  if (sink && sink->write)
+    {
+      lhos_log_record_t rec = {
+        .ts_ms = first->ts_ms,
+        .level = (lhos_log_level_t)first->level,
+        .tag = first->tag,
+        .msg = s_line,
+        .len = len,
+        .truncated = truncated,
+      };
+      sink->write (sink->ctx, &rec);
+    }
+  ring_release (r, first->nslots);
+}
+
+/* Drain every ring, merging the per-core streams by timestamp. */
+static void
+drain (void)
+{
+  for (;;)
+    {
+      lhos_log_ring_t *best = NULL;
+      lhos_log_slot_t *best_slot = NULL;
+      for (int c = 0; c < portNUM_PROCESSORS; c++)
+        {
+          lhos_log_slot_t *s = ring_peek (&s_rings[c]);
+          if (s
+              && (!best_slot
+                  || (int32_t)(s->ts_ms - best_slot->ts_ms) < 0))
+            {
+              best = &s_rings[c];
+              best_slot = s;
+            }
+        }
+      if (!best)
+        return;
+      emit_record (best, best_slot);
+    }
+}
+
+static void
+drainer_task (void *pv)
+{
+  (void)pv;
+  uint32_t reported_drops = 0;
+  for (;;)
+    {
+      ulTaskNotifyTake (pdTRUE, pdMS_TO_TICKS (LHOS_LOG_DRAIN_MS));
+      drain ();
+      const lhos_log_sink_t *sink = atomic_load (&s_sink);
+      if (sink && sink->idle)
+        sink->idle (sink->ctx);
+      uint32_t drops = atomic_load (&s_dropped);
+      if (drops != reported_drops)
+        {
+          ESP_LOGW (TAG, "%" PRIu32 " log records dropped (ring full)",
+                    drops - reported_drops);
+          reported_drops = drops;
+        }
+    }
+}
+
+esp_err_t
+lhos_log_init (void)
+{
+  if (s_drainer)
+    return ESP_OK;
+  for (int c = 0; c < portNUM_PROCESSORS; c++)
+    {
+      lhos_log_ring_t *r = &s_rings[c];
+      atomic_init (&r->head, 0);
+      atomic_init (&r->tail, 0);
+      for (uint32_t i = 0; i < LHOS_LOG_RING_SLOTS; i++)
+        atomic_init (&r->slots[i].seq, i);
+    }
+  /* low priority on the protocol core: console and sink I/O only happen
+     here (the stack leaves room for a filesystem sink) */
+  if (xTaskCreatePinnedToCore (drainer_task, "lhos_log", 4096, NULL,
+                               tskIDLE_PRIORITY + 1, &s_drainer, 0)
+      != pdPASS)
+    {
+      s_drainer = NULL;
+      return ESP_ERR_NO_MEM;
+    }
+  atomic_store_explicit (&s_ready, true, memory_order_release);
+  return ESP_OK;
+}
+
+static bool
+rings_empty (void)
+{
+  for (int c = 0; c < portNUM_PROCESSORS; c++)
+    {
+      if (atomic_load (&s_rings[c].head) != atomic_load (&s_rings[c].tail))
+        return false;
+    }
+  return true;
+}
+
+esp_err_t
+lhos_log_flush (uint32_t timeout_ms)
+{
+  if (!s_drainer)
+    return ESP_OK;
+  TickType_t start = xTaskGetTickCount ();
+  xTaskNotifyGive (s_drainer);
+  while (!rings_empty ())
+    {
+      if ((xTaskGetTickCount () - start) >= pdMS_TO_TICKS (timeout_ms))
+        return ESP_ERR_TIMEOUT;
+      vTaskDelay (pdMS_TO_TICKS (5));
+    }
+  return ESP_OK;
+}
+
+void
+lhos_log_set_sink (const lhos_log_sink_t *sink)
+{
+  atomic_store (&s_sink, sink);
+}
+
+void
+lhos_log_get_stats (lhos_log_stats_t *out)
+{
+  if (!out)
+    return;
+  out->written = atomic_load (&s_written);
+  out->dropped = atomic_load (&s_dropped);
+  out->truncated = atomic_load (&s_truncated);
+  out->high_water = atomic_load (&s_high_water);
+}
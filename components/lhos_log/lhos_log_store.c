@@ -0,0 +1,1020 @@
+/* LHOS persistent log store.
+ *
+ * On-flash layout: each file is a sequence of frames
+ *
+ *   frame_hdr_t | payload (stored_len bytes)
+ *
+ * The payload is the raw record stream, LZ-compressed when that makes it
+ * smaller (FRAME_COMPRESSED). A raw record is
+ *
+ *   varint  zigzag(ts_ms - previous ts_ms)   first record: minus base_ms
+ *   u8      level | tag_index << 3           tag_index 31: literal follows
+ *   [u8 len, tag bytes]                      literal tags join the frame's
+ *                                            dictionary while it has room
+ *   varint  message length, message bytes
+ *
+ * The CRC covers the header (crc field zeroed) and the payload, so a torn
+ * write at the end of a file is detected and the reader resynchronizes on
+ * the next frame magic.
+ */
+
+#include "lhos_log_store.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "lhos_storage.h"
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define FRAME_MAGIC 0x474c484cu /* "LHLG" */
+#define FRAME_COMPRESSED 0x01
+#define TAG_DICT 31
+#define TAG_LITERAL 31
+#define LZ_HASH_BITS 10
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (0x7f + LZ_MIN_MATCH)
+#define LZ_MAX_LITERALS 128
+#define LZ_EMPTY 0xffff
+/* worst case for one record: ts varint, level byte, literal tag, length
+   varint */
+#define RECORD_OVERHEAD (10 + 1 + 1 + LHOS_LOG_TAG_MAX + 5)
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t seq;     /* frame sequence, increasing across files */
+  int64_t base_ms;  /* timestamp the first record's delta applies to */
+  uint16_t raw_len; /* record bytes before compression */
+  uint16_t stored_len;
+  uint16_t count;   /* records in the frame */
+  uint8_t flags;
+  uint8_t levels;   /* bit n set if a record of level n is present */
+  uint32_t crc;
+  uint32_t reserved;
+} frame_hdr_t;
+
+_Static_assert (sizeof (frame_hdr_t) == 32, "frame header layout");
+_Static_assert (LHOS_LOG_STORE_FRAME_SIZE < LZ_EMPTY,
+                "LHOS_LOG_STORE_FRAME_SIZE must fit the LZ offsets");
+_Static_assert (LHOS_LOG_STORE_FRAME_SIZE > 2 * RECORD_OVERHEAD,
+                "LHOS_LOG_STORE_FRAME_SIZE too small");
+
+/* Builds frames and appends them to one file. */
+typedef struct
+{
+  int fd;
+  uint32_t file_size; /* bytes already handed to the filesystem */
+  bool dirty;         /* written since the last fsync */
+  uint8_t *out;       /* sealed frames waiting to be written */
+  size_t out_len;
+  uint32_t next_seq;
+  /* open frame */
+  uint8_t raw[LHOS_LOG_STORE_FRAME_SIZE];
+  size_t raw_len;
+  uint16_t count;
+  uint8_t levels;
+  int64_t base_ms;
+  int64_t last_ms;
+  uint8_t ntags;
+  char tags[TAG_DICT][LHOS_LOG_TAG_MAX];
+} store_writer_t;
+
+/* Walks the records of one decoded frame. */
+typedef struct
+{
+  const uint8_t *p;
+  const uint8_t *end;
+  int64_t ts;
+  uint8_t ntags;
+  char tags[TAG_DICT][LHOS_LOG_TAG_MAX];
+  char literal[LHOS_LOG_TAG_MAX];
+} frame_reader_t;
+
+struct lhos_log_store_iter
+{
+  lhos_log_store_query_t query;
+  char tag[LHOS_LOG_TAG_MAX];
+  uint8_t levels; /* levels the query accepts, as in frame_hdr_t */
+  uint8_t order[LHOS_LOG_STORE_FILES];
+  int nfiles;
+  int file; /* position in `order` */
+  int fd;
+  off_t off;
+  frame_reader_t reader;
+  uint8_t payload[LHOS_LOG_STORE_FRAME_SIZE];
+  uint8_t raw[LHOS_LOG_STORE_FRAME_SIZE];
+};
+
+static const char *TAG = "lhos_log_store";
+
+static SemaphoreHandle_t s_lock = NULL;
+static store_writer_t s_live = { .fd = -1 };
+static int s_cur = 0; /* file slot s_live appends to */
+static size_t s_block = 4096;
+static _Atomic uint8_t s_level = LHOS_LOG_INFO;
+static bool s_urgent = false;
+static int64_t s_last_sync_ms = 0;
+static lhos_log_store_stats_t s_stats;
+static uint16_t s_lz_table[1 << LZ_HASH_BITS];
+
+static void store_sink_write (void *ctx, const lhos_log_record_t *rec);
+static void store_sink_idle (void *ctx);
+
+static const lhos_log_sink_t s_sink = {
+  .write = store_sink_write,
+  .idle = store_sink_idle,
+  .ctx = NULL,
+};
+
+static int64_t
+now_ms (void)
+{
+  struct timeval tv;
+  gettimeofday (&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void
+file_path (char *buf, size_t size, int slot)
+{
+  snprintf (buf, size, "%s/%02d.lhl", LHOS_LOG_STORE_DIR, slot);
+}
+
+/* ---- varints ---------------------------------------------------------- */
+
+static size_t
+put_varint (uint8_t *p, uint64_t v)
+{
+  size_t n = 0;
+  while (v >= 0x80)
+    {
+      p[n++] = (uint8_t)(v | 0x80);
+      v >>= 7;
+    }
+  p[n++] = (uint8_t)v;
+  return n;
+}
+
+static bool
+get_varint (const uint8_t **pp, const uint8_t *end, uint64_t *out)
+{
+  uint64_t v = 0;
+  for (int shift = 0; shift < 64; shift += 7)
+    {
+      if (*pp >= end)
+        return false;
+      uint8_t b = *(*pp)++;
+      v |= (uint64_t)(b & 0x7f) << shift;
+      if (!(b & 0x80))
+        {
+          *out = v;
+          return true;
+        }
+    }
+  return false;
+}
+
+static uint64_t
+zigzag (int64_t v)
+{
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t
+unzigzag (uint64_t v)
+{
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/* ---- LZ codec ----------------------------------------------------------
+ * Token byte 0xxxxxxx: x+1 literal bytes follow.
+ * Token byte 1xxxxxxx: copy x+3 bytes from `offset` bytes back; the u16le
+ * offset follows. Log text repeats tags, prefixes and field names, which
+ * is what this greedy single-probe matcher is good at. */
+
+static uint32_t
+lz_hash (const uint8_t *p)
+{
+  uint32_t v = p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16;
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static bool
+lz_literals (const uint8_t *src, size_t n, uint8_t *out, size_t cap,
+             size_t *op)
+{
+  while (n > 0)
+    {
+      size_t k = n < LZ_MAX_LITERALS ? n : LZ_MAX_LITERALS;
+      if (*op + 1 + k > cap)
+        return false;
+      out[(*op)++] = (uint8_t)(k - 1);
+      memcpy (out + *op, src, k);
+      *op += k;
+      src += k;
+      n -= k;
+    }
+  return true;
+}
+
+/* Returns the compressed size, or 0 if it would not fit in `cap`. */
+static size_t
+lz_compress (const uint8_t *in, size_t n, uint8_t *out, size_t cap)
+{
+  memset (s_lz_table, 0xff, sizeof (s_lz_table));
+  size_t ip = 0, lit = 0, op = 0;
+  while (ip + LZ_MIN_MATCH <= n)
+    {
+      uint32_t h = lz_hash (in + ip);
+      uint16_t cand = s_lz_table[h];
+      s_lz_table[h] = (uint16_t)ip;
+      if (cand == LZ_EMPTY || memcmp (in + cand, in + ip, LZ_MIN_MATCH) != 0)
+        {
+          ip++;
+          continue;
+        }
+      size_t len = LZ_MIN_MATCH;
+      while (ip + len < n && len < LZ_MAX_MATCH && in[cand + len] == in[ip + len])
+        len++;
+      if (!lz_literals (in + lit, ip - lit, out, cap, &op) || op + 3 > cap)
+        return 0;
+      size_t dist = ip - cand;
+      out[op++] = (uint8_t)(0x80 | (len - LZ_MIN_MATCH));
+      out[op++] = (uint8_t)dist;
+      out[op++] = (uint8_t)(dist >> 8);
+      ip += len;
+      lit = ip;
+    }
+  if (!lz_literals (in + lit, n - lit, out, cap, &op))
+    return 0;
+  return op;
+}
+
+/* Returns the decompressed size, or -1 on malformed input. */
+static int
+lz_decompress (const uint8_t *in, size_t n, uint8_t *out, size_t cap)
+{
+  size_t ip = 0, op = 0;
+  while (ip < n)
+    {
+      uint8_t c = in[ip++];
+      if (c & 0x80)
+        {
+          size_t len = (c & 0x7f) + LZ_MIN_MATCH;
+          if (ip + 2 > n)
+            return -1;
+          size_t dist = in[ip] | (size_t)in[ip + 1] << 8;
+          ip += 2;
+          if (dist == 0 || dist > op || op + len > cap)
+            return -1;
+          /* byte by byte: the source may overlap the destination */
+          for (size_t k = 0; k < len; k++, op++)
+            out[op] = out[op - dist];
+        }
+      else
+        {
+          size_t k = (size_t)c + 1;
+          if (ip + k > n || op + k > cap)
+            return -1;
+          memcpy (out + op, in + ip, k);
+          ip += k;
+          op += k;
+        }
+    }
+  return (int)op;
+}
+
+/* ---- frames ----------------------------------------------------------- */
+
+static uint32_t
+frame_crc (const frame_hdr_t *hdr, const uint8_t *payload)
+{
+  frame_hdr_t h = *hdr;
+  h.crc = 0;
+  uint32_t crc = esp_rom_crc32_le (0, (const uint8_t *)&h, sizeof (h));
+  return esp_rom_crc32_le (crc, payload, hdr->stored_len);
+}
+
+static bool
+frame_hdr_plausible (const frame_hdr_t *h)
+{
+  return h->magic == FRAME_MAGIC && h->raw_len <= LHOS_LOG_STORE_FRAME_SIZE
+         && h->stored_len <= LHOS_LOG_STORE_FRAME_SIZE;
+}
+
+/* Move `*off` to the next position holding the frame magic. */
+static bool
+frame_resync (int fd, off_t *off)
+{
+  uint8_t buf[256];
+  const uint32_t magic = FRAME_MAGIC;
+  off_t pos = *off + 1;
+  for (;;)
+    {
+      ssize_t n = pread (fd, buf, sizeof (buf), pos);
+      if (n < (ssize_t)sizeof (magic))
+        return false;
+      for (ssize_t i = 0; i + (ssize_t)sizeof (magic) <= n; i++)
+        {
+          if (memcmp (buf + i, &magic, sizeof (magic)) == 0)
+            {
+              *off = pos + i;
+              return true;
+            }
+        }
+      pos += n - (sizeof (magic) - 1);
+    }
+}
+
+/* Read the frame at `*off` (or the next intact one after it) into `hdr`
+   and `payload`, advancing `*off` past it. Returns false at end of file. */
+static bool
+frame_read (int fd, off_t *off, frame_hdr_t *hdr, uint8_t *payload)
+{
+  for (;;)
+    {
+      ssize_t n = pread (fd, hdr, sizeof (*hdr), *off);
+      if (n < (ssize_t)sizeof (*hdr))
+        return false;
+      if (frame_hdr_plausible (hdr)
+          && pread (fd, payload, hdr->stored_len, *off + sizeof (*hdr))
+                 == hdr->stored_len
+          && frame_crc (hdr, payload) == hdr->crc)
+        {
+          *off += sizeof (*hdr) + hdr->stored_len;
+          return true;
+        }
+      if (!frame_resync (fd, off))
+        return false;
+    }
+}
+
+/* Decode the payload of a frame into `raw` and point `rd` at it. */
+static bool
+frame_open (const frame_hdr_t *hdr, const uint8_t *payload, uint8_t *raw,
+            frame_reader_t *rd)
+{
+  const uint8_t *src = payload;
+  if (hdr->flags & FRAME_COMPRESSED)
+    {
+      if (lz_decompress (payload, hdr->stored_len, raw,
+                         LHOS_LOG_STORE_FRAME_SIZE)
+          != hdr->raw_len)
+        return false;
+      src = raw;
+    }
+  else if (hdr->stored_len != hdr->raw_len)
+    return false;
+  rd->p = src;
+  rd->end = src + hdr->raw_len;
+  rd->ts = hdr->base_ms;
+  rd->ntags = 0;
+  return true;
+}
+
+static bool
+frame_next (frame_reader_t *rd, lhos_log_store_record_t *rec)
+{
+  uint64_t v;
+  if (rd->p >= rd->end || !get_varint (&rd->p, rd->end, &v))
+    return false;
+  rd->ts += unzigzag (v);
+  if (rd->p >= rd->end)
+    return false;
+  uint8_t b = *rd->p++;
+  unsigned idx = b >> 3;
+  rec->level = (lhos_log_level_t)(b & 0x07);
+  if (idx == TAG_LITERAL)
+    {
+      if (rd->p >= rd->end)
+        return false;
+      size_t n = *rd->p++;
+      if (n >= LHOS_LOG_TAG_MAX || rd->p + n > rd->end)
+        return false;
+      char *dst = (rd->ntags < TAG_DICT) ? rd->tags[rd->ntags++] : rd->literal;
+      memcpy (dst, rd->p, n);
+      dst[n] = '\0';
+      rd->p += n;
+      rec->tag = dst;
+    }
+  else if (idx < rd->ntags)
+    rec->tag = rd->tags[idx];
+  else
+    return false;
+  if (!get_varint (&rd->p, rd->end, &v) || v > (uint64_t)(rd->end - rd->p))
+    return false;
+  rec->ts_ms = rd->ts;
+  rec->msg = (const char *)rd->p;
+  rec->len = (size_t)v;
+  rd->p += v;
+  return true;
+}
+
+/* ---- writer ----------------------------------------------------------- */
+
+static size_t
+writer_out_cap (void)
+{
+  return s_block + sizeof (frame_hdr_t) + LHOS_LOG_STORE_FRAME_SIZE;
+}
+
+static void
+writer_reset_frame (store_writer_t *w)
+{
+  w->raw_len = 0;
+  w->count = 0;
+  w->levels = 0;
+  w->ntags = 0;
+}
+
+/* Append a record to the open frame. Returns false if it does not fit. */
+static bool
+writer_add (store_writer_t *w, int64_t ts, lhos_log_level_t level,
+            const char *tag, const char *msg, size_t len)
+{
+  size_t max_msg = LHOS_LOG_STORE_FRAME_SIZE - RECORD_OVERHEAD;
+  if (len > max_msg)
+    len = max_msg;
+  if (w->raw_len + RECORD_OVERHEAD + len > LHOS_LOG_STORE_FRAME_SIZE)
+    return false;
+  if (w->count == 0)
+    {
+      w->base_ms = ts;
+      w->last_ms = ts;
+    }
+  uint8_t *p = w->raw + w->raw_len;
+  p += put_varint (p, zigzag (ts - w->last_ms));
+  w->last_ms = ts;
+
+  unsigned idx;
+  for (idx = 0; idx < w->ntags; idx++)
+    {
+      if (strcmp (w->tags[idx], tag) == 0)
+        break;
+    }
+  if (idx < w->ntags)
+    *p++ = (uint8_t)(level | idx << 3);
+  else
+    {
+      size_t n = strnlen (tag, LHOS_LOG_TAG_MAX - 1);
+      *p++ = (uint8_t)(level | TAG_LITERAL << 3);
+      *p++ = (uint8_t)n;
+      memcpy (p, tag, n);
+      p += n;
+      if (w->ntags < TAG_DICT)
+        {
+          memcpy (w->tags[w->ntags], tag, n);
+          w->tags[w->ntags][n] = '\0';
+          w->ntags++;
+        }
+    }
+  p += put_varint (p, len);
+  memcpy (p, msg, len);
+  p += len;
+
+  w->raw_len = p - w->raw;
+  w->count++;
+  w->levels |= 1u << level;
+  return true;
+}
+
+/* Compress the open frame into the output staging buffer. */
+static void
+writer_seal (store_writer_t *w)
+{
+  if (w->count == 0)
+    return;
+  uint8_t *dst = w->out + w->out_len;
+  frame_hdr_t hdr = {
+    .magic = FRAME_MAGIC,
+    .seq = w->next_seq++,
+    .base_ms = w->base_ms,
+    .raw_len = (uint16_t)w->raw_len,
+    .count = w->count,
+    .levels = w->levels,
+  };
+  uint8_t *payload = dst + sizeof (hdr);
+  size_t n = lz_compress (w->raw, w->raw_len, payload, w->raw_len - 1);
+  if (n > 0)
+    hdr.flags = FRAME_COMPRESSED;
+  else
+    {
+      memcpy (payload, w->raw, w->raw_len);
+      n = w->raw_len;
+    }
+  hdr.stored_len = (uint16_t)n;
+  hdr.crc = frame_crc (&hdr, payload);
+  memcpy (dst, &hdr, sizeof (hdr));
+  w->out_len += sizeof (hdr) + n;
+
+  s_stats.frames++;
+  s_stats.bytes_raw += w->raw_len;
+  s_stats.bytes_stored += sizeof (hdr) + n;
+  writer_reset_frame (w);
+}
+
+/* Write staged bytes in chunks ending on block boundaries. Unless `all` is
+   set, a trailing partial block stays in RAM to be completed later. */
+static esp_err_t
+writer_write (store_writer_t *w, bool all)
+{
+  while (w->out_len > 0)
+    {
+      size_t room = s_block - (w->file_size % s_block);
+      size_t n = (w->out_len < room) ? w->out_len : room;
+      if (n < room && !all)
+        break;
+      ssize_t wr = write (w->fd, w->out, n);
+      s_stats.writes++;
+      if (wr != (ssize_t)n)
+        {
+          /* drop what is staged rather than retrying on a sick flash */
+          s_stats.errors++;
+          w->out_len = 0;
+          return ESP_FAIL;
+        }
+      w->file_size += n;
+      w->dirty = true;
+      w->out_len -= n;
+      memmove (w->out, w->out + n, w->out_len);
+    }
+  return ESP_OK;
+}
+
+static esp_err_t
+writer_sync (store_writer_t *w)
+{
+  esp_err_t rc = writer_write (w, true);
+  if (w->dirty)
+    {
+      s_stats.syncs++;
+      if (fsync (w->fd) != 0)
+        {
+          s_stats.errors++;
+          rc = ESP_FAIL;
+        }
+      w->dirty = false;
+    }
+  return rc;
+}
+
+/* ---- live file ring --------------------------------------------------- */
+
+static esp_err_t
+live_open (int slot, bool truncate)
+{
+  char path[64];
+  file_path (path, sizeof (path), slot);
+  int flags = O_WRONLY | O_CREAT | (truncate ? O_TRUNC : O_APPEND);
+  int fd = open (path, flags, 0644);
+  if (fd < 0)
+    {
+      s_stats.errors++;
+      ESP_LOGE (TAG, "open %s failed", path);
+      return ESP_FAIL;
+    }
+  struct stat st;
+  s_live.fd = fd;
+  s_live.file_size = (!truncate && fstat (fd, &st) == 0) ? st.st_size : 0;
+  s_live.dirty = false;
+  s_cur = slot;
+  return ESP_OK;
+}
+
+static void
+live_rotate (void)
+{
+  if (s_live.fd >= 0)
+    {
+      writer_sync (&s_live);
+      close (s_live.fd);
+      s_live.fd = -1;
+    }
+  s_stats.rotations++;
+  live_open ((s_cur + 1) % LHOS_LOG_STORE_FILES, true);
+}
+
+static void
+live_seal (void)
+{
+  if (s_live.count == 0)
+    return;
+  size_t worst = sizeof (frame_hdr_t) + s_live.raw_len;
+  if (s_live.file_size + s_live.out_len + worst > LHOS_LOG_STORE_FILE_SIZE)
+    live_rotate ();
+  writer_seal (&s_live);
+  if (s_live.fd >= 0)
+    writer_write (&s_live, false);
+  else
+    s_live.out_len = 0;
+}
+
+static void
+live_sync (void)
+{
+  live_seal ();
+  if (s_live.fd >= 0)
+    writer_sync (&s_live);
+  s_last_sync_ms = now_ms ();
+  s_urgent = false;
+}
+
+static void
+store_sink_write (void *ctx, const lhos_log_record_t *rec)
+{
+  (void)ctx;
+  if (rec->level > atomic_load (&s_level))
+    return;
+  /* records carry boot time; store wall clock time */
+  int64_t ts = now_ms () - (int32_t)(esp_log_timestamp () - rec->ts_ms);
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  if (!writer_add (&s_live, ts, rec->level, rec->tag, rec->msg, rec->len))
+    {
+      live_seal ();
+      writer_add (&s_live, ts, rec->level, rec->tag, rec->msg, rec->len);
+    }
+  s_stats.records++;
+  if (rec->level <= LHOS_LOG_ERROR)
+    s_urgent = true;
+  xSemaphoreGive (s_lock);
+}
+
+static void
+store_sink_idle (void *ctx)
+{
+  (void)ctx;
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  if (s_live.count > 0 || s_live.out_len > 0)
+    {
+      if (s_urgent || now_ms () - s_last_sync_ms >= LHOS_LOG_STORE_FLUSH_MS)
+        live_sync ();
+    }
+  xSemaphoreGive (s_lock);
+}
+
+/* First frame sequence of a file slot, or false if it holds no frame. */
+static bool
+slot_first_seq (int slot, uint32_t *seq, uint8_t *payload)
+{
+  char path[64];
+  file_path (path, sizeof (path), slot);
+  int fd = open (path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  frame_hdr_t hdr;
+  off_t off = 0;
+  bool ok = frame_read (fd, &off, &hdr, payload);
+  close (fd);
+  if (ok)
+    *seq = hdr.seq;
+  return ok;
+}
+
+/* Order the slots holding frames from oldest to newest. */
+static int
+slots_by_age (uint8_t *order, uint8_t *payload)
+{
+  uint32_t seqs[LHOS_LOG_STORE_FILES];
+  int n = 0;
+  for (int slot = 0; slot < LHOS_LOG_STORE_FILES; slot++)
+    {
+      uint32_t seq;
+      if (!slot_first_seq (slot, &seq, payload))
+        continue;
+      int i = n++;
+      while (i > 0 && seqs[i - 1] > seq)
+        {
+          seqs[i] = seqs[i - 1];
+          order[i] = order[i - 1];
+          i--;
+        }
+      seqs[i] = seq;
+      order[i] = (uint8_t)slot;
+    }
+  return n;
+}
+
+esp_err_t
+lhos_log_store_init (void)
+{
+  if (s_lock)
+    return ESP_OK;
+  esp_err_t rc = lhos_storage_mount ();
+  if (rc != ESP_OK)
+    return rc;
+  rc = lhos_storage_mkdirs (LHOS_LOG_STORE_DIR);
+  if (rc != ESP_OK)
+    return rc;
+  s_block = lhos_storage_block_size ();
+  s_live.out = malloc (writer_out_cap ());
+  uint8_t *payload = malloc (LHOS_LOG_STORE_FRAME_SIZE);
+  s_lock = xSemaphoreCreateMutex ();
+  if (!s_live.out || !payload || !s_lock)
+    {
+      free (s_live.out);
+      free (payload);
+      if (s_lock)
+        vSemaphoreDelete (s_lock);
+      s_live.out = NULL;
+      s_lock = NULL;
+      return ESP_ERR_NO_MEM;
+    }
+  writer_reset_frame (&s_live);
+
+  /* continue after the newest frame on flash */
+  uint8_t order[LHOS_LOG_STORE_FILES];
+  int n = slots_by_age (order, payload);
+  if (n > 0)
+    {
+      int slot = order[n - 1];
+      char path[64];
+      file_path (path, sizeof (path), slot);
+      int fd = open (path, O_RDONLY);
+      frame_hdr_t hdr;
+      off_t off = 0;
+      while (fd >= 0 && frame_read (fd, &off, &hdr, payload))
+        s_live.next_seq = hdr.seq + 1;
+      if (fd >= 0)
+        close (fd);
+      rc = live_open (slot, false);
+    }
+  else
+    rc = live_open (0, true);
+  free (payload);
+
+  s_last_sync_ms = now_ms ();
+  lhos_log_set_sink (&s_sink);
+  ESP_LOGI (TAG, "%d log file(s), next frame %u, block %u", n,
+            (unsigned)s_live.next_seq, (unsigned)s_block);
+  return rc;
+}
+
+esp_err_t
+lhos_log_store_format (void)
+{
+  /* a running store means the partition mounted; nothing to recover */
+  if (s_lock)
+    return ESP_ERR_INVALID_STATE;
+  esp_err_t rc = lhos_storage_format ();
+  if (rc != ESP_OK)
+    return rc;
+  return lhos_log_store_init ();
+}
+
+void
+lhos_log_store_set_level (lhos_log_level_t level)
+{
+  atomic_store (&s_level, (uint8_t)level);
+}
+
+lhos_log_level_t
+lhos_log_store_get_level (void)
+{
+  return (lhos_log_level_t)atomic_load (&s_level);
+}
+
+esp_err_t
+lhos_log_store_sync (void)
+{
+  if (!s_lock)
+    return ESP_ERR_INVALID_STATE;
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  uint32_t errors = s_stats.errors;
+  live_sync ();
+  esp_err_t rc = (s_stats.errors == errors) ? ESP_OK : ESP_FAIL;
+  xSemaphoreGive (s_lock);
+  return rc;
+}
+
+void
+lhos_log_store_get_stats (lhos_log_store_stats_t *out)
+{
+  if (!out)
+    return;
+  if (!s_lock)
+    {
+      memset (out, 0, sizeof (*out));
+      return;
+    }
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  *out = s_stats;
+  xSemaphoreGive (s_lock);
+}
+
+/* ---- compaction ------------------------------------------------------- */
+
+/* Rewrite one closed file through `w`; called with s_lock held. */
+static esp_err_t
+compact_slot (int slot, uint8_t keep, store_writer_t *w, uint8_t *payload,
+              uint8_t *records, frame_reader_t *rd)
+{
+  char path[64], tmp[64];
+  file_path (path, sizeof (path), slot);
+  int fd = open (path, O_RDONLY);
+  if (fd < 0)
+    return ESP_OK;
+
+  /* leave files that only hold records we keep alone */
+  frame_hdr_t hdr;
+  off_t off = 0;
+  bool needed = false;
+  while (!needed && frame_read (fd, &off, &hdr, payload))
+    needed = (hdr.levels & ~keep) != 0;
+  if (!needed)
+    {
+      close (fd);
+      return ESP_OK;
+    }
+
+  snprintf (tmp, sizeof (tmp), "%s/compact.tmp", LHOS_LOG_STORE_DIR);
+  w->fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (w->fd < 0)
+    {
+      close (fd);
+      s_stats.errors++;
+      return ESP_FAIL;
+    }
+  w->file_size = 0;
+  w->out_len = 0;
+  w->dirty = false;
+  writer_reset_frame (w);
+
+  esp_err_t rc = ESP_OK;
+  off = 0;
+  while (rc == ESP_OK && frame_read (fd, &off, &hdr, payload))
+    {
+      if (!(hdr.levels & keep) || !frame_open (&hdr, payload, records, rd))
+        continue;
+      lhos_log_store_record_t rec;
+      while (frame_next (rd, &rec))
+        {
+          if (!(keep & (1u << rec.level)))
+            continue;
+          if (w->count == 0)
+            w->next_seq = hdr.seq;
+          if (!writer_add (w, rec.ts_ms, rec.level, rec.tag, rec.msg,
+                           rec.len))
+            {
+              writer_seal (w);
+              rc = writer_write (w, false);
+              w->next_seq = hdr.seq;
+              writer_add (w, rec.ts_ms, rec.level, rec.tag, rec.msg, rec.len);
+            }
+        }
+    }
+  close (fd);
+  writer_seal (w);
+  if (rc == ESP_OK)
+    rc = writer_sync (w);
+  uint32_t kept = w->file_size;
+  close (w->fd);
+  w->fd = -1;
+
+  if (rc != ESP_OK)
+    unlink (tmp);
+  else if (kept == 0)
+    {
+      unlink (tmp);
+      unlink (path);
+    }
+  else if (rename (tmp, path) != 0)
+    {
+      s_stats.errors++;
+      unlink (tmp);
+      rc = ESP_FAIL;
+    }
+  return rc;
+}
+
+esp_err_t
+lhos_log_store_compact (lhos_log_level_t level)
+{
+  if (!s_lock)
+    return ESP_ERR_INVALID_STATE;
+  uint8_t keep = (uint8_t)((2u << level) - 1) & ~1u;
+  store_writer_t *w = calloc (1, sizeof (*w));
+  frame_reader_t *rd = malloc (sizeof (*rd));
+  uint8_t *payload = malloc (LHOS_LOG_STORE_FRAME_SIZE);
+  uint8_t *records = malloc (LHOS_LOG_STORE_FRAME_SIZE);
+  if (w)
+    w->out = malloc (writer_out_cap ());
+  esp_err_t rc = ESP_OK;
+  if (!w || !w->out || !rd || !payload || !records)
+    rc = ESP_ERR_NO_MEM;
+  for (int slot = 0; rc == ESP_OK && slot < LHOS_LOG_STORE_FILES; slot++)
+    {
+      /* one file per lock hold so the drainer can run in between */
+      xSemaphoreTake (s_lock, portMAX_DELAY);
+      if (slot != s_cur)
+        rc = compact_slot (slot, keep, w, payload, records, rd);
+      xSemaphoreGive (s_lock);
+    }
+  if (w)
+    free (w->out);
+  free (w);
+  free (rd);
+  free (payload);
+  free (records);
+  return rc;
+}
+
+/* ---- reader ----------------------------------------------------------- */
+
+esp_err_t
+lhos_log_store_iter_open (const lhos_log_store_query_t *query,
+                          lhos_log_store_iter_t **out)
+{
+  if (!out)
+    return ESP_ERR_INVALID_ARG;
+  lhos_log_store_iter_t *it = calloc (1, sizeof (*it));
+  if (!it)
+    return ESP_ERR_NO_MEM;
+  if (query)
+    it->query = *query;
+  if (it->query.tag)
+    {
+      strncpy (it->tag, it->query.tag, LHOS_LOG_TAG_MAX - 1);
+      it->query.tag = it->tag;
+    }
+  lhos_log_level_t level = it->query.level ? it->query.level
+                                           : LHOS_LOG_VERBOSE;
+  it->levels = (uint8_t)((2u << level) - 1) & ~1u;
+  it->nfiles = slots_by_age (it->order, it->payload);
+  it->file = -1;
+  it->fd = -1;
+  *out = it;
+  return ESP_OK;
+}
+
+/* Load the next frame that may hold matching records. */
+static bool
+iter_next_frame (lhos_log_store_iter_t *it)
+{
+  for (;;)
+    {
+      if (it->fd < 0)
+        {
+          if (++it->file >= it->nfiles)
+            return false;
+          char path[64];
+          file_path (path, sizeof (path), it->order[it->file]);
+          it->fd = open (path, O_RDONLY);
+          it->off = 0;
+          if (it->fd < 0)
+            continue;
+        }
+      frame_hdr_t hdr;
+      if (!frame_read (it->fd, &it->off, &hdr, it->payload))
+        {
+          close (it->fd);
+          it->fd = -1;
+          continue;
+        }
+      if ((hdr.levels & it->levels)
+          && frame_open (&hdr, it->payload, it->raw, &it->reader))
+        return true;
+    }
+}
+
+bool
+lhos_log_store_iter_next (lhos_log_store_iter_t *it,
+                          lhos_log_store_record_t *rec)
+{
+  if (!it)
+    return false;
+  for (;;)
+    {
+      if (it->file < 0 || !frame_next (&it->reader, rec))
+        {
+          if (!iter_next_frame (it))
+            return false;
+          continue;
+        }
+      const lhos_log_store_query_t *q = &it->query;
+      if (!(it->levels & (1u << rec->level)))
+        continue;
+      if (rec->ts_ms < q->since_ms || (q->until_ms && rec->ts_ms >= q->until_ms))
+        continue;
+      if (q->tag && strcmp (q->tag, rec->tag) != 0)
+        continue;
+      return true;
+    }
+}
+
+void
+lhos_log_store_iter_close (lhos_log_store_iter_t *it)
+{
+  if (!it)
+    return;
+  if (it->fd >= 0)
+    close (it->fd);
+  free (it);
+}
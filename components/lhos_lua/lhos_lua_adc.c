@@ -0,0 +1,206 @@
+/* Lua binding for lhos_adc.
+ * API (Lua):
+ *   adc.read([channel=0]) -> raw | nil, err         one-shot read
+ *   adc.to_mv(raw) -> millivolts | nil, err
+ *   adc.start{channel=0, rate=10000, window=1000, decimate=0,
+ *             sim=false, sim_freq=50, sim_amplitude=1000,
+ *             sim_offset=2048, sim_noise=0} -> true | nil, err
+ *   adc.stop() -> true | nil, err
+ *   adc.on_frame(fn | nil)
+ *   adc.stats() -> { frames, dropped, samples, overruns, running }
+ * While sampling, `fn(frame)` is called from the event loop once per
+ * window with frame = { seq, t_us, n, mean, rms, std, min, max,
+ * points = { ... } }; `points` holds the decimated trace when `decimate`
+ * is set. One-shot reads fail while a non-simulated capture runs.
+ */
+
+#include "esp_err.h"
+#include "lauxlib.h"
+#include "lhos_adc.h"
+#include "lhos_lua.h"
+#include "lua.h"
+
+#define LHOS_LUA_ADC_EVENT "adc"
+
+_Static_assert (sizeof (lhos_adc_frame_t) <= LHOS_EVENT_MAX,
+                "ADC frames must fit in an event");
+
+static int
+push_error (lua_State *L, esp_err_t rc)
+{
+  lua_pushnil (L);
+  lua_pushstring (L, esp_err_to_name (rc));
+  return 2;
+}
+
+static int
+push_frame (lua_State *L, const void *data, size_t len)
+{
+  const lhos_adc_frame_t *f = data;
+  (void)len;
+  lua_createtable (L, 0, 9);
+  lua_pushinteger (L, f->seq);
+  lua_setfield (L, -2, "seq");
+  lua_pushinteger (L, f->t_us);
+  lua_setfield (L, -2, "t_us");
+  lua_pushinteger (L, f->count);
+  lua_setfield (L, -2, "n");
+  lua_pushnumber (L, lhos_adc_frame_mean (f));
+  lua_setfield (L, -2, "mean");
+  lua_pushnumber (L, lhos_adc_frame_rms (f));
+  lua_setfield (L, -2, "rms");
+  lua_pushnumber (L, lhos_adc_frame_stddev (f));
+  lua_setfield (L, -2, "std");
+  lua_pushinteger (L, f->min);
+  lua_setfield (L, -2, "min");
+  lua_pushinteger (L, f->max);
+  lua_setfield (L, -2, "max");
+  if (f->npoints)
+    {
+      lua_createtable (L, f->npoints, 0);
+      for (uint16_t i = 0; i < f->npoints; i++)
+        {
+          lua_pushinteger (L, f->points[i]);
+          lua_rawseti (L, -2, i + 1);
+        }
+      lua_setfield (L, -2, "points");
+    }
+  return 1;
+}
+
+/* Runs on the ADC task: frames are copied into the event queue. */
+static bool
+post_frame (const lhos_adc_frame_t *frame, void *ctx)
+{
+  (void)ctx;
+  return lhos_lua_post_event (LHOS_LUA_ADC_EVENT, push_frame, frame,
+                              sizeof (*frame));
+}
+
+static int
+lhos_lua_adc_read (lua_State *L)
+{
+  int raw = 0;
+  esp_err_t rc = lhos_adc_read ((int)luaL_optinteger (L, 1, 0), &raw);
+  if (rc != ESP_OK)
+    return push_error (L, rc);
+  lua_pushinteger (L, raw);
+  return 1;
+}
+
+static int
+lhos_lua_adc_to_mv (lua_State *L)
+{
+  int mv = 0;
+  esp_err_t rc = lhos_adc_raw_to_mv ((int)luaL_checkinteger (L, 1), &mv);
+  if (rc != ESP_OK)
+    return push_error (L, rc);
+  lua_pushinteger (L, mv);
+  return 1;
+}
+
+static lua_Integer
+opt_field_int (lua_State *L, int t, const char *k, lua_Integer def)
+{
+  lua_getfield (L, t, k);
+  lua_Integer v = luaL_optinteger (L, -1, def);
+  lua_pop (L, 1);
+  return v;
+}
+
+static lua_Number
+opt_field_num (lua_State *L, int t, const char *k, lua_Number def)
+{
+  lua_getfield (L, t, k);
+  lua_Number v = luaL_optnumber (L, -1, def);
+  lua_pop (L, 1);
+  return v;
+}
+
+static int
+lhos_lua_adc_start (lua_State *L)
+{
+  if (lua_isnoneornil (L, 1))
+    {
+      lua_settop (L, 0);
+      lua_newtable (L);
+    }
+  luaL_checktype (L, 1, LUA_TTABLE);
+  lhos_adc_config_t cfg = {
+    .channel = (int)opt_field_int (L, 1, "channel", 0),
+    .rate_hz = (uint32_t)opt_field_int (L, 1, "rate", 10000),
+    .window = (uint32_t)opt_field_int (L, 1, "window", 1000),
+    .decimate = (uint32_t)opt_field_int (L, 1, "decimate", 0),
+    .sim_freq_hz = (float)opt_field_num (L, 1, "sim_freq", 50),
+    .sim_amplitude = (float)opt_field_num (L, 1, "sim_amplitude", 1000),
+    .sim_offset = (uint16_t)opt_field_int (L, 1, "sim_offset", 2048),
+    .sim_noise = (uint16_t)opt_field_int (L, 1, "sim_noise", 0),
+  };
+  lua_getfield (L, 1, "sim");
+  cfg.simulate = lua_toboolean (L, -1);
+  lua_pop (L, 1);
+
+  esp_err_t rc = lhos_adc_start (&cfg, post_frame, NULL);
+  if (rc != ESP_OK)
+    return push_error (L, rc);
+  lua_pushboolean (L, 1);
+  return 1;
+}
+
+static int
+lhos_lua_adc_stop (lua_State *L)
+{
+  esp_err_t rc = lhos_adc_stop ();
+  if (rc != ESP_OK)
+    return push_error (L, rc);
+  lua_pushboolean (L, 1);
+  return 1;
+}
+
+static int
+lhos_lua_adc_on_frame (lua_State *L)
+{
+  if (!lua_isnoneornil (L, 1))
+    luaL_checktype (L, 1, LUA_TFUNCTION);
+  if (!lhos_lua_set_event_handler (L, LHOS_LUA_ADC_EVENT, 1))
+    return luaL_error (L, "too many event handlers");
+  return 0;
+}
+
+static int
+lhos_lua_adc_stats (lua_State *L)
+{
+  lhos_adc_stats_t st;
+  lhos_adc_get_stats (&st);
+  lua_createtable (L, 0, 5);
+  lua_pushinteger (L, st.frames);
+  lua_setfield (L, -2, "frames");
+  lua_pushinteger (L, st.dropped);
+  lua_setfield (L, -2, "dropped");
+  lua_pushinteger (L, (lua_Integer)st.samples);
+  lua_setfield (L, -2, "samples");
+  lua_pushinteger (L, st.overruns);
+  lua_setfield (L, -2, "overruns");
+  lua_pushboolean (L, st.running);
+  lua_setfield (L, -2, "running");
+  return 1;
+}
+
+void
+lhos_lua_adc_register (lua_State *L)
+{
+  lua_newtable (L);
+  lua_pushcfunction (L, lhos_lua_adc_read);
+  lua_setfield (L, -2, "read");
+  lua_pushcfunction (L, lhos_lua_adc_to_mv);
+  lua_setfield (L, -2, "to_mv");
+  lua_pushcfunction (L, lhos_lua_adc_start);
+  lua_setfield (L, -2, "start");
+  lua_pushcfunction (L, lhos_lua_adc_stop);
+  lua_setfield (L, -2, "stop");
+  lua_pushcfunction (L, lhos_lua_adc_on_frame);
+  lua_setfield (L, -2, "on_frame");
+  lua_pushcfunction (L, lhos_lua_adc_stats);
+  lua_setfield (L, -2, "stats");
+  lua_setglobal (L, "adc");
+}
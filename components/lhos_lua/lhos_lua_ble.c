@@ -1,7 +1,7 @@
 
-/* Minimal in-tree BLE Lua binding stub.
- * Returns (false, ESP_ERR_NOT_SUPPORTED) for operations until
- * a real BLE implementation is added back into the tree.
+/* BLE Lua bindings: the global `ble` table over lhos_ble.
+ * Without NimBLE in sdkconfig every call returns
+ * (false, ESP_ERR_NOT_SUPPORTED).
  */
 
 #include "esp_err.h"
@@ -21,6 +21,18 @@ lhos_lua_ble_scan (lua_State *L)
   return lhos_ble_scan (L);
 }
 
+int
+lhos_lua_ble_stop_scan (lua_State *L)
+{
+  return lhos_ble_stop_scan (L);
+}
+
+int
+lhos_lua_ble_scan_stats (lua_State *L)
+{
+  return lhos_ble_scan_stats (L);
+}
+
 int
 lhos_lua_ble_connect (lua_State *L)
 {
@@ -33,6 +45,24 @@ lhos_lua_ble_disconnect (lua_State *L)
   return lhos_ble_disconnect (L);
 }
 
+int
+lhos_lua_ble_connections (lua_State *L)
+{
+  return lhos_ble_connections (L);
+}
+
+int
+lhos_lua_ble_on_disconnect (lua_State *L)
+{
+  return lhos_ble_on_disconnect (L);
+}
+
+int
+lhos_lua_ble_on_gatt (lua_State *L)
+{
+  return lhos_ble_on_gatt (L);
+}
+
 int
 lhos_lua_ble_notify (lua_State *L)
 {
@@ -51,6 +81,78 @@ lhos_lua_ble_write (lua_State *L)
   return lhos_ble_write (L);
 }
 
+int
+lhos_lua_ble_discover (lua_State *L)
+{
+  return lhos_ble_discover (L);
+}
+
+int
+lhos_lua_ble_handle (lua_State *L)
+{
+  return lhos_ble_handle (L);
+}
+
+int
+lhos_lua_ble_characteristics (lua_State *L)
+{
+  return lhos_ble_characteristics (L);
+}
+
+int
+lhos_lua_ble_forget (lua_State *L)
+{
+  return lhos_ble_forget (L);
+}
+
+int
+lhos_lua_ble_advertise (lua_State *L)
+{
+  return lhos_ble_advertise (L);
+}
+
+int
+lhos_lua_ble_stop_advertise (lua_State *L)
+{
+  return lhos_ble_stop_advertise (L);
+}
+
+int
+lhos_lua_ble_on_connect (lua_State *L)
+{
+  return lhos_ble_on_connect (L);
+}
+
+int
+lhos_lua_ble_mtu (lua_State *L)
+{
+  return lhos_ble_mtu (L);
+}
+
+int
+lhos_lua_ble_serve (lua_State *L)
+{
+  return lhos_ble_serve (L);
+}
+
+int
+lhos_lua_ble_update (lua_State *L)
+{
+  return lhos_ble_update (L);
+}
+
+int
+lhos_lua_ble_flush (lua_State *L)
+{
+  return lhos_ble_flush (L);
+}
+
+int
+lhos_lua_ble_on_write (lua_State *L)
+{
+  return lhos_ble_on_write (L);
+}
+
 void
 lhos_lua_ble_register (lua_State *L)
 {
@@ -59,15 +161,49 @@ lhos_lua_ble_register (lua_State *L)
   lua_setfield (L, -2, "init");
   lua_pushcfunction (L, lhos_lua_ble_scan);
   lua_setfield (L, -2, "scan");
+  lua_pushcfunction (L, lhos_lua_ble_stop_scan);
+  lua_setfield (L, -2, "stop_scan");
+  lua_pushcfunction (L, lhos_lua_ble_scan_stats);
+  lua_setfield (L, -2, "scan_stats");
   lua_pushcfunction (L, lhos_lua_ble_connect);
   lua_setfield (L, -2, "connect");
   lua_pushcfunction (L, lhos_lua_ble_disconnect);
   lua_setfield (L, -2, "disconnect");
+  lua_pushcfunction (L, lhos_lua_ble_connections);
+  lua_setfield (L, -2, "connections");
+  lua_pushcfunction (L, lhos_lua_ble_on_disconnect);
+  lua_setfield (L, -2, "on_disconnect");
+  lua_pushcfunction (L, lhos_lua_ble_on_gatt);
+  lua_setfield (L, -2, "on_gatt");
   lua_pushcfunction (L, lhos_lua_ble_notify);
   lua_setfield (L, -2, "notify");
   lua_pushcfunction (L, lhos_lua_ble_read);
   lua_setfield (L, -2, "read");
   lua_pushcfunction (L, lhos_lua_ble_write);
   lua_setfield (L, -2, "write");
-  lua_setfield (L, -2, "ble");
+  lua_pushcfunction (L, lhos_lua_ble_discover);
+  lua_setfield (L, -2, "discover");
+  lua_pushcfunction (L, lhos_lua_ble_handle);
+  lua_setfield (L, -2, "handle");
+  lua_pushcfunction (L, lhos_lua_ble_characteristics);
+  lua_setfield (L, -2, "characteristics");
+  lua_pushcfunction (L, lhos_lua_ble_forget);
+  lua_setfield (L, -2, "forget");
+  lua_pushcfunction (L, lhos_lua_ble_advertise);
+  lua_setfield (L, -2, "advertise");
+  lua_pushcfunction (L, lhos_lua_ble_stop_advertise);
+  lua_setfield (L, -2, "stop_advertise");
+  lua_pushcfunction (L, lhos_lua_ble_on_connect);
+  lua_setfield (L, -2, "on_connect");
+  lua_pushcfunction (L, lhos_lua_ble_mtu);
+  lua_setfield (L, -2, "mtu");
+  lua_pushcfunction (L, lhos_lua_ble_serve);
+  lua_setfield (L, -2, "serve");
+  lua_pushcfunction (L, lhos_lua_ble_update);
+  lua_setfield (L, -2, "update");
+  lua_pushcfunction (L, lhos_lua_ble_flush);
+  lua_setfield (L, -2, "flush");
+  lua_pushcfunction (L, lhos_lua_ble_on_write);
+  lua_setfield (L, -2, "on_write");
+  lua_setglobal (L, "ble");
 }
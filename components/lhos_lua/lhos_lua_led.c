@@ -1,10 +1,50 @@
-﻿/* Lua binding for LED (WS2812B) using lhos_ws2812b component */
+﻿/* Lua binding for LED (WS2812B) using lhos_ws2812b component
+ * API (Lua):
+ *   led.config([gpio=48 [, count=1]]) -> true | nil, err
+ *   led.count() -> n
+ *   led.pixel(i, r, g, b) -> true | nil, err      (i is 1-based)
+ *   led.get([i=1]) -> r, g, b | nil, err
+ *   led.fill(r, g, b [, first=1 [, n]]) -> true | nil, err
+ *   led.set_range(first, { 0xRRGGBB, ... }) -> true | nil, err
+ *   led.write(data [, first=1 [, format="rgb"]]) -> pixels | nil, err
+ *   led.hsv(h, s, v) -> 0xRRGGBB                   (all 0-255)
+ *   led.palette({ 0xRRGGBB, ... } [, index=0]) -> true | nil, err
+ *   led.show() -> true | nil, err
+ *   led.stats() -> { shown, merged, errors }
+ *   led.animate(spec) -> id | nil, err
+ *   led.stop([id])
+ *   led.brightness(0-255), led.gamma(g) -> true | nil, err
+ *   led.set(r, g, b), led.off(), led.set_enum(i), led.flash(n, on, off)
+ * pixel, fill and set_range only draw; led.show() queues the refresh and
+ * returns at once. led.set and friends color the whole strip and show it.
+ *
+ * led.write takes a string or buffer of packed pixels and shows it in one
+ * call: 3 bytes per LED in format "rgb", "grb", "brg", "rbg", "gbr", "bgr"
+ * or "hsv", or 1 byte per LED with "index" into the 256-entry palette.
+ * Data running past the end of the strip is ignored.
+ *
+ * spec = { type = "blink" | "breathe" | "fade" | "chase" | "sequence",
+ *          color = 0xRRGGBB, color2 = 0, first = 1, count = all,
+ *          on = 500, off = 500,        -- blink
+ *          period = 1000,              -- breathe, fade, chase (per LED)
+ *          width = 1,                  -- chase
+ *          keys = { {0xRRGGBB, ms}, ... }, smooth = false, -- sequence
+ *          ["repeat"] = 0 }            -- cycles, 0: forever
+ * Animations run in C on a timer; the VM only starts and stops them.
+ */
 #include "lhos_lua_led.h"
 #include "esp_err.h"
 #include "lauxlib.h"
+#include "lhos_lua_buffer.h"
 #include "lhos_ws2812b.h"
 #include "lua.h"
 
+#include <stdlib.h>
+#include <string.h>
+
+/* Colors set_range converts per call without allocating */
+#define LHOS_LUA_LED_CHUNK 64
+
 static int
 push_error (lua_State *L, const char *msg)
 {
@@ -13,6 +53,33 @@ push_error (lua_State *L, const char *msg)
   return 2;
 }
 
+static int
+push_result (lua_State *L, esp_err_t err)
+{
+  if (err != ESP_OK)
+    return push_error (L, esp_err_to_name (err));
+  lua_pushboolean (L, 1);
+  return 1;
+}
+
+static uint8_t
+check_channel (lua_State *L, int idx)
+{
+  lua_Integer v = luaL_checkinteger (L, idx);
+  luaL_argcheck (L, v >= 0 && v <= 255, idx, "must be 0-255");
+  return (uint8_t)v;
+}
+
+/* 1-based Lua index -> 0-based LED index */
+static size_t
+check_index (lua_State *L, int idx, lua_Integer def)
+{
+  lua_Integer i = luaL_optinteger (L, idx, def);
+  luaL_argcheck (L, i >= 1 && (size_t)i <= lhos_ws2812b_count (), idx,
+                 "led index out of range");
+  return (size_t)(i - 1);
+}
+
 int
 lhos_lua_led_set (lua_State *L)
 {
@@ -39,8 +106,11 @@ lhos_lua_led_off (lua_State *L)
 int
 lhos_lua_led_config (lua_State *L)
 {
-  (void)L;
-  esp_err_t err = lhos_ws2812b_init ();
+  int gpio = (int)luaL_optinteger (L, 1, WS2812B_GPIO_PIN);
+  lua_Integer count = luaL_optinteger (L, 2, WS2812B_LED_COUNT);
+  luaL_argcheck (L, count >= 1 && count <= WS2812B_MAX_LEDS, 2,
+                 "count out of range");
+  esp_err_t err = lhos_ws2812b_strip_init (gpio, (size_t)count);
   if (err != ESP_OK)
     return push_error (L, "failed to init ws2812b");
   lua_pushboolean (L, 1);
@@ -50,9 +120,16 @@ lhos_lua_led_config (lua_State *L)
 int
 lhos_lua_led_get (lua_State *L)
 {
-  (void)L;
-  /* Not supported by underlying driver */
-  return push_error (L, "get not supported");
+  uint8_t r, g, b;
+  if (lhos_ws2812b_count () == 0)
+    return push_error (L, esp_err_to_name (ESP_ERR_INVALID_STATE));
+  esp_err_t err = lhos_ws2812b_get_pixel (check_index (L, 1, 1), &r, &g, &b);
+  if (err != ESP_OK)
+    return push_error (L, esp_err_to_name (err));
+  lua_pushinteger (L, r);
+  lua_pushinteger (L, g);
+  lua_pushinteger (L, b);
+  return 3;
 }
 
 int
@@ -79,51 +156,235 @@ lhos_lua_led_flash (lua_State *L)
   return 1;
 }
 
-void
-lhos_lua_led_register (lua_State *L)
+int
+lhos_lua_led_count (lua_State *L)
 {
-  lua_newtable (L);
-  lua_pushcfunction (L, lhos_lua_led_set);
-  lua_setfield (L, -2, "set");
-  lua_pushcfunction (L, lhos_lua_led_off);
-  lua_setfield (L, -2, "off");
-  lua_pushcfunction (L, lhos_lua_led_config);
-  lua_setfield (L, -2, "config");
-  lua_pushcfunction (L, lhos_lua_led_get);
-  lua_setfield (L, -2, "get");
-  lua_pushcfunction (L, lhos_lua_led_set_enum);
-  lua_setfield (L, -2, "set_enum");
-  lua_pushcfunction (L, lhos_lua_led_flash);
-  lua_setfield (L, -2, "flash");
-  lua_setglobal (L, "led");
+  lua_pushinteger (L, (lua_Integer)lhos_ws2812b_count ());
+  return 1;
 }
-#include "lauxlib.h"
-#include "lhos_led.h"
-#include "lhos_lua_led.h"
-#include "lua.h"
 
 int
-lhos_lua_led_init (lua_State *L)
+lhos_lua_led_pixel (lua_State *L)
 {
-  esp_err_t r = lhos_led_init ();
-  lua_pushinteger (L, (int)r);
+  if (lhos_ws2812b_count () == 0)
+    return push_result (L, ESP_ERR_INVALID_STATE);
+  size_t i = check_index (L, 1, 0);
+  return push_result (L, lhos_ws2812b_set_pixel (i, check_channel (L, 2),
+                                                 check_channel (L, 3),
+                                                 check_channel (L, 4)));
+}
+
+int
+lhos_lua_led_fill (lua_State *L)
+{
+  uint8_t r = check_channel (L, 1);
+  uint8_t g = check_channel (L, 2);
+  uint8_t b = check_channel (L, 3);
+  size_t count = lhos_ws2812b_count ();
+  if (count == 0)
+    return push_result (L, ESP_ERR_INVALID_STATE);
+  size_t first = check_index (L, 4, 1);
+  lua_Integer n = luaL_optinteger (L, 5, (lua_Integer)(count - first));
+  luaL_argcheck (L, n >= 0 && (size_t)n <= count - first, 5,
+                 "range out of strip");
+  return push_result (L, lhos_ws2812b_fill (first, (size_t)n, r, g, b));
+}
+
+int
+lhos_lua_led_set_range (lua_State *L)
+{
+  size_t count = lhos_ws2812b_count ();
+  if (count == 0)
+    return push_result (L, ESP_ERR_INVALID_STATE);
+  size_t first = check_index (L, 1, 0);
+  luaL_checktype (L, 2, LUA_TTABLE);
+  size_t n = (size_t)lua_rawlen (L, 2);
+  luaL_argcheck (L, n <= count - first, 2, "range out of strip");
+
+  uint32_t rgb[LHOS_LUA_LED_CHUNK];
+  for (size_t done = 0; done < n;)
+    {
+      size_t k = n - done < LHOS_LUA_LED_CHUNK ? n - done : LHOS_LUA_LED_CHUNK;
+      for (size_t j = 0; j < k; j++)
+        {
+          lua_rawgeti (L, 2, (lua_Integer)(done + j + 1));
+          rgb[j] = (uint32_t)luaL_checkinteger (L, -1) & 0xFFFFFF;
+          lua_pop (L, 1);
+        }
+      esp_err_t err = lhos_ws2812b_set_range (first + done, rgb, k);
+      if (err != ESP_OK)
+        return push_result (L, err);
+      done += k;
+    }
+  lua_pushboolean (L, 1);
   return 1;
 }
 
 int
-lhos_lua_led_set (lua_State *L)
+lhos_lua_led_write (lua_State *L)
 {
-  int color = luaL_checkinteger (L, 1);
-  esp_err_t r = lhos_led_set_color ((lhos_led_color_t)color);
-  lua_pushinteger (L, (int)r);
+  static const char *const formats[]
+      = { "rgb", "grb", "brg", "rbg", "gbr", "bgr", "hsv", "index", NULL };
+  size_t len = 0;
+  const uint8_t *data = lhos_lua_checkbytes (L, 1, &len);
+  size_t count = lhos_ws2812b_count ();
+  if (count == 0)
+    return push_result (L, ESP_ERR_INVALID_STATE);
+  size_t first = check_index (L, 2, 1);
+  lhos_fx_format_t fmt
+      = (lhos_fx_format_t)luaL_checkoption (L, 3, "rgb", formats);
+
+  size_t n = len / lhos_fx_format_size (fmt);
+  if (n > count - first)
+    n = count - first;
+  esp_err_t err = lhos_ws2812b_write (first, data, n, fmt);
+  if (err != ESP_OK)
+    return push_result (L, err);
+  lua_pushinteger (L, (lua_Integer)n);
   return 1;
 }
 
 int
-lhos_lua_led_off (lua_State *L)
+lhos_lua_led_hsv (lua_State *L)
 {
-  esp_err_t r = lhos_led_off ();
-  lua_pushinteger (L, (int)r);
+  lua_pushinteger (L, lhos_fx_hsv (check_channel (L, 1), check_channel (L, 2),
+                                   check_channel (L, 3)));
+  return 1;
+}
+
+int
+lhos_lua_led_palette (lua_State *L)
+{
+  luaL_checktype (L, 1, LUA_TTABLE);
+  lua_Integer first = luaL_optinteger (L, 2, 0);
+  size_t n = (size_t)lua_rawlen (L, 1);
+  luaL_argcheck (L, first >= 0 && first <= 255, 2, "index must be 0-255");
+  luaL_argcheck (L, n <= 256 - (size_t)first, 1, "palette holds 256 colors");
+
+  uint32_t rgb[256];
+  for (size_t i = 0; i < n; i++)
+    {
+      lua_rawgeti (L, 1, (lua_Integer)(i + 1));
+      rgb[i] = (uint32_t)luaL_checkinteger (L, -1) & 0xFFFFFF;
+      lua_pop (L, 1);
+    }
+  return push_result (L, lhos_ws2812b_set_palette ((size_t)first, rgb, n));
+}
+
+int
+lhos_lua_led_show (lua_State *L)
+{
+  return push_result (L, lhos_ws2812b_show ());
+}
+
+static lua_Integer
+opt_field (lua_State *L, int t, const char *name, lua_Integer def)
+{
+  lua_getfield (L, t, name);
+  lua_Integer v = luaL_optinteger (L, -1, def);
+  lua_pop (L, 1);
+  return v;
+}
+
+static void
+check_keys (lua_State *L, int t, lhos_fx_t *fx)
+{
+  lua_getfield (L, t, "keys");
+  luaL_argcheck (L, lua_istable (L, -1), 1, "sequence needs keys");
+  size_t n = (size_t)lua_rawlen (L, -1);
+  luaL_argcheck (L, n >= 1 && n <= LHOS_FX_KEYS_MAX, 1,
+                 "keys must hold 1-16 entries");
+  for (size_t i = 0; i < n; i++)
+    {
+      lua_rawgeti (L, -1, (lua_Integer)(i + 1));
+      luaL_argcheck (L, lua_istable (L, -1), 1, "key must be {color, ms}");
+      lua_rawgeti (L, -1, 1);
+      lua_rawgeti (L, -2, 2);
+      fx->keys[i].color = (uint32_t)luaL_checkinteger (L, -2) & 0xFFFFFF;
+      fx->keys[i].ms = (uint32_t)luaL_checkinteger (L, -1);
+      lua_pop (L, 3);
+    }
+  fx->nkeys = (uint8_t)n;
+  lua_pop (L, 1);
+}
+
+int
+lhos_lua_led_animate (lua_State *L)
+{
+  static const char *const types[]
+      = { "blink", "breathe", "fade", "chase", "sequence", NULL };
+  luaL_checktype (L, 1, LUA_TTABLE);
+  size_t count = lhos_ws2812b_count ();
+  if (count == 0)
+    return push_result (L, ESP_ERR_INVALID_STATE);
+
+  lhos_fx_t fx;
+  memset (&fx, 0, sizeof (fx));
+  lua_getfield (L, 1, "type");
+  fx.type = (lhos_fx_type_t)luaL_checkoption (L, -1, "blink", types);
+  lua_pop (L, 1);
+  fx.color = (uint32_t)opt_field (L, 1, "color", 0xFFFFFF) & 0xFFFFFF;
+  fx.color2 = (uint32_t)opt_field (L, 1, "color2", 0) & 0xFFFFFF;
+  fx.on_ms = (uint32_t)opt_field (L, 1, "on", 500);
+  fx.off_ms = (uint32_t)opt_field (L, 1, "off", 500);
+  fx.period_ms = (uint32_t)opt_field (L, 1, "period", 1000);
+  fx.width = (uint16_t)opt_field (L, 1, "width", 1);
+  fx.repeat = (uint16_t)opt_field (L, 1, "repeat", 0);
+  lua_getfield (L, 1, "smooth");
+  fx.smooth = lua_toboolean (L, -1);
+  lua_pop (L, 1);
+  if (fx.type == LHOS_FX_SEQUENCE)
+    check_keys (L, 1, &fx);
+
+  lua_Integer first = opt_field (L, 1, "first", 1);
+  luaL_argcheck (L, first >= 1 && (size_t)first <= count, 1,
+                 "first out of range");
+  lua_Integer n = opt_field (L, 1, "count", (lua_Integer)count - first + 1);
+  luaL_argcheck (L, n >= 1 && (size_t)n <= count - (size_t)(first - 1), 1,
+                 "count out of range");
+
+  int id = 0;
+  esp_err_t err
+      = lhos_ws2812b_animate ((size_t)first - 1, (size_t)n, &fx, &id);
+  if (err != ESP_OK)
+    return push_result (L, err);
+  lua_pushinteger (L, id + 1);
+  return 1;
+}
+
+int
+lhos_lua_led_stop (lua_State *L)
+{
+  lua_Integer id = luaL_optinteger (L, 1, 0);
+  luaL_argcheck (L, id >= 0 && id <= WS2812B_ANIMS, 1, "invalid id");
+  return push_result (L, lhos_ws2812b_stop ((int)id - 1));
+}
+
+int
+lhos_lua_led_brightness (lua_State *L)
+{
+  return push_result (L, lhos_ws2812b_set_brightness (check_channel (L, 1)));
+}
+
+int
+lhos_lua_led_gamma (lua_State *L)
+{
+  return push_result (
+      L, lhos_ws2812b_set_gamma ((float)luaL_checknumber (L, 1)));
+}
+
+int
+lhos_lua_led_stats (lua_State *L)
+{
+  ws2812b_stats_t st;
+  lhos_ws2812b_get_stats (&st);
+  lua_createtable (L, 0, 3);
+  lua_pushinteger (L, st.shown);
+  lua_setfield (L, -2, "shown");
+  lua_pushinteger (L, st.merged);
+  lua_setfield (L, -2, "merged");
+  lua_pushinteger (L, st.errors);
+  lua_setfield (L, -2, "errors");
   return 1;
 }
 
@@ -131,11 +392,43 @@ void
 lhos_lua_led_register (lua_State *L)
 {
   lua_newtable (L);
-  lua_pushcfunction (L, lhos_lua_led_init);
-  lua_setfield (L, -2, "init");
   lua_pushcfunction (L, lhos_lua_led_set);
   lua_setfield (L, -2, "set");
   lua_pushcfunction (L, lhos_lua_led_off);
   lua_setfield (L, -2, "off");
-  lua_setfield (L, -2, "led");
+  lua_pushcfunction (L, lhos_lua_led_config);
+  lua_setfield (L, -2, "config");
+  lua_pushcfunction (L, lhos_lua_led_get);
+  lua_setfield (L, -2, "get");
+  lua_pushcfunction (L, lhos_lua_led_set_enum);
+  lua_setfield (L, -2, "set_enum");
+  lua_pushcfunction (L, lhos_lua_led_flash);
+  lua_setfield (L, -2, "flash");
+  lua_pushcfunction (L, lhos_lua_led_count);
+  lua_setfield (L, -2, "count");
+  lua_pushcfunction (L, lhos_lua_led_pixel);
+  lua_setfield (L, -2, "pixel");
+  lua_pushcfunction (L, lhos_lua_led_fill);
+  lua_setfield (L, -2, "fill");
+  lua_pushcfunction (L, lhos_lua_led_set_range);
+  lua_setfield (L, -2, "set_range");
+  lua_pushcfunction (L, lhos_lua_led_show);
+  lua_setfield (L, -2, "show");
+  lua_pushcfunction (L, lhos_lua_led_stats);
+  lua_setfield (L, -2, "stats");
+  lua_pushcfunction (L, lhos_lua_led_animate);
+  lua_setfield (L, -2, "animate");
+  lua_pushcfunction (L, lhos_lua_led_stop);
+  lua_setfield (L, -2, "stop");
+  lua_pushcfunction (L, lhos_lua_led_brightness);
+  lua_setfield (L, -2, "brightness");
+  lua_pushcfunction (L, lhos_lua_led_gamma);
+  lua_setfield (L, -2, "gamma");
+  lua_pushcfunction (L, lhos_lua_led_write);
+  lua_setfield (L, -2, "write");
+  lua_pushcfunction (L, lhos_lua_led_hsv);
+  lua_setfield (L, -2, "hsv");
+  lua_pushcfunction (L, lhos_lua_led_palette);
+  lua_setfield (L, -2, "palette");
+  lua_setglobal (L, "led");
 }
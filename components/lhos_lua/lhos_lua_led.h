@@ -6,6 +6,14 @@
 int lhos_lua_led_set (lua_State *L);
 int lhos_lua_led_get (lua_State *L);
 int lhos_lua_led_config (lua_State *L);
+int lhos_lua_led_count (lua_State *L);
+int lhos_lua_led_pixel (lua_State *L);
+int lhos_lua_led_fill (lua_State *L);
+int lhos_lua_led_set_range (lua_State *L);
+int lhos_lua_led_show (lua_State *L);
+int lhos_lua_led_write (lua_State *L);
+int lhos_lua_led_animate (lua_State *L);
+int lhos_lua_led_stop (lua_State *L);
 void lhos_lua_led_register (lua_State *L);
 
 #endif // LHOS_LUA_LED_H
@@ -0,0 +1,403 @@
+/* Lua binding for the lhos_log subsystem.
+ * API (Lua):
+ *   log.error(tag, ...)  log.warn  log.info  log.debug  log.verbose
+ *   log.set_level(level) | log.set_level(tag, level) -> true | nil, err
+ *   log.level() -> level name
+ *   log.stats() -> { written, dropped, truncated, high_water, store = {...} }
+ *   log.flush(timeout_ms=1000) -> true | nil, err
+ * Persistent store (see lhos_log_store.h):
+ *   log.persist([level]) -> level name; records above it are not stored
+ *   log.sync() -> true | nil, err        flush rings and staged frames
+ *   log.records([{since=, until=, level=, tag=}]) -> iterator
+ *     for ts_ms, level, tag, msg in log.records{level="warn"} do ... end
+ *   log.compact(level) -> true | nil, err
+ *   log.format() -> true | nil, err   erase a partition that did not mount
+ * `level` is "none", "error", "warn", "info", "debug" or "verbose".
+ */
+
+#include "lhos_lua_log.h"
+#include "esp_err.h"
+#include "lhos_log_store.h"
+#include "lauxlib.h"
+#include "lua.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* Arguments formatted on the fast path; more fall back to luaL_Buffer. */
+#ifndef LHOS_LUA_LOG_FAST_ARGS
+#define LHOS_LUA_LOG_FAST_ARGS 8
+#endif
+#define LHOS_LUA_LOG_NUM_MAX 32
+#define LHOS_LUA_LOG_ITER_MT "lhos.log.records"
+
+static const char *const level_names[] = {
+  "none", "error", "warn", "info", "debug", "verbose", NULL,
+};
+
+static size_t
+format_number (lua_State *L, int idx, char *out)
+{
+  int len;
+  if (lua_isinteger (L, idx))
+    len = snprintf (out, LHOS_LUA_LOG_NUM_MAX, LUA_INTEGER_FMT,
+                    (LUAI_UACINT)lua_tointeger (L, idx));
+  else
+    {
+      len = snprintf (out, LHOS_LUA_LOG_NUM_MAX, LUA_NUMBER_FMT,
+                      lua_tonumber (L, idx));
+      /* keep `tostring` semantics: floats that look integral get ".0" */
+      if (len > 0 && len < LHOS_LUA_LOG_NUM_MAX - 2
+          && out[strspn (out, "-0123456789")] == '\0')
+        {
+          out[len++] = '.';
+          out[len++] = '0';
+          out[len] = '\0';
+        }
+    }
+  return (len > 0) ? (size_t)len : 0;
+}
+
+static void
+log_args_slow (lua_State *L, int first, int top, lhos_log_level_t level,
+               const char *tag)
+{
+  luaL_Buffer b;
+  luaL_buffinit (L, &b);
+  for (int i = first; i <= top; i++)
+    {
+      if (i > first)
+        luaL_addchar (&b, '\t');
+      luaL_tolstring (L, i, NULL);
+      luaL_addvalue (&b);
+    }
+  luaL_pushresult (&b);
+  size_t len;
+  const char *s = lua_tolstring (L, -1, &len);
+  lhos_log_write (level, tag, s, len);
+}
+
+void
+lhos_lua_log_args (lua_State *L, int first, lhos_log_level_t level,
+                   const char *tag)
+{
+  int top = lua_gettop (L);
+  if (!lhos_log_enabled (level, tag))
+    return;
+  int n = top - first + 1;
+  if (n > LHOS_LUA_LOG_FAST_ARGS)
+    {
+      log_args_slow (L, first, top, level, tag);
+      lua_settop (L, top);
+      return;
+    }
+
+  lhos_log_iov_t iov[2 * LHOS_LUA_LOG_FAST_ARGS];
+  char nums[LHOS_LUA_LOG_FAST_ARGS][LHOS_LUA_LOG_NUM_MAX];
+  int cnt = 0;
+  luaL_checkstack (L, n, "too many arguments to log");
+  for (int i = first; i <= top; i++)
+    {
+      if (i > first)
+        iov[cnt++] = (lhos_log_iov_t){ "\t", 1 };
+      lhos_log_iov_t *v = &iov[cnt++];
+      switch (lua_type (L, i))
+        {
+        case LUA_TSTRING:
+          v->ptr = lua_tolstring (L, i, &v->len);
+          break;
+        case LUA_TNUMBER:
+          v->ptr = nums[i - first];
+          v->len = format_number (L, i, nums[i - first]);
+          break;
+        case LUA_TBOOLEAN:
+          v->ptr = lua_toboolean (L, i) ? "true" : "false";
+          v->len = strlen (v->ptr);
+          break;
+        case LUA_TNIL:
+          v->ptr = "nil";
+          v->len = 3;
+          break;
+        default:
+          /* tables, userdata...: honour __tostring / __name; the pushed
+             string stays on the stack until the record is written */
+          v->ptr = luaL_tolstring (L, i, &v->len);
+          break;
+        }
+    }
+  lhos_log_writev (level, tag, iov, cnt);
+  lua_settop (L, top);
+}
+
+static int
+log_at (lua_State *L, lhos_log_level_t level)
+{
+  const char *tag = luaL_checkstring (L, 1);
+  lhos_lua_log_args (L, 2, level, tag);
+  return 0;
+}
+
+static int
+lhos_lua_log_error (lua_State *L)
+{
+  return log_at (L, LHOS_LOG_ERROR);
+}
+
+static int
+lhos_lua_log_warn (lua_State *L)
+{
+  return log_at (L, LHOS_LOG_WARN);
+}
+
+static int
+lhos_lua_log_info (lua_State *L)
+{
+  return log_at (L, LHOS_LOG_INFO);
+}
+
+static int
+lhos_lua_log_debug (lua_State *L)
+{
+  return log_at (L, LHOS_LOG_DEBUG);
+}
+
+static int
+lhos_lua_log_verbose (lua_State *L)
+{
+  return log_at (L, LHOS_LOG_VERBOSE);
+}
+
+static lhos_log_level_t
+check_level (lua_State *L, int idx)
+{
+  if (lua_isinteger (L, idx))
+    {
+      lua_Integer lv = lua_tointeger (L, idx);
+      luaL_argcheck (L, lv >= LHOS_LOG_NONE && lv <= LHOS_LOG_VERBOSE, idx,
+                     "invalid level");
+      return (lhos_log_level_t)lv;
+    }
+  return (lhos_log_level_t)luaL_checkoption (L, idx, NULL, level_names);
+}
+
+static int
+lhos_lua_log_set_level (lua_State *L)
+{
+  if (lua_gettop (L) >= 2)
+    {
+      const char *tag = luaL_checkstring (L, 1);
+      esp_err_t rc = lhos_log_set_tag_level (tag, check_level (L, 2));
+      if (rc != ESP_OK)
+        {
+          lua_pushnil (L);
+          lua_pushstring (L, esp_err_to_name (rc));
+          return 2;
+        }
+    }
+  else
+    lhos_log_set_level (check_level (L, 1));
+  lua_pushboolean (L, 1);
+  return 1;
+}
+
+static int
+lhos_lua_log_level (lua_State *L)
+{
+  lua_pushstring (L, lhos_log_level_name (lhos_log_get_level ()));
+  return 1;
+}
+
+static int
+lhos_lua_log_stats (lua_State *L)
+{
+  lhos_log_stats_t st;
+  lhos_log_get_stats (&st);
+  lua_createtable (L, 0, 5);
+  lua_pushinteger (L, st.written);
+  lua_setfield (L, -2, "written");
+  lua_pushinteger (L, st.dropped);
+  lua_setfield (L, -2, "dropped");
+  lua_pushinteger (L, st.truncated);
+  lua_setfield (L, -2, "truncated");
+  lua_pushinteger (L, st.high_water);
+  lua_setfield (L, -2, "high_water");
+
+  lhos_log_store_stats_t ss;
+  lhos_log_store_get_stats (&ss);
+  lua_createtable (L, 0, 8);
+  lua_pushinteger (L, ss.records);
+  lua_setfield (L, -2, "records");
+  lua_pushinteger (L, ss.frames);
+  lua_setfield (L, -2, "frames");
+  lua_pushinteger (L, ss.bytes_raw);
+  lua_setfield (L, -2, "bytes_raw");
+  lua_pushinteger (L, ss.bytes_stored);
+  lua_setfield (L, -2, "bytes_stored");
+  lua_pushinteger (L, ss.writes);
+  lua_setfield (L, -2, "writes");
+  lua_pushinteger (L, ss.syncs);
+  lua_setfield (L, -2, "syncs");
+  lua_pushinteger (L, ss.rotations);
+  lua_setfield (L, -2, "rotations");
+  lua_pushinteger (L, ss.errors);
+  lua_setfield (L, -2, "errors");
+  lua_setfield (L, -2, "store");
+  return 1;
+}
+
+static int
+lhos_lua_log_flush (lua_State *L)
+{
+  uint32_t timeout_ms = (uint32_t)luaL_optinteger (L, 1, 1000);
+  esp_err_t rc = lhos_log_flush (timeout_ms);
+  if (rc != ESP_OK)
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, esp_err_to_name (rc));
+      return 2;
+    }
+  lua_pushboolean (L, 1);
+  return 1;
+}
+
+static int
+push_result (lua_State *L, esp_err_t rc)
+{
+  if (rc != ESP_OK)
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, esp_err_to_name (rc));
+      return 2;
+    }
+  lua_pushboolean (L, 1);
+  return 1;
+}
+
+static int
+lhos_lua_log_persist (lua_State *L)
+{
+  if (!lua_isnoneornil (L, 1))
+    lhos_log_store_set_level (check_level (L, 1));
+  lua_pushstring (L, lhos_log_level_name (lhos_log_store_get_level ()));
+  return 1;
+}
+
+static int
+lhos_lua_log_sync (lua_State *L)
+{
+  lhos_log_flush ((uint32_t)luaL_optinteger (L, 1, 1000));
+  return push_result (L, lhos_log_store_sync ());
+}
+
+static int
+lhos_lua_log_compact (lua_State *L)
+{
+  lhos_log_level_t level = check_level (L, 1);
+  luaL_argcheck (L, level != LHOS_LOG_NONE, 1, "would drop every record");
+  return push_result (L, lhos_log_store_compact (level));
+}
+
+static int
+lhos_lua_log_format (lua_State *L)
+{
+  return push_result (L, lhos_log_store_format ());
+}
+
+static int
+log_iter_gc (lua_State *L)
+{
+  lhos_log_store_iter_t **it = luaL_checkudata (L, 1, LHOS_LUA_LOG_ITER_MT);
+  lhos_log_store_iter_close (*it);
+  *it = NULL;
+  return 0;
+}
+
+static int
+log_iter_next (lua_State *L)
+{
+  lhos_log_store_iter_t **it
+      = luaL_checkudata (L, lua_upvalueindex (1), LHOS_LUA_LOG_ITER_MT);
+  lhos_log_store_record_t rec;
+  if (!*it || !lhos_log_store_iter_next (*it, &rec))
+    {
+      /* release the files as soon as the loop ends */
+      lhos_log_store_iter_close (*it);
+      *it = NULL;
+      return 0;
+    }
+  lua_pushinteger (L, (lua_Integer)rec.ts_ms);
+  lua_pushstring (L, lhos_log_level_name (rec.level));
+  lua_pushstring (L, rec.tag);
+  lua_pushlstring (L, rec.msg, rec.len);
+  return 4;
+}
+
+static int
+lhos_lua_log_records (lua_State *L)
+{
+  lhos_log_store_query_t q = { 0 };
+  if (!lua_isnoneornil (L, 1))
+    {
+      luaL_checktype (L, 1, LUA_TTABLE);
+      if (lua_getfield (L, 1, "since") != LUA_TNIL)
+        q.since_ms = (int64_t)luaL_checkinteger (L, -1);
+      if (lua_getfield (L, 1, "until") != LUA_TNIL)
+        q.until_ms = (int64_t)luaL_checkinteger (L, -1);
+      if (lua_getfield (L, 1, "level") != LUA_TNIL)
+        q.level = check_level (L, -1);
+      if (lua_getfield (L, 1, "tag") != LUA_TNIL)
+        q.tag = luaL_checkstring (L, -1);
+      /* the tag stays anchored on the stack until iter_open copies it */
+    }
+
+  lhos_log_store_iter_t **it = lua_newuserdatauv (L, sizeof (*it), 0);
+  *it = NULL;
+  luaL_setmetatable (L, LHOS_LUA_LOG_ITER_MT);
+  esp_err_t rc = lhos_log_store_iter_open (&q, it);
+  if (rc != ESP_OK)
+    return push_result (L, rc);
+  lua_pushcclosure (L, log_iter_next, 1);
+  return 1;
+}
+
+void
+lhos_lua_log_register (lua_State *L)
+{
+  if (luaL_newmetatable (L, LHOS_LUA_LOG_ITER_MT))
+    {
+      lua_pushcfunction (L, log_iter_gc);
+      lua_setfield (L, -2, "__gc");
+    }
+  lua_pop (L, 1);
+
+  lua_newtable (L);
+  lua_pushcfunction (L, lhos_lua_log_error);
+  lua_setfield (L, -2, "error");
+  lua_pushcfunction (L, lhos_lua_log_warn);
+  lua_setfield (L, -2, "warn");
+  lua_pushcfunction (L, lhos_lua_log_info);
+  lua_setfield (L, -2, "info");
+  lua_pushcfunction (L, lhos_lua_log_debug);
+  lua_setfield (L, -2, "debug");
+  lua_pushcfunction (L, lhos_lua_log_verbose);
+  lua_setfield (L, -2, "verbose");
+  lua_pushcfunction (L, lhos_lua_log_set_level);
+  lua_setfield (L, -2, "set_level");
+  lua_pushcfunction (L, lhos_lua_log_level);
+  lua_setfield (L, -2, "level");
+  lua_pushcfunction (L, lhos_lua_log_stats);
+  lua_setfield (L, -2, "stats");
+  lua_pushcfunction (L, lhos_lua_log_flush);
+  lua_setfield (L, -2, "flush");
+  lua_pushcfunction (L, lhos_lua_log_persist);
+  lua_setfield (L, -2, "persist");
+  lua_pushcfunction (L, lhos_lua_log_sync);
+  lua_setfield (L, -2, "sync");
+  lua_pushcfunction (L, lhos_lua_log_records);
+  lua_setfield (L, -2, "records");
+  lua_pushcfunction (L, lhos_lua_log_compact);
+  lua_setfield (L, -2, "compact");
+  lua_pushcfunction (L, lhos_lua_log_format);
+  lua_setfield (L, -2, "format");
+  lua_setglobal (L, "log");
+}
@@ -0,0 +1,15 @@
+#ifndef LHOS_LUA_LOG_H
+#define LHOS_LUA_LOG_H
+
+#include "lhos_log.h"
+#include "lua.h"
+
+/* Format the stack values from `first` to the top tab-separated, as
+   `print` does, and append them to the log as one record. Strings,
+   numbers, booleans and nil are formatted without calling `tostring`. */
+void lhos_lua_log_args (lua_State *L, int first, lhos_log_level_t level,
+                        const char *tag);
+
+void lhos_lua_log_register (lua_State *L);
+
+#endif // LHOS_LUA_LOG_H
@@ -0,0 +1,308 @@
+/* Lua binding for lhos_modbus.
+ * API (Lua):
+ *   modbus.open(port, baud, tx_pin, rx_pin [, {parity=, rs485=, rts_pin=,
+ *               timeout=200, retries=1, gap=3}]) -> true | nil, err
+ *   modbus.close(port) -> true | nil, err
+ *   modbus.read_holding(port, slave, addr, count, fn) -> id | nil, err
+ *   modbus.read_input(port, slave, addr, count, fn) -> id | nil, err
+ *   modbus.stats(port) -> { requests, transactions, responses, timeouts,
+ *                           crc_errors, exceptions, retries, pending }
+ * Reads return at once; `fn(values, err, id)` runs later from the event
+ * loop with `values` an array of registers (nil on failure) and `err` nil,
+ * "timeout", "crc", "bad_response", "write_failed" (the port did not take
+ * the request), or the exception name
+ * ("illegal_function", "illegal_data_address", "illegal_data_value",
+ * "slave_device_failure", "exception_<n>"). Up to 1000 registers may be
+ * read at once. Closing a port forgets its pending callbacks.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_err.h"
+#include "lauxlib.h"
+#include "lhos_lua.h"
+#include "lhos_modbus.h"
+#include "lua.h"
+
+#define LHOS_LUA_MODBUS_EVENT "modbus"
+
+/* Registry table: port -> { id -> callback } */
+static int s_pending = LUA_NOREF;
+
+static int
+push_error (lua_State *L, esp_err_t rc)
+{
+  lua_pushnil (L);
+  lua_pushstring (L, esp_err_to_name (rc));
+  return 2;
+}
+
+static int
+push_result_error (lua_State *L, const lhos_modbus_result_t *r)
+{
+  static const char *const names[] = {
+    NULL,
+    "illegal_function",
+    "illegal_data_address",
+    "illegal_data_value",
+    "slave_device_failure",
+  };
+  switch (r->err)
+    {
+    case ESP_ERR_TIMEOUT:
+      lua_pushstring (L, "timeout");
+      break;
+    case ESP_ERR_INVALID_CRC:
+      lua_pushstring (L, "crc");
+      break;
+    case ESP_ERR_INVALID_STATE:
+      lua_pushstring (L, "write_failed");
+      break;
+    case ESP_FAIL:
+      if (r->exception > 0 && r->exception < 5)
+        lua_pushstring (L, names[r->exception]);
+      else
+        lua_pushfstring (L, "exception_%d", r->exception);
+      break;
+    default:
+      lua_pushstring (L, "bad_response");
+      break;
+    }
+  return 1;
+}
+
+/* Runs on the Lua task: (port, id, values | nil, err | nil) */
+static int
+push_result (lua_State *L, const void *data, size_t len)
+{
+  const lhos_modbus_result_t *r = data;
+  (void)len;
+  lua_pushinteger (L, r->port);
+  lua_pushinteger (L, r->id);
+  if (r->err == ESP_OK)
+    {
+      lua_createtable (L, r->count, 0);
+      for (uint16_t i = 0; i < r->count; i++)
+        {
+          lua_pushinteger (L, r->values[i]);
+          lua_rawseti (L, -2, i + 1);
+        }
+      lua_pushnil (L);
+    }
+  else
+    {
+      lua_pushnil (L);
+      push_result_error (L, r);
+    }
+  return 4;
+}
+
+static void
+release_result (lua_State *L, void *data)
+{
+  (void)L;
+  free (data);
+}
+
+/* Runs on the master task. */
+static bool
+post_result (lhos_modbus_result_t *res, void *ctx)
+{
+  (void)ctx;
+  return lhos_lua_post_event_ref (
+      LHOS_LUA_MODBUS_EVENT, push_result, release_result, res,
+      sizeof (*res) + res->count * sizeof (uint16_t));
+}
+
+/* Handler of "modbus" events: hand the result to the read's callback. */
+static int
+dispatch_result (lua_State *L)
+{
+  lua_Integer port = luaL_checkinteger (L, 1);
+  lua_Integer id = luaL_checkinteger (L, 2);
+  lua_rawgeti (L, LUA_REGISTRYINDEX, s_pending);
+  if (lua_rawgeti (L, -1, port) != LUA_TTABLE)
+    return 0; /* port closed meanwhile */
+  if (lua_rawgeti (L, -1, id) != LUA_TFUNCTION)
+    return 0;
+  lua_pushnil (L);
+  lua_rawseti (L, -3, id);
+  lua_pushvalue (L, 3);
+  lua_pushvalue (L, 4);
+  lua_pushvalue (L, 2);
+  lua_call (L, 3, 0);
+  return 0;
+}
+
+/* Push pending[port], creating it when asked. */
+static bool
+push_pending (lua_State *L, lua_Integer port, bool create)
+{
+  if (s_pending == LUA_NOREF)
+    {
+      lua_newtable (L);
+      s_pending = luaL_ref (L, LUA_REGISTRYINDEX);
+    }
+  lua_rawgeti (L, LUA_REGISTRYINDEX, s_pending);
+  if (lua_rawgeti (L, -1, port) != LUA_TTABLE && create)
+    {
+      lua_pop (L, 1);
+      lua_newtable (L);
+      lua_pushvalue (L, -1);
+      lua_rawseti (L, -3, port);
+    }
+  lua_remove (L, -2);
+  return lua_istable (L, -1);
+}
+
+static int
+lhos_lua_modbus_open (lua_State *L)
+{
+  int port = (int)luaL_checkinteger (L, 1);
+  lhos_uart_config_t ucfg = LHOS_UART_CONFIG_DEFAULT ();
+  lhos_modbus_config_t mcfg = { 0 };
+  ucfg.baud = (int)luaL_optinteger (L, 2, 9600);
+  ucfg.tx_pin = (int)luaL_optinteger (L, 3, UART_PIN_NO_CHANGE);
+  ucfg.rx_pin = (int)luaL_optinteger (L, 4, UART_PIN_NO_CHANGE);
+  if (lua_istable (L, 5))
+    {
+      lua_getfield (L, 5, "parity");
+      const char *parity = lua_tostring (L, -1);
+      if (parity && strcmp (parity, "even") == 0)
+        ucfg.parity = UART_PARITY_EVEN;
+      else if (parity && strcmp (parity, "odd") == 0)
+        ucfg.parity = UART_PARITY_ODD;
+      lua_getfield (L, 5, "rs485");
+      ucfg.rs485 = lua_toboolean (L, -1);
+      lua_getfield (L, 5, "rts_pin");
+      ucfg.rts_pin = (int)luaL_optinteger (L, -1, UART_PIN_NO_CHANGE);
+      lua_getfield (L, 5, "timeout");
+      mcfg.timeout_ms = (uint32_t)luaL_optinteger (L, -1, 0);
+      lua_getfield (L, 5, "retries");
+      mcfg.retries = (uint8_t)luaL_optinteger (L, -1, 1);
+      lua_getfield (L, 5, "gap");
+      ucfg.gap = (uint8_t)luaL_optinteger (L, -1, 0);
+      lua_pop (L, 6);
+    }
+  else
+    mcfg.retries = 1;
+
+  /* results reach Lua through one handler that finds the read's callback */
+  if (!lhos_lua_has_event_handler (LHOS_LUA_MODBUS_EVENT))
+    {
+      lua_pushcfunction (L, dispatch_result);
+      bool ok = lhos_lua_set_event_handler (L, LHOS_LUA_MODBUS_EVENT,
+                                            lua_gettop (L));
+      lua_pop (L, 1);
+      if (!ok)
+        return luaL_error (L, "too many event handlers");
+    }
+
+  esp_err_t rc = lhos_modbus_open (port, &ucfg, &mcfg, post_result, NULL);
+  if (rc != ESP_OK)
+    return push_error (L, rc);
+  push_pending (L, port, true);
+  lua_pushboolean (L, 1);
+  return 1;
+}
+
+static int
+lhos_lua_modbus_close (lua_State *L)
+{
+  lua_Integer port = luaL_checkinteger (L, 1);
+  esp_err_t rc = lhos_modbus_close ((int)port);
+  if (s_pending != LUA_NOREF)
+    {
+      lua_rawgeti (L, LUA_REGISTRYINDEX, s_pending);
+      lua_pushnil (L);
+      lua_rawseti (L, -2, port);
+      lua_pop (L, 1);
+    }
+  if (rc != ESP_OK)
+    return push_error (L, rc);
+  lua_pushboolean (L, 1);
+  return 1;
+}
+
+static int
+modbus_read (lua_State *L, uint8_t function)
+{
+  lua_Integer port = luaL_checkinteger (L, 1);
+  lua_Integer slave = luaL_checkinteger (L, 2);
+  lua_Integer addr = luaL_checkinteger (L, 3);
+  lua_Integer count = luaL_checkinteger (L, 4);
+  luaL_checktype (L, 5, LUA_TFUNCTION);
+  luaL_argcheck (L, slave >= 1 && slave <= 247, 2, "slave must be 1-247");
+  luaL_argcheck (L, addr >= 0 && addr <= 0xFFFF, 3, "address out of range");
+  luaL_argcheck (L, count >= 1 && count <= LHOS_MODBUS_MAX_REGS, 4,
+                 "count out of range");
+
+  uint32_t id = 0;
+  esp_err_t rc = lhos_modbus_read ((int)port, (uint8_t)slave, function,
+                                   (uint16_t)addr, (uint16_t)count, &id);
+  if (rc != ESP_OK)
+    return push_error (L, rc);
+  if (!push_pending (L, port, false))
+    return push_error (L, ESP_ERR_INVALID_STATE);
+  lua_pushvalue (L, 5);
+  lua_rawseti (L, -2, id);
+  lua_pushinteger (L, id);
+  return 1;
+}
+
+static int
+lhos_lua_modbus_read_holding (lua_State *L)
+{
+  return modbus_read (L, LHOS_MODBUS_FC_READ_HOLDING);
+}
+
+static int
+lhos_lua_modbus_read_input (lua_State *L)
+{
+  return modbus_read (L, LHOS_MODBUS_FC_READ_INPUT);
+}
+
+static int
+lhos_lua_modbus_stats (lua_State *L)
+{
+  lhos_modbus_stats_t st;
+  esp_err_t rc = lhos_modbus_get_stats ((int)luaL_checkinteger (L, 1), &st);
+  if (rc != ESP_OK)
+    return push_error (L, rc);
+  lua_createtable (L, 0, 8);
+  lua_pushinteger (L, st.requests);
+  lua_setfield (L, -2, "requests");
+  lua_pushinteger (L, st.transactions);
+  lua_setfield (L, -2, "transactions");
+  lua_pushinteger (L, st.responses);
+  lua_setfield (L, -2, "responses");
+  lua_pushinteger (L, st.timeouts);
+  lua_setfield (L, -2, "timeouts");
+  lua_pushinteger (L, st.crc_errors);
+  lua_setfield (L, -2, "crc_errors");
+  lua_pushinteger (L, st.exceptions);
+  lua_setfield (L, -2, "exceptions");
+  lua_pushinteger (L, st.retries);
+  lua_setfield (L, -2, "retries");
+  lua_pushinteger (L, st.pending);
+  lua_setfield (L, -2, "pending");
+  return 1;
+}
+
+void
+lhos_lua_modbus_register (lua_State *L)
+{
+  lua_newtable (L);
+  lua_pushcfunction (L, lhos_lua_modbus_open);
+  lua_setfield (L, -2, "open");
+  lua_pushcfunction (L, lhos_lua_modbus_close);
+  lua_setfield (L, -2, "close");
+  lua_pushcfunction (L, lhos_lua_modbus_read_holding);
+  lua_setfield (L, -2, "read_holding");
+  lua_pushcfunction (L, lhos_lua_modbus_read_input);
+  lua_setfield (L, -2, "read_input");
+  lua_pushcfunction (L, lhos_lua_modbus_stats);
+  lua_setfield (L, -2, "stats");
+  lua_setglobal (L, "modbus");
+}
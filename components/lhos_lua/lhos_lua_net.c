@@ -1,6 +1,7 @@
 
 #include "lhos_lua_net.h"
 #include "lauxlib.h"
+#include "lhos_lua.h"
 #include "lhos_net.h"
 #include "lua.h"
 
@@ -4,5 +4,6 @@
 #include "lua.h"
 
 void lhos_lua_net_register (lua_State *L);
+int lhos_lua_net_shutdown_all (lua_State *L);
 
 #endif // LHOS_LUA_NET_H
@@ -31,6 +31,24 @@ lhos_lua_ntp_stop (lua_State *L)
   return lhos_ntp_stop (L);
 }
 
+int
+lhos_lua_ntp_on_sync (lua_State *L)
+{
+  return lhos_ntp_on_sync (L);
+}
+
+int
+lhos_lua_ntp_set_smooth (lua_State *L)
+{
+  return lhos_ntp_set_smooth (L);
+}
+
+int
+lhos_lua_ntp_set_interval (lua_State *L)
+{
+  return lhos_ntp_set_interval (L);
+}
+
 void
 lhos_lua_ntp_register (lua_State *L)
 {
@@ -45,6 +63,12 @@ lhos_lua_ntp_register (lua_State *L)
   lua_setfield (L, -2, "set_server");
   lua_pushcfunction (L, lhos_lua_ntp_stop);
   lua_setfield (L, -2, "stop");
+  lua_pushcfunction (L, lhos_lua_ntp_on_sync);
+  lua_setfield (L, -2, "on_sync");
+  lua_pushcfunction (L, lhos_lua_ntp_set_smooth);
+  lua_setfield (L, -2, "set_smooth");
+  lua_pushcfunction (L, lhos_lua_ntp_set_interval);
+  lua_setfield (L, -2, "set_interval");
   /* Expose as global `ntp` */
   lua_setglobal (L, "ntp");
 }
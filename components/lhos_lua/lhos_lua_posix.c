@@ -1,10 +1,13 @@
 ﻿#include "lhos_lua_posix.h"
 #include "lauxlib.h"
+#include "lhos_lua_buffer.h"
+#include "lhos_stream.h"
+#include "lhos_walk.h"
 #include "lua.h"
 
 #include <errno.h>
 #include <fcntl.h>
-#include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -19,6 +22,36 @@ push_error (lua_State *L, const char *msg)
   return 3;
 }
 
+typedef ssize_t (*read_fn) (void *ctx, void *dst, size_t n);
+
+/* Append up to `n` bytes from `rd` to `lb` in pieces of at most `chunk`,
+   as io.read(n) does: a large `n` only costs memory for the data that
+   actually arrives. Stops at the first short read. Returns the count, or
+   -1 with errno set if nothing was read. */
+static ssize_t
+read_chunks (luaL_Buffer *lb, size_t n, size_t chunk, read_fn rd, void *ctx)
+{
+  size_t got = 0;
+  while (got < n)
+    {
+      size_t want = n - got < chunk ? n - got : chunk;
+      ssize_t r = rd (ctx, luaL_prepbuffsize (lb, want), want);
+      if (r < 0)
+        return got ? (ssize_t)got : -1;
+      luaL_addsize (lb, (size_t)r);
+      got += (size_t)r;
+      if ((size_t)r < want)
+        break;
+    }
+  return (ssize_t)got;
+}
+
+static ssize_t
+fd_read (void *ctx, void *dst, size_t n)
+{
+  return read (*(int *)ctx, dst, n);
+}
+
 int
 lhos_lua_posix_open (lua_State *L)
 {
@@ -42,27 +75,31 @@ lhos_lua_posix_close (lua_State *L)
   return 1;
 }
 
+/* posix.read(fd, len) -> string  (up to `len` bytes; stops early at a
+                                   short read)
+   posix.read(fd, buf) -> count  (fills `buf` from offset 0) */
 int
 lhos_lua_posix_read (lua_State *L)
 {
   int fd = (int)luaL_checkinteger (L, 1);
-  size_t len = (size_t)luaL_checkinteger (L, 2);
-  if (len == 0)
+  lhos_buffer_t *b = lhos_lua_buffer_test (L, 2);
+  if (b)
     {
-      lua_pushliteral (L, "");
+      ssize_t r = read (fd, b->data, b->cap);
+      if (r < 0)
+        return push_error (L, NULL);
+      b->len = (size_t)r;
+      lua_pushinteger (L, (lua_Integer)r);
       return 1;
     }
-  void *buf = malloc (len);
-  if (!buf)
-    return luaL_error (L, "out of memory");
-  ssize_t r = read (fd, buf, len);
-  if (r < 0)
-    {
-      free (buf);
-      return push_error (L, NULL);
-    }
-  lua_pushlstring (L, (const char *)buf, (size_t)r);
-  free (buf);
+  lua_Integer len = luaL_checkinteger (L, 2);
+  luaL_argcheck (L, len >= 0, 2, "negative length");
+  /* read straight into the string being built */
+  luaL_Buffer lb;
+  luaL_buffinit (L, &lb);
+  if (read_chunks (&lb, (size_t)len, LUAL_BUFFERSIZE, fd_read, &fd) < 0)
+    return push_error (L, NULL);
+  luaL_pushresult (&lb);
   return 1;
 }
 
@@ -71,7 +108,7 @@ lhos_lua_posix_write (lua_State *L)
 {
   int fd = (int)luaL_checkinteger (L, 1);
   size_t len;
-  const char *s = luaL_checklstring (L, 2, &len);
+  const uint8_t *s = lhos_lua_checkbytes (L, 2, &len);
   ssize_t w = write (fd, s, len);
   if (w < 0)
     return push_error (L, NULL);
@@ -128,9 +165,567 @@ lhos_lua_posix_mkdir (lua_State *L)
   return 1;
 }
 
+/* posix.file: buffered stream userdata over a descriptor. Small reads
+   and writes go through an internal buffer (read-ahead or write-behind),
+   so line-oriented parsing makes one VFS call per buffer, not per
+   line. */
+
+#define LHOS_LUA_FILE_MT "lhos.file"
+#define FILE_BUF_DEFAULT 512
+#define FILE_BUF_MAX 16384
+
+typedef struct
+{
+  lhos_stream_t s; /* s.fd < 0 once closed */
+} lua_file_t;
+
+static lua_file_t *
+check_file (lua_State *L)
+{
+  lua_file_t *f = luaL_checkudata (L, 1, LHOS_LUA_FILE_MT);
+  if (f->s.fd < 0)
+    luaL_error (L, "attempt to use a closed file");
+  return f;
+}
+
+static int
+mode_flags (const char *mode)
+{
+  int flags;
+  switch (mode[0])
+    {
+    case 'r':
+      flags = 0;
+      break;
+    case 'w':
+      flags = O_CREAT | O_TRUNC;
+      break;
+    case 'a':
+      flags = O_CREAT | O_APPEND;
+      break;
+    default:
+      return -1;
+    }
+  bool plus = strchr (mode + 1, '+') != NULL;
+  if (plus)
+    return flags | O_RDWR;
+  return flags | (mode[0] == 'r' ? O_RDONLY : O_WRONLY);
+}
+
+/* posix.file(path, mode="r", bufsize=512) -> file
+   `mode` is an fopen() mode ("r", "w", "a", with optional "+") or open()
+   flags. */
+int
+lhos_lua_posix_file (lua_State *L)
+{
+  const char *path = luaL_checkstring (L, 1);
+  int flags;
+  if (lua_type (L, 2) == LUA_TNUMBER)
+    flags = (int)lua_tointeger (L, 2);
+  else
+    {
+      flags = mode_flags (luaL_optstring (L, 2, "r"));
+      luaL_argcheck (L, flags >= 0, 2, "invalid mode");
+    }
+  lua_Integer cap = luaL_optinteger (L, 3, FILE_BUF_DEFAULT);
+  luaL_argcheck (L, cap > 0 && cap <= FILE_BUF_MAX, 3, "out of range");
+  /* storage lives inline after the header, as with buffers */
+  lua_file_t *f = lua_newuserdatauv (L, sizeof (*f) + (size_t)cap, 0);
+  f->s.fd = -1;
+  luaL_setmetatable (L, LHOS_LUA_FILE_MT);
+  int fd = open (path, flags, 0644);
+  if (fd < 0)
+    return push_error (L, NULL);
+  lhos_stream_init (&f->s, fd, (uint8_t *)(f + 1), (size_t)cap);
+  return 1;
+}
+
+static ssize_t
+stream_read (void *ctx, void *dst, size_t n)
+{
+  return lhos_stream_read (ctx, dst, n);
+}
+
+/* file:read(n) -> string, nil at end of file */
+static int
+file_read (lua_State *L)
+{
+  lua_file_t *f = check_file (L);
+  lua_Integer n = luaL_checkinteger (L, 2);
+  luaL_argcheck (L, n >= 0, 2, "negative length");
+  luaL_Buffer lb;
+  luaL_buffinit (L, &lb);
+  /* whole buffers at a time: those bypass the stream's copy */
+  ssize_t r = read_chunks (&lb, (size_t)n, f->s.cap, stream_read, &f->s);
+  if (r < 0)
+    return push_error (L, NULL);
+  if (r == 0 && n > 0)
+    {
+      lua_pushnil (L);
+      return 1;
+    }
+  luaL_pushresult (&lb);
+  return 1;
+}
+
+/* file:read_line(keep=false) -> line, nil at end of file. The newline
+   (and a CR before it) is dropped unless `keep`. */
+static int
+file_read_line (lua_State *L)
+{
+  lua_file_t *f = check_file (L);
+  bool keep = lua_toboolean (L, 2);
+  luaL_Buffer lb;
+  luaL_buffinit (L, &lb);
+  const uint8_t *p;
+  ssize_t avail;
+  bool any = false, nl = false;
+  while (!nl && (avail = lhos_stream_peek (&f->s, &p)) > 0)
+    {
+      const uint8_t *end = memchr (p, '\n', (size_t)avail);
+      size_t take = end ? (size_t)(end - p) + 1 : (size_t)avail;
+      luaL_addlstring (&lb, (const char *)p, take);
+      lhos_stream_consume (&f->s, take);
+      any = true;
+      nl = end != NULL;
+    }
+  if (!nl && avail < 0)
+    return push_error (L, NULL);
+  if (!any)
+    {
+      lua_pushnil (L);
+      return 1;
+    }
+  if (nl && !keep)
+    {
+      size_t n = luaL_bufflen (&lb);
+      luaL_buffsub (&lb, n > 1 && luaL_buffaddr (&lb)[n - 2] == '\r' ? 2 : 1);
+    }
+  luaL_pushresult (&lb);
+  return 1;
+}
+
+static int
+file_lines_iter (lua_State *L)
+{
+  lua_settop (L, 0);
+  lua_pushvalue (L, lua_upvalueindex (1));
+  return file_read_line (L);
+}
+
+/* for line in file:lines() do ... end */
+static int
+file_lines (lua_State *L)
+{
+  check_file (L);
+  lua_settop (L, 1);
+  lua_pushcclosure (L, file_lines_iter, 1);
+  return 1;
+}
+
+/* file:read_into(buf) -> count: fills `buf` from offset 0, like
+   posix.read(fd, buf); 0 at end of file. */
+static int
+file_read_into (lua_State *L)
+{
+  lua_file_t *f = check_file (L);
+  lhos_buffer_t *b = lhos_lua_buffer_check (L, 2);
+  ssize_t r = lhos_stream_read (&f->s, b->data, b->cap);
+  if (r < 0)
+    return push_error (L, NULL);
+  b->len = (size_t)r;
+  lua_pushinteger (L, (lua_Integer)r);
+  return 1;
+}
+
+/* file:write(data) -> count; `data` is a string or a buffer. A short
+   count means an error, reported by the next write. */
+static int
+file_write (lua_State *L)
+{
+  lua_file_t *f = check_file (L);
+  size_t len;
+  const uint8_t *data = lhos_lua_checkbytes (L, 2, &len);
+  ssize_t w = lhos_stream_write (&f->s, data, len);
+  if (w < 0)
+    return push_error (L, NULL);
+  lua_pushinteger (L, (lua_Integer)w);
+  return 1;
+}
+
+typedef struct
+{
+  int fd;
+  off_t off;
+} pread_ctx_t;
+
+static ssize_t
+fd_pread (void *ctx, void *dst, size_t n)
+{
+  pread_ctx_t *pc = ctx;
+  ssize_t r = pread (pc->fd, dst, n, pc->off);
+  if (r > 0)
+    pc->off += r;
+  return r;
+}
+
+/* file:pread(off, n) -> string, file:pread(off, buf) -> count. Does not
+   move the stream position. */
+static int
+file_pread (lua_State *L)
+{
+  lua_file_t *f = check_file (L);
+  lua_Integer off = luaL_checkinteger (L, 2);
+  luaL_argcheck (L, off >= 0, 2, "negative offset");
+  /* pending writes may cover the range */
+  if (lhos_stream_flush (&f->s) != 0)
+    return push_error (L, NULL);
+  lhos_buffer_t *b = lhos_lua_buffer_test (L, 3);
+  if (b)
+    {
+      ssize_t r = pread (f->s.fd, b->data, b->cap, (off_t)off);
+      if (r < 0)
+        return push_error (L, NULL);
+      b->len = (size_t)r;
+      lua_pushinteger (L, (lua_Integer)r);
+      return 1;
+    }
+  lua_Integer n = luaL_checkinteger (L, 3);
+  luaL_argcheck (L, n >= 0, 3, "negative length");
+  luaL_Buffer lb;
+  luaL_buffinit (L, &lb);
+  pread_ctx_t pc = { f->s.fd, (off_t)off };
+  if (read_chunks (&lb, (size_t)n, f->s.cap, fd_pread, &pc) < 0)
+    return push_error (L, NULL);
+  luaL_pushresult (&lb);
+  return 1;
+}
+
+/* file:pwrite(off, data) -> count. Does not move the stream position. */
+static int
+file_pwrite (lua_State *L)
+{
+  lua_file_t *f = check_file (L);
+  lua_Integer off = luaL_checkinteger (L, 2);
+  luaL_argcheck (L, off >= 0, 2, "negative offset");
+  size_t len;
+  const uint8_t *data = lhos_lua_checkbytes (L, 3, &len);
+  /* the read-ahead may hold the old bytes */
+  if (lhos_stream_sync (&f->s) != 0)
+    return push_error (L, NULL);
+  ssize_t w = pwrite (f->s.fd, data, len, (off_t)off);
+  if (w < 0)
+    return push_error (L, NULL);
+  lua_pushinteger (L, (lua_Integer)w);
+  return 1;
+}
+
+/* file:seek(whence="cur", off=0) -> position; whence is "set", "cur" or
+   "end" */
+static int
+file_seek (lua_State *L)
+{
+  static const char *const names[] = { "set", "cur", "end", NULL };
+  static const int whences[] = { SEEK_SET, SEEK_CUR, SEEK_END };
+  lua_file_t *f = check_file (L);
+  int w = luaL_checkoption (L, 2, "cur", names);
+  lua_Integer off = luaL_optinteger (L, 3, 0);
+  off_t at = (w == 1 && off == 0)
+                 ? lhos_stream_tell (&f->s)
+                 : lhos_stream_seek (&f->s, (off_t)off, whences[w]);
+  if (at < 0)
+    return push_error (L, NULL);
+  lua_pushinteger (L, (lua_Integer)at);
+  return 1;
+}
+
+static int
+file_flush (lua_State *L)
+{
+  lua_file_t *f = check_file (L);
+  if (lhos_stream_flush (&f->s) != 0)
+    return push_error (L, NULL);
+  lua_pushboolean (L, 1);
+  return 1;
+}
+
+static int
+file_close (lua_State *L)
+{
+  lua_file_t *f = check_file (L);
+  if (lhos_stream_close (&f->s) != 0)
+    {
+      f->s.fd = -1;
+      return push_error (L, NULL);
+    }
+  lua_pushboolean (L, 1);
+  return 1;
+}
+
+/* __gc and __close: flush what is pending and close, errors dropped */
+static int
+file_gc (lua_State *L)
+{
+  lua_file_t *f = luaL_checkudata (L, 1, LHOS_LUA_FILE_MT);
+  if (f->s.fd >= 0)
+    {
+      lhos_stream_close (&f->s);
+      f->s.fd = -1;
+    }
+  return 0;
+}
+
+static int
+file_tostring (lua_State *L)
+{
+  lua_file_t *f = luaL_checkudata (L, 1, LHOS_LUA_FILE_MT);
+  if (f->s.fd < 0)
+    lua_pushliteral (L, "file (closed)");
+  else
+    lua_pushfstring (L, "file (fd %d): %p", f->s.fd, (void *)f);
+  return 1;
+}
+
+static const luaL_Reg file_methods[] = {
+  { "read", file_read },
+  { "read_line", file_read_line },
+  { "lines", file_lines },
+  { "read_into", file_read_into },
+  { "write", file_write },
+  { "pread", file_pread },
+  { "pwrite", file_pwrite },
+  { "seek", file_seek },
+  { "flush", file_flush },
+  { "close", file_close },
+  { NULL, NULL },
+};
+
+/* Directory listing and walks. Entries come with type and size from one
+   readdir pass (plus a stat per file), so scripts need no stat round
+   trip per name. */
+
+#define LHOS_LUA_DIR_MT "lhos.dir"
+#define DIR_PATH_MAX 256
+#define WALK_DEPTH_DEFAULT 16
+
+static const char *const s_dirent_types[] = {
+  [LHOS_DIRENT_FILE] = "file",
+  [LHOS_DIRENT_DIR] = "dir",
+  [LHOS_DIRENT_OTHER] = "other",
+};
+
+typedef struct
+{
+  DIR *d; /* NULL once exhausted or closed */
+  size_t base;
+  char path[DIR_PATH_MAX];
+} lua_dir_t;
+
+/* Copy `src` into `path` with room for names below it; false if it does
+   not fit. */
+static bool
+set_dir_path (char *path, const char *src, size_t len)
+{
+  if (len + 2 > DIR_PATH_MAX)
+    return false;
+  memcpy (path, src, len + 1);
+  return true;
+}
+
+static int
+dir_gc (lua_State *L)
+{
+  lua_dir_t *dir = luaL_checkudata (L, 1, LHOS_LUA_DIR_MT);
+  if (dir->d)
+    {
+      closedir (dir->d);
+      dir->d = NULL;
+    }
+  return 0;
+}
+
+static int
+dir_iter (lua_State *L)
+{
+  lua_dir_t *dir = luaL_checkudata (L, 1, LHOS_LUA_DIR_MT);
+  if (!dir->d)
+    return 0;
+  lhos_dirent_t e;
+  int rc = lhos_dir_next (dir->d, dir->path, dir->base, DIR_PATH_MAX, &e,
+                          NULL);
+  if (rc <= 0)
+    {
+      int err = errno;
+      closedir (dir->d);
+      dir->d = NULL;
+      if (rc < 0)
+        return luaL_error (L, "readdir: %s", strerror (err));
+      return 0;
+    }
+  lua_pushstring (L, e.name);
+  lua_pushstring (L, s_dirent_types[e.type]);
+  lua_pushinteger (L, (lua_Integer)e.size);
+  return 3;
+}
+
+/* for name, type, size in posix.dir(path) do ... end
+   `type` is "file", "dir" or "other"; `size` is 0 for non-files.
+   Entries that cannot be stat()ed are left out. The
+   handle closes at the end of the loop, on break, or when collected.
+   Like lfs.dir, a directory that cannot be opened raises an error. */
+int
+lhos_lua_posix_dir (lua_State *L)
+{
+  size_t len;
+  const char *path = luaL_checklstring (L, 1, &len);
+  lua_dir_t *dir = lua_newuserdatauv (L, sizeof (*dir), 0);
+  dir->d = NULL;
+  luaL_setmetatable (L, LHOS_LUA_DIR_MT);
+  if (!set_dir_path (dir->path, path, len))
+    return luaL_error (L, "cannot open %s: %s", path,
+                       strerror (ENAMETOOLONG));
+  dir->d = opendir (path);
+  if (!dir->d)
+    return luaL_error (L, "cannot open %s: %s", path, strerror (errno));
+  dir->base = len;
+  if (len && dir->path[len - 1] != '/')
+    dir->path[dir->base++] = '/';
+  lua_pushcfunction (L, dir_iter);
+  lua_insert (L, -2);
+  lua_pushnil (L);
+  lua_pushvalue (L, -2); /* to-be-closed */
+  return 4;
+}
+
+#define WALK_LUA_ERROR (-2)
+
+typedef struct
+{
+  lua_State *L;
+  lua_Integer count;
+} walk_lua_t;
+
+static int
+walk_lua_cb (void *ctx, const char *path, const lhos_dirent_t *e,
+             int depth)
+{
+  walk_lua_t *w = ctx;
+  lua_State *L = w->L;
+  w->count++;
+  lua_pushvalue (L, 2);
+  lua_pushstring (L, path);
+  lua_pushstring (L, s_dirent_types[e->type]);
+  lua_pushinteger (L, (lua_Integer)e->size);
+  lua_pushinteger (L, depth);
+  /* protected, so that the open directories get closed on the way out */
+  if (lua_pcall (L, 4, 1, 0) != LUA_OK)
+    return WALK_LUA_ERROR;
+  bool prune = lua_type (L, -1) == LUA_TBOOLEAN && !lua_toboolean (L, -1);
+  lua_pop (L, 1);
+  return prune ? LHOS_WALK_SKIP : 0;
+}
+
+/* posix.walk(path, fn, max_depth=16) -> entries, missed
+   fn(path, type, size, depth) for everything below `path`, parents
+   first; returning false for a directory skips its contents. fn may
+   unlink the file it is given. `missed` counts the directories not
+   entered because of max_depth or because they could not be opened,
+   and the entries that could not be stat()ed. */
+int
+lhos_lua_posix_walk (lua_State *L)
+{
+  size_t len;
+  const char *root = luaL_checklstring (L, 1, &len);
+  luaL_checktype (L, 2, LUA_TFUNCTION);
+  lua_Integer max_depth = luaL_optinteger (L, 3, WALK_DEPTH_DEFAULT);
+  luaL_argcheck (L, max_depth >= 0 && max_depth <= WALK_DEPTH_DEFAULT, 3,
+                 "out of range");
+  lua_settop (L, 2);
+  char path[DIR_PATH_MAX];
+  if (!set_dir_path (path, root, len))
+    {
+      errno = ENAMETOOLONG;
+      return push_error (L, NULL);
+    }
+  walk_lua_t w = { .L = L };
+  lhos_walk_missed_t missed;
+  int rc = lhos_walk (path, sizeof (path), (int)max_depth, walk_lua_cb,
+                      &w, &missed);
+  if (rc == WALK_LUA_ERROR)
+    return lua_error (L);
+  if (rc < 0)
+    return push_error (L, NULL);
+  lua_pushinteger (L, w.count);
+  lua_pushinteger (L, (lua_Integer)missed.deep + missed.unreadable);
+  return 2;
+}
+
+typedef struct
+{
+  lua_Integer bytes, files, dirs;
+} du_t;
+
+static int
+du_cb (void *ctx, const char *path, const lhos_dirent_t *e, int depth)
+{
+  du_t *du = ctx;
+  if (e->type == LHOS_DIRENT_FILE)
+    {
+      du->files++;
+      du->bytes += (lua_Integer)e->size;
+    }
+  else if (e->type == LHOS_DIRENT_DIR)
+    du->dirs++;
+  return 0;
+}
+
+/* posix.du(path) -> bytes, files, dirs, missed below `path`; the
+   totals leave out the `missed` entries and the contents of the
+   `missed` directories (too deep or unreadable) */
+int
+lhos_lua_posix_du (lua_State *L)
+{
+  size_t len;
+  const char *root = luaL_checklstring (L, 1, &len);
+  char path[DIR_PATH_MAX];
+  if (!set_dir_path (path, root, len))
+    {
+      errno = ENAMETOOLONG;
+      return push_error (L, NULL);
+    }
+  du_t du = { 0 };
+  lhos_walk_missed_t missed;
+  if (lhos_walk (path, sizeof (path), WALK_DEPTH_DEFAULT, du_cb, &du,
+                 &missed)
+      < 0)
+    return push_error (L, NULL);
+  lua_pushinteger (L, du.bytes);
+  lua_pushinteger (L, du.files);
+  lua_pushinteger (L, du.dirs);
+  lua_pushinteger (L, (lua_Integer)missed.deep + missed.unreadable);
+  return 4;
+}
+
 void
 lhos_lua_posix_register (lua_State *L)
 {
+  luaL_newmetatable (L, LHOS_LUA_DIR_MT);
+  lua_pushcfunction (L, dir_gc);
+  lua_setfield (L, -2, "__gc");
+  lua_pushcfunction (L, dir_gc);
+  lua_setfield (L, -2, "__close");
+  lua_pop (L, 1);
+  luaL_newmetatable (L, LHOS_LUA_FILE_MT);
+  lua_pushcfunction (L, file_gc);
+  lua_setfield (L, -2, "__gc");
+  lua_pushcfunction (L, file_gc);
+  lua_setfield (L, -2, "__close");
+  lua_pushcfunction (L, file_tostring);
+  lua_setfield (L, -2, "__tostring");
+  luaL_newlib (L, file_methods);
+  lua_setfield (L, -2, "__index");
+  lua_pop (L, 1);
+
   lua_newtable (L);
   lua_pushcfunction (L, lhos_lua_posix_open);
   lua_setfield (L, -2, "open");
@@ -148,5 +743,13 @@ lhos_lua_posix_register (lua_State *L)
   lua_setfield (L, -2, "rename");
   lua_pushcfunction (L, lhos_lua_posix_mkdir);
   lua_setfield (L, -2, "mkdir");
+  lua_pushcfunction (L, lhos_lua_posix_file);
+  lua_setfield (L, -2, "file");
+  lua_pushcfunction (L, lhos_lua_posix_dir);
+  lua_setfield (L, -2, "dir");
+  lua_pushcfunction (L, lhos_lua_posix_walk);
+  lua_setfield (L, -2, "walk");
+  lua_pushcfunction (L, lhos_lua_posix_du);
+  lua_setfield (L, -2, "du");
   lua_setglobal (L, "posix");
 }
@@ -11,6 +11,10 @@ int lhos_lua_posix_stat (lua_State *L);
 int lhos_lua_posix_unlink (lua_State *L);
 int lhos_lua_posix_rename (lua_State *L);
 int lhos_lua_posix_mkdir (lua_State *L);
+int lhos_lua_posix_file (lua_State *L);
+int lhos_lua_posix_dir (lua_State *L);
+int lhos_lua_posix_walk (lua_State *L);
+int lhos_lua_posix_du (lua_State *L);
 void lhos_lua_posix_register (lua_State *L);
 
 #endif // LHOS_LUA_POSIX_H
@@ -0,0 +1,309 @@
+/* Lua binding for lhos_tsdb.
+ * API (Lua):
+ *   tsdb.open(name [, {segments=, segment_blocks=, scale=}]) -> series | nil, err
+ *   tsdb.remove(name) -> true | nil, err
+ *   s:append(value [, t_ms])          t_ms defaults to the wall clock
+ *   s:query(t0, t1 [, max=1024]) -> times, values [, next]
+ *     `next` (only when max was reached) is the t0 of the following query;
+ *     max is at most 2048, so longer ranges are read in pages
+ *   s:downsample(t0, t1, bucket_ms) -> { {t=, min=, max=, avg=, n=}, ... }
+ *   s:info() -> { segments, segment_blocks, block_size, scale, blocks,
+ *                 samples, first, last }
+ *   s:sync() -> true | nil, err
+ *   s:close()
+ * Values are stored as integers: with `scale` > 1 a value is multiplied by
+ * it on append and divided on the way out, e.g. scale=100 keeps two
+ * decimals. Empty buckets are left out of downsample results.
+ */
+
+#include "esp_err.h"
+#include "lauxlib.h"
+#include "lhos_tsdb.h"
+#include "lua.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#define LHOS_LUA_TSDB_MT "lhos.tsdb"
+#define LHOS_LUA_TSDB_QUERY_MAX 1024
+/* Largest page: 12 bytes of scratch plus two table slots per sample, some
+   70 KB in all, which still fits the heap left with Wi-Fi and BLE up. */
+#ifndef LHOS_LUA_TSDB_QUERY_LIMIT
+#define LHOS_LUA_TSDB_QUERY_LIMIT 2048
+#endif
+
+typedef struct
+{
+  lhos_tsdb_t *db;
+  uint32_t scale;
+} lhos_lua_tsdb_t;
+
+static int
+push_error (lua_State *L, esp_err_t rc)
+{
+  lua_pushnil (L);
+  lua_pushstring (L, esp_err_to_name (rc));
+  return 2;
+}
+
+static int
+push_result (lua_State *L, esp_err_t rc)
+{
+  if (rc != ESP_OK)
+    return push_error (L, rc);
+  lua_pushboolean (L, 1);
+  return 1;
+}
+
+static lhos_lua_tsdb_t *
+check_series (lua_State *L)
+{
+  lhos_lua_tsdb_t *s = luaL_checkudata (L, 1, LHOS_LUA_TSDB_MT);
+  luaL_argcheck (L, s->db != NULL, 1, "series is closed");
+  return s;
+}
+
+static void
+push_value (lua_State *L, const lhos_lua_tsdb_t *s, int32_t v)
+{
+  if (s->scale > 1)
+    lua_pushnumber (L, (lua_Number)v / s->scale);
+  else
+    lua_pushinteger (L, v);
+}
+
+static int
+lhos_lua_tsdb_open (lua_State *L)
+{
+  const char *name = luaL_checkstring (L, 1);
+  lhos_tsdb_config_t cfg = { 0 };
+  if (lua_istable (L, 2))
+    {
+      lua_getfield (L, 2, "segments");
+      cfg.segments = (uint32_t)luaL_optinteger (L, -1, 0);
+      lua_getfield (L, 2, "segment_blocks");
+      cfg.segment_blocks = (uint32_t)luaL_optinteger (L, -1, 0);
+      lua_getfield (L, 2, "scale");
+      cfg.scale = (uint32_t)luaL_optinteger (L, -1, 0);
+      lua_pop (L, 3);
+    }
+  lhos_lua_tsdb_t *s = lua_newuserdatauv (L, sizeof (*s), 0);
+  s->db = NULL;
+  luaL_setmetatable (L, LHOS_LUA_TSDB_MT);
+  esp_err_t rc = lhos_tsdb_open (name, &cfg, &s->db);
+  if (rc != ESP_OK)
+    return push_error (L, rc);
+  s->scale = lhos_tsdb_scale (s->db);
+  return 1;
+}
+
+static int
+lhos_lua_tsdb_remove (lua_State *L)
+{
+  return push_result (L, lhos_tsdb_remove (luaL_checkstring (L, 1)));
+}
+
+static int
+lhos_lua_tsdb_append (lua_State *L)
+{
+  lhos_lua_tsdb_t *s = check_series (L);
+  int32_t v;
+  if (s->scale > 1 || !lua_isinteger (L, 2))
+    {
+      lua_Number n = luaL_checknumber (L, 2) * (s->scale ? s->scale : 1);
+      luaL_argcheck (L, n >= INT32_MIN && n <= INT32_MAX, 2,
+                     "value out of range");
+      v = (int32_t)lround (n);
+    }
+  else
+    {
+      lua_Integer n = lua_tointeger (L, 2);
+      luaL_argcheck (L, n >= INT32_MIN && n <= INT32_MAX, 2,
+                     "value out of range");
+      v = (int32_t)n;
+    }
+  int64_t t;
+  if (lua_isnoneornil (L, 3))
+    {
+      struct timeval tv;
+      gettimeofday (&tv, NULL);
+      t = (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    }
+  else
+    t = (int64_t)luaL_checkinteger (L, 3);
+  return push_result (L, lhos_tsdb_append (s->db, t, v));
+}
+
+static int
+lhos_lua_tsdb_query (lua_State *L)
+{
+  lhos_lua_tsdb_t *s = check_series (L);
+  int64_t t0 = (int64_t)luaL_checkinteger (L, 2);
+  int64_t t1 = (int64_t)luaL_checkinteger (L, 3);
+  lua_Integer max = luaL_optinteger (L, 4, LHOS_LUA_TSDB_QUERY_MAX);
+  luaL_argcheck (L, max > 0 && max <= LHOS_LUA_TSDB_QUERY_LIMIT, 4,
+                 "max out of range");
+
+  /* scratch on the Lua heap: collected even if building the tables below
+     raises an error */
+  int64_t *times = lua_newuserdatauv (
+      L, (size_t)max * (sizeof (int64_t) + sizeof (int32_t)), 0);
+  int32_t *values = (int32_t *)(times + max);
+  size_t n = 0;
+  esp_err_t rc = lhos_tsdb_read (s->db, t0, t1, times, values, (size_t)max,
+                                 &n);
+  if (rc != ESP_OK)
+    return push_error (L, rc);
+
+  /* Samples may share a time, so a full result can end in the middle of
+     a run of them. Hold the whole run back for the next query, which
+     then starts at its time; a run filling all of `max` cannot be split
+     and the next query starts after it. */
+  bool more = (n == (size_t)max);
+  int64_t next = 0;
+  if (more)
+    {
+      size_t k = n - 1;
+      while (k > 0 && times[k - 1] == times[n - 1])
+        k--;
+      if (k > 0)
+        {
+          next = times[k];
+          n = k;
+        }
+      else
+        next = times[n - 1] + (times[n - 1] < INT64_MAX);
+    }
+
+  lua_createtable (L, (int)n, 0);
+  lua_createtable (L, (int)n, 0);
+  for (size_t i = 0; i < n; i++)
+    {
+      lua_pushinteger (L, (lua_Integer)times[i]);
+      lua_rawseti (L, -3, (lua_Integer)i + 1);
+      push_value (L, s, values[i]);
+      lua_rawseti (L, -2, (lua_Integer)i + 1);
+    }
+  if (!more)
+    return 2;
+  lua_pushinteger (L, (lua_Integer)next);
+  return 3;
+}
+
+static int
+lhos_lua_tsdb_downsample (lua_State *L)
+{
+  lhos_lua_tsdb_t *s = check_series (L);
+  int64_t t0 = (int64_t)luaL_checkinteger (L, 2);
+  int64_t t1 = (int64_t)luaL_checkinteger (L, 3);
+  int64_t bucket = (int64_t)luaL_checkinteger (L, 4);
+  luaL_argcheck (L, t1 > t0, 3, "empty range");
+  luaL_argcheck (L, bucket > 0, 4, "bucket must be positive");
+  /* t1 - t0 may not fit in an int64_t; the unsigned difference does */
+  uint64_t span = (uint64_t)t1 - (uint64_t)t0;
+  uint64_t nb = span / (uint64_t)bucket + (span % (uint64_t)bucket != 0);
+  luaL_argcheck (L, nb <= LHOS_TSDB_MAX_BUCKETS, 4, "too many buckets");
+
+  lhos_tsdb_bucket_t *b
+      = lua_newuserdatauv (L, (size_t)nb * sizeof (*b), 0);
+  esp_err_t rc = lhos_tsdb_downsample (s->db, t0, t1, bucket, b, (size_t)nb);
+  if (rc != ESP_OK)
+    return push_error (L, rc);
+
+  lua_newtable (L);
+  lua_Integer row = 0;
+  double div = (s->scale > 1) ? s->scale : 1;
+  for (size_t i = 0; i < nb; i++)
+    {
+      if (b[i].count == 0)
+        continue;
+      lua_createtable (L, 0, 5);
+      lua_pushinteger (L, (lua_Integer)b[i].t_ms);
+      lua_setfield (L, -2, "t");
+      push_value (L, s, b[i].min);
+      lua_setfield (L, -2, "min");
+      push_value (L, s, b[i].max);
+      lua_setfield (L, -2, "max");
+      lua_pushnumber (L, (lua_Number)b[i].sum / b[i].count / div);
+      lua_setfield (L, -2, "avg");
+      lua_pushinteger (L, b[i].count);
+      lua_setfield (L, -2, "n");
+      lua_rawseti (L, -2, ++row);
+    }
+  return 1;
+}
+
+static int
+lhos_lua_tsdb_info (lua_State *L)
+{
+  lhos_lua_tsdb_t *s = check_series (L);
+  lhos_tsdb_info_t info;
+  lhos_tsdb_get_info (s->db, &info);
+  lua_createtable (L, 0, 8);
+  lua_pushinteger (L, info.segments);
+  lua_setfield (L, -2, "segments");
+  lua_pushinteger (L, info.segment_blocks);
+  lua_setfield (L, -2, "segment_blocks");
+  lua_pushinteger (L, info.block_size);
+  lua_setfield (L, -2, "block_size");
+  lua_pushinteger (L, info.scale);
+  lua_setfield (L, -2, "scale");
+  lua_pushinteger (L, info.blocks_used);
+  lua_setfield (L, -2, "blocks");
+  lua_pushinteger (L, (lua_Integer)info.samples);
+  lua_setfield (L, -2, "samples");
+  lua_pushinteger (L, (lua_Integer)info.first_ms);
+  lua_setfield (L, -2, "first");
+  lua_pushinteger (L, (lua_Integer)info.last_ms);
+  lua_setfield (L, -2, "last");
+  return 1;
+}
+
+static int
+lhos_lua_tsdb_sync (lua_State *L)
+{
+  return push_result (L, lhos_tsdb_sync (check_series (L)->db));
+}
+
+static int
+lhos_lua_tsdb_close (lua_State *L)
+{
+  lhos_lua_tsdb_t *s = luaL_checkudata (L, 1, LHOS_LUA_TSDB_MT);
+  lhos_tsdb_close (s->db);
+  s->db = NULL;
+  return 0;
+}
+
+void
+lhos_lua_tsdb_register (lua_State *L)
+{
+  if (luaL_newmetatable (L, LHOS_LUA_TSDB_MT))
+    {
+      lua_newtable (L);
+      lua_pushcfunction (L, lhos_lua_tsdb_append);
+      lua_setfield (L, -2, "append");
+      lua_pushcfunction (L, lhos_lua_tsdb_query);
+      lua_setfield (L, -2, "query");
+      lua_pushcfunction (L, lhos_lua_tsdb_downsample);
+      lua_setfield (L, -2, "downsample");
+      lua_pushcfunction (L, lhos_lua_tsdb_info);
+      lua_setfield (L, -2, "info");
+      lua_pushcfunction (L, lhos_lua_tsdb_sync);
+      lua_setfield (L, -2, "sync");
+      lua_pushcfunction (L, lhos_lua_tsdb_close);
+      lua_setfield (L, -2, "close");
+      lua_setfield (L, -2, "__index");
+      lua_pushcfunction (L, lhos_lua_tsdb_close);
+      lua_setfield (L, -2, "__gc");
+    }
+  lua_pop (L, 1);
+
+  lua_newtable (L);
+  lua_pushcfunction (L, lhos_lua_tsdb_open);
+  lua_setfield (L, -2, "open");
+  lua_pushcfunction (L, lhos_lua_tsdb_remove);
+  lua_setfield (L, -2, "remove");
+  lua_setglobal (L, "tsdb");
+}
@@ -27,12 +27,30 @@ lhos_lua_uart_write (lua_State *L)
   return lhos_uart_write (L);
 }
 
+int
+lhos_lua_uart_send (lua_State *L)
+{
+  return lhos_uart_send (L);
+}
+
+int
+lhos_lua_uart_stats (lua_State *L)
+{
+  return lhos_uart_stats (L);
+}
+
 int
 lhos_lua_uart_available (lua_State *L)
 {
   return lhos_uart_available (L);
 }
 
+int
+lhos_lua_uart_on (lua_State *L)
+{
+  return lhos_uart_on (L);
+}
+
 void
 lhos_lua_uart_register (lua_State *L)
 {
@@ -45,8 +63,14 @@ lhos_lua_uart_register (lua_State *L)
   lua_setfield (L, -2, "read");
   lua_pushcfunction (L, lhos_lua_uart_write);
   lua_setfield (L, -2, "write");
+  lua_pushcfunction (L, lhos_lua_uart_send);
+  lua_setfield (L, -2, "send");
+  lua_pushcfunction (L, lhos_lua_uart_stats);
+  lua_setfield (L, -2, "stats");
   lua_pushcfunction (L, lhos_lua_uart_available);
   lua_setfield (L, -2, "available");
+  lua_pushcfunction (L, lhos_lua_uart_on);
+  lua_setfield (L, -2, "on");
   /* set as global `uart` */
   lua_setglobal (L, "uart");
 }
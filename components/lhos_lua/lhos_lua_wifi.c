@@ -1,7 +1,71 @@
 ﻿#include "lhos_lua_wifi.h"
 #include "lauxlib.h"
+#include "lhos_lua.h"
 #include "lhos_wifi.h"
 #include "lua.h"
+#include <stdio.h>
+
+#define WIFI_EVENT_NAME "wifi"
+
+static const char *const s_state_names[] = {
+  [LHOS_WIFI_IDLE] = "idle",
+  [LHOS_WIFI_CONNECTING] = "connecting",
+  [LHOS_WIFI_WAITING] = "waiting",
+  [LHOS_WIFI_LINKED] = "linked",
+  [LHOS_WIFI_CONNECTED] = "connected",
+};
+
+static const char *const s_event_names[] = {
+  [LHOS_WIFI_EV_CONNECTED] = "connected",
+  [LHOS_WIFI_EV_GOT_IP] = "got_ip",
+  [LHOS_WIFI_EV_LOST_IP] = "lost_ip",
+  [LHOS_WIFI_EV_DISCONNECTED] = "disconnected",
+};
+
+/* in lhos_wifi_profile_t order */
+static const char *const s_profile_names[] = {
+  "default", "throughput", "latency", "powersave", NULL,
+};
+
+static const char *const s_ps_names[] = { "none", "min_modem", "max_modem" };
+
+/* handler(name, info) */
+static int
+push_wifi_event (lua_State *L, const void *data, size_t len)
+{
+  const lhos_wifi_event_t *ev = data;
+  char bssid[18];
+  snprintf (bssid, sizeof (bssid), "%02X:%02X:%02X:%02X:%02X:%02X",
+            ev->bssid[0], ev->bssid[1], ev->bssid[2], ev->bssid[3],
+            ev->bssid[4], ev->bssid[5]);
+  lua_pushstring (L, s_event_names[ev->id]);
+  lua_createtable (L, 0, 7);
+  lua_pushstring (L, bssid);
+  lua_setfield (L, -2, "bssid");
+  lua_pushinteger (L, ev->channel);
+  lua_setfield (L, -2, "channel");
+  lua_pushinteger (L, ev->rssi);
+  lua_setfield (L, -2, "rssi");
+  lua_pushinteger (L, ev->reason);
+  lua_setfield (L, -2, "reason");
+  lua_pushboolean (L, ev->fast);
+  lua_setfield (L, -2, "fast");
+  if (ev->id == LHOS_WIFI_EV_GOT_IP)
+    {
+      lua_pushinteger (L, ev->elapsed_ms);
+      lua_setfield (L, -2, "ms");
+      lua_pushstring (L, ev->ip);
+      lua_setfield (L, -2, "ip");
+    }
+  return 2;
+}
+
+/* Event loop task: hand the event to the Lua task. */
+static void
+on_wifi_event (const lhos_wifi_event_t *ev, void *arg)
+{
+  lhos_lua_post_event (WIFI_EVENT_NAME, push_wifi_event, ev, sizeof (*ev));
+}
 
 int
 lhos_lua_wifi_init (lua_State *L)
@@ -37,9 +101,95 @@ lhos_lua_wifi_get_status (lua_State *L)
   return 1;
 }
 
+int
+lhos_lua_wifi_state (lua_State *L)
+{
+  lua_pushstring (L, s_state_names[lhos_wifi_state ()]);
+  return 1;
+}
+
+/* wifi.on_event(fn): fn(name, info) for "connected", "got_ip", "lost_ip"
+   and "disconnected"; nil removes it. */
+int
+lhos_lua_wifi_on_event (lua_State *L)
+{
+  if (!lua_isnoneornil (L, 1))
+    luaL_checktype (L, 1, LUA_TFUNCTION);
+  if (!lhos_lua_set_event_handler (L, WIFI_EVENT_NAME, 1))
+    return luaL_error (L, "too many event handlers");
+  return 0;
+}
+
+/* wifi.set_profile(name): "throughput", "latency", "powersave" or
+   "default". */
+int
+lhos_lua_wifi_set_profile (lua_State *L)
+{
+  int profile = luaL_checkoption (L, 1, NULL, s_profile_names);
+  esp_err_t r = lhos_wifi_set_profile ((lhos_wifi_profile_t)profile);
+  if (r != ESP_OK)
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, esp_err_to_name (r));
+      return 2;
+    }
+  lua_pushboolean (L, 1);
+  return 1;
+}
+
+int
+lhos_lua_wifi_stats (lua_State *L)
+{
+  lhos_wifi_stats_t st;
+  lhos_wifi_stats (&st);
+  lua_createtable (L, 0, 13);
+  lua_pushstring (L, s_profile_names[st.profile]);
+  lua_setfield (L, -2, "profile");
+  lua_pushstring (L, st.ps < 3 ? s_ps_names[st.ps] : "?");
+  lua_setfield (L, -2, "ps");
+  lua_pushinteger (L, st.bandwidth_mhz);
+  lua_setfield (L, -2, "bandwidth");
+  lua_pushnumber (L, st.tx_power / 4.0);
+  lua_setfield (L, -2, "tx_power");
+  lua_pushinteger (L, st.listen_interval);
+  lua_setfield (L, -2, "listen_interval");
+  lua_pushinteger (L, st.rssi);
+  lua_setfield (L, -2, "rssi");
+  lua_pushinteger (L, st.channel);
+  lua_setfield (L, -2, "channel");
+  lua_pushstring (L, s_state_names[lhos_wifi_state ()]);
+  lua_setfield (L, -2, "state");
+  lua_pushinteger (L, st.connects);
+  lua_setfield (L, -2, "connects");
+  lua_pushinteger (L, st.drops);
+  lua_setfield (L, -2, "drops");
+  lua_pushinteger (L, st.failures);
+  lua_setfield (L, -2, "failures");
+  lua_pushinteger (L, st.last_reason);
+  lua_setfield (L, -2, "last_reason");
+  lua_pushinteger (L, st.last_connect_ms);
+  lua_setfield (L, -2, "last_connect_ms");
+  return 1;
+}
+
+int
+lhos_lua_wifi_forget (lua_State *L)
+{
+  esp_err_t r = lhos_wifi_forget ();
+  if (r != ESP_OK)
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, esp_err_to_name (r));
+      return 2;
+    }
+  lua_pushboolean (L, 1);
+  return 1;
+}
+
 void
 lhos_lua_wifi_register (lua_State *L)
 {
+  lhos_wifi_set_event_cb (on_wifi_event, NULL);
   lua_newtable (L);
   lua_pushcfunction (L, lhos_lua_wifi_init);
   lua_setfield (L, -2, "init");
@@ -49,5 +199,15 @@ lhos_lua_wifi_register (lua_State *L)
   lua_setfield (L, -2, "disconnect");
   lua_pushcfunction (L, lhos_lua_wifi_get_status);
   lua_setfield (L, -2, "get_status");
-  lua_setfield (L, -2, "wifi");
+  lua_pushcfunction (L, lhos_lua_wifi_state);
+  lua_setfield (L, -2, "state");
+  lua_pushcfunction (L, lhos_lua_wifi_on_event);
+  lua_setfield (L, -2, "on_event");
+  lua_pushcfunction (L, lhos_lua_wifi_forget);
+  lua_setfield (L, -2, "forget");
+  lua_pushcfunction (L, lhos_lua_wifi_set_profile);
+  lua_setfield (L, -2, "set_profile");
+  lua_pushcfunction (L, lhos_lua_wifi_stats);
+  lua_setfield (L, -2, "stats");
+  lua_setglobal (L, "wifi");
 }
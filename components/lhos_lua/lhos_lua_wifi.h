@@ -7,6 +7,11 @@ int lhos_lua_wifi_init (lua_State *L);
 int lhos_lua_wifi_connect (lua_State *L);
 int lhos_lua_wifi_disconnect (lua_State *L);
 int lhos_lua_wifi_get_status (lua_State *L);
+int lhos_lua_wifi_state (lua_State *L);
+int lhos_lua_wifi_on_event (lua_State *L);
+int lhos_lua_wifi_forget (lua_State *L);
+int lhos_lua_wifi_set_profile (lua_State *L);
+int lhos_lua_wifi_stats (lua_State *L);
 void lhos_lua_wifi_register (lua_State *L);
 
 #endif // LHOS_LUA_WIFI_H
@@ -0,0 +1,205 @@
+#include "lhos_stream.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+void
+lhos_stream_init (lhos_stream_t *s, int fd, uint8_t *buf, size_t cap)
+{
+  s->fd = fd;
+  s->buf = buf;
+  s->cap = cap;
+  s->pos = 0;
+  s->len = 0;
+  s->writing = false;
+  s->err = 0;
+}
+
+int
+lhos_stream_flush (lhos_stream_t *s)
+{
+  if (!s->writing)
+    return 0;
+  size_t done = 0;
+  while (done < s->len)
+    {
+      ssize_t w = write (s->fd, s->buf + done, s->len - done);
+      if (w < 0 && errno == EINTR)
+        continue;
+      if (w <= 0)
+        {
+          if (w == 0)
+            errno = EIO;
+          /* keep what did not go out */
+          memmove (s->buf, s->buf + done, s->len - done);
+          s->len -= done;
+          return -1;
+        }
+      done += (size_t)w;
+    }
+  s->len = 0;
+  s->writing = false;
+  return 0;
+}
+
+int
+lhos_stream_sync (lhos_stream_t *s)
+{
+  if (s->writing)
+    return lhos_stream_flush (s);
+  if (s->pos < s->len
+      && lseek (s->fd, -(off_t)(s->len - s->pos), SEEK_CUR) < 0)
+    return -1;
+  s->pos = s->len = 0;
+  return 0;
+}
+
+ssize_t
+lhos_stream_peek (lhos_stream_t *s, const uint8_t **p)
+{
+  if (s->writing && lhos_stream_flush (s) != 0)
+    return -1;
+  if (s->pos == s->len)
+    {
+      ssize_t r;
+      do
+        r = read (s->fd, s->buf, s->cap);
+      while (r < 0 && errno == EINTR);
+      if (r < 0)
+        return -1;
+      s->pos = 0;
+      s->len = (size_t)r;
+    }
+  *p = s->buf + s->pos;
+  return (ssize_t)(s->len - s->pos);
+}
+
+void
+lhos_stream_consume (lhos_stream_t *s, size_t n)
+{
+  s->pos += n;
+}
+
+ssize_t
+lhos_stream_read (lhos_stream_t *s, void *dst, size_t n)
+{
+  uint8_t *out = dst;
+  size_t got = 0;
+  while (got < n)
+    {
+      /* nothing buffered and a whole buffer or more wanted: go direct */
+      if (!s->writing && s->pos == s->len && n - got >= s->cap)
+        {
+          ssize_t r = read (s->fd, out + got, n - got);
+          if (r < 0 && errno == EINTR)
+            continue;
+          if (r < 0)
+            return got ? (ssize_t)got : -1;
+          if (r == 0)
+            break;
+          got += (size_t)r;
+          continue;
+        }
+      const uint8_t *p;
+      ssize_t avail = lhos_stream_peek (s, &p);
+      if (avail < 0)
+        return got ? (ssize_t)got : -1;
+      if (avail == 0)
+        break;
+      size_t take = (size_t)avail < n - got ? (size_t)avail : n - got;
+      memcpy (out + got, p, take);
+      s->pos += take;
+      got += take;
+    }
+  return (ssize_t)got;
+}
+
+/* Bytes already taken stand; the error waits for the next call. */
+static ssize_t
+short_write (lhos_stream_t *s, size_t done)
+{
+  if (done == 0)
+    return -1;
+  s->err = errno;
+  return (ssize_t)done;
+}
+
+ssize_t
+lhos_stream_write (lhos_stream_t *s, const void *src, size_t n)
+{
+  const uint8_t *in = src;
+  if (s->err)
+    {
+      errno = s->err;
+      s->err = 0;
+      return -1;
+    }
+  if (!s->writing)
+    {
+      if (lhos_stream_sync (s) != 0)
+        return -1;
+      s->writing = true;
+    }
+  size_t done = 0;
+  while (done < n)
+    {
+      if (s->len == 0 && n - done >= s->cap)
+        {
+          ssize_t w = write (s->fd, in + done, n - done);
+          if (w < 0 && errno == EINTR)
+            continue;
+          if (w <= 0)
+            {
+              if (w == 0)
+                errno = EIO;
+              return short_write (s, done);
+            }
+          done += (size_t)w;
+          continue;
+        }
+      size_t room = s->cap - s->len;
+      size_t take = room < n - done ? room : n - done;
+      memcpy (s->buf + s->len, in + done, take);
+      s->len += take;
+      done += take;
+      if (s->len == s->cap)
+        {
+          if (lhos_stream_flush (s) != 0)
+            return short_write (s, done);
+          s->writing = true;
+        }
+    }
+  return (ssize_t)n;
+}
+
+off_t
+lhos_stream_seek (lhos_stream_t *s, off_t off, int whence)
+{
+  if (lhos_stream_sync (s) != 0)
+    return -1;
+  return lseek (s->fd, off, whence);
+}
+
+off_t
+lhos_stream_tell (lhos_stream_t *s)
+{
+  off_t at = lseek (s->fd, 0, SEEK_CUR);
+  if (at < 0)
+    return -1;
+  if (s->writing)
+    return at + (off_t)s->len;
+  return at - (off_t)(s->len - s->pos);
+}
+
+int
+lhos_stream_close (lhos_stream_t *s)
+{
+  int rc = lhos_stream_flush (s);
+  int saved = errno;
+  if (close (s->fd) != 0)
+    return -1;
+  s->fd = -1;
+  errno = saved;
+  return rc;
+}
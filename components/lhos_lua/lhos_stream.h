@@ -0,0 +1,56 @@
+#ifndef LHOS_STREAM_H
+#define LHOS_STREAM_H
+
+/* Buffered stream over a file descriptor, behind posix.file.
+ * One caller-provided buffer serves as read-ahead while reading and as
+ * write-behind while writing; switching direction flushes pending writes
+ * or gives unread bytes back to the file position, so the descriptor
+ * always agrees with the logical position once synced. Small reads and
+ * writes then cost a memcpy instead of a VFS call. Pure POSIX; not
+ * thread safe. Functions returning ssize_t or int report failure as -1
+ * with errno set.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct
+{
+  int fd;
+  uint8_t *buf;
+  size_t cap;
+  size_t pos;   /* reading: next unread byte in buf */
+  size_t len;   /* reading: bytes read ahead; writing: bytes pending */
+  bool writing; /* buf holds pending writes */
+  int err;      /* write error held back after a short count */
+} lhos_stream_t;
+
+void lhos_stream_init (lhos_stream_t *s, int fd, uint8_t *buf, size_t cap);
+
+/* Make buffered bytes available and point `*p` at them. Returns how
+   many (0 at end of file). Pair with lhos_stream_consume(). */
+ssize_t lhos_stream_peek (lhos_stream_t *s, const uint8_t **p);
+void lhos_stream_consume (lhos_stream_t *s, size_t n);
+
+/* Up to `n` bytes; short only at end of file. Large reads bypass the
+   buffer. */
+ssize_t lhos_stream_read (lhos_stream_t *s, void *dst, size_t n);
+/* All `n` bytes, unless an error stops it after some were written or
+   buffered: then that short count, and the error (-1, errno) from the
+   next call. -1 if none were taken. */
+ssize_t lhos_stream_write (lhos_stream_t *s, const void *src, size_t n);
+int lhos_stream_flush (lhos_stream_t *s);
+
+/* Flush pending writes and drop the read-ahead, leaving the descriptor
+   at the logical position. Needed before using the descriptor
+   directly (pread, pwrite, lseek). */
+int lhos_stream_sync (lhos_stream_t *s);
+off_t lhos_stream_seek (lhos_stream_t *s, off_t off, int whence);
+off_t lhos_stream_tell (lhos_stream_t *s);
+
+/* Flush and close the descriptor; the stream is unusable after. */
+int lhos_stream_close (lhos_stream_t *s);
+
+#endif /* LHOS_STREAM_H */
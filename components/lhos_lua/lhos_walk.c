@@ -0,0 +1,126 @@
+#include "lhos_walk.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+int
+lhos_dir_next (DIR *d, char *path, size_t base, size_t cap,
+               lhos_dirent_t *e, unsigned *unreadable)
+{
+  struct dirent *de;
+  struct stat st;
+  for (;;)
+    {
+      do
+        {
+          errno = 0;
+          de = readdir (d);
+          if (!de)
+            return errno ? -1 : 0;
+        }
+      while (strcmp (de->d_name, ".") == 0
+             || strcmp (de->d_name, "..") == 0);
+
+      size_t n = strlen (de->d_name);
+      if (base + n >= cap)
+        {
+          errno = ENAMETOOLONG;
+          return -1;
+        }
+      memcpy (path + base, de->d_name, n + 1);
+      e->name = path + base;
+      e->size = 0;
+      if (de->d_type == DT_DIR)
+        {
+          e->type = LHOS_DIRENT_DIR;
+          return 1;
+        }
+      /* sizes are only in stat(); an unknown type is found there too */
+      if (stat (path, &st) == 0)
+        break;
+      if (unreadable)
+        (*unreadable)++;
+    }
+  if (S_ISREG (st.st_mode))
+    {
+      e->type = LHOS_DIRENT_FILE;
+      e->size = st.st_size;
+    }
+  else
+    e->type = S_ISDIR (st.st_mode) ? LHOS_DIRENT_DIR : LHOS_DIRENT_OTHER;
+  return 1;
+}
+
+typedef struct
+{
+  size_t cap;
+  int max_depth;
+  lhos_walk_fn fn;
+  void *ctx;
+  lhos_walk_missed_t missed;
+} walk_t;
+
+static int
+walk_dir (walk_t *w, char *path, size_t len, int depth)
+{
+  DIR *d = opendir (path);
+  if (!d)
+    {
+      /* only the root is fatal; a subdirectory is left out */
+      if (depth == 0)
+        return -1;
+      w->missed.unreadable++;
+      return 0;
+    }
+  if (len && path[len - 1] != '/')
+    {
+      if (len + 1 >= w->cap)
+        {
+          closedir (d);
+          errno = ENAMETOOLONG;
+          return -1;
+        }
+      path[len++] = '/';
+    }
+  lhos_dirent_t e;
+  int rc;
+  while ((rc = lhos_dir_next (d, path, len, w->cap, &e,
+                              &w->missed.unreadable))
+         > 0)
+    {
+      int r = w->fn (w->ctx, path, &e, depth);
+      if (r < 0)
+        {
+          rc = r;
+          break;
+        }
+      if (e.type != LHOS_DIRENT_DIR || r == LHOS_WALK_SKIP)
+        continue;
+      if (depth >= w->max_depth)
+        {
+          w->missed.deep++;
+          continue;
+        }
+      rc = walk_dir (w, path, strlen (path), depth + 1);
+      if (rc < 0)
+        break;
+    }
+  int saved = errno;
+  closedir (d);
+  errno = saved;
+  return rc < 0 ? rc : 0;
+}
+
+int
+lhos_walk (char *path, size_t cap, int max_depth, lhos_walk_fn fn,
+           void *ctx, lhos_walk_missed_t *missed)
+{
+  walk_t w = { .cap = cap, .max_depth = max_depth, .fn = fn, .ctx = ctx };
+  size_t len = strlen (path);
+  int rc = walk_dir (&w, path, len, 0);
+  path[len] = '\0';
+  if (missed)
+    *missed = w.missed;
+  return rc;
+}
@@ -0,0 +1,61 @@
+#ifndef LHOS_WALK_H
+#define LHOS_WALK_H
+
+/* Directory listing and recursive walk behind posix.dir, posix.walk and
+ * posix.du. Each entry comes with its type and, for files, its size, so
+ * callers need no stat() of their own. Paths are built in one
+ * caller-provided buffer. Pure POSIX; functions returning int report
+ * failure as -1 with errno set.
+ */
+
+#include <dirent.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef enum
+{
+  LHOS_DIRENT_FILE = 0,
+  LHOS_DIRENT_DIR,
+  LHOS_DIRENT_OTHER,
+} lhos_dirent_type_t;
+
+typedef struct
+{
+  const char *name; /* inside the path buffer */
+  lhos_dirent_type_t type;
+  off_t size; /* files only, 0 otherwise */
+} lhos_dirent_t;
+
+/* Next entry of `d` other than "." and "..". `path` holds the directory
+   in its first `base` bytes (with the trailing '/'); the entry name is
+   appended there. Entries stat() fails on (gone meanwhile, dangling
+   links) are skipped and counted in `*unreadable` (may be NULL).
+   Returns 1, 0 at the end, or -1. */
+int lhos_dir_next (DIR *d, char *path, size_t base, size_t cap,
+                   lhos_dirent_t *e, unsigned *unreadable);
+
+/* Returned by a walk callback for a directory: do not descend. */
+#define LHOS_WALK_SKIP 1
+
+/* Non-negative to go on; a negative value stops the walk and is
+   returned by lhos_walk(). */
+typedef int (*lhos_walk_fn) (void *ctx, const char *path,
+                             const lhos_dirent_t *e, int depth);
+
+/* What a walk left out. */
+typedef struct
+{
+  unsigned deep;       /* directories below max_depth */
+  unsigned unreadable; /* directories opendir() failed on and entries
+                          stat() failed on; the walk went on */
+} lhos_walk_missed_t;
+
+/* Visit everything below the directory in `path` (NUL-terminated, `cap`
+   bytes of room), parents before children, at most `max_depth` levels
+   down. `path` is restored on return. `missed` (may be NULL) counts what
+   was left out. Returns 0, -1, or what a callback stopped
+   with. */
+int lhos_walk (char *path, size_t cap, int max_depth, lhos_walk_fn fn,
+               void *ctx, lhos_walk_missed_t *missed);
+
+#endif /* LHOS_WALK_H */
@@ -0,0 +1,44 @@
+/*
+ * Mutable byte buffer userdata shared by the LHOS I/O bindings.
+ *
+ * A buffer owns `cap` bytes of storage allocated once on the Lua heap and
+ * tracks how many of them are currently valid (`len`). Bindings read into
+ * a buffer and write from it without creating intermediate Lua strings, so
+ * protocol loops can reuse one buffer across calls.
+ */
+
+#ifndef LHOS_LUA_BUFFER_H
+#define LHOS_LUA_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lua.h"
+
+#define LHOS_LUA_BUFFER_MT "lhos.buffer"
+
+typedef struct
+{
+  uint8_t *data; /* first byte of this buffer (or slice) */
+  size_t len;    /* bytes currently valid, 0..cap */
+  size_t cap;    /* bytes addressable through this buffer */
+} lhos_buffer_t;
+
+/* Register the global `buffer` module and the buffer metatable. */
+void lhos_lua_buffer_register (lua_State *L);
+
+/* Push a new empty buffer with `cap` bytes of storage. */
+lhos_buffer_t *lhos_lua_buffer_new (lua_State *L, size_t cap);
+
+/* Return the buffer at `idx`, or NULL if the value is not a buffer. */
+lhos_buffer_t *lhos_lua_buffer_test (lua_State *L, int idx);
+
+/* Return the buffer at `idx`, raising a Lua argument error otherwise. */
+lhos_buffer_t *lhos_lua_buffer_check (lua_State *L, int idx);
+
+/* Accept either a string or a buffer at `idx` as a write source. Returns a
+        pointer to the bytes and stores their count in `len`. The pointer
+        stays valid while the value remains on the stack. */
+const uint8_t *lhos_lua_checkbytes (lua_State *L, int idx, size_t *len);
+
+#endif /* LHOS_LUA_BUFFER_H */
@@ -0,0 +1,105 @@
+/*
+ * Event queue between C producers and the Lua task.
+ *
+ * Producers (BLE, network, UART, ...) run on their own tasks and only
+ * enqueue; the Lua task drains the queue and calls the Lua handlers. This
+ * lives below lhos_lua so the components that produce events need not
+ * depend on the VM that consumes them.
+ */
+
+#ifndef LHOS_LUA_EVENT_H
+#define LHOS_LUA_EVENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef LHOS_EVENT_QUEUE_LEN
+#define LHOS_EVENT_QUEUE_LEN 8
+#endif
+/* Bytes of event payload carried inside a queue item. */
+#ifndef LHOS_EVENT_MAX
+#define LHOS_EVENT_MAX 256
+#endif
+/* Distinct event names that may have a Lua handler. */
+#ifndef LHOS_EVENT_HANDLERS
+#define LHOS_EVENT_HANDLERS 24
+#endif
+#define LHOS_EVENT_NAME_MAX 16
+
+/* forward declare Lua state to avoid forcing inclusion of lua headers */
+typedef struct lua_State lua_State;
+
+/* Create the queue. Called by lhos_lua_init(); until then every post is
+   dropped. */
+void lhos_lua_event_init (void);
+
+/* Run the Lua handlers of every queued event on `L`, the main thread of
+   the VM. */
+void lhos_lua_event_dispatch (lua_State *L);
+
+/* Block for up to `ticks` until an event is queued, without taking it.
+   Returns true if one is. */
+bool lhos_lua_event_wait (uint32_t ticks);
+
+/* Enqueue a notification (called from C BLE layer). */
+void lhos_lua_enqueue_notification (const uint8_t *data, size_t len);
+
+/* Register a Lua callback for BLE notifications (callable from Lua).
+        Should be used within the Lua VM. Returns 1 on success. */
+int lhos_lua_register_ble_callback (lua_State *L);
+
+/* Enqueue a network event (called from C network layer). */
+void lhos_lua_enqueue_net_event (int conn_id, const uint8_t *data, size_t len);
+
+/* Enqueue a network event taking ownership of `buf` (caller-allocated).
+        The buffer must be allocated with a leading `size_t` containing the
+        data length, followed by the data bytes. The dispatcher will free it
+        after invoking the Lua callback. */
+void lhos_lua_enqueue_net_event_owned (int conn_id, void *buf, size_t len);
+
+/* Register a Lua callback for network receive events. Lua callback
+   receives `(conn_id, data_string)` and should be registered from
+   within the Lua VM. Returns 1 on success. */
+int lhos_lua_register_net_callback (lua_State *L);
+
+/* Return non-zero if a net callback is registered in the Lua VM. */
+int lhos_lua_net_callback_registered (void);
+
+/* Named events. A C producer posts an event under a name ("adc",
+   "uart1", ...) together with a push function; the Lua task later calls
+   the push function to turn the payload into Lua values and invokes the
+   handler registered for that name with them. Events for names without a
+   handler are dropped at the producer. */
+
+/* Push the handler arguments for `data` and return how many were pushed.
+   Runs on the Lua task. */
+typedef int (*lhos_lua_event_push_t) (lua_State *L, const void *data,
+                                      size_t len);
+
+/* Release a payload posted by reference. Runs on the Lua task, after the
+   handler returned or when the event is discarded. */
+typedef void (*lhos_lua_event_release_t) (lua_State *L, void *data);
+
+/* Post an event whose payload (at most LHOS_EVENT_MAX bytes) is copied
+   into the queue. Never blocks; returns false if there is no handler, the
+   payload is too large or the queue is full. Not for ISRs. */
+bool lhos_lua_post_event (const char *name, lhos_lua_event_push_t push,
+                          const void *data, size_t len);
+
+/* Post an event carrying a pointer. On success ownership of `data` passes
+   to the dispatcher, which calls `release` (if not NULL) when done; on
+   failure the caller keeps it. */
+bool lhos_lua_post_event_ref (const char *name, lhos_lua_event_push_t push,
+                              lhos_lua_event_release_t release, void *data,
+                              size_t len);
+
+/* Install the function at stack index `idx` as the handler for `name`;
+   nil removes it. Must run on the Lua task. Returns false when the
+   handler table is full. */
+bool lhos_lua_set_event_handler (lua_State *L, const char *name, int idx);
+
+/* True if a Lua handler is installed for `name`. */
+bool lhos_lua_has_event_handler (const char *name);
+
+#endif /* LHOS_LUA_EVENT_H */
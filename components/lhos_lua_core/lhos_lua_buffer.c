@@ -0,0 +1,355 @@
+/*
+ * Mutable byte buffer userdata (`buffer` module).
+ * API (Lua):
+ *   buffer.new(capacity | string) -> buf
+ *   buf:capacity() -> n            #buf / buf:len() -> valid bytes
+ *   buf:setlen(n) -> buf           buf:clear() -> buf
+ *   buf:fill(byte, off=0, n=cap-off) -> buf
+ *   buf:put(off, data) -> next_off buf:append(data) -> len
+ *   buf:string(off=0, n=len-off) -> string
+ *   buf:slice(off, n=cap-off) -> view sharing storage with buf
+ *   buf:get_<t>(off) -> value      buf:set_<t>(off, value) -> buf
+ *     <t> = u8 i8 u16le u16be i16le i16be u32le u32be i32le i32be
+ *           f32le f32be
+ * Offsets are 0-based byte offsets. `data` may be a string or a buffer.
+ * Reads are bounded by `len`, writes by `cap`; writes past `len` extend it.
+ */
+
+#include "lhos_lua_buffer.h"
+#include "lauxlib.h"
+#include "lua.h"
+
+#include <string.h>
+
+enum
+{
+  BUF_SIGNED = 1,
+  BUF_BIG = 2,
+  BUF_FLOAT = 4,
+};
+
+lhos_buffer_t *
+lhos_lua_buffer_new (lua_State *L, size_t cap)
+{
+  /* storage lives inline after the header; user value 1 is reserved for
+     the parent of a slice */
+  lhos_buffer_t *b = lua_newuserdatauv (L, sizeof (*b) + cap, 1);
+  b->data = (uint8_t *)(b + 1);
+  b->len = 0;
+  b->cap = cap;
+  luaL_setmetatable (L, LHOS_LUA_BUFFER_MT);
+  return b;
+}
+
+lhos_buffer_t *
+lhos_lua_buffer_test (lua_State *L, int idx)
+{
+  return (lhos_buffer_t *)luaL_testudata (L, idx, LHOS_LUA_BUFFER_MT);
+}
+
+lhos_buffer_t *
+lhos_lua_buffer_check (lua_State *L, int idx)
+{
+  return (lhos_buffer_t *)luaL_checkudata (L, idx, LHOS_LUA_BUFFER_MT);
+}
+
+const uint8_t *
+lhos_lua_checkbytes (lua_State *L, int idx, size_t *len)
+{
+  lhos_buffer_t *b = lhos_lua_buffer_test (L, idx);
+  if (b)
+    {
+      *len = b->len;
+      return b->data;
+    }
+  if (lua_type (L, idx) != LUA_TSTRING && !lua_isnumber (L, idx))
+    luaL_typeerror (L, idx, "string or buffer");
+  return (const uint8_t *)lua_tolstring (L, idx, len);
+}
+
+static size_t
+check_range (lua_State *L, int arg, lua_Integer off, size_t width,
+             size_t limit)
+{
+  luaL_argcheck (L, off >= 0 && (size_t)off <= limit
+                        && width <= limit - (size_t)off,
+                 arg, "offset out of range");
+  return (size_t)off;
+}
+
+static int
+buffer_new (lua_State *L)
+{
+  if (lua_type (L, 1) == LUA_TSTRING)
+    {
+      size_t len;
+      const char *s = lua_tolstring (L, 1, &len);
+      lhos_buffer_t *b = lhos_lua_buffer_new (L, len);
+      memcpy (b->data, s, len);
+      b->len = len;
+      return 1;
+    }
+  lua_Integer cap = luaL_checkinteger (L, 1);
+  luaL_argcheck (L, cap >= 0, 1, "capacity must be non-negative");
+  lhos_buffer_t *b = lhos_lua_buffer_new (L, (size_t)cap);
+  memset (b->data, 0, (size_t)cap);
+  return 1;
+}
+
+static int
+buffer_capacity (lua_State *L)
+{
+  lhos_buffer_t *b = lhos_lua_buffer_check (L, 1);
+  lua_pushinteger (L, (lua_Integer)b->cap);
+  return 1;
+}
+
+static int
+buffer_len (lua_State *L)
+{
+  lhos_buffer_t *b = lhos_lua_buffer_check (L, 1);
+  lua_pushinteger (L, (lua_Integer)b->len);
+  return 1;
+}
+
+static int
+buffer_setlen (lua_State *L)
+{
+  lhos_buffer_t *b = lhos_lua_buffer_check (L, 1);
+  b->len = check_range (L, 2, luaL_checkinteger (L, 2), 0, b->cap);
+  lua_settop (L, 1);
+  return 1;
+}
+
+static int
+buffer_clear (lua_State *L)
+{
+  lhos_buffer_t *b = lhos_lua_buffer_check (L, 1);
+  b->len = 0;
+  lua_settop (L, 1);
+  return 1;
+}
+
+static int
+buffer_fill (lua_State *L)
+{
+  lhos_buffer_t *b = lhos_lua_buffer_check (L, 1);
+  int byte = (int)luaL_checkinteger (L, 2);
+  size_t off = check_range (L, 3, luaL_optinteger (L, 3, 0), 0, b->cap);
+  lua_Integer n = luaL_optinteger (L, 4, (lua_Integer)(b->cap - off));
+  luaL_argcheck (L, n >= 0, 4, "count must be non-negative");
+  check_range (L, 4, (lua_Integer)off, (size_t)n, b->cap);
+  memset (b->data + off, byte & 0xff, (size_t)n);
+  if (off + (size_t)n > b->len)
+    b->len = off + (size_t)n;
+  lua_settop (L, 1);
+  return 1;
+}
+
+static int
+buffer_put (lua_State *L)
+{
+  lhos_buffer_t *b = lhos_lua_buffer_check (L, 1);
+  lua_Integer o = luaL_checkinteger (L, 2);
+  size_t n;
+  const uint8_t *src = lhos_lua_checkbytes (L, 3, &n);
+  size_t off = check_range (L, 2, o, n, b->cap);
+  /* source may be a slice of the same storage */
+  memmove (b->data + off, src, n);
+  if (off + n > b->len)
+    b->len = off + n;
+  lua_pushinteger (L, (lua_Integer)(off + n));
+  return 1;
+}
+
+static int
+buffer_append (lua_State *L)
+{
+  lhos_buffer_t *b = lhos_lua_buffer_check (L, 1);
+  size_t n;
+  const uint8_t *src = lhos_lua_checkbytes (L, 2, &n);
+  if (n > b->cap - b->len)
+    return luaL_error (L, "buffer overflow (%d bytes free, %d needed)",
+                       (int)(b->cap - b->len), (int)n);
+  memmove (b->data + b->len, src, n);
+  b->len += n;
+  lua_pushinteger (L, (lua_Integer)b->len);
+  return 1;
+}
+
+static int
+buffer_string (lua_State *L)
+{
+  lhos_buffer_t *b = lhos_lua_buffer_check (L, 1);
+  size_t off = check_range (L, 2, luaL_optinteger (L, 2, 0), 0, b->len);
+  lua_Integer n = luaL_optinteger (L, 3, (lua_Integer)(b->len - off));
+  luaL_argcheck (L, n >= 0, 3, "count must be non-negative");
+  check_range (L, 3, (lua_Integer)off, (size_t)n, b->len);
+  lua_pushlstring (L, (const char *)b->data + off, (size_t)n);
+  return 1;
+}
+
+static int
+buffer_slice (lua_State *L)
+{
+  lhos_buffer_t *b = lhos_lua_buffer_check (L, 1);
+  size_t off = check_range (L, 2, luaL_checkinteger (L, 2), 0, b->cap);
+  lua_Integer n = luaL_optinteger (L, 3, (lua_Integer)(b->cap - off));
+  luaL_argcheck (L, n >= 0, 3, "count must be non-negative");
+  check_range (L, 3, (lua_Integer)off, (size_t)n, b->cap);
+
+  lhos_buffer_t *view = lua_newuserdatauv (L, sizeof (*view), 1);
+  view->data = b->data + off;
+  view->cap = (size_t)n;
+  view->len = (b->len > off) ? b->len - off : 0;
+  if (view->len > view->cap)
+    view->len = view->cap;
+  luaL_setmetatable (L, LHOS_LUA_BUFFER_MT);
+  /* keep the owner of the storage alive for as long as the view */
+  lua_pushvalue (L, 1);
+  lua_setiuservalue (L, -2, 1);
+  return 1;
+}
+
+static int
+buffer_get (lua_State *L, size_t width, int flags)
+{
+  lhos_buffer_t *b = lhos_lua_buffer_check (L, 1);
+  size_t off = check_range (L, 2, luaL_checkinteger (L, 2), width, b->len);
+  const uint8_t *p = b->data + off;
+  uint32_t v = 0;
+  for (size_t i = 0; i < width; i++)
+    {
+      size_t shift = (flags & BUF_BIG) ? (width - 1 - i) * 8 : i * 8;
+      v |= (uint32_t)p[i] << shift;
+    }
+  if (flags & BUF_FLOAT)
+    {
+      float f;
+      memcpy (&f, &v, sizeof (f));
+      lua_pushnumber (L, (lua_Number)f);
+    }
+  else if ((flags & BUF_SIGNED) && width < 4)
+    {
+      uint32_t sign = 1u << (width * 8 - 1);
+      lua_pushinteger (L, (lua_Integer)(int32_t)((v ^ sign) - sign));
+    }
+  else if (flags & BUF_SIGNED)
+    lua_pushinteger (L, (lua_Integer)(int32_t)v);
+  else
+    lua_pushinteger (L, (lua_Integer)v);
+  return 1;
+}
+
+static int
+buffer_set (lua_State *L, size_t width, int flags)
+{
+  lhos_buffer_t *b = lhos_lua_buffer_check (L, 1);
+  size_t off = check_range (L, 2, luaL_checkinteger (L, 2), width, b->cap);
+  uint32_t v;
+  if (flags & BUF_FLOAT)
+    {
+      float f = (float)luaL_checknumber (L, 3);
+      memcpy (&v, &f, sizeof (v));
+    }
+  else
+    {
+      lua_Integer x = luaL_checkinteger (L, 3);
+      int bits = (int)width * 8;
+      lua_Integer lo = (flags & BUF_SIGNED) ? -((lua_Integer)1 << (bits - 1))
+                                            : 0;
+      lua_Integer hi = (flags & BUF_SIGNED)
+                           ? ((lua_Integer)1 << (bits - 1)) - 1
+                           : ((lua_Integer)1 << bits) - 1;
+      luaL_argcheck (L, x >= lo && x <= hi, 3, "integer overflow");
+      v = (uint32_t)x;
+    }
+  uint8_t *p = b->data + off;
+  for (size_t i = 0; i < width; i++)
+    {
+      size_t shift = (flags & BUF_BIG) ? (width - 1 - i) * 8 : i * 8;
+      p[i] = (uint8_t)(v >> shift);
+    }
+  if (off + width > b->len)
+    b->len = off + width;
+  lua_settop (L, 1);
+  return 1;
+}
+
+#define LHOS_BUFFER_ACCESSORS(name, width, flags)                             \
+  static int buffer_get_##name (lua_State *L)                                 \
+  {                                                                           \
+    return buffer_get (L, width, flags);                                      \
+  }                                                                           \
+  static int buffer_set_##name (lua_State *L)                                 \
+  {                                                                           \
+    return buffer_set (L, width, flags);                                      \
+  }
+
+LHOS_BUFFER_ACCESSORS (u8, 1, 0)
+LHOS_BUFFER_ACCESSORS (i8, 1, BUF_SIGNED)
+LHOS_BUFFER_ACCESSORS (u16le, 2, 0)
+LHOS_BUFFER_ACCESSORS (u16be, 2, BUF_BIG)
+LHOS_BUFFER_ACCESSORS (i16le, 2, BUF_SIGNED)
+LHOS_BUFFER_ACCESSORS (i16be, 2, BUF_SIGNED | BUF_BIG)
+LHOS_BUFFER_ACCESSORS (u32le, 4, 0)
+LHOS_BUFFER_ACCESSORS (u32be, 4, BUF_BIG)
+LHOS_BUFFER_ACCESSORS (i32le, 4, BUF_SIGNED)
+LHOS_BUFFER_ACCESSORS (i32be, 4, BUF_SIGNED | BUF_BIG)
+LHOS_BUFFER_ACCESSORS (f32le, 4, BUF_FLOAT)
+LHOS_BUFFER_ACCESSORS (f32be, 4, BUF_FLOAT | BUF_BIG)
+
+#define LHOS_BUFFER_REG(name)                                                 \
+  { "get_" #name, buffer_get_##name }, { "set_" #name, buffer_set_##name }
+
+static int
+buffer_tostring (lua_State *L)
+{
+  lhos_buffer_t *b = lhos_lua_buffer_check (L, 1);
+  lua_pushfstring (L, "buffer (%d/%d): %p", (int)b->len, (int)b->cap,
+                   (void *)b);
+  return 1;
+}
+
+static const luaL_Reg buffer_methods[] = {
+  { "capacity", buffer_capacity },
+  { "len", buffer_len },
+  { "setlen", buffer_setlen },
+  { "clear", buffer_clear },
+  { "fill", buffer_fill },
+  { "put", buffer_put },
+  { "append", buffer_append },
+  { "string", buffer_string },
+  { "slice", buffer_slice },
+  LHOS_BUFFER_REG (u8),
+  LHOS_BUFFER_REG (i8),
+  LHOS_BUFFER_REG (u16le),
+  LHOS_BUFFER_REG (u16be),
+  LHOS_BUFFER_REG (i16le),
+  LHOS_BUFFER_REG (i16be),
+  LHOS_BUFFER_REG (u32le),
+  LHOS_BUFFER_REG (u32be),
+  LHOS_BUFFER_REG (i32le),
+  LHOS_BUFFER_REG (i32be),
+  LHOS_BUFFER_REG (f32le),
+  LHOS_BUFFER_REG (f32be),
+  { NULL, NULL },
+};
+
+void
+lhos_lua_buffer_register (lua_State *L)
+{
+  luaL_newmetatable (L, LHOS_LUA_BUFFER_MT);
+  lua_pushcfunction (L, buffer_len);
+  lua_setfield (L, -2, "__len");
+  lua_pushcfunction (L, buffer_tostring);
+  lua_setfield (L, -2, "__tostring");
+  luaL_newlib (L, buffer_methods);
+  lua_setfield (L, -2, "__index");
+  lua_pop (L, 1);
+
+  lua_newtable (L);
+  lua_pushcfunction (L, buffer_new);
+  lua_setfield (L, -2, "new");
+  lua_setglobal (L, "buffer");
+}
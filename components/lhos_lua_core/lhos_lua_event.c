@@ -0,0 +1,337 @@
+/*
+ * Event queue between C producers and the Lua task. Producers copy small
+ * payloads into the queue item (or hand over a pointer); the Lua task
+ * drains the queue in lhos_lua_event_dispatch() and runs the handlers.
+ */
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lauxlib.h"
+#include "lua.h"
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "lhos_lua_event.h"
+
+static const char *TAG = "LHOS_LUA";
+static QueueHandle_t lhos_event_queue = NULL;
+static int lhos_ble_notify_ref = LUA_NOREF;
+static int lhos_net_notify_ref = LUA_NOREF;
+
+enum lhos_event_type
+{
+  LHOS_EVENT_TYPE_BLE = 1,
+  LHOS_EVENT_TYPE_NET = 2,
+  LHOS_EVENT_TYPE_NAMED = 3,
+};
+
+struct lhos_event_item
+{
+  uint8_t type;
+  uint8_t conn_id; /* for network events */
+  uint16_t len;
+  bool owned; /* true if `ptr` owns the buffer */
+  void *ptr;  /* when owned==true, pointer to malloc'd buffer (len prefixed) */
+  uint8_t handler;                  /* named events: slot in s_handlers */
+  lhos_lua_event_push_t push;       /* named events */
+  lhos_lua_event_release_t release; /* named events posted by reference */
+  uint8_t data[LHOS_EVENT_MAX];
+};
+
+/* Handlers for named events. Slots are appended by the Lua task and never
+   removed, so producers can look names up without a lock. */
+typedef struct
+{
+  char name[LHOS_EVENT_NAME_MAX];
+  _Atomic int ref;
+} lhos_event_handler_t;
+
+static lhos_event_handler_t s_handlers[LHOS_EVENT_HANDLERS];
+static _Atomic int s_handler_count = 0;
+
+void
+lhos_lua_event_init (void)
+{
+  if (!lhos_event_queue)
+    {
+      lhos_event_queue = xQueueCreate (LHOS_EVENT_QUEUE_LEN,
+                                       sizeof (struct lhos_event_item));
+    }
+}
+
+bool
+lhos_lua_event_wait (uint32_t ticks)
+{
+  struct lhos_event_item it;
+  if (!lhos_event_queue)
+    return false;
+  return xQueuePeek (lhos_event_queue, &it, (TickType_t)ticks) == pdTRUE;
+}
+
+void
+lhos_lua_enqueue_notification (const uint8_t *data, size_t len)
+{
+  if (!lhos_event_queue || !data)
+    return;
+  struct lhos_event_item it;
+  if (len > LHOS_EVENT_MAX)
+    len = LHOS_EVENT_MAX;
+  it.type = LHOS_EVENT_TYPE_BLE;
+  it.conn_id = 0;
+  it.len = (uint16_t)len;
+  memcpy (it.data, data, it.len);
+  xQueueSend (lhos_event_queue, &it, 0);
+}
+
+void
+lhos_lua_enqueue_net_event (int conn_id, const uint8_t *data, size_t len)
+{
+  if (!lhos_event_queue || !data)
+    return;
+  struct lhos_event_item it;
+  if (len > LHOS_EVENT_MAX)
+    len = LHOS_EVENT_MAX;
+  it.type = LHOS_EVENT_TYPE_NET;
+  it.conn_id = (uint8_t)conn_id;
+  it.len = (uint16_t)len;
+  it.owned = false;
+  it.ptr = NULL;
+  memcpy (it.data, data, it.len);
+  xQueueSend (lhos_event_queue, &it, 0);
+}
+
+void
+lhos_lua_enqueue_net_event_owned (int conn_id, void *buf, size_t len)
+{
+  if (!lhos_event_queue || !buf)
+    return;
+  struct lhos_event_item it;
+  if (len > 0 && len > UINT16_MAX)
+    len = UINT16_MAX;
+  it.type = LHOS_EVENT_TYPE_NET;
+  it.conn_id = (uint8_t)conn_id;
+  it.len = (uint16_t)len;
+  it.owned = true;
+  it.ptr = buf;
+  xQueueSend (lhos_event_queue, &it, 0);
+}
+
+int
+lhos_lua_register_ble_callback (lua_State *L)
+{
+  if (!lhos_event_queue)
+    return luaL_error (L, "Lua VM not initialized");
+  if (!lua_isfunction (L, 1))
+    return luaL_error (L, "expected function");
+  /* store reference in registry attached to the VM */
+  lua_pushvalue (L, 1);
+  if (lhos_ble_notify_ref != LUA_NOREF)
+    luaL_unref (L, LUA_REGISTRYINDEX, lhos_ble_notify_ref);
+  lhos_ble_notify_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+  lua_pushboolean (L, 1);
+  return 1;
+}
+
+int
+lhos_lua_register_net_callback (lua_State *L)
+{
+  if (!lhos_event_queue)
+    return luaL_error (L, "Lua VM not initialized");
+  if (!lua_isfunction (L, 1))
+    return luaL_error (L, "expected function");
+  lua_pushvalue (L, 1);
+  if (lhos_net_notify_ref != LUA_NOREF)
+    luaL_unref (L, LUA_REGISTRYINDEX, lhos_net_notify_ref);
+  lhos_net_notify_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+  lua_pushboolean (L, 1);
+  return 1;
+}
+
+int
+lhos_lua_net_callback_registered (void)
+{
+  return (lhos_net_notify_ref != LUA_NOREF) ? 1 : 0;
+}
+
+static int
+find_handler (const char *name)
+{
+  int n = atomic_load_explicit (&s_handler_count, memory_order_acquire);
+  for (int i = 0; i < n; i++)
+    {
+      if (strncmp (s_handlers[i].name, name, LHOS_EVENT_NAME_MAX) == 0)
+        return i;
+    }
+  return -1;
+}
+
+bool
+lhos_lua_has_event_handler (const char *name)
+{
+  int slot = find_handler (name);
+  return slot >= 0 && atomic_load (&s_handlers[slot].ref) != LUA_NOREF;
+}
+
+bool
+lhos_lua_set_event_handler (lua_State *L, const char *name, int idx)
+{
+  int slot = find_handler (name);
+  if (slot < 0)
+    {
+      if (lua_isnoneornil (L, idx))
+        return true;
+      int n = atomic_load (&s_handler_count);
+      if (n >= LHOS_EVENT_HANDLERS)
+        return false;
+      strncpy (s_handlers[n].name, name, LHOS_EVENT_NAME_MAX - 1);
+      s_handlers[n].name[LHOS_EVENT_NAME_MAX - 1] = '\0';
+      atomic_store (&s_handlers[n].ref, LUA_NOREF);
+      atomic_store_explicit (&s_handler_count, n + 1, memory_order_release);
+      slot = n;
+    }
+  int old = atomic_load (&s_handlers[slot].ref);
+  int ref = LUA_NOREF;
+  if (!lua_isnoneornil (L, idx))
+    {
+      lua_pushvalue (L, idx);
+      ref = luaL_ref (L, LUA_REGISTRYINDEX);
+    }
+  atomic_store (&s_handlers[slot].ref, ref);
+  if (old != LUA_NOREF)
+    luaL_unref (L, LUA_REGISTRYINDEX, old);
+  return true;
+}
+
+static bool
+post_named (const char *name, struct lhos_event_item *it)
+{
+  if (!lhos_event_queue || !name)
+    return false;
+  int slot = find_handler (name);
+  if (slot < 0 || atomic_load (&s_handlers[slot].ref) == LUA_NOREF)
+    return false;
+  it->type = LHOS_EVENT_TYPE_NAMED;
+  it->conn_id = 0;
+  it->handler = (uint8_t)slot;
+  return xQueueSend (lhos_event_queue, it, 0) == pdTRUE;
+}
+
+bool
+lhos_lua_post_event (const char *name, lhos_lua_event_push_t push,
+                     const void *data, size_t len)
+{
+  if (!push || len > LHOS_EVENT_MAX)
+    return false;
+  struct lhos_event_item it;
+  it.len = (uint16_t)len;
+  it.owned = false;
+  it.ptr = NULL;
+  it.push = push;
+  it.release = NULL;
+  if (len)
+    memcpy (it.data, data, len);
+  return post_named (name, &it);
+}
+
+bool
+lhos_lua_post_event_ref (const char *name, lhos_lua_event_push_t push,
+                         lhos_lua_event_release_t release, void *data,
+                         size_t len)
+{
+  if (!push)
+    return false;
+  struct lhos_event_item it;
+  it.len = (uint16_t)(len > UINT16_MAX ? UINT16_MAX : len);
+  it.owned = true;
+  it.ptr = data;
+  it.push = push;
+  it.release = release;
+  /* only the header of the item is meaningful; skip copying data[] */
+  return post_named (name, &it);
+}
+
+static void
+dispatch_named (lua_State *L, struct lhos_event_item *it)
+{
+  const void *data = it->owned ? it->ptr : it->data;
+  int ref = atomic_load (&s_handlers[it->handler].ref);
+  if (ref != LUA_NOREF)
+    {
+      lua_rawgeti (L, LUA_REGISTRYINDEX, ref);
+      int top = lua_gettop (L);
+      int nargs = it->push (L, data, it->len);
+      /* a push function may fail softly and leave nothing */
+      if (lua_gettop (L) == top + nargs
+          && lua_pcall (L, nargs, 0, 0) != LUA_OK)
+        {
+          ESP_LOGW (TAG, "Lua %s handler error: %s",
+                    s_handlers[it->handler].name, lua_tostring (L, -1));
+          lua_pop (L, 1);
+        }
+      lua_settop (L, top - 1);
+    }
+  if (it->owned && it->release)
+    it->release (L, it->ptr);
+}
+
+void
+lhos_lua_event_dispatch (lua_State *L)
+{
+  struct lhos_event_item it;
+  if (!lhos_event_queue)
+    return;
+  while (xQueueReceive (lhos_event_queue, &it, 0) == pdTRUE)
+    {
+      if (it.type == LHOS_EVENT_TYPE_NAMED)
+        dispatch_named (L, &it);
+      else if (it.type == LHOS_EVENT_TYPE_BLE)
+        {
+          if (lhos_ble_notify_ref != LUA_NOREF)
+            {
+              lua_rawgeti (L, LUA_REGISTRYINDEX, lhos_ble_notify_ref);
+              lua_pushlstring (L, (const char *)it.data, it.len);
+              if (lua_pcall (L, 1, 0, 0) != LUA_OK)
+                {
+                  ESP_LOGW (TAG, "Lua BLE callback error: %s",
+                            lua_tostring (L, -1));
+                  lua_pop (L, 1);
+                }
+            }
+        }
+      else if (it.type == LHOS_EVENT_TYPE_NET)
+        {
+          if (lhos_net_notify_ref != LUA_NOREF)
+            {
+              lua_rawgeti (L, LUA_REGISTRYINDEX, lhos_net_notify_ref);
+              lua_pushinteger (L, it.conn_id);
+              if (it.owned && it.ptr)
+                {
+                  /* owned buffer format: [size_t len][data bytes] */
+                  size_t buflen = *((size_t *)it.ptr);
+                  char *buf = (char *)it.ptr + sizeof (size_t);
+                  lua_pushlstring (L, buf, buflen);
+                  if (lua_pcall (L, 2, 0, 0) != LUA_OK)
+                    {
+                      ESP_LOGW (TAG, "Lua NET callback error: %s",
+                                lua_tostring (L, -1));
+                      lua_pop (L, 1);
+                    }
+                  free (it.ptr);
+                }
+              else
+                {
+                  lua_pushlstring (L, (const char *)it.data, it.len);
+                  if (lua_pcall (L, 2, 0, 0) != LUA_OK)
+                    {
+                      ESP_LOGW (TAG, "Lua NET callback error: %s",
+                                lua_tostring (L, -1));
+                      lua_pop (L, 1);
+                    }
+                }
+            }
+        }
+    }
+}
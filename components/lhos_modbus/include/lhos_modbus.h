@@ -0,0 +1,84 @@
+/* LHOS Modbus RTU master
+ * One master per lhos_uart port. Reads are queued without blocking and run
+ * in order on the master's task; a read longer than 125 registers is split
+ * into several transactions and reported as one result. Frame boundaries
+ * come from the port's t3.5 gap framing (see lhos_uart_frame.h), so no
+ * byte is handled one at a time. Failed transactions (timeout, bad CRC,
+ * unexpected reply) are retried; exceptions are reported as they are.
+ */
+#ifndef LHOS_MODBUS_H
+#define LHOS_MODBUS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "lhos_modbus_rtu.h"
+#include "lhos_uart.h"
+
+#ifndef LHOS_MODBUS_QUEUE_LEN
+#define LHOS_MODBUS_QUEUE_LEN 32
+#endif
+/* Registers one read may ask for. */
+#define LHOS_MODBUS_MAX_REGS 1000
+
+typedef struct
+{
+  uint32_t timeout_ms; /* response timeout per transaction, 0: 200 */
+  uint8_t retries;     /* extra attempts after a failed transaction */
+} lhos_modbus_config_t;
+
+typedef struct
+{
+  uint32_t id;
+  uint8_t port;
+  uint8_t slave;
+  uint8_t function;
+  uint8_t exception; /* exception code when err == ESP_FAIL */
+  uint16_t addr;
+  uint16_t count;
+  /* ESP_OK, ESP_ERR_TIMEOUT, ESP_ERR_INVALID_CRC, ESP_ERR_INVALID_RESPONSE,
+     ESP_ERR_INVALID_STATE when the request could not be written to the
+     port, or ESP_FAIL for an exception */
+  esp_err_t err;
+  uint16_t values[];
+} lhos_modbus_result_t;
+
+/* Runs on the master task and takes ownership of `res` (release it with
+   free()). Return false if it cannot be taken yet: the master waits and
+   offers it again until the port is closed. */
+typedef bool (*lhos_modbus_result_cb_t) (lhos_modbus_result_t *res,
+                                         void *ctx);
+
+typedef struct
+{
+  uint32_t requests;     /* reads queued */
+  uint32_t transactions; /* request frames sent */
+  uint32_t responses;    /* valid replies, exceptions included */
+  uint32_t timeouts;
+  uint32_t crc_errors;
+  uint32_t exceptions;
+  uint32_t retries;
+  uint32_t pending; /* reads waiting in the queue */
+} lhos_modbus_stats_t;
+
+/* Open `port` (framing in `uart` is replaced by gap framing) and start a
+   master on it. */
+esp_err_t lhos_modbus_open (int port, const lhos_uart_config_t *uart,
+                            const lhos_modbus_config_t *cfg,
+                            lhos_modbus_result_cb_t cb, void *ctx);
+
+/* Stop the master, dropping queued reads, and close the port. On
+   ESP_ERR_TIMEOUT (see lhos_uart_port_close) the master stays stopped but
+   registered, and closing may be retried. */
+esp_err_t lhos_modbus_close (int port);
+
+/* Queue a read of holding or input registers. Never blocks; `*id` tags
+   the result. ESP_ERR_INVALID_SIZE for a bad count, ESP_ERR_NO_MEM when
+   the queue is full. */
+esp_err_t lhos_modbus_read (int port, uint8_t slave, uint8_t function,
+                            uint16_t addr, uint16_t count, uint32_t *id);
+
+esp_err_t lhos_modbus_get_stats (int port, lhos_modbus_stats_t *out);
+
+#endif /* LHOS_MODBUS_H */
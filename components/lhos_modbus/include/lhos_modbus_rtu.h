@@ -0,0 +1,48 @@
+/* Modbus RTU framing: CRC-16 and the read-register PDUs.
+ *
+ * Only whole frames are handled here; finding where a frame ends (the
+ * t3.5 gap) is up to the caller. Registers are big endian on the wire and
+ * the CRC little endian. A response is checked against its request before
+ * any value is written: the CRC first, so a corrupt frame never reads as a
+ * mismatch, then the slave, the function and the exact length.
+ */
+#ifndef LHOS_MODBUS_RTU_H
+#define LHOS_MODBUS_RTU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LHOS_MODBUS_FC_READ_HOLDING 0x03
+#define LHOS_MODBUS_FC_READ_INPUT 0x04
+
+/* Registers a single read request may ask for. */
+#define LHOS_MODBUS_PDU_REGS 125
+/* Longest RTU frame: address, PDU of up to 253 bytes, CRC. */
+#define LHOS_MODBUS_ADU_MAX 256
+#define LHOS_MODBUS_READ_REQ_LEN 8
+
+typedef enum
+{
+  LHOS_MODBUS_RTU_OK = 0,
+  LHOS_MODBUS_RTU_CRC,       /* bad checksum (line noise, collision) */
+  LHOS_MODBUS_RTU_MISMATCH,  /* other slave, function or length */
+  LHOS_MODBUS_RTU_EXCEPTION, /* the slave answered with an exception */
+} lhos_modbus_rtu_status_t;
+
+/* CRC-16/MODBUS (poly 0xA001 reflected, init 0xFFFF), table driven. The
+   result goes on the wire low byte first. */
+uint16_t lhos_modbus_crc16 (const uint8_t *data, size_t len);
+
+/* Write a read holding/input registers request into `out`; returns its
+   length, LHOS_MODBUS_READ_REQ_LEN. */
+size_t lhos_modbus_build_read (uint8_t *out, uint8_t slave, uint8_t function,
+                               uint16_t addr, uint16_t count);
+
+/* Check a response to the request above and decode `count` registers into
+   `values`. On LHOS_MODBUS_RTU_EXCEPTION `*exception` holds the code. */
+lhos_modbus_rtu_status_t
+lhos_modbus_parse_read (const uint8_t *frame, size_t len, uint8_t slave,
+                        uint8_t function, uint16_t count, uint16_t *values,
+                        uint8_t *exception);
+
+#endif /* LHOS_MODBUS_RTU_H */
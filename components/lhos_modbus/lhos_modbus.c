@@ -0,0 +1,302 @@
+#include "lhos_modbus.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "driver/uart.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+static const char *TAG = "lhos_modbus";
+
+#define LHOS_MODBUS_TIMEOUT_MS 200
+#define LHOS_MODBUS_TASK_STACK 3072
+#define LHOS_MODBUS_TASK_PRIO (tskIDLE_PRIORITY + 6)
+
+typedef struct
+{
+  uint32_t id;
+  uint8_t slave;
+  uint8_t function;
+  uint16_t addr;
+  uint16_t count; /* 0 wakes the task up to exit */
+} request_t;
+
+typedef struct
+{
+  uint16_t len;
+  uint8_t data[LHOS_MODBUS_ADU_MAX];
+} frame_t;
+
+typedef struct
+{
+  int port;
+  lhos_modbus_config_t cfg;
+  lhos_modbus_result_cb_t cb;
+  void *ctx;
+  QueueHandle_t requests;
+  QueueHandle_t rx; /* length 1: the latest frame from the bus */
+  TaskHandle_t task;
+  SemaphoreHandle_t done;
+  volatile bool run;
+  lhos_modbus_stats_t stats;
+} lhos_modbus_t;
+
+static lhos_modbus_t *s_masters[UART_NUM_MAX];
+/* Shared by all masters and kept across close, so a result of a closed
+   port still queued for Lua never carries the id of a newer read. */
+static uint32_t s_next_id;
+
+/* Frame sink of the port; runs on its lhos_uart service task. */
+static void
+on_frame (int port, const uint8_t *data, size_t len, void *ctx)
+{
+  lhos_modbus_t *m = ctx;
+  frame_t f;
+  (void)port;
+  if (len > sizeof (f.data))
+    return;
+  f.len = (uint16_t)len;
+  memcpy (f.data, data, len);
+  xQueueOverwrite (m->rx, &f);
+}
+
+/* One request/response exchange, retried on line errors. */
+static esp_err_t
+transact (lhos_modbus_t *m, const request_t *r, uint16_t addr,
+          uint16_t count, uint16_t *values, uint8_t *exception)
+{
+  uint8_t req[LHOS_MODBUS_READ_REQ_LEN];
+  frame_t f;
+  esp_err_t rc = ESP_ERR_TIMEOUT;
+  TickType_t timeout = pdMS_TO_TICKS (m->cfg.timeout_ms);
+
+  lhos_modbus_build_read (req, r->slave, r->function, addr, count);
+  for (int attempt = 0; attempt <= m->cfg.retries && m->run; attempt++)
+    {
+      if (attempt)
+        m->stats.retries++;
+      xQueueReset (m->rx);
+      /* a local failure, not the slave's: no retry helps */
+      if (lhos_uart_port_write (m->port, req, sizeof (req)) != sizeof (req))
+        return ESP_ERR_INVALID_STATE;
+      m->stats.transactions++;
+      /* the response timeout starts once the request is on the wire */
+      uart_wait_tx_done (m->port, timeout);
+      if (xQueueReceive (m->rx, &f, timeout) != pdTRUE)
+        {
+          m->stats.timeouts++;
+          rc = ESP_ERR_TIMEOUT;
+          continue;
+        }
+      switch (lhos_modbus_parse_read (f.data, f.len, r->slave, r->function,
+                                      count, values, exception))
+        {
+        case LHOS_MODBUS_RTU_OK:
+          m->stats.responses++;
+          return ESP_OK;
+        case LHOS_MODBUS_RTU_EXCEPTION:
+          m->stats.responses++;
+          m->stats.exceptions++;
+          return ESP_FAIL;
+        case LHOS_MODBUS_RTU_CRC:
+          m->stats.crc_errors++;
+          rc = ESP_ERR_INVALID_CRC;
+          break;
+        default:
+          rc = ESP_ERR_INVALID_RESPONSE;
+          break;
+        }
+    }
+  return rc;
+}
+
+static void
+run_read (lhos_modbus_t *m, const request_t *r, lhos_modbus_result_t *res)
+{
+  for (uint16_t off = 0; off < r->count; off += LHOS_MODBUS_PDU_REGS)
+    {
+      uint16_t n = r->count - off;
+      if (n > LHOS_MODBUS_PDU_REGS)
+        n = LHOS_MODBUS_PDU_REGS;
+      res->err = transact (m, r, r->addr + off, n, res->values + off,
+                           &res->exception);
+      if (res->err != ESP_OK)
+        return;
+    }
+}
+
+static void
+master_task (void *arg)
+{
+  lhos_modbus_t *m = arg;
+  request_t r;
+
+  while (m->run)
+    {
+      if (xQueueReceive (m->requests, &r, portMAX_DELAY) != pdTRUE
+          || r.count == 0)
+        continue;
+      lhos_modbus_result_t *res
+          = calloc (1, sizeof (*res) + r.count * sizeof (uint16_t));
+      if (!res)
+        {
+          ESP_LOGE (TAG, "no memory for read %u", (unsigned)r.id);
+          continue;
+        }
+      res->id = r.id;
+      res->port = (uint8_t)m->port;
+      res->slave = r.slave;
+      res->function = r.function;
+      res->addr = r.addr;
+      res->count = r.count;
+      run_read (m, &r, res);
+      while (!m->cb (res, m->ctx))
+        {
+          if (!m->run)
+            {
+              free (res);
+              break;
+            }
+          vTaskDelay (pdMS_TO_TICKS (5));
+        }
+    }
+  xSemaphoreGive (m->done);
+  vTaskDelete (NULL);
+}
+
+static void
+master_free (lhos_modbus_t *m)
+{
+  if (m->requests)
+    vQueueDelete (m->requests);
+  if (m->rx)
+    vQueueDelete (m->rx);
+  if (m->done)
+    vSemaphoreDelete (m->done);
+  free (m);
+}
+
+esp_err_t
+lhos_modbus_open (int port, const lhos_uart_config_t *uart,
+                  const lhos_modbus_config_t *cfg, lhos_modbus_result_cb_t cb,
+                  void *ctx)
+{
+  if (port < 0 || port >= UART_NUM_MAX || !uart || !cb)
+    return ESP_ERR_INVALID_ARG;
+  if (s_masters[port])
+    return ESP_ERR_INVALID_STATE;
+
+  lhos_modbus_t *m = calloc (1, sizeof (*m));
+  if (!m)
+    return ESP_ERR_NO_MEM;
+  m->port = port;
+  if (cfg)
+    m->cfg = *cfg;
+  if (!m->cfg.timeout_ms)
+    m->cfg.timeout_ms = LHOS_MODBUS_TIMEOUT_MS;
+  m->cb = cb;
+  m->ctx = ctx;
+  m->requests = xQueueCreate (LHOS_MODBUS_QUEUE_LEN, sizeof (request_t));
+  m->rx = xQueueCreate (1, sizeof (frame_t));
+  m->done = xSemaphoreCreateBinary ();
+  if (!m->requests || !m->rx || !m->done)
+    {
+      master_free (m);
+      return ESP_ERR_NO_MEM;
+    }
+
+  lhos_uart_config_t ucfg = *uart;
+  memset (&ucfg.framing, 0, sizeof (ucfg.framing));
+  ucfg.framing.mode = LHOS_UART_FRAME_GAP;
+  ucfg.max_frame = LHOS_MODBUS_ADU_MAX;
+  esp_err_t rc = lhos_uart_port_open (port, &ucfg);
+  if (rc != ESP_OK)
+    {
+      master_free (m);
+      return rc;
+    }
+  /* only once the port is ours: a failed open must not take over the
+     frames of a port opened elsewhere */
+  lhos_uart_set_frame_sink (port, on_frame, m);
+
+  m->run = true;
+  if (xTaskCreatePinnedToCore (master_task, "lhos_modbus",
+                               LHOS_MODBUS_TASK_STACK, m,
+                               LHOS_MODBUS_TASK_PRIO, &m->task, 0)
+      != pdPASS)
+    {
+      lhos_uart_port_close (port);
+      master_free (m);
+      return ESP_ERR_NO_MEM;
+    }
+  s_masters[port] = m;
+  return ESP_OK;
+}
+
+esp_err_t
+lhos_modbus_close (int port)
+{
+  if (port < 0 || port >= UART_NUM_MAX || !s_masters[port])
+    return ESP_ERR_INVALID_STATE;
+  lhos_modbus_t *m = s_masters[port];
+  if (m->task)
+    {
+      request_t wake = { 0 };
+      m->run = false;
+      xQueueSendToFront (m->requests, &wake, portMAX_DELAY);
+      xSemaphoreTake (m->done, portMAX_DELAY);
+      m->task = NULL;
+    }
+  /* the port's service task may still be feeding on_frame: keep `m` until
+     the port is closed, and let a timed out close be repeated */
+  esp_err_t rc = lhos_uart_port_close (port);
+  if (rc == ESP_ERR_TIMEOUT)
+    return rc;
+  s_masters[port] = NULL;
+  master_free (m);
+  return rc;
+}
+
+esp_err_t
+lhos_modbus_read (int port, uint8_t slave, uint8_t function, uint16_t addr,
+                  uint16_t count, uint32_t *id)
+{
+  if (port < 0 || port >= UART_NUM_MAX || !s_masters[port]
+      || !s_masters[port]->run)
+    return ESP_ERR_INVALID_STATE;
+  if (count == 0 || count > LHOS_MODBUS_MAX_REGS
+      || (uint32_t)addr + count > 0x10000)
+    return ESP_ERR_INVALID_SIZE;
+  if (function != LHOS_MODBUS_FC_READ_HOLDING
+      && function != LHOS_MODBUS_FC_READ_INPUT)
+    return ESP_ERR_NOT_SUPPORTED;
+  lhos_modbus_t *m = s_masters[port];
+  request_t r = {
+    .id = ++s_next_id,
+    .slave = slave,
+    .function = function,
+    .addr = addr,
+    .count = count,
+  };
+  if (xQueueSend (m->requests, &r, 0) != pdTRUE)
+    return ESP_ERR_NO_MEM;
+  m->stats.requests++;
+  if (id)
+    *id = r.id;
+  return ESP_OK;
+}
+
+esp_err_t
+lhos_modbus_get_stats (int port, lhos_modbus_stats_t *out)
+{
+  if (port < 0 || port >= UART_NUM_MAX || !s_masters[port] || !out)
+    return ESP_ERR_INVALID_STATE;
+  lhos_modbus_t *m = s_masters[port];
+  *out = m->stats;
+  out->pending = uxQueueMessagesWaiting (m->requests);
+  return ESP_OK;
+}
@@ -29,13 +29,17 @@ typedef struct lua_State lua_State;
                - `max_retries` (integer): max retry attempts (0 = unlimited)
      - `disconnect(conn_id) -> true | false, err`
      - `send(conn_id, data) -> bytes_queued | false, err`
+           `data` may be a string or a `buffer`
      - `recv(conn_id, max_bytes=1024) -> data | nil, err`  (non-blocking poll)
+     - `recv(conn_id, buf) -> count | nil, err`  fills `buf` from offset 0;
+           bytes that do not fit stay queued for the next call
 
 */
 int lhos_net_connect (lua_State *L);
 int lhos_net_disconnect (lua_State *L);
 int lhos_net_send (lua_State *L);
 int lhos_net_recv (lua_State *L);
+int lhos_net_shutdown_all (lua_State *L);
 
 /* Set per-connection dispatch preference.
      Usage from Lua: `net.set_use_dispatcher(conn_id, true|false)`
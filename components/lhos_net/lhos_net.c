@@ -7,7 +7,12 @@
 
 #include "lhos_net.h"
 #include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
 #include "lauxlib.h"
+#include "lhos_lua_buffer.h"
 #include "lua.h"
 
 #include <errno.h>
@@ -52,6 +57,8 @@ typedef struct
   int id;
   QueueHandle_t txq; /* items: pointer+len pairs */
   QueueHandle_t rxq; /* items: pointer to buffer (malloc'd) */
+  void *rx_pending;  /* rxq item partly read into a buffer, or NULL */
+  size_t rx_off;     /* bytes of rx_pending already returned */
   /* reconnection policy */
   bool reconnect;
   uint32_t backoff_ms;
@@ -94,6 +101,8 @@ alloc_conn (void)
           conns[i].sock = -1;
           conns[i].txq = xQueueCreate (8, sizeof (struct tx_item));
           conns[i].rxq = xQueueCreate (LHOS_NET_RX_QUEUE_LEN, sizeof (void *));
+          conns[i].rx_pending = NULL;
+          conns[i].rx_off = 0;
           conns[i].reconnect = false;
           conns[i].backoff_ms = 1000;
           conns[i].max_retries = 3;
@@ -506,6 +515,8 @@ lhos_net_disconnect (lua_State *L)
       vQueueDelete (c->rxq);
       c->rxq = NULL;
     }
+  free (c->rx_pending);
+  c->rx_pending = NULL;
   c->used = false;
   xSemaphoreGive (conns_lock);
   lua_pushboolean (L, 1);
@@ -545,6 +556,8 @@ lhos_net_shutdown_all (lua_State *L)
           vQueueDelete (conns[i].rxq);
           conns[i].rxq = NULL;
         }
+      free (conns[i].rx_pending);
+      conns[i].rx_pending = NULL;
       conns[i].used = false;
     }
   xSemaphoreGive (conns_lock);
@@ -557,7 +570,7 @@ lhos_net_send (lua_State *L)
 {
   int id = (int)luaL_checkinteger (L, 1);
   size_t len = 0;
-  const char *data = luaL_checklstring (L, 2, &len);
+  const uint8_t *data = lhos_lua_checkbytes (L, 2, &len);
   lhos_conn_t *c = get_conn_by_id (id);
   if (!c)
     {
@@ -596,16 +609,41 @@ lhos_net_recv (lua_State *L)
       lua_pushstring (L, "invalid conn id");
       return 2;
     }
-  void *item = NULL;
-  if (xQueueReceive (c->rxq, &item, 0) != pdTRUE)
+  /* the tail of a message read into a buffer comes before rxq */
+  void *item = c->rx_pending;
+  size_t off = c->rx_off;
+  if (!item)
     {
-      lua_pushnil (L);
-      lua_pushstring (L, "no data");
-      return 2;
+      if (xQueueReceive (c->rxq, &item, 0) != pdTRUE)
+        {
+          lua_pushnil (L);
+          lua_pushstring (L, "no data");
+          return 2;
+        }
+      off = 0;
     }
+  c->rx_pending = NULL;
+  c->rx_off = 0;
   /* item is malloc'd buffer with prefixed size_t length */
-  size_t len = *((size_t *)item);
-  char *buf = (char *)item + sizeof (size_t);
+  size_t len = *((size_t *)item) - off;
+  char *buf = (char *)item + sizeof (size_t) + off;
+  lhos_buffer_t *b = lhos_lua_buffer_test (L, 2);
+  if (b)
+    {
+      size_t n = (len < b->cap) ? len : b->cap;
+      memcpy (b->data, buf, n);
+      b->len = n;
+      if (n < len)
+        {
+          /* keep the unread tail for the next call */
+          c->rx_pending = item;
+          c->rx_off = off + n;
+          item = NULL;
+        }
+      free (item);
+      lua_pushinteger (L, (lua_Integer)n);
+      return 1;
+    }
   lua_pushlstring (L, buf, len);
   free (item);
   return 1;
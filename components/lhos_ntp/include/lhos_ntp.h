@@ -1,5 +1,6 @@
 /* LHOS NTP bindings - C side
- * Exposes `lhos_ntp_sync(lua_State*)` and `lhos_ntp_status(lua_State*)`
+ * Exposes `lhos_ntp_sync(lua_State*)` and `lhos_ntp_status(lua_State*)`;
+ * completed syncs are posted as the "time_synced" event.
  */
 #ifndef LHOS_NTP_H
 #define LHOS_NTP_H
@@ -14,5 +15,8 @@ int lhos_ntp_status (lua_State *L);
 int lhos_ntp_get_time (lua_State *L);
 int lhos_ntp_set_server (lua_State *L);
 int lhos_ntp_stop (lua_State *L);
+int lhos_ntp_on_sync (lua_State *L);
+int lhos_ntp_set_smooth (lua_State *L);
+int lhos_ntp_set_interval (lua_State *L);
 
 #endif /* LHOS_NTP_H */
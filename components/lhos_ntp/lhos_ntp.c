@@ -1,85 +1,133 @@
 /* Lightweight NTP helper for LHOS
  * Provides simple Lua-facing wrappers to start SNTP and query status.
+ * SNTP keeps running between calls and resynchronises on its own; each
+ * completed sync is posted to Lua as a "time_synced" event from the SNTP
+ * notification callback.
  */
 
 #include "lhos_ntp.h"
 #include "esp_log.h"
+#include "esp_sntp.h"
+#include "esp_timer.h"
 #include "lauxlib.h"
 #include "lua.h"
 
-#include "lhos_lua.h"
-#include "lwip/apps/sntp.h"
-#include <stdlib.h>
+#include "lhos_lua_event.h"
 #include <string.h>
+#include <sys/time.h>
 #include <time.h>
 
 static const char *TAG = "lhos_ntp";
 
-struct ntp_notify_args
+#define NTP_EVENT "time_synced"
+#define NTP_DEFAULT_SERVER "pool.ntp.org"
+#define NTP_MIN_INTERVAL_MS 15000 /* lwIP SNTP lower bound */
+
+typedef struct
 {
-  int wait_ms;
-};
+  int64_t time_us;   /* server time */
+  int64_t offset_us; /* server minus local clock before the sync */
+  bool smooth;       /* slewed rather than stepped */
+} ntp_event_t;
+
+/* SNTP keeps the pointer, so the name lives here. */
+static char s_server[64] = NTP_DEFAULT_SERVER;
+static volatile bool s_synced;
+/* The local clock was s_ref_wall_us when esp_timer read s_ref_mono_us;
+   written when SNTP (re)starts and then only by the callback. */
+static int64_t s_ref_wall_us;
+static int64_t s_ref_mono_us;
+
+static int64_t
+wall_us (void)
+{
+  struct timeval tv;
+  gettimeofday (&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
 
+static int
+push_ntp_event (lua_State *L, const void *data, size_t len)
+{
+  const ntp_event_t *e = data;
+  lua_pushinteger (L, (lua_Integer)(e->time_us / 1000000));
+  lua_pushnumber (L, (lua_Number)e->offset_us / 1e6);
+  lua_pushboolean (L, e->smooth);
+  return 3;
+}
+
+/* tcpip task. A stepped clock already reads the server time, so the
+   offset is taken against where it would be without this sync: the
+   previous reference carried forward by the monotonic timer. A slewed
+   clock has not moved yet and is compared directly. */
 static void
-ntp_notify_task (void *pv)
+on_time_sync (struct timeval *tv)
 {
-  struct ntp_notify_args *a = (struct ntp_notify_args *)pv;
-  TickType_t start = xTaskGetTickCount ();
-  while (1)
+  int64_t mono = esp_timer_get_time ();
+  ntp_event_t e = {
+    .time_us = (int64_t)tv->tv_sec * 1000000 + tv->tv_usec,
+    .smooth = sntp_get_sync_mode () == SNTP_SYNC_MODE_SMOOTH,
+  };
+  if (e.smooth)
+    {
+      /* adjtime() refuses offsets too large to slew and SNTP then steps
+         the clock, which leaves no correction pending */
+      struct timeval left = { 0 };
+      adjtime (NULL, &left);
+      e.smooth = left.tv_sec != 0 || left.tv_usec != 0;
+    }
+  if (e.smooth)
     {
-      time_t now = time (NULL);
-      if (now != ((time_t)-1) && now > 1600000000)
-        {
-          char msg[64];
-          snprintf (msg, sizeof (msg), "ntp_synced:%ld", (long)now);
-          lhos_lua_enqueue_notification ((const uint8_t *)msg, strlen (msg));
-          break;
-        }
-      TickType_t nowt = xTaskGetTickCount ();
-      if ((nowt - start) >= pdMS_TO_TICKS (a->wait_ms))
-        break;
-      vTaskDelay (pdMS_TO_TICKS (1000));
+      s_ref_wall_us = wall_us ();
+      e.offset_us = e.time_us - s_ref_wall_us;
     }
-  free (a);
-  vTaskDelete (NULL);
+  else
+    {
+      e.offset_us = e.time_us - (s_ref_wall_us + (mono - s_ref_mono_us));
+      s_ref_wall_us = e.time_us;
+    }
+  s_ref_mono_us = mono;
+  s_synced = true;
+  ESP_LOGI (TAG, "time synced, offset %lld us%s", (long long)e.offset_us,
+            e.smooth ? " (slewing)" : "");
+  lhos_lua_post_event (NTP_EVENT, push_ntp_event, &e, sizeof (e));
 }
 
+/* ntp.sync([server]): start the time service, or make a running one
+   resynchronise now. The result arrives through ntp.on_sync(). */
 int
 lhos_ntp_sync (lua_State *L)
 {
-  const char *server = NULL;
-  bool notify = false;
-  /* parse args: (server_string?, notify_bool?) */
-  if (lua_isstring (L, 1))
-    server = lua_tostring (L, 1);
-  if (lua_isboolean (L, 2))
-    notify = lua_toboolean (L, 2);
-  else if (lua_isboolean (L, 1) && !server)
-    notify = lua_toboolean (L, 1);
-
-  ESP_LOGI (TAG, "Starting SNTP sync (server=%s, notify=%d)",
-            server ? server : "pool.ntp.org", (int)notify);
-
-  /* Stop any previous SNTP instance to avoid duplicates */
-  sntp_stop ();
-  sntp_setoperatingmode (SNTP_OPMODE_POLL);
-  if (server)
-    sntp_setservername (0, server);
-  else
-    sntp_setservername (0, "pool.ntp.org");
-  sntp_init ();
-
-  if (notify)
+  /* a boolean used to request the old polling notification; ignored */
+  const char *server = lua_type (L, 1) == LUA_TSTRING
+                           ? lua_tostring (L, 1)
+                           : NULL;
+  if (server && strlen (server) >= sizeof (s_server))
     {
-      struct ntp_notify_args *args = malloc (sizeof (*args));
-      if (args)
-        {
-          args->wait_ms = 60000; /* 60s timeout */
-          xTaskCreatePinnedToCore (ntp_notify_task, "lhos_ntp_notify", 2048,
-                                   args, tskIDLE_PRIORITY + 1, NULL, 1);
-        }
+      lua_pushnil (L);
+      lua_pushstring (L, "server name too long");
+      return 2;
     }
+  bool running = esp_sntp_enabled ();
+  bool same = !server || strcmp (server, s_server) == 0;
+  ESP_LOGI (TAG, "Starting SNTP sync (server=%s)", server ? server : s_server);
 
+  if (running && same)
+    {
+      sntp_restart ();
+      lua_pushboolean (L, 1);
+      return 1;
+    }
+  if (running)
+    esp_sntp_stop ();
+  if (server)
+    strcpy (s_server, server);
+  s_ref_wall_us = wall_us ();
+  s_ref_mono_us = esp_timer_get_time ();
+  esp_sntp_setoperatingmode (ESP_SNTP_OPMODE_POLL);
+  esp_sntp_setservername (0, s_server);
+  sntp_set_time_sync_notification_cb (on_time_sync);
+  esp_sntp_init ();
   lua_pushboolean (L, 1);
   return 1;
 }
@@ -88,7 +136,7 @@ int
 lhos_ntp_status (lua_State *L)
 {
   time_t now = time (NULL);
-  if (now != ((time_t)-1) && now > 1600000000)
+  if (s_synced || (now != ((time_t)-1) && now > 1600000000))
     lua_pushinteger (L, 1);
   else
     lua_pushinteger (L, 0);
@@ -112,14 +160,26 @@ lhos_ntp_get_time (lua_State *L)
 int
 lhos_ntp_set_server (lua_State *L)
 {
-  const char *server = luaL_checkstring (L, 1);
-  if (!server)
+  size_t len;
+  const char *server = luaL_checklstring (L, 1, &len);
+  if (len >= sizeof (s_server))
     {
       lua_pushboolean (L, 0);
       lua_pushstring (L, "invalid server");
       return 2;
     }
-  sntp_setservername (0, server);
+  bool running = esp_sntp_enabled ();
+  if (running)
+    esp_sntp_stop ();
+  memcpy (s_server, server, len + 1);
+  esp_sntp_setservername (0, s_server);
+  if (running)
+    {
+      /* the callback is quiet while stopped: restart the reference */
+      s_ref_wall_us = wall_us ();
+      s_ref_mono_us = esp_timer_get_time ();
+      esp_sntp_init ();
+    }
   lua_pushboolean (L, 1);
   return 1;
 }
@@ -127,7 +187,45 @@ lhos_ntp_set_server (lua_State *L)
 int
 lhos_ntp_stop (lua_State *L)
 {
-  sntp_stop ();
+  esp_sntp_stop ();
   lua_pushboolean (L, 1);
   return 1;
 }
+
+/* ntp.on_sync(fn): fn(time, offset, smooth) after every sync; `offset`
+   is in seconds and `smooth` is false whenever the clock was stepped,
+   even in smooth mode. nil removes it. */
+int
+lhos_ntp_on_sync (lua_State *L)
+{
+  if (!lua_isnoneornil (L, 1))
+    luaL_checktype (L, 1, LUA_TFUNCTION);
+  if (!lhos_lua_set_event_handler (L, NTP_EVENT, 1))
+    return luaL_error (L, "too many event handlers");
+  return 0;
+}
+
+/* ntp.set_smooth(on): slew the clock with adjtime() instead of stepping
+   it. Offsets too large to slew are still stepped. */
+int
+lhos_ntp_set_smooth (lua_State *L)
+{
+  luaL_checktype (L, 1, LUA_TBOOLEAN);
+  sntp_set_sync_mode (lua_toboolean (L, 1) ? SNTP_SYNC_MODE_SMOOTH
+                                           : SNTP_SYNC_MODE_IMMED);
+  return 0;
+}
+
+/* ntp.set_interval(ms): time between resynchronisations. */
+int
+lhos_ntp_set_interval (lua_State *L)
+{
+  lua_Integer ms = luaL_checkinteger (L, 1);
+  luaL_argcheck (L, ms >= NTP_MIN_INTERVAL_MS && ms <= UINT32_MAX, 1,
+                 "out of range");
+  sntp_set_sync_interval ((uint32_t)ms);
+  /* a running client only picks the interval up when restarted */
+  if (esp_sntp_enabled ())
+    sntp_restart ();
+  return 0;
+}
@@ -0,0 +1,36 @@
+/* Data partition shared by the on-device stores (logs, time series).
+ * The `storage` littlefs partition from partitions.csv is mounted once at
+ * LHOS_STORAGE_BASE_PATH and stays mounted.
+ */
+#ifndef LHOS_STORAGE_H
+#define LHOS_STORAGE_H
+
+#include <stddef.h>
+
+#include "esp_err.h"
+
+#ifndef LHOS_STORAGE_PARTITION
+#define LHOS_STORAGE_PARTITION "storage"
+#endif
+#ifndef LHOS_STORAGE_BASE_PATH
+#define LHOS_STORAGE_BASE_PATH "/storage"
+#endif
+
+/* Mount the storage partition. Idempotent; safe to call from several
+   components. A partition that fails to mount is left as it is and the
+   error returned. */
+esp_err_t lhos_storage_mount (void);
+
+/* Erase the storage partition and mount the empty filesystem. Only on
+   explicit request, since it destroys every store; ESP_ERR_INVALID_STATE
+   while the partition is mounted. */
+esp_err_t lhos_storage_format (void);
+
+/* Erase block size of the mounted filesystem, in bytes. Writes sized and
+   aligned to it avoid read-modify-write cycles in littlefs. */
+size_t lhos_storage_block_size (void);
+
+/* Create `path` and any missing parent directories below the mount. */
+esp_err_t lhos_storage_mkdirs (const char *path);
+
+#endif /* LHOS_STORAGE_H */
@@ -0,0 +1,92 @@
+#include "lhos_storage.h"
+#include "esp_littlefs.h"
+#include "esp_log.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static const char *TAG = "lhos_storage";
+
+esp_err_t
+lhos_storage_mount (void)
+{
+  if (esp_littlefs_mounted (LHOS_STORAGE_PARTITION))
+    return ESP_OK;
+  esp_vfs_littlefs_conf_t conf = {
+    .base_path = LHOS_STORAGE_BASE_PATH,
+    .partition_label = LHOS_STORAGE_PARTITION,
+    /* a failed mount may still hold field logs worth recovering; only
+       lhos_storage_format() erases the partition */
+    .format_if_mount_failed = 0,
+    .read_only = 0,
+    .dont_mount = 0,
+    .grow_on_mount = 1,
+  };
+  esp_err_t rc = esp_vfs_littlefs_register (&conf);
+  if (rc == ESP_ERR_INVALID_STATE)
+    return ESP_OK; /* mounted concurrently */
+  if (rc != ESP_OK)
+    {
+      ESP_LOGE (TAG, "mount %s failed: %s", LHOS_STORAGE_PARTITION,
+                esp_err_to_name (rc));
+      return rc;
+    }
+  size_t total = 0, used = 0;
+  esp_littlefs_info (LHOS_STORAGE_PARTITION, &total, &used);
+  ESP_LOGI (TAG, "%s mounted at %s (%u/%u bytes used)",
+            LHOS_STORAGE_PARTITION, LHOS_STORAGE_BASE_PATH, (unsigned)used,
+            (unsigned)total);
+  return ESP_OK;
+}
+
+esp_err_t
+lhos_storage_format (void)
+{
+  if (esp_littlefs_mounted (LHOS_STORAGE_PARTITION))
+    return ESP_ERR_INVALID_STATE;
+  ESP_LOGW (TAG, "formatting %s", LHOS_STORAGE_PARTITION);
+  esp_err_t rc = esp_littlefs_format (LHOS_STORAGE_PARTITION);
+  if (rc != ESP_OK)
+    {
+      ESP_LOGE (TAG, "format %s failed: %s", LHOS_STORAGE_PARTITION,
+                esp_err_to_name (rc));
+      return rc;
+    }
+  return lhos_storage_mount ();
+}
+
+size_t
+lhos_storage_block_size (void)
+{
+  struct stat st;
+  if (stat (LHOS_STORAGE_BASE_PATH, &st) == 0 && st.st_blksize > 0)
+    return (size_t)st.st_blksize;
+  return 4096;
+}
+
+esp_err_t
+lhos_storage_mkdirs (const char *path)
+{
+  char tmp[128];
+  size_t len = strlen (path);
+  if (len == 0 || len >= sizeof (tmp))
+    return ESP_ERR_INVALID_ARG;
+  memcpy (tmp, path, len + 1);
+  for (char *p = tmp + 1; *p; p++)
+    {
+      if (*p != '/')
+        continue;
+      *p = '\0';
+      if (mkdir (tmp, 0755) != 0 && errno != EEXIST)
+        {
+          /* the mount point itself is not a littlefs directory */
+          if (strcmp (tmp, LHOS_STORAGE_BASE_PATH) != 0)
+            return ESP_FAIL;
+        }
+      *p = '/';
+    }
+  if (mkdir (tmp, 0755) != 0 && errno != EEXIST)
+    return ESP_FAIL;
+  return ESP_OK;
+}
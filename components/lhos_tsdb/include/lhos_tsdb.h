@@ -0,0 +1,123 @@
+/* LHOS time-series store
+ * Fixed-size sample series (int64 ms timestamp, int32 value) kept on the
+ * `storage` littlefs partition for on-device history.
+ *
+ * A series is a ring of segment files, each holding up to
+ * `segment_blocks` fixed-size blocks of one filesystem block each. A block
+ * starts with a summary (first/last time, min, max, sum, count) followed
+ * by a bit stream of zigzag-encoded timestamp delta-of-deltas and value
+ * deltas, so a steady 1 Hz sensor costs about one byte per sample. The
+ * block being filled lives in RAM and is rewritten in place at its fixed
+ * offset when it fills or every LHOS_TSDB_SYNC_MS. When the ring wraps the
+ * oldest segment is truncated and reused, so a series never grows past
+ * `segments * segment_blocks` blocks.
+ *
+ * Segments are separate files because littlefs rewrites everything after
+ * a modified block: each file is only ever appended to or has its tail
+ * block replaced.
+ */
+#ifndef LHOS_TSDB_H
+#define LHOS_TSDB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#ifndef LHOS_TSDB_DIR
+#define LHOS_TSDB_DIR "/storage/tsdb"
+#endif
+/* Series name length, including the terminating NUL. */
+#ifndef LHOS_TSDB_NAME_MAX
+#define LHOS_TSDB_NAME_MAX 16
+#endif
+#ifndef LHOS_TSDB_SEGMENTS
+#define LHOS_TSDB_SEGMENTS 16
+#endif
+#ifndef LHOS_TSDB_SEGMENT_BLOCKS
+#define LHOS_TSDB_SEGMENT_BLOCKS 16
+#endif
+/* Longest time appended samples may stay only in RAM. */
+#ifndef LHOS_TSDB_SYNC_MS
+#define LHOS_TSDB_SYNC_MS 60000
+#endif
+/* Upper bound on buckets returned by one downsample call. */
+#ifndef LHOS_TSDB_MAX_BUCKETS
+#define LHOS_TSDB_MAX_BUCKETS 1024
+#endif
+
+typedef struct lhos_tsdb lhos_tsdb_t;
+
+/* Geometry used when a series is created. An existing series keeps the
+   geometry it was created with. Zero fields take the defaults above. */
+typedef struct
+{
+  uint32_t segments;
+  uint32_t segment_blocks;
+  uint32_t scale; /* informational for bindings: stored = value * scale */
+} lhos_tsdb_config_t;
+
+typedef struct
+{
+  uint32_t segments;
+  uint32_t segment_blocks;
+  uint32_t block_size;
+  uint32_t scale;
+  uint32_t blocks_used; /* blocks holding data, including the open one */
+  uint64_t samples;     /* samples in those blocks */
+  int64_t first_ms;     /* oldest sample still stored (0 if empty) */
+  int64_t last_ms;      /* newest sample (0 if empty) */
+} lhos_tsdb_info_t;
+
+typedef struct
+{
+  int64_t t_ms; /* bucket start */
+  int32_t min;
+  int32_t max;
+  int64_t sum;
+  uint32_t count; /* 0 for buckets without samples */
+} lhos_tsdb_bucket_t;
+
+/* Open `name` (letters, digits, '_' and '-'), creating it if needed. The
+   storage partition is mounted on first use. */
+esp_err_t lhos_tsdb_open (const char *name, const lhos_tsdb_config_t *cfg,
+                          lhos_tsdb_t **out);
+
+/* Write pending samples and release the series. */
+void lhos_tsdb_close (lhos_tsdb_t *db);
+
+/* Delete a series that is not open. */
+esp_err_t lhos_tsdb_remove (const char *name);
+
+/* Append one sample. Timestamps must not go below the newest one in the
+   series, sealed blocks and earlier boots included (ESP_ERR_INVALID_ARG).
+   Safe to call from several tasks. */
+esp_err_t lhos_tsdb_append (lhos_tsdb_t *db, int64_t t_ms, int32_t value);
+
+/* Write the open block to flash now. */
+esp_err_t lhos_tsdb_sync (lhos_tsdb_t *db);
+
+/* Copy up to `max` samples with t0 <= t < t1 in time order. `*n` receives
+   the count. When it equals `max` there may be more, including further
+   samples at times[*n - 1]: continue from that time and skip the ones
+   already seen. */
+esp_err_t lhos_tsdb_read (lhos_tsdb_t *db, int64_t t0, int64_t t1,
+                          int64_t *times, int32_t *values, size_t max,
+                          size_t *n);
+
+/* Aggregate [t0, t1) into consecutive buckets of `bucket_ms`. `out` must
+   hold ceil((t1 - t0) / bucket_ms) entries, at most
+   LHOS_TSDB_MAX_BUCKETS. Blocks that fall inside one bucket are folded
+   from their summary without being decoded. */
+esp_err_t lhos_tsdb_downsample (lhos_tsdb_t *db, int64_t t0, int64_t t1,
+                                int64_t bucket_ms, lhos_tsdb_bucket_t *out,
+                                size_t nbuckets);
+
+/* Walks every block header on flash for the counts and time range. */
+void lhos_tsdb_get_info (lhos_tsdb_t *db, lhos_tsdb_info_t *out);
+
+/* Value scale of the series, from its metadata; no flash access. */
+uint32_t lhos_tsdb_scale (const lhos_tsdb_t *db);
+
+#endif /* LHOS_TSDB_H */
@@ -0,0 +1,910 @@
+/* LHOS time-series store.
+ *
+ * Files of a series `name`:
+ *   LHOS_TSDB_DIR/name/meta      geometry (tsdb_meta_t)
+ *   LHOS_TSDB_DIR/name/NN.seg    segment slot NN, blocks appended in order
+ *
+ * Block layout (one filesystem block):
+ *   block_hdr_t | bit stream, MSB first
+ * The first sample is kept in the header; each later sample adds
+ *   zz(delta-of-delta of the timestamp), zz(value delta)
+ * where zz() is zigzag followed by a prefix code:
+ *   0 -> 0 | 10 -> 6 bits | 110 -> 12 bits | 1110 -> 20 bits | 1111 -> 32 bits
+ *
+ * Block sequence numbers increase across segments; on open the newest
+ * block found on flash becomes the open block again.
+ */
+
+#include "lhos_tsdb.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "lhos_storage.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define META_MAGIC 0x4454484cu  /* "LHTD" */
+#define BLOCK_MAGIC 0x5354484cu /* "LHTS" */
+#define META_VERSION 1
+#define ZZ_CLASSES 5
+#define SAMPLE_BITS_MAX (2 * (4 + 32))
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t block_size;
+  uint32_t segments;
+  uint32_t segment_blocks;
+  uint32_t scale;
+  uint32_t crc;
+} tsdb_meta_t;
+
+typedef struct
+{
+  int64_t t_first;
+  int64_t t_last;
+  int64_t sum;
+  uint32_t magic;
+  uint32_t seq;
+  int32_t v_first;
+  int32_t v_min;
+  int32_t v_max;
+  uint32_t count;
+  uint32_t bits; /* bit stream length */
+  uint32_t crc;  /* header (crc zeroed) and used stream bytes */
+} block_hdr_t;
+
+_Static_assert (sizeof (block_hdr_t) == 56, "block header layout");
+
+struct lhos_tsdb
+{
+  char name[LHOS_TSDB_NAME_MAX];
+  SemaphoreHandle_t lock;
+  uint32_t block_size;
+  uint32_t segments;
+  uint32_t segment_blocks;
+  uint32_t scale;
+  int fd;       /* open segment */
+  uint32_t seg; /* open segment slot */
+  uint32_t blk; /* open block index within the segment */
+  /* open block */
+  block_hdr_t hdr;
+  uint8_t *buf; /* block image; the stream starts after the header */
+  int64_t prev_t;
+  int64_t prev_dt;
+  int32_t prev_v;
+  /* newest sample of the series, sealed or not; appends never go below */
+  int64_t last_t;
+  bool has_last;
+  bool dirty;
+  int64_t last_sync_ms;
+};
+
+typedef struct
+{
+  const uint8_t *bits;
+  uint32_t pos;
+  uint32_t end;
+  uint32_t left;
+  bool first;
+  int64_t t;
+  int64_t dt;
+  int32_t v;
+} block_cursor_t;
+
+/* walk_blocks callback results */
+enum
+{
+  WALK_NEXT,
+  WALK_NEED_DATA,
+  WALK_STOP,
+};
+
+typedef int (*block_fn_t) (void *ctx, const block_hdr_t *hdr,
+                           const uint8_t *bits);
+
+static const char *TAG = "lhos_tsdb";
+static const uint8_t k_zz_bits[ZZ_CLASSES] = { 0, 6, 12, 20, 32 };
+
+static int64_t
+now_ms (void)
+{
+  struct timeval tv;
+  gettimeofday (&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static bool
+valid_name (const char *name)
+{
+  size_t n = name ? strlen (name) : 0;
+  if (n == 0 || n >= LHOS_TSDB_NAME_MAX)
+    return false;
+  for (size_t i = 0; i < n; i++)
+    {
+      char c = name[i];
+      if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+            || (c >= '0' && c <= '9') || c == '_' || c == '-'))
+        return false;
+    }
+  return true;
+}
+
+static void
+series_path (char *buf, size_t size, const char *name, const char *file)
+{
+  if (file)
+    snprintf (buf, size, "%s/%s/%s", LHOS_TSDB_DIR, name, file);
+  else
+    snprintf (buf, size, "%s/%s", LHOS_TSDB_DIR, name);
+}
+
+static void
+segment_path (char *buf, size_t size, const char *name, uint32_t seg)
+{
+  snprintf (buf, size, "%s/%s/%02u.seg", LHOS_TSDB_DIR, name,
+            (unsigned)seg);
+}
+
+/* ---- bit stream ------------------------------------------------------- */
+
+static void
+put_bits (uint8_t *d, uint32_t *pos, uint32_t v, unsigned n)
+{
+  while (n-- > 0)
+    {
+      if ((v >> n) & 1)
+        d[*pos >> 3] |= 0x80 >> (*pos & 7);
+      (*pos)++;
+    }
+}
+
+static bool
+get_bits (block_cursor_t *c, unsigned n, uint32_t *out)
+{
+  if (c->pos + n > c->end)
+    return false;
+  uint32_t v = 0;
+  while (n-- > 0)
+    {
+      v = (v << 1) | ((c->bits[c->pos >> 3] >> (7 - (c->pos & 7))) & 1);
+      c->pos++;
+    }
+  *out = v;
+  return true;
+}
+
+static uint32_t
+zz_encode (int32_t v)
+{
+  return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static int32_t
+zz_decode (uint32_t v)
+{
+  return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+static void
+put_zz (uint8_t *d, uint32_t *pos, int32_t v)
+{
+  uint32_t u = zz_encode (v);
+  if (u == 0)
+    {
+      put_bits (d, pos, 0, 1);
+      return;
+    }
+  unsigned c = 1;
+  while (c < ZZ_CLASSES - 1 && u >= (1u << k_zz_bits[c]))
+    c++;
+  /* c ones, terminated by a zero except for the last class */
+  if (c < ZZ_CLASSES - 1)
+    put_bits (d, pos, ((1u << c) - 1) << 1, c + 1);
+  else
+    put_bits (d, pos, (1u << c) - 1, c);
+  put_bits (d, pos, u, k_zz_bits[c]);
+}
+
+static bool
+get_zz (block_cursor_t *c, int32_t *out)
+{
+  unsigned cls = 0;
+  uint32_t b;
+  while (cls < ZZ_CLASSES - 1)
+    {
+      if (!get_bits (c, 1, &b))
+        return false;
+      if (!b)
+        break;
+      cls++;
+    }
+  uint32_t u = 0;
+  if (k_zz_bits[cls] && !get_bits (c, k_zz_bits[cls], &u))
+    return false;
+  *out = zz_decode (u);
+  return true;
+}
+
+/* ---- blocks ----------------------------------------------------------- */
+
+static uint32_t
+block_crc (const block_hdr_t *hdr, const uint8_t *bits)
+{
+  block_hdr_t h = *hdr;
+  h.crc = 0;
+  uint32_t crc = esp_rom_crc32_le (0, (const uint8_t *)&h, sizeof (h));
+  return esp_rom_crc32_le (crc, bits, (hdr->bits + 7) / 8);
+}
+
+static bool
+block_valid (const lhos_tsdb_t *db, const block_hdr_t *hdr,
+             const uint8_t *bits)
+{
+  if (hdr->magic != BLOCK_MAGIC || hdr->count == 0
+      || hdr->bits > (db->block_size - sizeof (*hdr)) * 8)
+    return false;
+  return !bits || block_crc (hdr, bits) == hdr->crc;
+}
+
+static void
+cursor_init (block_cursor_t *c, const block_hdr_t *hdr, const uint8_t *bits)
+{
+  c->bits = bits;
+  c->pos = 0;
+  c->end = hdr->bits;
+  c->left = hdr->count;
+  c->first = true;
+  c->t = hdr->t_first;
+  c->dt = 0;
+  c->v = hdr->v_first;
+}
+
+static bool
+cursor_next (block_cursor_t *c, int64_t *t, int32_t *v)
+{
+  if (c->left == 0)
+    return false;
+  if (!c->first)
+    {
+      int32_t dod, dv;
+      if (!get_zz (c, &dod) || !get_zz (c, &dv))
+        return false;
+      c->dt += dod;
+      c->t += c->dt;
+      c->v += dv;
+    }
+  c->first = false;
+  c->left--;
+  *t = c->t;
+  *v = c->v;
+  return true;
+}
+
+static uint8_t *
+stream (const lhos_tsdb_t *db)
+{
+  return db->buf + sizeof (block_hdr_t);
+}
+
+static esp_err_t
+write_block (lhos_tsdb_t *db)
+{
+  db->hdr.crc = block_crc (&db->hdr, stream (db));
+  memcpy (db->buf, &db->hdr, sizeof (db->hdr));
+  off_t off = (off_t)db->blk * db->block_size;
+  if (pwrite (db->fd, db->buf, db->block_size, off)
+      != (ssize_t)db->block_size)
+    return ESP_FAIL;
+  if (fsync (db->fd) != 0)
+    return ESP_FAIL;
+  db->dirty = false;
+  db->last_sync_ms = now_ms ();
+  return ESP_OK;
+}
+
+static esp_err_t
+open_segment (lhos_tsdb_t *db, uint32_t seg, bool truncate)
+{
+  char path[64];
+  segment_path (path, sizeof (path), db->name, seg);
+  if (db->fd >= 0)
+    close (db->fd);
+  db->fd = open (path, O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+  db->seg = seg;
+  return (db->fd >= 0) ? ESP_OK : ESP_FAIL;
+}
+
+static void
+reset_block (lhos_tsdb_t *db, uint32_t seq)
+{
+  memset (db->buf, 0, db->block_size);
+  memset (&db->hdr, 0, sizeof (db->hdr));
+  db->hdr.magic = BLOCK_MAGIC;
+  db->hdr.seq = seq;
+}
+
+/* Write the full open block and start the next one, moving to the next
+   segment slot (dropping its old contents) when this one is full. */
+static esp_err_t
+seal_block (lhos_tsdb_t *db)
+{
+  esp_err_t rc = write_block (db);
+  uint32_t seq = db->hdr.seq + 1;
+  if (++db->blk >= db->segment_blocks)
+    {
+      esp_err_t orc = open_segment (db, (db->seg + 1) % db->segments, true);
+      db->blk = 0;
+      if (rc == ESP_OK)
+        rc = orc;
+    }
+  reset_block (db, seq);
+  return rc;
+}
+
+static bool
+block_has_room (const lhos_tsdb_t *db)
+{
+  uint32_t cap = (db->block_size - sizeof (block_hdr_t)) * 8;
+  return db->hdr.bits + SAMPLE_BITS_MAX <= cap;
+}
+
+esp_err_t
+lhos_tsdb_append (lhos_tsdb_t *db, int64_t t_ms, int32_t value)
+{
+  if (!db)
+    return ESP_ERR_INVALID_ARG;
+  esp_err_t rc = ESP_OK;
+  xSemaphoreTake (db->lock, portMAX_DELAY);
+  block_hdr_t *h = &db->hdr;
+  if (db->has_last && t_ms < db->last_t)
+    {
+      xSemaphoreGive (db->lock);
+      return ESP_ERR_INVALID_ARG;
+    }
+  if (h->count > 0)
+    {
+      int64_t dt = t_ms - db->prev_t;
+      int64_t dod = dt - db->prev_dt;
+      int64_t dv = (int64_t)value - db->prev_v;
+      if (!block_has_room (db) || dod < INT32_MIN || dod > INT32_MAX
+          || dv < INT32_MIN || dv > INT32_MAX)
+        rc = seal_block (db);
+      else
+        {
+          put_zz (stream (db), &h->bits, (int32_t)dod);
+          put_zz (stream (db), &h->bits, (int32_t)dv);
+          db->prev_dt = dt;
+        }
+    }
+  if (h->count == 0)
+    {
+      h->t_first = t_ms;
+      h->v_first = value;
+      h->v_min = value;
+      h->v_max = value;
+      db->prev_dt = 0;
+    }
+  db->prev_t = t_ms;
+  db->prev_v = value;
+  db->last_t = t_ms;
+  db->has_last = true;
+  h->t_last = t_ms;
+  h->sum += value;
+  if (value < h->v_min)
+    h->v_min = value;
+  if (value > h->v_max)
+    h->v_max = value;
+  h->count++;
+  db->dirty = true;
+  if (now_ms () - db->last_sync_ms >= LHOS_TSDB_SYNC_MS)
+    {
+      esp_err_t wrc = write_block (db);
+      if (rc == ESP_OK)
+        rc = wrc;
+    }
+  xSemaphoreGive (db->lock);
+  return rc;
+}
+
+esp_err_t
+lhos_tsdb_sync (lhos_tsdb_t *db)
+{
+  if (!db)
+    return ESP_ERR_INVALID_ARG;
+  esp_err_t rc = ESP_OK;
+  xSemaphoreTake (db->lock, portMAX_DELAY);
+  if (db->dirty)
+    rc = write_block (db);
+  xSemaphoreGive (db->lock);
+  return rc;
+}
+
+/* ---- walking stored blocks -------------------------------------------- */
+
+/* Visit every block overlapping [t0, t1) from oldest to newest; called
+   with the lock held. The open block is served from RAM. */
+static esp_err_t
+walk_blocks (lhos_tsdb_t *db, int64_t t0, int64_t t1, block_fn_t fn,
+             void *ctx)
+{
+  uint8_t *scratch = NULL;
+  for (uint32_t i = 1; i <= db->segments; i++)
+    {
+      uint32_t seg = (db->seg + i) % db->segments;
+      int fd = -1;
+      if (seg != db->seg)
+        {
+          char path[64];
+          segment_path (path, sizeof (path), db->name, seg);
+          fd = open (path, O_RDONLY);
+          if (fd < 0)
+            continue;
+        }
+      uint32_t nblk = (seg == db->seg) ? db->blk + 1 : db->segment_blocks;
+      for (uint32_t b = 0; b < nblk; b++)
+        {
+          block_hdr_t hdr;
+          const uint8_t *bits = NULL;
+          bool live = (seg == db->seg && b == db->blk);
+          if (live)
+            {
+              hdr = db->hdr;
+              bits = stream (db);
+              if (hdr.count == 0)
+                continue;
+            }
+          else
+            {
+              int rfd = (fd >= 0) ? fd : db->fd;
+              off_t off = (off_t)b * db->block_size;
+              if (pread (rfd, &hdr, sizeof (hdr), off) != sizeof (hdr))
+                break;
+              if (!block_valid (db, &hdr, NULL))
+                continue;
+            }
+          if (hdr.t_last < t0 || hdr.t_first >= t1)
+            continue;
+          int r = fn (ctx, &hdr, live ? bits : NULL);
+          if (r == WALK_NEED_DATA && !live)
+            {
+              if (!scratch && !(scratch = malloc (db->block_size)))
+                {
+                  if (fd >= 0)
+                    close (fd);
+                  return ESP_ERR_NO_MEM;
+                }
+              int rfd = (fd >= 0) ? fd : db->fd;
+              off_t off = (off_t)b * db->block_size;
+              if (pread (rfd, scratch, db->block_size, off)
+                      != (ssize_t)db->block_size
+                  || !block_valid (db, &hdr, scratch + sizeof (hdr)))
+                continue;
+              r = fn (ctx, &hdr, scratch + sizeof (hdr));
+            }
+          if (r == WALK_STOP)
+            {
+              if (fd >= 0)
+                close (fd);
+              free (scratch);
+              return ESP_OK;
+            }
+        }
+      if (fd >= 0)
+        close (fd);
+    }
+  free (scratch);
+  return ESP_OK;
+}
+
+typedef struct
+{
+  int64_t t0, t1;
+  int64_t *times;
+  int32_t *values;
+  size_t max;
+  size_t n;
+} read_ctx_t;
+
+static int
+read_block (void *arg, const block_hdr_t *hdr, const uint8_t *bits)
+{
+  read_ctx_t *rc = arg;
+  if (!bits)
+    return WALK_NEED_DATA;
+  block_cursor_t c;
+  int64_t t;
+  int32_t v;
+  cursor_init (&c, hdr, bits);
+  while (cursor_next (&c, &t, &v))
+    {
+      if (t < rc->t0)
+        continue;
+      if (t >= rc->t1)
+        return WALK_STOP;
+      rc->times[rc->n] = t;
+      rc->values[rc->n] = v;
+      if (++rc->n == rc->max)
+        return WALK_STOP;
+    }
+  return WALK_NEXT;
+}
+
+esp_err_t
+lhos_tsdb_read (lhos_tsdb_t *db, int64_t t0, int64_t t1, int64_t *times,
+                int32_t *values, size_t max, size_t *n)
+{
+  if (!db || !times || !values || !n)
+    return ESP_ERR_INVALID_ARG;
+  read_ctx_t ctx = {
+    .t0 = t0, .t1 = t1, .times = times, .values = values, .max = max,
+  };
+  esp_err_t rc = ESP_OK;
+  if (max > 0 && t1 > t0)
+    {
+      xSemaphoreTake (db->lock, portMAX_DELAY);
+      rc = walk_blocks (db, t0, t1, read_block, &ctx);
+      xSemaphoreGive (db->lock);
+    }
+  *n = ctx.n;
+  return rc;
+}
+
+typedef struct
+{
+  int64_t t0, t1, bucket_ms;
+  lhos_tsdb_bucket_t *out;
+  size_t nbuckets;
+} down_ctx_t;
+
+static void
+bucket_add (lhos_tsdb_bucket_t *b, int32_t min, int32_t max, int64_t sum,
+            uint32_t count)
+{
+  if (b->count == 0 || min < b->min)
+    b->min = min;
+  if (b->count == 0 || max > b->max)
+    b->max = max;
+  b->sum += sum;
+  b->count += count;
+}
+
+/* Bucket of a time in [t0, t1); unsigned, as t - t0 may not fit in an
+   int64_t. */
+static size_t
+bucket_of (const down_ctx_t *dc, int64_t t)
+{
+  return (size_t)(((uint64_t)t - (uint64_t)dc->t0) / (uint64_t)dc->bucket_ms);
+}
+
+static int
+down_block (void *arg, const block_hdr_t *hdr, const uint8_t *bits)
+{
+  down_ctx_t *dc = arg;
+  if (!bits)
+    {
+      /* the whole block lands in one bucket: use its summary */
+      if (hdr->t_first >= dc->t0 && hdr->t_last < dc->t1
+          && bucket_of (dc, hdr->t_first) == bucket_of (dc, hdr->t_last))
+        {
+          size_t i = bucket_of (dc, hdr->t_first);
+          bucket_add (&dc->out[i], hdr->v_min, hdr->v_max, hdr->sum,
+                      hdr->count);
+          return WALK_NEXT;
+        }
+      return WALK_NEED_DATA;
+    }
+  block_cursor_t c;
+  int64_t t;
+  int32_t v;
+  cursor_init (&c, hdr, bits);
+  while (cursor_next (&c, &t, &v))
+    {
+      if (t < dc->t0)
+        continue;
+      if (t >= dc->t1)
+        return WALK_STOP;
+      bucket_add (&dc->out[bucket_of (dc, t)], v, v, v, 1);
+    }
+  return WALK_NEXT;
+}
+
+esp_err_t
+lhos_tsdb_downsample (lhos_tsdb_t *db, int64_t t0, int64_t t1,
+                      int64_t bucket_ms, lhos_tsdb_bucket_t *out,
+                      size_t nbuckets)
+{
+  if (!db || !out || bucket_ms <= 0 || t1 <= t0)
+    return ESP_ERR_INVALID_ARG;
+  uint64_t span = (uint64_t)t1 - (uint64_t)t0;
+  uint64_t need
+      = span / (uint64_t)bucket_ms + (span % (uint64_t)bucket_ms != 0);
+  if (need > LHOS_TSDB_MAX_BUCKETS || need > nbuckets)
+    return ESP_ERR_INVALID_SIZE;
+  for (size_t i = 0; i < need; i++)
+    {
+      memset (&out[i], 0, sizeof (out[i]));
+      out[i].t_ms = (int64_t)((uint64_t)t0 + i * (uint64_t)bucket_ms);
+    }
+  down_ctx_t ctx = {
+    .t0 = t0, .t1 = t1, .bucket_ms = bucket_ms, .out = out,
+    .nbuckets = (size_t)need,
+  };
+  xSemaphoreTake (db->lock, portMAX_DELAY);
+  esp_err_t rc = walk_blocks (db, t0, t1, down_block, &ctx);
+  xSemaphoreGive (db->lock);
+  return rc;
+}
+
+static int
+info_block (void *arg, const block_hdr_t *hdr, const uint8_t *bits)
+{
+  lhos_tsdb_info_t *info = arg;
+  (void)bits;
+  if (info->blocks_used == 0)
+    info->first_ms = hdr->t_first;
+  info->last_ms = hdr->t_last;
+  info->blocks_used++;
+  info->samples += hdr->count;
+  return WALK_NEXT;
+}
+
+void
+lhos_tsdb_get_info (lhos_tsdb_t *db, lhos_tsdb_info_t *out)
+{
+  if (!db || !out)
+    return;
+  memset (out, 0, sizeof (*out));
+  out->segments = db->segments;
+  out->segment_blocks = db->segment_blocks;
+  out->block_size = db->block_size;
+  out->scale = db->scale;
+  xSemaphoreTake (db->lock, portMAX_DELAY);
+  walk_blocks (db, INT64_MIN, INT64_MAX, info_block, out);
+  xSemaphoreGive (db->lock);
+}
+
+uint32_t
+lhos_tsdb_scale (const lhos_tsdb_t *db)
+{
+  return db ? db->scale : 1;
+}
+
+/* ---- open / recovery -------------------------------------------------- */
+
+static esp_err_t
+load_meta (lhos_tsdb_t *db, const lhos_tsdb_config_t *cfg)
+{
+  char path[64];
+  series_path (path, sizeof (path), db->name, "meta");
+  tsdb_meta_t meta;
+  int fd = open (path, O_RDONLY);
+  if (fd >= 0)
+    {
+      ssize_t n = read (fd, &meta, sizeof (meta));
+      close (fd);
+      uint32_t crc = meta.crc;
+      meta.crc = 0;
+      if (n == sizeof (meta) && meta.magic == META_MAGIC
+          && meta.version == META_VERSION
+          && crc
+                 == esp_rom_crc32_le (0, (const uint8_t *)&meta,
+                                      sizeof (meta)))
+        {
+          db->block_size = meta.block_size;
+          db->segments = meta.segments;
+          db->segment_blocks = meta.segment_blocks;
+          db->scale = meta.scale;
+          return ESP_OK;
+        }
+      ESP_LOGW (TAG, "%s: bad meta, recreating series", db->name);
+    }
+
+  /* new series */
+  db->block_size = lhos_storage_block_size ();
+  db->segments = (cfg && cfg->segments) ? cfg->segments : LHOS_TSDB_SEGMENTS;
+  db->segment_blocks = (cfg && cfg->segment_blocks) ? cfg->segment_blocks
+                                                    : LHOS_TSDB_SEGMENT_BLOCKS;
+  db->scale = (cfg && cfg->scale) ? cfg->scale : 1;
+  if (db->segments < 2 || db->segments > 99)
+    return ESP_ERR_INVALID_ARG;
+  meta = (tsdb_meta_t){
+    .magic = META_MAGIC,
+    .version = META_VERSION,
+    .block_size = db->block_size,
+    .segments = db->segments,
+    .segment_blocks = db->segment_blocks,
+    .scale = db->scale,
+  };
+  meta.crc = esp_rom_crc32_le (0, (const uint8_t *)&meta, sizeof (meta));
+  for (uint32_t s = 0; s < db->segments; s++)
+    {
+      segment_path (path, sizeof (path), db->name, s);
+      unlink (path);
+    }
+  series_path (path, sizeof (path), db->name, "meta");
+  fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return ESP_FAIL;
+  bool ok = write (fd, &meta, sizeof (meta)) == sizeof (meta);
+  close (fd);
+  return ok ? ESP_OK : ESP_FAIL;
+}
+
+/* Find the newest block on flash and make it the open block again. */
+static esp_err_t
+recover (lhos_tsdb_t *db)
+{
+  uint32_t best_seq = 0, best_seg = 0;
+  for (uint32_t s = 0; s < db->segments; s++)
+    {
+      char path[64];
+      segment_path (path, sizeof (path), db->name, s);
+      int fd = open (path, O_RDONLY);
+      if (fd < 0)
+        continue;
+      block_hdr_t hdr;
+      if (pread (fd, &hdr, sizeof (hdr), 0) == sizeof (hdr)
+          && block_valid (db, &hdr, NULL))
+        {
+          /* a lower bound should the newest segment turn out torn */
+          if (hdr.count && (!db->has_last || hdr.t_last > db->last_t))
+            {
+              db->last_t = hdr.t_last;
+              db->has_last = true;
+            }
+          if (hdr.seq > best_seq)
+            {
+              best_seq = hdr.seq;
+              best_seg = s;
+            }
+        }
+      close (fd);
+    }
+  if (best_seq == 0)
+    {
+      db->blk = 0;
+      reset_block (db, 1);
+      return open_segment (db, 0, true);
+    }
+
+  esp_err_t rc = open_segment (db, best_seg, false);
+  if (rc != ESP_OK)
+    return rc;
+  /* last intact block of the newest segment */
+  uint32_t last = 0;
+  bool found = false;
+  for (uint32_t b = 0; b < db->segment_blocks; b++)
+    {
+      off_t off = (off_t)b * db->block_size;
+      if (pread (db->fd, db->buf, db->block_size, off)
+          != (ssize_t)db->block_size)
+        break;
+      block_hdr_t hdr;
+      memcpy (&hdr, db->buf, sizeof (hdr));
+      if (!block_valid (db, &hdr, stream (db)) || hdr.seq < best_seq)
+        break;
+      best_seq = hdr.seq;
+      last = b;
+      found = true;
+    }
+  if (!found)
+    {
+      /* first block is torn: restart the segment */
+      db->blk = 0;
+      reset_block (db, best_seq + 1);
+      return open_segment (db, best_seg, true);
+    }
+
+  pread (db->fd, db->buf, db->block_size, (off_t)last * db->block_size);
+  memcpy (&db->hdr, db->buf, sizeof (db->hdr));
+  db->blk = last;
+
+  /* replay the stream to restore the encoder state */
+  block_cursor_t c;
+  int64_t t;
+  int32_t v;
+  cursor_init (&c, &db->hdr, stream (db));
+  while (cursor_next (&c, &t, &v))
+    ;
+  db->prev_t = c.t;
+  db->prev_dt = c.dt;
+  db->prev_v = c.v;
+  if (db->hdr.count && (!db->has_last || c.t > db->last_t))
+    {
+      db->last_t = c.t;
+      db->has_last = true;
+    }
+  if (!block_has_room (db))
+    return seal_block (db);
+  return ESP_OK;
+}
+
+esp_err_t
+lhos_tsdb_open (const char *name, const lhos_tsdb_config_t *cfg,
+                lhos_tsdb_t **out)
+{
+  if (!valid_name (name) || !out)
+    return ESP_ERR_INVALID_ARG;
+  esp_err_t rc = lhos_storage_mount ();
+  if (rc != ESP_OK)
+    return rc;
+  char path[64];
+  series_path (path, sizeof (path), name, NULL);
+  rc = lhos_storage_mkdirs (path);
+  if (rc != ESP_OK)
+    return rc;
+
+  lhos_tsdb_t *db = calloc (1, sizeof (*db));
+  if (!db)
+    return ESP_ERR_NO_MEM;
+  strcpy (db->name, name);
+  db->fd = -1;
+  rc = load_meta (db, cfg);
+  if (rc == ESP_OK)
+    {
+      db->buf = calloc (1, db->block_size);
+      db->lock = xSemaphoreCreateMutex ();
+      rc = (db->buf && db->lock) ? recover (db) : ESP_ERR_NO_MEM;
+    }
+  if (rc != ESP_OK)
+    {
+      ESP_LOGE (TAG, "%s: open failed: %s", name, esp_err_to_name (rc));
+      lhos_tsdb_close (db);
+      return rc;
+    }
+  db->last_sync_ms = now_ms ();
+  *out = db;
+  return ESP_OK;
+}
+
+void
+lhos_tsdb_close (lhos_tsdb_t *db)
+{
+  if (!db)
+    return;
+  if (db->fd >= 0)
+    {
+      if (db->dirty)
+        write_block (db);
+      close (db->fd);
+    }
+  if (db->lock)
+    vSemaphoreDelete (db->lock);
+  free (db->buf);
+  free (db);
+}
+
+esp_err_t
+lhos_tsdb_remove (const char *name)
+{
+  if (!valid_name (name))
+    return ESP_ERR_INVALID_ARG;
+  esp_err_t rc = lhos_storage_mount ();
+  if (rc != ESP_OK)
+    return rc;
+  char dir[64], path[64 + 2 * LHOS_TSDB_NAME_MAX];
+  series_path (dir, sizeof (dir), name, NULL);
+  DIR *d = opendir (dir);
+  if (!d)
+    return ESP_ERR_NOT_FOUND;
+  struct dirent *e;
+  while ((e = readdir (d)) != NULL)
+    {
+      if (e->d_name[0] == '.')
+        continue;
+      snprintf (path, sizeof (path), "%s/%s", dir, e->d_name);
+      unlink (path);
+    }
+  closedir (d);
+  return (rmdir (dir) == 0) ? ESP_OK : ESP_FAIL;
+}
@@ -3,6 +3,14 @@
 #ifndef LHOS_UART_H
 #define LHOS_UART_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "driver/uart.h"
+#include "esp_err.h"
+#include "lhos_uart_frame.h"
+
 #ifndef LUA_STATE_DECL
 typedef struct lua_State lua_State;
 #define LUA_STATE_DECL
@@ -12,6 +20,81 @@ int lhos_uart_open (lua_State *L);
 int lhos_uart_close (lua_State *L);
 int lhos_uart_read (lua_State *L);
 int lhos_uart_write (lua_State *L);
+int lhos_uart_send (lua_State *L);
 int lhos_uart_available (lua_State *L);
 
+/* uart.on(port, fn | nil): deliver received data and line errors for
+   `port` to `fn(port, event, data)` from the Lua event loop. */
+int lhos_uart_on (lua_State *L);
+
+/* uart.stats(port [, reset]) -> table of lhos_uart_stats_t counters */
+int lhos_uart_stats (lua_State *L);
+
+/* C API used by protocol engines layered on a port (e.g. lhos_modbus). */
+
+typedef struct
+{
+  int baud;
+  int tx_pin; /* UART_PIN_NO_CHANGE keeps the current routing */
+  int rx_pin;
+  int rts_pin;
+  int rx_buffer_size; /* clamped to 128..65536 */
+  int tx_buffer_size;
+  uart_parity_t parity;
+  bool flow_control;
+  bool rs485; /* half duplex, RTS drives the transceiver's DE line */
+  lhos_uart_frame_config_t framing;
+  size_t max_frame; /* 0: 256 */
+  uint8_t gap;      /* GAP framing, idle character times; 0: t3.5 */
+} lhos_uart_config_t;
+
+#define LHOS_UART_CONFIG_DEFAULT()                                           \
+  {                                                                          \
+    .baud = 115200, .tx_pin = UART_PIN_NO_CHANGE,                            \
+    .rx_pin = UART_PIN_NO_CHANGE, .rts_pin = UART_PIN_NO_CHANGE,             \
+    .rx_buffer_size = 1024, .parity = UART_PARITY_DISABLE,                   \
+    .framing = { .mode = LHOS_UART_FRAME_NONE },                             \
+  }
+
+/* Per-port counters, cleared when the port is opened. */
+typedef struct
+{
+  uint32_t rx_bytes;       /* taken from the RX ring buffer */
+  uint32_t tx_bytes;       /* handed to the driver */
+  uint32_t overflows;      /* hardware RX FIFO overflows */
+  uint32_t buffer_full;    /* RX ring buffer full, bytes dropped */
+  uint32_t parity_errors;
+  uint32_t frame_errors;
+  uint32_t breaks;
+  uint32_t events_dropped; /* data or frames Lua did not take in time */
+  uint32_t max_buffered;   /* high-water mark of the RX ring buffer */
+  uint32_t rx_buffer_size;
+  uint32_t frames;         /* framer output */
+  uint32_t frames_dropped; /* framer: over max_frame or malformed */
+} lhos_uart_stats_t;
+
+/* Receives each complete frame of a framed port on its service task, in
+   place of Lua "frame" events. `frame` is only valid during the call. */
+typedef void (*lhos_uart_frame_sink_t) (int port, const uint8_t *frame,
+                                        size_t len, void *ctx);
+
+/* Configure the port, install the driver and start its service task. */
+esp_err_t lhos_uart_port_open (int port, const lhos_uart_config_t *cfg);
+
+/* Stop the service and TX tasks and remove the driver. Queued writes are
+   dropped; the Lua references they hold are released by the next
+   uart.open or uart.close. ESP_ERR_TIMEOUT, with the port left open, if a
+   task does not stop in time; the call may then be repeated. */
+esp_err_t lhos_uart_port_close (int port);
+
+/* Blocking write that is accounted in the port's statistics. */
+int lhos_uart_port_write (int port, const void *data, size_t len);
+
+esp_err_t lhos_uart_get_stats (int port, lhos_uart_stats_t *out);
+void lhos_uart_reset_stats (int port);
+
+/* Route the frames of `port` to `sink` (NULL: back to Lua). */
+void lhos_uart_set_frame_sink (int port, lhos_uart_frame_sink_t sink,
+                               void *ctx);
+
 #endif /* LHOS_UART_H */
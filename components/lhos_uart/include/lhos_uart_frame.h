@@ -0,0 +1,80 @@
+/* Byte-stream framing for UART protocols.
+ *
+ * A framer accumulates received bytes in a caller-provided buffer and
+ * hands each complete frame to a callback:
+ *   DELIM   frames end with a 1-4 byte delimiter, which is stripped;
+ *   LENGTH  a 1 or 2 byte length field at `len_offset` gives the payload
+ *           size; `len_adjust` adds fixed trailer bytes (e.g. a CRC);
+ *   GAP     frames end when the line goes idle (Modbus RTU t3.5); the
+ *           caller detects the gap and calls lhos_uart_framer_flush.
+ *
+ * The buffer holds at most one frame, and the callback only ever sees a
+ * complete one. A frame longer than the buffer is still read up to its
+ * delimiter, length or gap so the stream stays in sync, then dropped whole
+ * and counted in `dropped`. Nothing is allocated; a framer belongs to the
+ * single task reading its port.
+ */
+#ifndef LHOS_UART_FRAME_H
+#define LHOS_UART_FRAME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LHOS_UART_DELIM_MAX 4
+
+typedef enum
+{
+  LHOS_UART_FRAME_NONE = 0,
+  LHOS_UART_FRAME_DELIM,
+  LHOS_UART_FRAME_LENGTH,
+  LHOS_UART_FRAME_GAP,
+} lhos_uart_frame_mode_t;
+
+typedef struct
+{
+  lhos_uart_frame_mode_t mode;
+  uint8_t delim[LHOS_UART_DELIM_MAX]; /* DELIM */
+  uint8_t delim_len;
+  uint8_t len_offset; /* LENGTH: bytes before the length field */
+  uint8_t len_size;   /* LENGTH: 1 or 2 */
+  bool len_le;        /* LENGTH: 2-byte field is little endian */
+  int16_t len_adjust; /* LENGTH: bytes after the payload */
+} lhos_uart_frame_config_t;
+
+typedef struct
+{
+  lhos_uart_frame_config_t cfg;
+  uint8_t *buf;
+  size_t cap;
+  size_t len;
+  size_t need;  /* LENGTH: total frame size once the header is in */
+  bool discard; /* current frame overflowed the buffer */
+  uint32_t frames;
+  uint32_t dropped;
+} lhos_uart_framer_t;
+
+/* Called for each complete frame; `frame` is only valid during the call. */
+typedef void (*lhos_uart_frame_cb_t) (const uint8_t *frame, size_t len,
+                                      void *ctx);
+
+/* Returns false if the configuration is invalid or `cap` cannot hold a
+   delimiter or length header. */
+bool lhos_uart_framer_init (lhos_uart_framer_t *f,
+                            const lhos_uart_frame_config_t *cfg, uint8_t *buf,
+                            size_t cap);
+
+/* Consume `n` bytes, emitting each frame that completes. Returns the number
+   of frames emitted. */
+size_t lhos_uart_framer_feed (lhos_uart_framer_t *f, const uint8_t *data,
+                              size_t n, lhos_uart_frame_cb_t cb, void *ctx);
+
+/* The line went idle. GAP emits what was collected; the other modes drop
+   a partial frame so the next one starts in sync. Returns frames emitted. */
+size_t lhos_uart_framer_flush (lhos_uart_framer_t *f, lhos_uart_frame_cb_t cb,
+                               void *ctx);
+
+/* Forget any partial frame, e.g. after an overflow. */
+void lhos_uart_framer_reset (lhos_uart_framer_t *f);
+
+#endif /* LHOS_UART_FRAME_H */
@@ -1,35 +1,969 @@
 /* Minimal UART helpers for LHOS Lua bindings.
  * Lua wrappers expect arguments on the stack and return Lua values.
  * API (Lua):
- *   uart.open(uart_num, baud, tx_pin, rx_pin) -> true|nil, err
+ *   uart.open(uart_num, baud, tx_pin, rx_pin [, opts]) -> true|nil, err
  *   uart.close(uart_num) -> true|nil, err
  *   uart.write(uart_num, data) -> bytes_written | nil, err
+ *   uart.send(uart_num, buf) -> bytes | nil, err
  *   uart.read(uart_num, max_bytes=256, timeout_ms=100) -> data | nil, err
+ *   uart.read(uart_num, buf, timeout_ms=100) -> count | nil, err
+ *   uart.on(uart_num, fn | nil)
+ *   uart.stats(uart_num [, reset]) -> { rx_bytes, tx_bytes, overflows,
+ *              buffer_full, parity_errors, frame_errors, breaks,
+ *              events_dropped, max_buffered, rx_buffer_size, frames,
+ *              frames_dropped }
+ * `data` may be a string or a `buffer`; reading into a buffer fills it from
+ * offset 0 up to its capacity without allocating.
+ *
+ * Each open port has a service task blocked on the driver's event queue.
+ * Once a handler is installed with uart.on, the task drains received bytes
+ * itself and hands them to the Lua event loop as `fn(port, event, data)`,
+ * where event is "data", "overflow", "break", "parity_error" or
+ * "frame_error" (data is nil for the error events). Without a handler the
+ * bytes stay in the driver's ring buffer for uart.read.
+ *
+ * Framing options make the service task deliver whole frames instead, as
+ * event "frame":
+ *   delimiter = "\n"          split after a 1-4 byte delimiter (stripped);
+ *                             a run of one repeated character, e.g. "\n"
+ *                             or "+++", uses hardware pattern detection
+ *   length = 1|2, length_offset = 0, length_adjust = 0,
+ *   little_endian = false     length-prefixed frames
+ *   gap = true | chars        frames end when the line is idle for `chars`
+ *                             character times (true: 3, Modbus RTU t3.5)
+ *   max_frame = 256           longer frames are dropped
+ *
+ * With opts.nonblocking = true writes never block the VM: uart.write and
+ * uart.send queue the data (at most opts.tx_queue = 16 writes) for a TX
+ * task and return at once, or return nil, "busy" when the queue is full;
+ * a "writable" event follows once it has drained to half. Strings are
+ * queued by reference; uart.write copies a buffer while uart.send hands
+ * the buffer itself over, so it must not be modified until it has been
+ * sent. Without the option uart.send is a plain blocking write.
+ *
+ * uart.close waits up to 1 s for each task; a write held back by CTS then
+ * has flow control dropped so it can drain. If a task still does not stop
+ * close returns nil, "ESP_ERR_TIMEOUT" and may be called again.
+ *
+ * The counters of uart.stats are kept by the service and TX tasks and
+ * survive uart.close; max_buffered against rx_buffer_size tells how close
+ * the ring buffer came to overflowing.
  */
 
 #include "lhos_uart.h"
 #include "esp_log.h"
 #include "lauxlib.h"
+#include "lhos_lua_event.h"
+#include "lhos_lua_buffer.h"
+#include "lhos_uart_frame.h"
 #include "lua.h"
 
 #include "driver/uart.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 static const char *TAG = "lhos_uart";
 
+#define LHOS_UART_QUEUE_LEN 16
+#define LHOS_UART_TASK_STACK 3072
+#define LHOS_UART_TASK_PRIO (tskIDLE_PRIORITY + 6)
+/* How long the service task waits for room in the Lua event queue before
+   dropping a chunk. */
+#define LHOS_UART_POST_WAIT_MS 50
+#define LHOS_UART_FRAME_DEFAULT 256
+#define LHOS_UART_FRAME_MAX 4096
+/* Pattern positions the driver remembers between service task wakeups. */
+#define LHOS_UART_PATTERN_QUEUE 16
+/* Longest run of one character handed to hardware pattern detection. */
+#define LHOS_UART_PATTERN_MAX 3
+/* RX idle timeout, in character times, approximating Modbus t3.5. */
+#define LHOS_UART_GAP_DEFAULT 3
+#define LHOS_UART_GAP_MAX 126
+#define LHOS_UART_TX_QUEUE_DEFAULT 16
+#define LHOS_UART_TX_QUEUE_MAX 64
+/* Finished writes whose Lua references are dropped in one event. */
+#define LHOS_UART_TX_BATCH 16
+/* Internal event that releases the references of finished writes. */
+#define LHOS_UART_TX_EVENT "uart_tx"
+/* How long closing waits for each task to stop. */
+#define LHOS_UART_STOP_MS 1000
+
+enum
+{
+  LHOS_UART_EV_DATA,
+  LHOS_UART_EV_OVERFLOW,
+  LHOS_UART_EV_BREAK,
+  LHOS_UART_EV_PARITY_ERR,
+  LHOS_UART_EV_FRAME_ERR,
+  LHOS_UART_EV_FRAME,
+  LHOS_UART_EV_WRITABLE,
+};
+
+static const char *const s_event_names[] = {
+  [LHOS_UART_EV_DATA] = "data",
+  [LHOS_UART_EV_OVERFLOW] = "overflow",
+  [LHOS_UART_EV_BREAK] = "break",
+  [LHOS_UART_EV_PARITY_ERR] = "parity_error",
+  [LHOS_UART_EV_FRAME_ERR] = "frame_error",
+  [LHOS_UART_EV_FRAME] = "frame",
+  [LHOS_UART_EV_WRITABLE] = "writable",
+};
+
+/* Payload of a "uartN" Lua event; only `len` bytes of `data` are copied
+   into the event queue. Frames that do not fit are posted by reference in
+   a heap block sized to the frame. */
+typedef struct
+{
+  uint8_t port;
+  uint8_t kind;
+  uint16_t len;
+  uint8_t data[LHOS_EVENT_MAX - 4];
+} lhos_uart_event_t;
+
+/* A queued write: a referenced Lua string or buffer, or a heap copy. */
+typedef struct
+{
+  const uint8_t *data; /* NULL wakes the TX task up to exit */
+  size_t len;
+  int ref;
+  bool owned;
+} tx_item_t;
+
+typedef struct
+{
+  uint8_t n;
+  int refs[LHOS_UART_TX_BATCH];
+} tx_done_t;
+
+typedef struct
+{
+  char name[LHOS_EVENT_NAME_MAX]; /* Lua event name, "uartN" */
+  QueueHandle_t events;           /* owned by the driver */
+  TaskHandle_t task;
+  SemaphoreHandle_t done;
+  volatile bool run;
+  bool framed;
+  uint8_t pattern_len; /* hardware pattern detection; 0 when off */
+  lhos_uart_framer_t framer;
+  lhos_uart_frame_sink_t sink; /* C consumer of frames instead of Lua */
+  void *sink_ctx;
+  /* non-blocking TX */
+  QueueHandle_t txq;
+  TaskHandle_t tx_task;
+  SemaphoreHandle_t tx_done;
+  volatile bool tx_run;
+  volatile bool tx_blocked; /* a write was refused: report "writable" */
+  uint8_t tx_depth;
+  tx_done_t tx_left; /* finished writes the TX task could not release */
+  /* references of writes dropped by a close, released on the Lua task by
+     the next uart.open or uart.close */
+  int *tx_orphans;
+  size_t tx_norphans;
+  lhos_uart_stats_t stats;
+} lhos_uart_port_t;
+
+static lhos_uart_port_t s_ports[UART_NUM_MAX];
+
+static lhos_uart_port_t *
+port_get (int uart_num)
+{
+  lhos_uart_port_t *p = &s_ports[uart_num];
+  if (!p->name[0])
+    snprintf (p->name, sizeof (p->name), "uart%d", uart_num);
+  return p;
+}
+
+static int
+check_port (lua_State *L, int idx)
+{
+  int uart_num = (int)luaL_checkinteger (L, idx);
+  luaL_argcheck (L, uart_num >= 0 && uart_num < UART_NUM_MAX, idx,
+                 "invalid uart port");
+  port_get (uart_num);
+  return uart_num;
+}
+
+/* Received bytes are consumed by the service task, rather than left for
+   uart.read, when something listens. */
+static bool
+has_consumer (lhos_uart_port_t *p)
+{
+  return p->sink || lhos_lua_has_event_handler (p->name);
+}
+
+static int
+push_event (lua_State *L, const void *data, size_t len)
+{
+  const lhos_uart_event_t *e = data;
+  (void)len;
+  lua_pushinteger (L, e->port);
+  lua_pushstring (L, s_event_names[e->kind]);
+  if (e->kind == LHOS_UART_EV_DATA || e->kind == LHOS_UART_EV_FRAME)
+    lua_pushlstring (L, (const char *)e->data, e->len);
+  else
+    lua_pushnil (L);
+  return 3;
+}
+
+static void
+release_event (lua_State *L, void *data)
+{
+  (void)L;
+  free (data);
+}
+
+/* Post with a short wait: the service task may block, the Lua task never
+   does. Gives up at once when the handler goes away. With `ref` the
+   dispatcher takes ownership of `e` on success. */
+static bool
+post_event (lhos_uart_port_t *p, lhos_uart_event_t *e, bool ref)
+{
+  size_t len = offsetof (lhos_uart_event_t, data) + e->len;
+  TickType_t start = xTaskGetTickCount ();
+  while (!(ref ? lhos_lua_post_event_ref (p->name, push_event, release_event,
+                                          e, len)
+               : lhos_lua_post_event (p->name, push_event, e, len)))
+    {
+      if (!p->run || !lhos_lua_has_event_handler (p->name)
+          || xTaskGetTickCount () - start
+                 > pdMS_TO_TICKS (LHOS_UART_POST_WAIT_MS))
+        return false;
+      vTaskDelay (1);
+    }
+  return true;
+}
+
+static void
+post_status (lhos_uart_port_t *p, int port, uint8_t kind)
+{
+  lhos_uart_event_t e = { .port = (uint8_t)port, .kind = kind };
+  if (lhos_lua_has_event_handler (p->name))
+    post_event (p, &e, false);
+}
+
+static void
+emit_frame (const uint8_t *frame, size_t len, void *ctx)
+{
+  lhos_uart_port_t *p = ctx;
+  int port = (int)(p - s_ports);
+  lhos_uart_event_t inl;
+  lhos_uart_event_t *e = &inl;
+
+  if (p->sink)
+    {
+      p->sink (port, frame, len, p->sink_ctx);
+      return;
+    }
+  if (len > sizeof (inl.data))
+    {
+      e = malloc (offsetof (lhos_uart_event_t, data) + len);
+      if (!e)
+        {
+          ESP_LOGW (TAG, "uart%d: no memory for a %u byte frame", port,
+                    (unsigned)len);
+          return;
+        }
+    }
+  e->port = (uint8_t)port;
+  e->kind = LHOS_UART_EV_FRAME;
+  e->len = (uint16_t)len;
+  memcpy (e->data, frame, len);
+  if (!post_event (p, e, e != &inl))
+    {
+      p->stats.events_dropped++;
+      ESP_LOGW (TAG, "uart%d: dropped a frame, Lua is not keeping up", port);
+      if (e != &inl)
+        free (e);
+    }
+}
+
+/* Move `size` received bytes (0: everything buffered) into Lua events,
+   either as raw chunks or through the port's framer. Reading exactly what
+   an event announced keeps idle gaps aligned with the bytes before them. */
+static void
+forward_data (lhos_uart_port_t *p, int port, size_t size)
+{
+  lhos_uart_event_t e = { .port = (uint8_t)port, .kind = LHOS_UART_EV_DATA };
+  size_t avail = size;
+
+  if (!has_consumer (p))
+    return; /* polled with uart.read */
+  if (avail == 0)
+    uart_get_buffered_data_len (port, &avail);
+  while (avail > 0 && p->run)
+    {
+      size_t n = avail < sizeof (e.data) ? avail : sizeof (e.data);
+      int r = uart_read_bytes (port, e.data, n, 0);
+      if (r <= 0)
+        break;
+      avail -= (size_t)r;
+      p->stats.rx_bytes += (uint32_t)r;
+      if (p->framed)
+        {
+          lhos_uart_framer_feed (&p->framer, e.data, (size_t)r, emit_frame, p);
+          continue;
+        }
+      e.len = (uint16_t)r;
+      if (!post_event (p, &e, false))
+        {
+          p->stats.events_dropped++;
+          ESP_LOGW (TAG, "uart%d: dropped %d bytes, Lua is not keeping up",
+                    port, r);
+        }
+    }
+}
+
+/* Read and discard `n` bytes from the ring buffer. */
+static void
+skip_bytes (lhos_uart_port_t *p, int port, size_t n)
+{
+  uint8_t tmp[64];
+  while (n > 0)
+    {
+      int r = uart_read_bytes (port, tmp, n < sizeof (tmp) ? n : sizeof (tmp),
+                               0);
+      if (r <= 0)
+        break;
+      n -= (size_t)r;
+      p->stats.rx_bytes += (uint32_t)r;
+    }
+}
+
+/* Track the fill level of the RX ring buffer; called on every event. */
+static void
+note_buffered (lhos_uart_port_t *p, int port)
+{
+  size_t len = 0;
+  if (uart_get_buffered_data_len (port, &len) == ESP_OK
+      && len > p->stats.max_buffered)
+    p->stats.max_buffered = (uint32_t)len;
+}
+
+/* The hardware saw the delimiter: the frame is the `pos` bytes in front of
+   it, so no byte of it is inspected in software. */
+static void
+read_pattern (lhos_uart_port_t *p, int port)
+{
+  int pos = uart_pattern_pop_pos (port);
+  if (!has_consumer (p))
+    return;
+  if (pos < 0)
+    {
+      /* the position queue overflowed, so frame boundaries are lost */
+      uart_flush_input (port);
+      uart_pattern_queue_reset (port, LHOS_UART_PATTERN_QUEUE);
+      post_status (p, port, LHOS_UART_EV_OVERFLOW);
+      return;
+    }
+  if ((size_t)pos > p->framer.cap)
+    {
+      skip_bytes (p, port, (size_t)pos + p->pattern_len);
+      p->framer.dropped++;
+      return;
+    }
+  int r = uart_read_bytes (port, p->framer.buf, (uint32_t)pos, 0);
+  if (r > 0)
+    p->stats.rx_bytes += (uint32_t)r;
+  skip_bytes (p, port, p->pattern_len);
+  if (r == pos)
+    {
+      p->framer.frames++;
+      emit_frame (p->framer.buf, (size_t)r, p);
+    }
+}
+
+static void
+service_task (void *arg)
+{
+  lhos_uart_port_t *p = arg;
+  int port = (int)(p - s_ports);
+  uart_event_t ev;
+
+  while (p->run)
+    {
+      if (xQueueReceive (p->events, &ev, portMAX_DELAY) != pdTRUE)
+        continue;
+      if (ev.type == UART_DATA || ev.type == UART_PATTERN_DET)
+        note_buffered (p, port);
+      switch (ev.type)
+        {
+        case UART_DATA:
+          if (p->pattern_len)
+            break; /* read when the delimiter is seen */
+          forward_data (p, port, ev.size);
+          if (ev.timeout_flag && p->framed
+              && p->framer.cfg.mode == LHOS_UART_FRAME_GAP)
+            lhos_uart_framer_flush (&p->framer, emit_frame, p);
+          break;
+        case UART_PATTERN_DET:
+          read_pattern (p, port);
+          break;
+        case UART_FIFO_OVF:
+        case UART_BUFFER_FULL:
+          /* Bytes already lost in hardware; keep draining so the driver
+             re-enables reception. A frame in progress is incomplete. */
+          if (ev.type == UART_FIFO_OVF)
+            p->stats.overflows++;
+          else
+            {
+              p->stats.buffer_full++;
+              p->stats.max_buffered = p->stats.rx_buffer_size;
+            }
+          post_status (p, port, LHOS_UART_EV_OVERFLOW);
+          if (p->pattern_len)
+            {
+              if (has_consumer (p))
+                {
+                  uart_flush_input (port);
+                  uart_pattern_queue_reset (port, LHOS_UART_PATTERN_QUEUE);
+                }
+              break;
+            }
+          if (p->framed)
+            lhos_uart_framer_reset (&p->framer);
+          forward_data (p, port, 0);
+          break;
+        case UART_BREAK:
+          p->stats.breaks++;
+          post_status (p, port, LHOS_UART_EV_BREAK);
+          break;
+        case UART_PARITY_ERR:
+          p->stats.parity_errors++;
+          post_status (p, port, LHOS_UART_EV_PARITY_ERR);
+          break;
+        case UART_FRAME_ERR:
+          p->stats.frame_errors++;
+          post_status (p, port, LHOS_UART_EV_FRAME_ERR);
+          break;
+        default:
+          break;
+        }
+    }
+  xSemaphoreGive (p->done);
+  vTaskDelete (NULL);
+}
+
+static esp_err_t
+service_start (int port)
+{
+  lhos_uart_port_t *p = &s_ports[port];
+  if (!p->done)
+    p->done = xSemaphoreCreateBinary ();
+  if (!p->done)
+    return ESP_ERR_NO_MEM;
+  p->run = true;
+  if (xTaskCreatePinnedToCore (service_task, "lhos_uart", LHOS_UART_TASK_STACK,
+                               p, LHOS_UART_TASK_PRIO, &p->task, 0)
+      != pdPASS)
+    {
+      p->run = false;
+      p->task = NULL;
+      return ESP_ERR_NO_MEM;
+    }
+  return ESP_OK;
+}
+
+static esp_err_t
+service_stop (int port)
+{
+  lhos_uart_port_t *p = &s_ports[port];
+  if (!p->task)
+    return ESP_OK;
+  /* wake the task with an event the driver never produces; with the queue
+     full it is awake anyway and sees `run` after the current event */
+  uart_event_t wake = { .type = UART_EVENT_MAX };
+  p->run = false;
+  xQueueSend (p->events, &wake, 0);
+  if (xSemaphoreTake (p->done, pdMS_TO_TICKS (LHOS_UART_STOP_MS)) != pdTRUE)
+    return ESP_ERR_TIMEOUT;
+  p->task = NULL;
+  p->events = NULL;
+  return ESP_OK;
+}
+
+/* Runs on the Lua task: drop the references of finished writes. */
+static int
+push_tx_done (lua_State *L, const void *data, size_t len)
+{
+  const tx_done_t *d = data;
+  (void)len;
+  for (uint8_t i = 0; i < d->n; i++)
+    luaL_unref (L, LUA_REGISTRYINDEX, d->refs[i]);
+  return 0;
+}
+
+/* The work is done in push_tx_done; the event only needs a handler. */
+static int
+tx_done_handler (lua_State *L)
+{
+  (void)L;
+  return 0;
+}
+
+static void
+tx_release (lhos_uart_port_t *p, tx_done_t *done)
+{
+  size_t len = offsetof (tx_done_t, refs) + done->n * sizeof (int);
+  while (!lhos_lua_post_event (LHOS_UART_TX_EVENT, push_tx_done, done, len))
+    {
+      if (!p->tx_run)
+        return; /* left for uart.close */
+      vTaskDelay (pdMS_TO_TICKS (5));
+    }
+  done->n = 0;
+}
+
+static void
+tx_task (void *arg)
+{
+  lhos_uart_port_t *p = arg;
+  int port = (int)(p - s_ports);
+  tx_done_t done = { 0 };
+  tx_item_t it;
+
+  while (p->tx_run)
+    {
+      if (xQueueReceive (p->txq, &it, portMAX_DELAY) != pdTRUE || !it.data)
+        continue;
+      /* blocks this task, not the VM, until the bytes fit the driver */
+      lhos_uart_port_write (port, it.data, it.len);
+      if (it.owned)
+        free ((void *)it.data);
+      else
+        done.refs[done.n++] = it.ref;
+      UBaseType_t waiting = uxQueueMessagesWaiting (p->txq);
+      if (done.n && (waiting == 0 || done.n == LHOS_UART_TX_BATCH))
+        tx_release (p, &done);
+      if (p->tx_blocked && waiting <= p->tx_depth / 2)
+        {
+          p->tx_blocked = false;
+          post_status (p, port, LHOS_UART_EV_WRITABLE);
+        }
+    }
+  p->tx_left = done;
+  xSemaphoreGive (p->tx_done);
+  vTaskDelete (NULL);
+}
+
+static esp_err_t
+tx_start (int port, uint8_t depth)
+{
+  lhos_uart_port_t *p = &s_ports[port];
+  p->tx_depth = depth;
+  p->tx_blocked = false;
+  p->tx_left.n = 0;
+  p->txq = xQueueCreate (depth, sizeof (tx_item_t));
+  if (!p->tx_done)
+    p->tx_done = xSemaphoreCreateBinary ();
+  if (!p->txq || !p->tx_done)
+    goto fail;
+  p->tx_run = true;
+  if (xTaskCreatePinnedToCore (tx_task, "lhos_uart_tx", LHOS_UART_TASK_STACK,
+                               p, LHOS_UART_TASK_PRIO, &p->tx_task, 0)
+      == pdPASS)
+    return ESP_OK;
+  p->tx_run = false;
+  p->tx_task = NULL;
+fail:
+  if (p->txq)
+    vQueueDelete (p->txq);
+  p->txq = NULL;
+  return ESP_ERR_NO_MEM;
+}
+
+/* Waits for the write in progress, if any; queued writes are left for
+   tx_drain. A write held back by CTS would never finish, so after a while
+   flow control is dropped to let the FIFO drain. */
+static esp_err_t
+tx_stop (int port)
+{
+  lhos_uart_port_t *p = &s_ports[port];
+  if (!p->tx_task)
+    return ESP_OK;
+  /* a full queue needs no wake: the task is writing and sees `tx_run`
+     before it takes the next item */
+  tx_item_t wake = { .data = NULL };
+  p->tx_run = false;
+  xQueueSendToFront (p->txq, &wake, 0);
+  if (xSemaphoreTake (p->tx_done, pdMS_TO_TICKS (LHOS_UART_STOP_MS))
+      != pdTRUE)
+    {
+      uart_set_hw_flow_ctrl (port, UART_HW_FLOWCTRL_DISABLE, 0);
+      if (xSemaphoreTake (p->tx_done, pdMS_TO_TICKS (LHOS_UART_STOP_MS))
+          != pdTRUE)
+        return ESP_ERR_TIMEOUT;
+    }
+  p->tx_task = NULL;
+  return ESP_OK;
+}
+
+/* After tx_stop: free copied writes and move the Lua references still
+   held by the port to tx_orphans. Needs no Lua state, so closing through
+   the C API leaves nothing behind. */
+static void
+tx_drain (int port)
+{
+  lhos_uart_port_t *p = &s_ports[port];
+  if (!p->txq)
+    return;
+  size_t n = p->tx_norphans;
+  size_t cap = n + uxQueueMessagesWaiting (p->txq) + p->tx_left.n;
+  int *refs = cap ? realloc (p->tx_orphans, cap * sizeof (int)) : NULL;
+  if (refs)
+    p->tx_orphans = refs;
+  else if (cap > n)
+    ESP_LOGW (TAG, "uart%d: no memory, %u write(s) stay referenced", port,
+              (unsigned)(cap - n));
+  tx_item_t it;
+  while (xQueueReceive (p->txq, &it, 0) == pdTRUE)
+    {
+      if (it.owned)
+        free ((void *)it.data);
+      else if (it.data && refs)
+        refs[n++] = it.ref;
+    }
+  for (uint8_t i = 0; refs && i < p->tx_left.n; i++)
+    refs[n++] = p->tx_left.refs[i];
+  p->tx_left.n = 0;
+  p->tx_norphans = n;
+  vQueueDelete (p->txq);
+  p->txq = NULL;
+}
+
+/* On the Lua task: drop the references tx_drain collected. */
+static void
+tx_unref_orphans (lua_State *L, int port)
+{
+  lhos_uart_port_t *p = &s_ports[port];
+  for (size_t i = 0; i < p->tx_norphans; i++)
+    luaL_unref (L, LUA_REGISTRYINDEX, p->tx_orphans[i]);
+  free (p->tx_orphans);
+  p->tx_orphans = NULL;
+  p->tx_norphans = 0;
+}
+
+/* Queue the value at `idx` (a string or buffer) for the TX task. With
+   `copy` a buffer is copied; strings are immutable and always referenced. */
+static int
+tx_enqueue (lua_State *L, int port, int idx, bool copy)
+{
+  lhos_uart_port_t *p = &s_ports[port];
+  tx_item_t it = { .ref = LUA_NOREF };
+  lhos_buffer_t *b = lhos_lua_buffer_test (L, idx);
+
+  it.data = lhos_lua_checkbytes (L, idx, &it.len);
+  if (it.len == 0)
+    {
+      lua_pushinteger (L, 0);
+      return 1;
+    }
+  if (b && copy)
+    {
+      uint8_t *dup = malloc (it.len);
+      if (!dup)
+        {
+          lua_pushnil (L);
+          lua_pushstring (L, "oom");
+          return 2;
+        }
+      memcpy (dup, it.data, it.len);
+      it.data = dup;
+      it.owned = true;
+    }
+  else
+    {
+      lua_pushvalue (L, idx);
+      it.ref = luaL_ref (L, LUA_REGISTRYINDEX);
+    }
+  if (xQueueSend (p->txq, &it, 0) != pdTRUE)
+    {
+      if (it.owned)
+        free ((void *)it.data);
+      else
+        luaL_unref (L, LUA_REGISTRYINDEX, it.ref);
+      p->tx_blocked = true;
+      lua_pushnil (L);
+      lua_pushstring (L, "busy");
+      return 2;
+    }
+  lua_pushinteger (L, (lua_Integer)it.len);
+  return 1;
+}
+
+/* Framing options of uart.open (table at `t`). */
+static void
+parse_framing (lua_State *L, int t, lhos_uart_frame_config_t *fc,
+               size_t *max_frame, uint8_t *gap)
+{
+  memset (fc, 0, sizeof (*fc));
+  *gap = 0;
+
+  lua_getfield (L, t, "max_frame");
+  lua_Integer mf = luaL_optinteger (L, -1, LHOS_UART_FRAME_DEFAULT);
+  luaL_argcheck (L, mf >= 16 && mf <= LHOS_UART_FRAME_MAX, t,
+                 "max_frame out of range");
+  *max_frame = (size_t)mf;
+  lua_pop (L, 1);
+
+  lua_getfield (L, t, "delimiter");
+  if (!lua_isnil (L, -1))
+    {
+      size_t dl = 0;
+      const char *d = luaL_checklstring (L, -1, &dl);
+      luaL_argcheck (L, dl > 0 && dl <= LHOS_UART_DELIM_MAX, t,
+                     "delimiter must be 1-4 bytes");
+      fc->mode = LHOS_UART_FRAME_DELIM;
+      memcpy (fc->delim, d, dl);
+      fc->delim_len = (uint8_t)dl;
+    }
+  lua_pop (L, 1);
+
+  lua_getfield (L, t, "length");
+  if (!lua_isnil (L, -1))
+    {
+      luaL_argcheck (L, fc->mode == LHOS_UART_FRAME_NONE, t,
+                     "only one framing option may be set");
+      lua_Integer size = luaL_checkinteger (L, -1);
+      luaL_argcheck (L, size == 1 || size == 2, t, "length must be 1 or 2");
+      fc->mode = LHOS_UART_FRAME_LENGTH;
+      fc->len_size = (uint8_t)size;
+      lua_getfield (L, t, "length_offset");
+      lua_Integer off = luaL_optinteger (L, -1, 0);
+      luaL_argcheck (L, off >= 0 && off < 16, t,
+                     "length_offset out of range");
+      fc->len_offset = (uint8_t)off;
+      lua_getfield (L, t, "length_adjust");
+      lua_Integer adj = luaL_optinteger (L, -1, 0);
+      luaL_argcheck (L, adj >= -256 && adj <= 256, t,
+                     "length_adjust out of range");
+      fc->len_adjust = (int16_t)adj;
+      lua_getfield (L, t, "little_endian");
+      fc->len_le = lua_toboolean (L, -1);
+      lua_pop (L, 3);
+    }
+  lua_pop (L, 1);
+
+  lua_getfield (L, t, "gap");
+  if (lua_toboolean (L, -1))
+    {
+      luaL_argcheck (L, fc->mode == LHOS_UART_FRAME_NONE, t,
+                     "only one framing option may be set");
+      lua_Integer chars = lua_isboolean (L, -1) ? LHOS_UART_GAP_DEFAULT
+                                                : luaL_checkinteger (L, -1);
+      luaL_argcheck (L, chars >= 1 && chars <= LHOS_UART_GAP_MAX, t,
+                     "gap out of range");
+      fc->mode = LHOS_UART_FRAME_GAP;
+      *gap = (uint8_t)chars;
+    }
+  lua_pop (L, 1);
+}
+
+static bool
+is_pattern (const lhos_uart_frame_config_t *fc)
+{
+  if (fc->mode != LHOS_UART_FRAME_DELIM
+      || fc->delim_len > LHOS_UART_PATTERN_MAX)
+    return false;
+  for (uint8_t i = 1; i < fc->delim_len; i++)
+    if (fc->delim[i] != fc->delim[0])
+      return false;
+  return true;
+}
+
+/* Runs after the driver is installed and before the service task starts. */
+static esp_err_t
+framing_start (int port, const lhos_uart_frame_config_t *fc,
+               size_t max_frame, uint8_t gap)
+{
+  lhos_uart_port_t *p = &s_ports[port];
+  p->framed = false;
+  p->pattern_len = 0;
+  if (fc->mode == LHOS_UART_FRAME_NONE)
+    return ESP_OK;
+
+  uint8_t *buf = malloc (max_frame);
+  if (!buf)
+    return ESP_ERR_NO_MEM;
+  if (!lhos_uart_framer_init (&p->framer, fc, buf, max_frame))
+    {
+      free (buf);
+      return ESP_ERR_INVALID_ARG;
+    }
+  esp_err_t rc = ESP_OK;
+  if (is_pattern (fc))
+    {
+      rc = uart_enable_pattern_det_baud_intr (port, (char)fc->delim[0],
+                                              fc->delim_len, 9, 0, 0);
+      if (rc == ESP_OK)
+        rc = uart_pattern_queue_reset (port, LHOS_UART_PATTERN_QUEUE);
+      if (rc == ESP_OK)
+        p->pattern_len = fc->delim_len;
+    }
+  else if (fc->mode == LHOS_UART_FRAME_GAP)
+    rc = uart_set_rx_timeout (port, gap);
+  if (rc != ESP_OK)
+    {
+      free (buf);
+      p->framer.buf = NULL;
+      return rc;
+    }
+  p->framed = true;
+  return ESP_OK;
+}
+
+/* Runs once the service task is gone. */
+static void
+framing_stop (int port)
+{
+  lhos_uart_port_t *p = &s_ports[port];
+  free (p->framer.buf);
+  p->framer.buf = NULL;
+  p->framed = false;
+  p->pattern_len = 0;
+}
+
+esp_err_t
+lhos_uart_port_open (int uart_num, const lhos_uart_config_t *c)
+{
+  if (uart_num < 0 || uart_num >= UART_NUM_MAX || !c)
+    return ESP_ERR_INVALID_ARG;
+  lhos_uart_port_t *p = port_get (uart_num);
+  int rx_buf_size = c->rx_buffer_size;
+  if (rx_buf_size < 128)
+    rx_buf_size = 128;
+  if (rx_buf_size > 65536)
+    rx_buf_size = 65536;
+
+  uart_config_t cfg = {
+    .baud_rate = c->baud > 0 ? c->baud : 115200,
+    .data_bits = UART_DATA_8_BITS,
+    .parity = c->parity,
+    .stop_bits = UART_STOP_BITS_1,
+    .flow_ctrl = c->flow_control ? UART_HW_FLOWCTRL_CTS_RTS
+                                 : UART_HW_FLOWCTRL_DISABLE,
+    .source_clk = UART_SCLK_APB,
+  };
+
+  esp_err_t rc = uart_param_config (uart_num, &cfg);
+  if (rc != ESP_OK)
+    return rc;
+  memset (&p->stats, 0, sizeof (p->stats));
+  p->stats.rx_buffer_size = (uint32_t)rx_buf_size;
+  rc = uart_set_pin (uart_num, c->tx_pin, c->rx_pin, c->rts_pin,
+                     UART_PIN_NO_CHANGE);
+  if (rc != ESP_OK)
+    return rc;
+
+  /* install driver with RX/TX buffer sizes (circular buffer provided by
+   * driver) and an event queue for the service task */
+  rc = uart_driver_install (uart_num, rx_buf_size, c->tx_buffer_size,
+                            LHOS_UART_QUEUE_LEN, &p->events, 0);
+  if (rc != ESP_OK)
+    return rc;
+  if (c->rs485)
+    rc = uart_set_mode (uart_num, UART_MODE_RS485_HALF_DUPLEX);
+  if (rc == ESP_OK)
+    rc = framing_start (uart_num, &c->framing,
+                        c->max_frame ? c->max_frame : LHOS_UART_FRAME_DEFAULT,
+                        c->gap ? c->gap : LHOS_UART_GAP_DEFAULT);
+  if (rc == ESP_OK)
+    {
+      rc = service_start (uart_num);
+      if (rc != ESP_OK)
+        framing_stop (uart_num);
+    }
+  if (rc != ESP_OK)
+    {
+      uart_driver_delete (uart_num);
+      p->events = NULL;
+    }
+  return rc;
+}
+
+esp_err_t
+lhos_uart_port_close (int uart_num)
+{
+  if (uart_num < 0 || uart_num >= UART_NUM_MAX)
+    return ESP_ERR_INVALID_ARG;
+  esp_err_t rc = tx_stop (uart_num);
+  if (rc == ESP_OK)
+    rc = service_stop (uart_num);
+  if (rc != ESP_OK)
+    {
+      ESP_LOGW (TAG, "uart%d: close timed out", uart_num);
+      return rc;
+    }
+  tx_drain (uart_num);
+  framing_stop (uart_num);
+  s_ports[uart_num].sink = NULL;
+  return uart_driver_delete (uart_num);
+}
+
+int
+lhos_uart_port_write (int uart_num, const void *data, size_t len)
+{
+  int written = uart_write_bytes (uart_num, data, len);
+  if (written > 0)
+    s_ports[uart_num].stats.tx_bytes += (uint32_t)written;
+  return written;
+}
+
+esp_err_t
+lhos_uart_get_stats (int uart_num, lhos_uart_stats_t *out)
+{
+  if (uart_num < 0 || uart_num >= UART_NUM_MAX || !out)
+    return ESP_ERR_INVALID_ARG;
+  lhos_uart_port_t *p = &s_ports[uart_num];
+  *out = p->stats;
+  out->frames = p->framer.frames;
+  out->frames_dropped = p->framer.dropped;
+  return ESP_OK;
+}
+
+void
+lhos_uart_reset_stats (int uart_num)
+{
+  if (uart_num < 0 || uart_num >= UART_NUM_MAX)
+    return;
+  lhos_uart_port_t *p = &s_ports[uart_num];
+  uint32_t size = p->stats.rx_buffer_size;
+  memset (&p->stats, 0, sizeof (p->stats));
+  p->stats.rx_buffer_size = size;
+  p->framer.frames = 0;
+  p->framer.dropped = 0;
+}
+
+void
+lhos_uart_set_frame_sink (int uart_num, lhos_uart_frame_sink_t sink,
+                          void *ctx)
+{
+  if (uart_num < 0 || uart_num >= UART_NUM_MAX)
+    return;
+  lhos_uart_port_t *p = port_get (uart_num);
+  p->sink = NULL;
+  p->sink_ctx = ctx;
+  p->sink = sink;
+}
+
 int
 lhos_uart_open (lua_State *L)
 {
-  int uart_num = (int)luaL_checkinteger (L, 1);
-  int baud = (int)luaL_optinteger (L, 2, 115200);
-  int tx_pin = (int)luaL_optinteger (L, 3, UART_PIN_NO_CHANGE);
-  int rx_pin = (int)luaL_optinteger (L, 4, UART_PIN_NO_CHANGE);
+  int uart_num = check_port (L, 1);
+  /* left by a close through the C API */
+  tx_unref_orphans (L, uart_num);
+  lhos_uart_config_t cfg = LHOS_UART_CONFIG_DEFAULT ();
+  cfg.baud = (int)luaL_optinteger (L, 2, 115200);
+  cfg.tx_pin = (int)luaL_optinteger (L, 3, UART_PIN_NO_CHANGE);
+  cfg.rx_pin = (int)luaL_optinteger (L, 4, UART_PIN_NO_CHANGE);
+  bool nonblocking = false;
+  lua_Integer tx_queue = LHOS_UART_TX_QUEUE_DEFAULT;
   /* Optional options table at arg 5 */
-  int rx_buf_size = 1024;
-  int tx_buf_size = 0;
-  uart_parity_t parity = UART_PARITY_DISABLE;
-  uart_hw_flowcontrol_t flow = UART_HW_FLOWCTRL_DISABLE;
   if (lua_istable (L, 5))
     {
       lua_getfield (L, 5, "parity");
@@ -37,68 +971,66 @@ lhos_uart_open (lua_State *L)
         {
           const char *p = lua_tostring (L, -1);
           if (strcmp (p, "even") == 0)
-            parity = UART_PARITY_EVEN;
+            cfg.parity = UART_PARITY_EVEN;
           else if (strcmp (p, "odd") == 0)
-            parity = UART_PARITY_ODD;
+            cfg.parity = UART_PARITY_ODD;
           else
-            parity = UART_PARITY_DISABLE;
+            cfg.parity = UART_PARITY_DISABLE;
         }
       lua_pop (L, 1);
       lua_getfield (L, 5, "flow_control");
       if (lua_isboolean (L, -1) && lua_toboolean (L, -1))
-        flow = UART_HW_FLOWCTRL_CTS_RTS;
+        cfg.flow_control = true;
       lua_pop (L, 1);
       lua_getfield (L, 5, "rx_buffer_size");
       if (lua_isnumber (L, -1))
-        rx_buf_size = (int)lua_tointeger (L, -1);
+        cfg.rx_buffer_size = (int)lua_tointeger (L, -1);
       lua_pop (L, 1);
       lua_getfield (L, 5, "tx_buffer_size");
       if (lua_isnumber (L, -1))
-        tx_buf_size = (int)lua_tointeger (L, -1);
+        cfg.tx_buffer_size = (int)lua_tointeger (L, -1);
+      lua_pop (L, 1);
+      lua_getfield (L, 5, "rts_pin");
+      if (lua_isnumber (L, -1))
+        cfg.rts_pin = (int)lua_tointeger (L, -1);
+      lua_pop (L, 1);
+      lua_getfield (L, 5, "rs485");
+      cfg.rs485 = lua_toboolean (L, -1);
+      lua_pop (L, 1);
+      lua_getfield (L, 5, "nonblocking");
+      nonblocking = lua_toboolean (L, -1);
       lua_pop (L, 1);
+      lua_getfield (L, 5, "tx_queue");
+      tx_queue = luaL_optinteger (L, -1, LHOS_UART_TX_QUEUE_DEFAULT);
+      luaL_argcheck (L, tx_queue >= 1 && tx_queue <= LHOS_UART_TX_QUEUE_MAX,
+                     5, "tx_queue out of range");
+      lua_pop (L, 1);
+      parse_framing (L, 5, &cfg.framing, &cfg.max_frame, &cfg.gap);
     }
 
-  if (rx_buf_size < 128)
-    rx_buf_size = 128;
-  if (rx_buf_size > 65536)
-    rx_buf_size = 65536;
-
-  uart_config_t cfg = {
-    .baud_rate = baud,
-    .data_bits = UART_DATA_8_BITS,
-    .parity = parity,
-    .stop_bits = UART_STOP_BITS_1,
-    .flow_ctrl = flow,
-    .source_clk = UART_SCLK_APB,
-  };
-
-  esp_err_t rc = uart_param_config (uart_num, &cfg);
-  if (rc != ESP_OK)
+  if (nonblocking && !lhos_lua_has_event_handler (LHOS_UART_TX_EVENT))
     {
-      lua_pushnil (L);
-      lua_pushstring (L, esp_err_to_name (rc));
-      return 2;
+      lua_pushcfunction (L, tx_done_handler);
+      bool ok = lhos_lua_set_event_handler (L, LHOS_UART_TX_EVENT,
+                                            lua_gettop (L));
+      lua_pop (L, 1);
+      if (!ok)
+        return luaL_error (L, "too many event handlers");
     }
 
-  rc = uart_set_pin (uart_num, tx_pin, rx_pin, UART_PIN_NO_CHANGE,
-                     UART_PIN_NO_CHANGE);
-  if (rc != ESP_OK)
+  esp_err_t rc = lhos_uart_port_open (uart_num, &cfg);
+  if (rc == ESP_OK && nonblocking)
     {
-      lua_pushnil (L);
-      lua_pushstring (L, esp_err_to_name (rc));
-      return 2;
+      rc = tx_start (uart_num, (uint8_t)tx_queue);
+      if (rc != ESP_OK)
+        lhos_uart_port_close (uart_num);
     }
-
-  /* install driver with RX/TX buffer sizes (circular buffer provided by
-   * driver) */
-  rc = uart_driver_install (uart_num, rx_buf_size, tx_buf_size, 0, NULL, 0);
   if (rc != ESP_OK)
     {
       lua_pushnil (L);
       lua_pushstring (L, esp_err_to_name (rc));
       return 2;
     }
-
   lua_pushboolean (L, 1);
   return 1;
 }
@@ -106,8 +1038,9 @@ lhos_uart_open (lua_State *L)
 int
 lhos_uart_close (lua_State *L)
 {
-  int uart_num = (int)luaL_checkinteger (L, 1);
-  esp_err_t rc = uart_driver_delete (uart_num);
+  int uart_num = check_port (L, 1);
+  esp_err_t rc = lhos_uart_port_close (uart_num);
+  tx_unref_orphans (L, uart_num);
   if (rc != ESP_OK)
     {
       lua_pushnil (L);
@@ -121,15 +1054,17 @@ lhos_uart_close (lua_State *L)
 int
 lhos_uart_write (lua_State *L)
 {
-  int uart_num = (int)luaL_checkinteger (L, 1);
+  int uart_num = check_port (L, 1);
+  if (s_ports[uart_num].txq)
+    return tx_enqueue (L, uart_num, 2, true);
   size_t len = 0;
-  const char *data = luaL_checklstring (L, 2, &len);
+  const uint8_t *data = lhos_lua_checkbytes (L, 2, &len);
   if (!data || len == 0)
     {
       lua_pushinteger (L, 0);
       return 1;
     }
-  int written = uart_write_bytes (uart_num, data, len);
+  int written = lhos_uart_port_write (uart_num, data, len);
   if (written < 0)
     {
       lua_pushnil (L);
@@ -140,13 +1075,41 @@ lhos_uart_write (lua_State *L)
   return 1;
 }
 
+int
+lhos_uart_send (lua_State *L)
+{
+  int uart_num = check_port (L, 1);
+  lhos_lua_buffer_check (L, 2);
+  if (s_ports[uart_num].txq)
+    return tx_enqueue (L, uart_num, 2, false);
+  return lhos_uart_write (L);
+}
+
 int
 lhos_uart_read (lua_State *L)
 {
-  int uart_num = (int)luaL_checkinteger (L, 1);
-  int max_bytes = (int)luaL_optinteger (L, 2, 256);
+  int uart_num = check_port (L, 1);
+  lhos_uart_stats_t *st = &s_ports[uart_num].stats;
   int timeout_ms = (int)luaL_optinteger (L, 3, 100);
 
+  lhos_buffer_t *b = lhos_lua_buffer_test (L, 2);
+  if (b)
+    {
+      int r = uart_read_bytes (uart_num, b->data, b->cap,
+                               pdMS_TO_TICKS (timeout_ms));
+      if (r < 0)
+        {
+          lua_pushnil (L);
+          lua_pushstring (L, "read_failed");
+          return 2;
+        }
+      b->len = (size_t)r;
+      st->rx_bytes += (uint32_t)r;
+      lua_pushinteger (L, r);
+      return 1;
+    }
+
+  int max_bytes = (int)luaL_optinteger (L, 2, 256);
   if (max_bytes <= 0)
     max_bytes = 256;
   uint8_t *buf = malloc (max_bytes);
@@ -165,6 +1128,7 @@ lhos_uart_read (lua_State *L)
       lua_pushstring (L, "read_failed");
       return 2;
     }
+  st->rx_bytes += (uint32_t)r;
   lua_pushlstring (L, (const char *)buf, r);
   free (buf);
   return 1;
@@ -185,3 +1149,49 @@ lhos_uart_available (lua_State *L)
   lua_pushinteger (L, (lua_Integer)len);
   return 1;
 }
+
+int
+lhos_uart_on (lua_State *L)
+{
+  int uart_num = check_port (L, 1);
+  lhos_uart_port_t *p = &s_ports[uart_num];
+  if (!lua_isnoneornil (L, 2))
+    luaL_checktype (L, 2, LUA_TFUNCTION);
+  if (!lhos_lua_set_event_handler (L, p->name, 2))
+    return luaL_error (L, "too many event handlers");
+  /* hand over whatever arrived while nobody was listening */
+  if (p->task && !lua_isnoneornil (L, 2))
+    {
+      uart_event_t kick = { .type = UART_DATA };
+      xQueueSend (p->events, &kick, 0);
+    }
+  return 0;
+}
+
+int
+lhos_uart_stats (lua_State *L)
+{
+  int uart_num = check_port (L, 1);
+  lhos_uart_stats_t st;
+  lhos_uart_get_stats (uart_num, &st);
+  if (lua_toboolean (L, 2))
+    lhos_uart_reset_stats (uart_num);
+  lua_createtable (L, 0, 12);
+#define STAT(f)                                                              \
+  lua_pushinteger (L, st.f);                                                 \
+  lua_setfield (L, -2, #f)
+  STAT (rx_bytes);
+  STAT (tx_bytes);
+  STAT (overflows);
+  STAT (buffer_full);
+  STAT (parity_errors);
+  STAT (frame_errors);
+  STAT (breaks);
+  STAT (events_dropped);
+  STAT (max_buffered);
+  STAT (rx_buffer_size);
+  STAT (frames);
+  STAT (frames_dropped);
+#undef STAT
+  return 1;
+}
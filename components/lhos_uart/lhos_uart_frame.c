@@ -0,0 +1,184 @@
+#include "lhos_uart_frame.h"
+
+#include <string.h>
+
+static size_t
+header_size (const lhos_uart_frame_config_t *cfg)
+{
+  return (size_t)cfg->len_offset + cfg->len_size;
+}
+
+static void
+emit (lhos_uart_framer_t *f, size_t len, lhos_uart_frame_cb_t cb, void *ctx)
+{
+  if (f->discard)
+    f->dropped++;
+  else
+    {
+      f->frames++;
+      if (cb)
+        cb (f->buf, len, ctx);
+    }
+}
+
+void
+lhos_uart_framer_reset (lhos_uart_framer_t *f)
+{
+  f->len = 0;
+  f->need = 0;
+  f->discard = false;
+}
+
+bool
+lhos_uart_framer_init (lhos_uart_framer_t *f,
+                       const lhos_uart_frame_config_t *cfg, uint8_t *buf,
+                       size_t cap)
+{
+  if (!f || !cfg || !buf)
+    return false;
+  switch (cfg->mode)
+    {
+    case LHOS_UART_FRAME_DELIM:
+      if (cfg->delim_len == 0 || cfg->delim_len > LHOS_UART_DELIM_MAX
+          || cap <= cfg->delim_len)
+        return false;
+      break;
+    case LHOS_UART_FRAME_LENGTH:
+      if ((cfg->len_size != 1 && cfg->len_size != 2)
+          || cap < header_size (cfg))
+        return false;
+      break;
+    case LHOS_UART_FRAME_GAP:
+      if (cap == 0)
+        return false;
+      break;
+    default:
+      return false;
+    }
+  memset (f, 0, sizeof (*f));
+  f->cfg = *cfg;
+  f->buf = buf;
+  f->cap = cap;
+  return true;
+}
+
+static size_t
+feed_delim (lhos_uart_framer_t *f, const uint8_t *data, size_t n,
+            lhos_uart_frame_cb_t cb, void *ctx)
+{
+  const uint8_t *delim = f->cfg.delim;
+  const size_t dl = f->cfg.delim_len;
+  const uint8_t last = delim[dl - 1];
+  size_t frames = 0;
+  for (size_t i = 0; i < n; i++)
+    {
+      if (f->len == f->cap)
+        {
+          /* too long: drop what we have but keep enough of the tail to
+             recognise a delimiter that straddles the cut */
+          size_t keep = dl - 1;
+          memmove (f->buf, f->buf + f->len - keep, keep);
+          f->len = keep;
+          f->discard = true;
+        }
+      f->buf[f->len++] = data[i];
+      if (data[i] == last && f->len >= dl
+          && memcmp (f->buf + f->len - dl, delim, dl) == 0)
+        {
+          emit (f, f->len - dl, cb, ctx);
+          frames += !f->discard;
+          lhos_uart_framer_reset (f);
+        }
+    }
+  return frames;
+}
+
+static size_t
+feed_length (lhos_uart_framer_t *f, const uint8_t *data, size_t n,
+             lhos_uart_frame_cb_t cb, void *ctx)
+{
+  const lhos_uart_frame_config_t *c = &f->cfg;
+  const size_t hdr = header_size (c);
+  size_t frames = 0;
+  size_t i = 0;
+  while (i < n)
+    {
+      size_t want = (f->need ? f->need : hdr) - f->len;
+      size_t take = (n - i < want) ? n - i : want;
+      /* an oversized frame is skipped by counting, not stored */
+      if (!f->discard)
+        memcpy (f->buf + f->len, data + i, take);
+      f->len += take;
+      i += take;
+
+      if (!f->need && f->len == hdr)
+        {
+          const uint8_t *p = f->buf + c->len_offset;
+          long v;
+          if (c->len_size == 1)
+            v = p[0];
+          else if (c->len_le)
+            v = p[0] | (p[1] << 8);
+          else
+            v = (p[0] << 8) | p[1];
+          long total = (long)hdr + v + c->len_adjust;
+          f->need = total > (long)hdr ? (size_t)total : hdr;
+          if (f->need > f->cap)
+            f->discard = true;
+        }
+      if (f->need && f->len == f->need)
+        {
+          emit (f, f->len, cb, ctx);
+          frames += !f->discard;
+          lhos_uart_framer_reset (f);
+        }
+    }
+  return frames;
+}
+
+static void
+feed_gap (lhos_uart_framer_t *f, const uint8_t *data, size_t n)
+{
+  size_t room = f->cap - f->len;
+  size_t take = n < room ? n : room;
+  memcpy (f->buf + f->len, data, take);
+  f->len += take;
+  if (take < n)
+    f->discard = true;
+}
+
+size_t
+lhos_uart_framer_feed (lhos_uart_framer_t *f, const uint8_t *data, size_t n,
+                       lhos_uart_frame_cb_t cb, void *ctx)
+{
+  switch (f->cfg.mode)
+    {
+    case LHOS_UART_FRAME_DELIM:
+      return feed_delim (f, data, n, cb, ctx);
+    case LHOS_UART_FRAME_LENGTH:
+      return feed_length (f, data, n, cb, ctx);
+    case LHOS_UART_FRAME_GAP:
+      feed_gap (f, data, n);
+      return 0;
+    default:
+      return 0;
+    }
+}
+
+size_t
+lhos_uart_framer_flush (lhos_uart_framer_t *f, lhos_uart_frame_cb_t cb,
+                        void *ctx)
+{
+  size_t frames = 0;
+  if (f->len == 0)
+    return 0;
+  if (f->cfg.mode == LHOS_UART_FRAME_GAP)
+    {
+      emit (f, f->len, cb, ctx);
+      frames = !f->discard;
+    }
+  else
+    f->dropped++;
+  lhos_uart_framer_reset (f);
+  return frames;
+}
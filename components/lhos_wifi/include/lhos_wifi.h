@@ -5,10 +5,82 @@
 
 #include "esp_err.h"
 #include <stdbool.h>
+#include <stdint.h>
+
+/* Station state, driven by WIFI_EVENT/IP_EVENT */
+typedef enum
+{
+  LHOS_WIFI_IDLE = 0,   /* not asked to connect */
+  LHOS_WIFI_CONNECTING, /* attempt in progress */
+  LHOS_WIFI_WAITING,    /* retry scheduled, or PMK being derived */
+  LHOS_WIFI_LINKED,     /* associated, waiting for an address */
+  LHOS_WIFI_CONNECTED,  /* got an IP address */
+} lhos_wifi_state_t;
+
+typedef enum
+{
+  LHOS_WIFI_EV_CONNECTED = 0, /* associated with the AP */
+  LHOS_WIFI_EV_GOT_IP,
+  LHOS_WIFI_EV_LOST_IP,
+  LHOS_WIFI_EV_DISCONNECTED, /* link lost or attempt failed */
+} lhos_wifi_event_id_t;
+
+typedef struct
+{
+  lhos_wifi_event_id_t id;
+  uint8_t bssid[6];
+  uint8_t channel;
+  int8_t rssi;
+  uint8_t reason;      /* wifi_err_reason_t of a disconnection */
+  bool fast;           /* attempt used the cached BSSID and channel */
+  uint32_t elapsed_ms; /* GOT_IP: since the attempt started */
+  char ip[16];
+} lhos_wifi_event_t;
+
+/* Radio settings applied together */
+typedef enum
+{
+  LHOS_WIFI_PROFILE_DEFAULT = 0, /* driver defaults, nothing applied */
+  LHOS_WIFI_PROFILE_THROUGHPUT,  /* no power save, HT40, full power */
+  LHOS_WIFI_PROFILE_LATENCY,     /* no power save, HT20, every beacon */
+  LHOS_WIFI_PROFILE_POWERSAVE,   /* max modem sleep, reduced power */
+} lhos_wifi_profile_t;
+
+typedef struct
+{
+  lhos_wifi_profile_t profile;
+  uint8_t ps;               /* wifi_ps_type_t in effect */
+  uint8_t bandwidth_mhz;    /* 20 or 40 */
+  int8_t tx_power;          /* limit, in 0.25 dBm; 0 before starting */
+  uint16_t listen_interval; /* beacons; taken at association */
+  int8_t rssi;              /* 0 when not associated */
+  uint8_t channel;
+  uint8_t last_reason; /* of the last disconnection */
+  uint32_t connects;   /* associations */
+  uint32_t drops;      /* established links lost */
+  uint32_t failures;   /* attempts that did not associate */
+  uint32_t last_connect_ms; /* attempt start to IP, last time */
+} lhos_wifi_stats_t;
+
+/* Called on the event loop task; must not block. */
+typedef void (*lhos_wifi_event_cb_t) (const lhos_wifi_event_t *ev,
+                                      void *arg);
 
 esp_err_t lhos_wifi_init (void);
+esp_err_t lhos_wifi_deinit (void);
+/* Starts connecting and returns; progress arrives as events. The driver
+   reconnects on its own until lhos_wifi_disconnect(). */
 esp_err_t lhos_wifi_connect (const char *ssid, const char *pwd);
 esp_err_t lhos_wifi_disconnect (void);
 bool lhos_wifi_is_connected (void);
+lhos_wifi_state_t lhos_wifi_state (void);
+void lhos_wifi_set_event_cb (lhos_wifi_event_cb_t cb, void *arg);
+/* Power save and TX power change at once; bandwidth and listen interval
+   are part of the association and apply from the next one. */
+esp_err_t lhos_wifi_set_profile (lhos_wifi_profile_t profile);
+lhos_wifi_profile_t lhos_wifi_profile (void);
+void lhos_wifi_stats (lhos_wifi_stats_t *out);
+/* Drop the cached AP (BSSID, channel, PMK) from NVS. */
+esp_err_t lhos_wifi_forget (void);
 
 #endif /* LHOS_WIFI_H */
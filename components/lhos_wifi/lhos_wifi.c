@@ -1,93 +1,776 @@
-/* LHOS WiFi: single implementation using NVS and esp_event loop
- * This file provides `lhos_wifi_init`, `lho s_wifi_deinit`,
- * `lhos_wifi_connect`, `lhos_wifi_disconnect`, and `lhos_wifi_is_connected`.
+/* LHOS WiFi: station manager driven by the esp_event loop.
+ * WIFI_EVENT and IP_EVENT handlers keep the connection state and
+ * reconnect on their own. The last AP joined (BSSID, channel and, for
+ * WPA/WPA2-PSK, the PMK) is cached in NVS, so a reconnect goes straight
+ * to the known AP on its channel without scanning; a full scan with the
+ * passphrase is the fallback. PBKDF2 runs once per new credentials, on
+ * a task of its own so lhos_wifi_connect() returns at once, and never
+ * inside the driver's attempts.
  */
 
 #include "lhos_wifi.h"
 #include "esp_event.h"
 #include "esp_log.h"
 #include "esp_netif.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "mbedtls/pkcs5.h"
+#include "nvs.h"
 #include "nvs_flash.h"
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 static const char *TAG = "LHOS_WIFI";
 
+#define WIFI_NVS_NAMESPACE "lhos_wifi"
+#define WIFI_NVS_KEY "ap"
+#define WIFI_CACHE_VERSION 2
+#define WIFI_FAST_TRIES 2 /* attempts on the cached AP before scanning */
+#define WIFI_RETRY_MIN_MS 100
+#define WIFI_RETRY_MAX_MS 10000
+#define WIFI_DERIVE_STACK 4096
+
+/* Radio settings of a profile */
+typedef struct
+{
+  wifi_ps_type_t ps;
+  wifi_bandwidth_t bandwidth;
+  int8_t tx_power; /* 0.25 dBm */
+  uint16_t listen_interval;
+} wifi_profile_t;
+
+static const wifi_profile_t s_profiles[] = {
+  [LHOS_WIFI_PROFILE_THROUGHPUT] = { WIFI_PS_NONE, WIFI_BW_HT40, 80, 3 },
+  [LHOS_WIFI_PROFILE_LATENCY] = { WIFI_PS_NONE, WIFI_BW_HT20, 80, 1 },
+  [LHOS_WIFI_PROFILE_POWERSAVE] = { WIFI_PS_MAX_MODEM, WIFI_BW_HT20, 52, 10 },
+};
+
+/* Last AP joined, as stored in NVS. The SSID and PMK tie it to the
+   credentials it was learnt with; nothing cheaper to test a password
+   guess against than the PMK itself is kept. */
+typedef struct
+{
+  uint8_t version;
+  uint8_t channel;
+  uint8_t has_pmk; /* the credentials had a password; pmk is theirs */
+  uint8_t psk;     /* the AP takes pmk as its PSK */
+  uint8_t bssid[6];
+  char ssid[33];
+  uint8_t pmk[32];
+} wifi_cache_t;
+
+/* Credentials handed to the PBKDF2 task */
+typedef struct
+{
+  uint32_t gen;
+  char ssid[33];
+  char password[65];
+} wifi_derive_t;
+
+static esp_netif_t *s_netif;
+static esp_event_handler_instance_t s_wifi_handler;
+static esp_event_handler_instance_t s_got_ip_handler;
+static esp_event_handler_instance_t s_lost_ip_handler;
+static esp_timer_handle_t s_retry_timer;
+static SemaphoreHandle_t s_lock; /* everything below */
+static volatile lhos_wifi_state_t s_state;
+static bool s_started;
+static lhos_wifi_event_cb_t s_cb;
+static void *s_cb_arg;
+
+static wifi_config_t s_config; /* full scan with the passphrase */
+static wifi_cache_t s_cache;
+static bool s_cache_valid; /* s_cache.bssid/channel describe the AP */
+static bool s_cache_dirty; /* differs from NVS */
+static uint8_t s_pmk[32];
+static bool s_pmk_ready; /* s_pmk derived from the current credentials */
+static bool s_deriving;  /* a task is deriving s_pmk */
+static uint32_t s_gen;   /* bumped by new credentials */
+static bool s_fast;      /* the attempt in progress uses the cache */
+static bool s_replace;   /* lhos_wifi_connect() dropped the link */
+static int s_tries;      /* failed attempts since the last success */
+static int64_t s_since_us;
+static lhos_wifi_profile_t s_profile;
+static lhos_wifi_stats_t s_stats; /* counters only */
+
+/* Load the cache if it was learnt for `ssid` and, unless the network is
+   open, for the password whose PMK is `pmk`. */
+static void
+cache_load (const char *ssid, const uint8_t *pmk)
+{
+  s_cache_valid = false;
+  nvs_handle_t h;
+  if (nvs_open (WIFI_NVS_NAMESPACE, NVS_READONLY, &h) == ESP_OK)
+    {
+      size_t len = sizeof (s_cache);
+      esp_err_t err = nvs_get_blob (h, WIFI_NVS_KEY, &s_cache, &len);
+      nvs_close (h);
+      s_cache_valid = err == ESP_OK && len == sizeof (s_cache)
+                      && s_cache.version == WIFI_CACHE_VERSION
+                      && strncmp (s_cache.ssid, ssid, sizeof (s_cache.ssid))
+                             == 0
+                      && s_cache.has_pmk == (pmk != NULL)
+                      && (!pmk || memcmp (s_cache.pmk, pmk, 32) == 0);
+    }
+  if (!s_cache_valid)
+    {
+      memset (&s_cache, 0, sizeof (s_cache));
+      s_cache.version = WIFI_CACHE_VERSION;
+      strncpy (s_cache.ssid, ssid, sizeof (s_cache.ssid) - 1);
+      s_cache.has_pmk = pmk != NULL;
+      if (pmk)
+        memcpy (s_cache.pmk, pmk, sizeof (s_cache.pmk));
+    }
+}
+
+/* Without s_lock: a flash commit can stall for a while. */
+static void
+cache_store (const wifi_cache_t *c)
+{
+  nvs_handle_t h;
+  esp_err_t err = nvs_open (WIFI_NVS_NAMESPACE, NVS_READWRITE, &h);
+  if (err == ESP_OK)
+    {
+      err = nvs_set_blob (h, WIFI_NVS_KEY, c, sizeof (*c));
+      if (err == ESP_OK)
+        err = nvs_commit (h);
+      nvs_close (h);
+    }
+  if (err != ESP_OK)
+    ESP_LOGW (TAG, "AP cache not saved: %s", esp_err_to_name (err));
+}
+
+/* A 64-character password is the PSK in hex. */
+static bool
+hex_psk (const char *s, uint8_t psk[32])
+{
+  for (int i = 0; i < 64; i++)
+    {
+      int c = s[i] | 0x20, v;
+      if (s[i] >= '0' && s[i] <= '9')
+        v = s[i] - '0';
+      else if (c >= 'a' && c <= 'f')
+        v = c - 'a' + 10;
+      else
+        return false;
+      psk[i / 2] = (uint8_t)((i & 1) ? (psk[i / 2] << 4) | v : v);
+    }
+  return true;
+}
+
+/* Start one attempt, on the cached AP while it has not failed too often;
+   s_lock held. */
+static esp_err_t
+attempt (void)
+{
+  wifi_config_t c = s_config;
+  s_fast = s_cache_valid && s_tries < WIFI_FAST_TRIES;
+  if (s_fast)
+    {
+      c.sta.bssid_set = true;
+      memcpy (c.sta.bssid, s_cache.bssid, sizeof (c.sta.bssid));
+      c.sta.channel = s_cache.channel;
+      c.sta.scan_method = WIFI_FAST_SCAN;
+      /* 64 hex digits are taken as the PSK itself */
+      if (s_cache.psk)
+        for (int i = 0; i < 32; i++)
+          {
+            static const char hex[] = "0123456789abcdef";
+            c.sta.password[i * 2] = (uint8_t)hex[s_cache.pmk[i] >> 4];
+            c.sta.password[i * 2 + 1] = (uint8_t)hex[s_cache.pmk[i] & 15];
+          }
+    }
+  esp_err_t err = ESP_OK;
+  if (s_profile != LHOS_WIFI_PROFILE_DEFAULT)
+    {
+      const wifi_profile_t *p = &s_profiles[s_profile];
+      c.sta.listen_interval = p->listen_interval;
+      err = esp_wifi_set_bandwidth (WIFI_IF_STA, p->bandwidth);
+    }
+  if (err == ESP_OK)
+    err = esp_wifi_set_config (WIFI_IF_STA, &c);
+  if (err == ESP_OK)
+    err = esp_wifi_connect ();
+  s_state = LHOS_WIFI_CONNECTING;
+  return err;
+}
+
+/* The part of the profile that applies to a running driver; s_lock
+   held. */
+static esp_err_t
+apply_profile (void)
+{
+  if (s_profile == LHOS_WIFI_PROFILE_DEFAULT || !s_started)
+    return ESP_OK;
+  const wifi_profile_t *p = &s_profiles[s_profile];
+  esp_err_t err = esp_wifi_set_ps (p->ps);
+  if (err != ESP_OK && p->ps == WIFI_PS_NONE)
+    {
+      /* the coexistence scheme needs modem sleep while Bluetooth runs */
+      ESP_LOGW (TAG, "power save kept: %s", esp_err_to_name (err));
+      err = esp_wifi_set_ps (WIFI_PS_MIN_MODEM);
+    }
+  if (err == ESP_OK)
+    err = esp_wifi_set_max_tx_power (p->tx_power);
+  return err;
+}
+
+/* Retry after a failed attempt, backing off; s_lock held. */
+static void
+schedule_retry (void)
+{
+  int shift = s_tries > 7 ? 7 : s_tries;
+  uint32_t ms = WIFI_RETRY_MIN_MS << shift;
+  if (ms > WIFI_RETRY_MAX_MS)
+    ms = WIFI_RETRY_MAX_MS;
+  s_state = LHOS_WIFI_WAITING;
+  esp_timer_stop (s_retry_timer);
+  if (esp_timer_start_once (s_retry_timer, (uint64_t)ms * 1000) != ESP_OK)
+    ESP_LOGE (TAG, "retry timer failed");
+}
+
+static void
+retry_tick (void *arg)
+{
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  if (s_state == LHOS_WIFI_WAITING && !s_deriving)
+    {
+      esp_err_t err = attempt ();
+      if (err != ESP_OK)
+        {
+          ESP_LOGW (TAG, "connect failed: %s", esp_err_to_name (err));
+          s_tries++;
+          schedule_retry ();
+        }
+    }
+  xSemaphoreGive (s_lock);
+}
+
+static void
+emit (const lhos_wifi_event_t *ev)
+{
+  lhos_wifi_event_cb_t cb = s_cb;
+  if (cb)
+    cb (ev, s_cb_arg);
+}
+
+static bool
+is_psk (wifi_auth_mode_t mode)
+{
+  return mode == WIFI_AUTH_WPA_PSK || mode == WIFI_AUTH_WPA2_PSK
+         || mode == WIFI_AUTH_WPA_WPA2_PSK;
+}
+
+static void
+on_wifi_event (void *arg, esp_event_base_t base, int32_t id, void *data)
+{
+  lhos_wifi_event_t ev = { 0 };
+  bool post = false;
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  if (id == WIFI_EVENT_STA_CONNECTED)
+    {
+      const wifi_event_sta_connected_t *e = data;
+      /* learn the AP; the PMK only fits the PSK modes */
+      bool psk = s_pmk_ready && is_psk (e->authmode);
+      if (!s_cache_valid || s_cache.channel != e->channel
+          || memcmp (s_cache.bssid, e->bssid, 6) != 0 || s_cache.psk != psk)
+        s_cache_dirty = true;
+      memcpy (s_cache.bssid, e->bssid, 6);
+      s_cache.channel = e->channel;
+      s_cache.psk = psk;
+      s_cache_valid = true;
+      s_tries = 0;
+      s_stats.connects++;
+      if (s_state != LHOS_WIFI_IDLE)
+        s_state = LHOS_WIFI_LINKED;
+      ev = (lhos_wifi_event_t){ .id = LHOS_WIFI_EV_CONNECTED,
+                                .channel = e->channel,
+                                .fast = s_fast };
+      memcpy (ev.bssid, e->bssid, 6);
+      post = true;
+    }
+  else if (id == WIFI_EVENT_STA_DISCONNECTED)
+    {
+      const wifi_event_sta_disconnected_t *e = data;
+      ev = (lhos_wifi_event_t){ .id = LHOS_WIFI_EV_DISCONNECTED,
+                                .reason = e->reason,
+                                .rssi = e->rssi,
+                                .fast = s_fast };
+      memcpy (ev.bssid, e->bssid, 6);
+      post = true;
+      bool was_up = s_state == LHOS_WIFI_LINKED
+                    || s_state == LHOS_WIFI_CONNECTED;
+      s_stats.last_reason = e->reason;
+      if (was_up)
+        s_stats.drops++;
+      else if (s_state == LHOS_WIFI_CONNECTING)
+        s_stats.failures++;
+      bool idle = s_state == LHOS_WIFI_IDLE || s_deriving
+                  || (s_state == LHOS_WIFI_WAITING && !s_replace);
+      if (s_deriving)
+        s_replace = false; /* derive_task() starts the attempt */
+      if (idle)
+        ; /* not wanted, or a retry is already due */
+      else if (was_up || s_replace)
+        {
+          /* a dropout, or lhos_wifi_connect() replacing the link: go
+             straight back, to the AP just left if it was cached */
+          if (was_up)
+            s_since_us = esp_timer_get_time ();
+          s_replace = false;
+          esp_err_t err = attempt ();
+          if (err != ESP_OK)
+            {
+              s_tries++;
+              schedule_retry ();
+            }
+        }
+      else
+        {
+          s_tries++;
+          schedule_retry ();
+        }
+    }
+  xSemaphoreGive (s_lock);
+  if (post)
+    emit (&ev);
+}
+
+static void
+on_ip_event (void *arg, esp_event_base_t base, int32_t id, void *data)
+{
+  lhos_wifi_event_t ev = { 0 };
+  wifi_cache_t store;
+  bool dirty = false;
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  if (id == IP_EVENT_STA_GOT_IP)
+    {
+      const ip_event_got_ip_t *e = data;
+      if (s_state != LHOS_WIFI_IDLE)
+        s_state = LHOS_WIFI_CONNECTED;
+      ev.id = LHOS_WIFI_EV_GOT_IP;
+      ev.fast = s_fast;
+      ev.elapsed_ms = (uint32_t)((esp_timer_get_time () - s_since_us)
+                                 / 1000);
+      snprintf (ev.ip, sizeof (ev.ip), IPSTR, IP2STR (&e->ip_info.ip));
+      s_stats.last_connect_ms = ev.elapsed_ms;
+      wifi_ap_record_t ap;
+      if (esp_wifi_sta_get_ap_info (&ap) == ESP_OK)
+        {
+          memcpy (ev.bssid, ap.bssid, 6);
+          ev.channel = ap.primary;
+          ev.rssi = ap.rssi;
+        }
+      /* only once the link proved usable */
+      dirty = s_cache_dirty;
+      if (dirty)
+        {
+          store = s_cache;
+          s_cache_dirty = false;
+        }
+      ESP_LOGI (TAG, "got %s in %lu ms%s", ev.ip,
+                (unsigned long)ev.elapsed_ms, s_fast ? " (cached AP)" : "");
+    }
+  else
+    {
+      if (s_state == LHOS_WIFI_CONNECTED)
+        s_state = LHOS_WIFI_LINKED;
+      ev.id = LHOS_WIFI_EV_LOST_IP;
+    }
+  xSemaphoreGive (s_lock);
+  if (dirty)
+    cache_store (&store);
+  emit (&ev);
+}
+
+/* PBKDF2 takes a good part of a second; the result is dropped if other
+   credentials came meanwhile. The attempt starts here unless the old
+   link is still going down, in which case its disconnection does. */
+static void
+derive_task (void *arg)
+{
+  wifi_derive_t *d = arg;
+  uint8_t pmk[32];
+  bool ok = mbedtls_pkcs5_pbkdf2_hmac_ext (
+                MBEDTLS_MD_SHA1, (const uint8_t *)d->password,
+                strlen (d->password), (const uint8_t *)d->ssid,
+                strlen (d->ssid), 4096, sizeof (pmk), pmk)
+            == 0;
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  if (d->gen == s_gen)
+    {
+      s_deriving = false;
+      if (!ok)
+        {
+          ESP_LOGE (TAG, "PMK derivation failed");
+          s_state = LHOS_WIFI_IDLE;
+          s_replace = false;
+        }
+      else
+        {
+          memcpy (s_pmk, pmk, sizeof (s_pmk));
+          s_pmk_ready = true;
+          cache_load (d->ssid, s_pmk);
+          s_cache_dirty = false;
+          if (s_state == LHOS_WIFI_WAITING && !s_replace
+              && attempt () != ESP_OK)
+            {
+              s_tries++;
+              schedule_retry ();
+            }
+        }
+    }
+  xSemaphoreGive (s_lock);
+  memset (d, 0, sizeof (*d));
+  free (d);
+  vTaskDelete (NULL);
+}
+
+/* `ssid` and `password` are what s_config holds; s_lock held. */
+static bool
+same_credentials (const char *ssid, const char *password)
+{
+  return strncmp ((const char *)s_config.sta.ssid, ssid,
+                  sizeof (s_config.sta.ssid))
+             == 0
+         && strncmp ((const char *)s_config.sta.password, password,
+                     sizeof (s_config.sta.password))
+                == 0;
+}
+
+static void
+unregister_handlers (void)
+{
+  if (s_wifi_handler)
+    esp_event_handler_instance_unregister (WIFI_EVENT, ESP_EVENT_ANY_ID,
+                                           s_wifi_handler);
+  if (s_got_ip_handler)
+    esp_event_handler_instance_unregister (IP_EVENT, IP_EVENT_STA_GOT_IP,
+                                           s_got_ip_handler);
+  if (s_lost_ip_handler)
+    esp_event_handler_instance_unregister (IP_EVENT, IP_EVENT_STA_LOST_IP,
+                                           s_lost_ip_handler);
+  s_wifi_handler = s_got_ip_handler = s_lost_ip_handler = NULL;
+}
+
 esp_err_t
 lhos_wifi_init (void)
 {
+  if (s_netif)
+    return ESP_OK;
   ESP_LOGI (TAG, "Initializing WiFi");
   esp_err_t ret = nvs_flash_init ();
   if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND)
     {
-      ESP_ERROR_CHECK (nvs_flash_erase ());
-      ret = nvs_flash_init ();
+      ret = nvs_flash_erase ();
+      if (ret == ESP_OK)
+        ret = nvs_flash_init ();
     }
-  ESP_ERROR_CHECK (ret);
+  if (ret != ESP_OK)
+    goto fail;
 
-  ESP_ERROR_CHECK (esp_netif_init ());
-  ESP_ERROR_CHECK (esp_event_loop_create_default ());
-  esp_netif_create_default_wifi_sta ();
+  if (!s_lock && !(s_lock = xSemaphoreCreateMutex ()))
+    return ESP_ERR_NO_MEM;
+  if (!s_retry_timer)
+    {
+      esp_timer_create_args_t args = {
+        .callback = retry_tick,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "lhos_wifi",
+      };
+      ret = esp_timer_create (&args, &s_retry_timer);
+      if (ret != ESP_OK)
+        goto fail;
+    }
+  ret = esp_netif_init ();
+  if (ret != ESP_OK)
+    goto fail;
+  /* somebody else may have created it */
+  ret = esp_event_loop_create_default ();
+  if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE)
+    goto fail;
 
+  s_netif = esp_netif_create_default_wifi_sta ();
+  if (!s_netif)
+    return ESP_ERR_NO_MEM;
   wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT ();
-  ESP_ERROR_CHECK (esp_wifi_init (&cfg));
-
+  ret = esp_wifi_init (&cfg);
+  if (ret != ESP_OK)
+    goto fail_netif;
+  /* the AP cache is ours; the driver need not rewrite its config to
+     flash on every attempt */
+  esp_wifi_set_storage (WIFI_STORAGE_RAM);
+  ret = esp_event_handler_instance_register (
+      WIFI_EVENT, ESP_EVENT_ANY_ID, on_wifi_event, NULL, &s_wifi_handler);
+  if (ret == ESP_OK)
+    ret = esp_event_handler_instance_register (
+        IP_EVENT, IP_EVENT_STA_GOT_IP, on_ip_event, NULL, &s_got_ip_handler);
+  if (ret == ESP_OK)
+    ret = esp_event_handler_instance_register (IP_EVENT,
+                                               IP_EVENT_STA_LOST_IP,
+                                               on_ip_event, NULL,
+                                               &s_lost_ip_handler);
+  if (ret != ESP_OK)
+    {
+      unregister_handlers ();
+      esp_wifi_deinit ();
+      goto fail_netif;
+    }
   return ESP_OK;
+
+fail_netif:
+  esp_netif_destroy_default_wifi (s_netif);
+  s_netif = NULL;
+fail:
+  ESP_LOGE (TAG, "init failed: %s", esp_err_to_name (ret));
+  return ret;
 }
 
 esp_err_t
 lhos_wifi_deinit (void)
 {
   ESP_LOGI (TAG, "Deinitializing WiFi");
-  ESP_ERROR_CHECK (esp_wifi_deinit ());
-  ESP_ERROR_CHECK (esp_event_loop_delete_default ());
-  ESP_ERROR_CHECK (esp_netif_deinit ());
-  return ESP_OK;
+  lhos_wifi_disconnect ();
+  unregister_handlers ();
+  esp_err_t ret = esp_wifi_deinit ();
+  if (s_netif)
+    {
+      esp_netif_destroy_default_wifi (s_netif);
+      s_netif = NULL;
+    }
+  return ret;
 }
 
 esp_err_t
 lhos_wifi_connect (const char *ssid, const char *password)
 {
+  if (!s_netif)
+    return ESP_ERR_INVALID_STATE;
+  if (!ssid || !ssid[0] || strlen (ssid) > 32)
+    return ESP_ERR_INVALID_ARG;
+  if (!password)
+    password = "";
+  size_t pwd_len = strlen (password);
+  if (pwd_len > 64 || (pwd_len > 0 && pwd_len < 8))
+    return ESP_ERR_INVALID_ARG;
   ESP_LOGI (TAG, "Connecting to WiFi SSID: %s", ssid);
 
-  wifi_config_t wifi_config = {
-    .sta = {
-      .threshold.authmode = WIFI_AUTH_WPA2_PSK,
-      .pmf_cfg = {
-        .capable = true,
-        .required = false,
-      },
-    },
-  };
-  if (ssid)
-    strncpy ((char *)wifi_config.sta.ssid, ssid,
-             sizeof (wifi_config.sta.ssid) - 1);
-  if (password)
-    strncpy ((char *)wifi_config.sta.password, password,
-             sizeof (wifi_config.sta.password) - 1);
-
-  ESP_ERROR_CHECK (esp_wifi_set_mode (WIFI_MODE_STA));
-  ESP_ERROR_CHECK (esp_wifi_set_config (WIFI_IF_STA, &wifi_config));
-  ESP_ERROR_CHECK (esp_wifi_start ());
-  ESP_ERROR_CHECK (esp_wifi_connect ());
+  /* The PMK is derived once per credentials rather than inside every
+     attempt; it also identifies the cached AP. A 64-digit password
+     already is the PSK, any other one goes to derive_task(). */
+  uint8_t pmk[32];
+  if (pwd_len == 64 && !hex_psk (password, pmk))
+    return ESP_ERR_INVALID_ARG;
 
-  return ESP_OK;
+  esp_err_t ret = ESP_OK;
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  bool same = (s_pmk_ready || s_deriving)
+              && same_credentials (ssid, password);
+  if (!same)
+    {
+      s_gen++;
+      s_deriving = false;
+      s_pmk_ready = pwd_len == 64;
+      if (s_pmk_ready)
+        memcpy (s_pmk, pmk, sizeof (s_pmk));
+      if (pwd_len && pwd_len < 64)
+        {
+          wifi_derive_t *d = malloc (sizeof (*d));
+          if (d)
+            {
+              d->gen = s_gen;
+              strcpy (d->ssid, ssid);
+              strcpy (d->password, password);
+            }
+          if (!d
+              || xTaskCreate (derive_task, "lhos_wifi_pmk", WIFI_DERIVE_STACK,
+                              d, tskIDLE_PRIORITY + 1, NULL)
+                     != pdPASS)
+            {
+              free (d);
+              ret = ESP_ERR_NO_MEM;
+            }
+          s_deriving = ret == ESP_OK;
+          s_cache_valid = false;
+        }
+      else
+        cache_load (ssid, s_pmk_ready ? s_pmk : NULL);
+      s_cache_dirty = false;
+    }
+
+  memset (&s_config, 0, sizeof (s_config));
+  strncpy ((char *)s_config.sta.ssid, ssid, sizeof (s_config.sta.ssid));
+  memcpy (s_config.sta.password, password, pwd_len);
+  s_config.sta.threshold.authmode
+      = pwd_len ? WIFI_AUTH_WPA2_PSK : WIFI_AUTH_OPEN;
+  s_config.sta.pmf_cfg.capable = true;
+  s_config.sta.pmf_cfg.required = false;
+  s_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+  s_config.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+
+  if (ret == ESP_OK && !s_started)
+    {
+      ret = esp_wifi_set_mode (WIFI_MODE_STA);
+      if (ret == ESP_OK)
+        ret = esp_wifi_start ();
+      s_started = ret == ESP_OK;
+      if (s_started && apply_profile () != ESP_OK)
+        ESP_LOGW (TAG, "profile not applied");
+    }
+  if (ret == ESP_OK)
+    {
+      lhos_wifi_state_t prev = s_state;
+      s_tries = 0;
+      s_since_us = esp_timer_get_time ();
+      esp_timer_stop (s_retry_timer);
+      if (prev == LHOS_WIFI_LINKED || prev == LHOS_WIFI_CONNECTED
+          || prev == LHOS_WIFI_CONNECTING)
+        {
+          /* the disconnection event starts the new attempt */
+          s_state = LHOS_WIFI_WAITING;
+          s_replace = true;
+          ret = esp_wifi_disconnect ();
+        }
+      else if (s_deriving)
+        s_state = LHOS_WIFI_WAITING; /* derive_task() starts it */
+      else
+        ret = attempt ();
+    }
+  if (ret != ESP_OK)
+    s_state = LHOS_WIFI_IDLE;
+  xSemaphoreGive (s_lock);
+  if (ret != ESP_OK)
+    ESP_LOGE (TAG, "connect failed: %s", esp_err_to_name (ret));
+  return ret;
 }
 
 esp_err_t
 lhos_wifi_disconnect (void)
 {
+  if (!s_lock)
+    return ESP_ERR_INVALID_STATE;
   ESP_LOGI (TAG, "Disconnecting from WiFi");
-  ESP_ERROR_CHECK (esp_wifi_disconnect ());
-  ESP_ERROR_CHECK (esp_wifi_stop ());
-  return ESP_OK;
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  s_state = LHOS_WIFI_IDLE;
+  s_replace = false;
+  esp_timer_stop (s_retry_timer);
+  esp_err_t ret = ESP_OK;
+  if (s_started)
+    {
+      esp_wifi_disconnect ();
+      ret = esp_wifi_stop ();
+      s_started = false;
+    }
+  xSemaphoreGive (s_lock);
+  return ret;
 }
 
 bool
 lhos_wifi_is_connected (void)
 {
-  wifi_ap_record_t ap_info;
-  if (esp_wifi_sta_get_ap_info (&ap_info) == ESP_OK)
-    return true;
-  return false;
-}
\ No newline at end of file
+  return s_state == LHOS_WIFI_CONNECTED;
+}
+
+lhos_wifi_state_t
+lhos_wifi_state (void)
+{
+  return s_state;
+}
+
+void
+lhos_wifi_set_event_cb (lhos_wifi_event_cb_t cb, void *arg)
+{
+  s_cb_arg = arg;
+  s_cb = cb;
+}
+
+esp_err_t
+lhos_wifi_set_profile (lhos_wifi_profile_t profile)
+{
+  if (profile < LHOS_WIFI_PROFILE_DEFAULT
+      || profile > LHOS_WIFI_PROFILE_POWERSAVE)
+    return ESP_ERR_INVALID_ARG;
+  if (!s_lock)
+    {
+      /* before init: taken when the driver starts */
+      s_profile = profile;
+      return ESP_OK;
+    }
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  s_profile = profile;
+  esp_err_t err = apply_profile ();
+  xSemaphoreGive (s_lock);
+  if (err != ESP_OK)
+    ESP_LOGE (TAG, "profile failed: %s", esp_err_to_name (err));
+  return err;
+}
+
+lhos_wifi_profile_t
+lhos_wifi_profile (void)
+{
+  return s_profile;
+}
+
+void
+lhos_wifi_stats (lhos_wifi_stats_t *out)
+{
+  memset (out, 0, sizeof (*out));
+  if (!s_lock)
+    {
+      out->profile = s_profile;
+      return;
+    }
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  *out = s_stats;
+  out->profile = s_profile;
+  bool linked = s_state == LHOS_WIFI_LINKED
+                || s_state == LHOS_WIFI_CONNECTED;
+  bool started = s_started;
+  xSemaphoreGive (s_lock);
+
+  /* report what the driver has, not what was asked for */
+  wifi_ps_type_t ps;
+  if (esp_wifi_get_ps (&ps) == ESP_OK)
+    out->ps = ps;
+  wifi_bandwidth_t bw;
+  if (esp_wifi_get_bandwidth (WIFI_IF_STA, &bw) == ESP_OK)
+    out->bandwidth_mhz = bw == WIFI_BW_HT40 ? 40 : 20;
+  if (started)
+    esp_wifi_get_max_tx_power (&out->tx_power);
+  wifi_config_t c;
+  if (esp_wifi_get_config (WIFI_IF_STA, &c) == ESP_OK)
+    out->listen_interval = c.sta.listen_interval;
+  wifi_ap_record_t ap;
+  if (linked && esp_wifi_sta_get_ap_info (&ap) == ESP_OK)
+    {
+      out->rssi = ap.rssi;
+      out->channel = ap.primary;
+    }
+}
+
+esp_err_t
+lhos_wifi_forget (void)
+{
+  nvs_handle_t h;
+  esp_err_t err = nvs_open (WIFI_NVS_NAMESPACE, NVS_READWRITE, &h);
+  if (err != ESP_OK)
+    return err;
+  err = nvs_erase_key (h, WIFI_NVS_KEY);
+  if (err == ESP_ERR_NVS_NOT_FOUND)
+    err = ESP_OK;
+  if (err == ESP_OK)
+    err = nvs_commit (h);
+  nvs_close (h);
+  if (s_lock)
+    {
+      xSemaphoreTake (s_lock, portMAX_DELAY);
+      s_cache_valid = false;
+      s_cache.psk = 0;
+      xSemaphoreGive (s_lock);
+    }
+  return err;
+}
@@ -1,9 +1,14 @@
 #include "lhos_ws2812b.h"
 #include "driver/rmt_encoder.h"
 #include "driver/rmt_tx.h"
+#include "esp_heap_caps.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
+#include "soc/soc_caps.h"
+#include <stdlib.h>
 #include <string.h>
 
 static const char *TAG = "LHOS_WS2812B";
@@ -16,78 +21,605 @@ static const char *TAG = "LHOS_WS2812B";
 #define WS2812B_T0L 26      // 0.8us
 #define WS2812B_T1H 26      // 0.7us
 #define WS2812B_T1L 14      // 0.6us
-#define WS2812B_RESET 30000 // 300us reset
+#define WS2812B_RESET 6000 // 150us, both halves of one symbol: 300us reset
 
-static rmt_channel_handle_t tx_channel = NULL;
-static rmt_encoder_handle_t copy_encoder = NULL;
-static rmt_symbol_word_t
-    led_data[24 * WS2812B_LED_COUNT + 1]; // 24 bits per LED + reset
+#define WS2812B_MEM_SYMBOLS 64
+#define WS2812B_DMA_SYMBOLS 1024
+#define WS2812B_TASK_STACK 2560
+#define WS2812B_TASK_PRIO (tskIDLE_PRIORITY + 3)
 
-esp_err_t
-lhos_ws2812b_init (void)
+#define WS2812B_NOTIFY_SHOW 0x01
+#define WS2812B_NOTIFY_STOP 0x02
+
+// Animation frame period; frames due while one is on the wire are skipped
+#define WS2812B_FRAME_MS 20
+
+/* Pixel bytes go through the RMT bytes encoder, which expands each bit
+   into a symbol on the fly while the channel drains its memory, then the
+   copy encoder appends the reset (latch) low time. */
+typedef struct
+{
+  rmt_encoder_t base; /* first: the driver hands us &base */
+  rmt_encoder_handle_t bytes;
+  rmt_encoder_handle_t copy;
+  int state;
+  rmt_symbol_word_t reset;
+} ws2812b_encoder_t;
+
+typedef struct
+{
+  rmt_channel_handle_t chan;
+  rmt_encoder_handle_t enc;
+  size_t count;
+  uint8_t *back;  /* drawn by callers, under s_lock */
+  uint8_t *front; /* read by the RMT channel while a frame is sent */
+  SemaphoreHandle_t done; /* TX task exited */
+  TaskHandle_t task;
+  volatile bool pending; /* show() not yet picked up */
+  volatile bool busy;    /* a frame is on the wire */
+  ws2812b_stats_t stats;
+} ws2812b_strip_t;
+
+typedef struct
+{
+  bool active;
+  size_t first;
+  size_t n;
+  int64_t start_us;
+  lhos_fx_t fx;
+} ws2812b_anim_t;
+
+static ws2812b_strip_t s_strip;
+/* Created once and kept, so the animation timer can always take it. */
+static SemaphoreHandle_t s_lock;
+/* Gamma and brightness, applied byte by byte as a frame is copied out. */
+static uint8_t s_lut[256];
+static float s_gamma = 1.0f;
+static uint8_t s_brightness = 255;
+static ws2812b_anim_t s_anims[WS2812B_ANIMS];
+/* GRB colors for LHOS_FX_INDEX data; a hue wheel until set. */
+static uint8_t s_palette[256 * 3];
+static esp_timer_handle_t s_timer;
+
+static void
+put (uint8_t *p, uint32_t rgb)
+{
+  // WS2812B uses GRB order
+  p[0] = (uint8_t)(rgb >> 8);
+  p[1] = (uint8_t)(rgb >> 16);
+  p[2] = (uint8_t)rgb;
+}
+
+static size_t
+encoder_encode (rmt_encoder_t *encoder, rmt_channel_handle_t channel,
+                const void *data, size_t size, rmt_encode_state_t *ret_state)
+{
+  ws2812b_encoder_t *e = (ws2812b_encoder_t *)encoder;
+  rmt_encode_state_t session = RMT_ENCODING_RESET;
+  int state = RMT_ENCODING_RESET;
+  size_t encoded = 0;
+
+  switch (e->state)
+    {
+    case 0:
+      encoded += e->bytes->encode (e->bytes, channel, data, size, &session);
+      if (session & RMT_ENCODING_COMPLETE)
+        e->state = 1;
+      if (session & RMT_ENCODING_MEM_FULL)
+        {
+          state |= RMT_ENCODING_MEM_FULL;
+          break;
+        }
+      /* fall through */
+    case 1:
+      encoded += e->copy->encode (e->copy, channel, &e->reset,
+                                  sizeof (e->reset), &session);
+      if (session & RMT_ENCODING_COMPLETE)
+        {
+          e->state = 0;
+          state |= RMT_ENCODING_COMPLETE;
+        }
+      if (session & RMT_ENCODING_MEM_FULL)
+        state |= RMT_ENCODING_MEM_FULL;
+      break;
+    }
+  *ret_state = (rmt_encode_state_t)state;
+  return encoded;
+}
+
+static esp_err_t
+encoder_reset (rmt_encoder_t *encoder)
+{
+  ws2812b_encoder_t *e = (ws2812b_encoder_t *)encoder;
+  rmt_encoder_reset (e->bytes);
+  rmt_encoder_reset (e->copy);
+  e->state = 0;
+  return ESP_OK;
+}
+
+static esp_err_t
+encoder_del (rmt_encoder_t *encoder)
 {
-  ESP_LOGI (TAG, "Initializing WS2812B on GPIO %d", WS2812B_GPIO_PIN);
+  ws2812b_encoder_t *e = (ws2812b_encoder_t *)encoder;
+  if (e->bytes)
+    rmt_del_encoder (e->bytes);
+  if (e->copy)
+    rmt_del_encoder (e->copy);
+  free (e);
+  return ESP_OK;
+}
+
+static esp_err_t
+encoder_new (rmt_encoder_handle_t *out)
+{
+  ws2812b_encoder_t *e = rmt_alloc_encoder_mem (sizeof (*e));
+  if (!e)
+    return ESP_ERR_NO_MEM;
+  memset (e, 0, sizeof (*e));
+  e->base.encode = encoder_encode;
+  e->base.reset = encoder_reset;
+  e->base.del = encoder_del;
+
+  rmt_bytes_encoder_config_t bytes_config = {
+    .bit0 = { .level0 = 1, .duration0 = WS2812B_T0H,
+              .level1 = 0, .duration1 = WS2812B_T0L },
+    .bit1 = { .level0 = 1, .duration0 = WS2812B_T1H,
+              .level1 = 0, .duration1 = WS2812B_T1L },
+    .flags.msb_first = 1,
+  };
+  rmt_copy_encoder_config_t copy_config = {};
+  esp_err_t rc = rmt_new_bytes_encoder (&bytes_config, &e->bytes);
+  if (rc == ESP_OK)
+    rc = rmt_new_copy_encoder (&copy_config, &e->copy);
+  if (rc != ESP_OK)
+    {
+      encoder_del (&e->base);
+      return rc;
+    }
+  e->reset = (rmt_symbol_word_t){ .level0 = 0, .duration0 = WS2812B_RESET,
+                                  .level1 = 0, .duration1 = WS2812B_RESET };
+  *out = &e->base;
+  return ESP_OK;
+}
 
+static esp_err_t
+channel_new (int gpio, rmt_channel_handle_t *out)
+{
   rmt_tx_channel_config_t tx_config = {
-    .gpio_num = WS2812B_GPIO_PIN,
+    .gpio_num = gpio,
     .clk_src = RMT_CLK_SRC_DEFAULT,
     .resolution_hz = RMT_RESOLUTION_HZ,
-    .mem_block_symbols = 64,
+    .mem_block_symbols = WS2812B_MEM_SYMBOLS,
     .trans_queue_depth = 4,
   };
+#if SOC_RMT_SUPPORT_DMA
+  /* DMA keeps long strips glitch free under interrupt load; the channel
+     memory is the fallback when no DMA channel is left. */
+  tx_config.mem_block_symbols = WS2812B_DMA_SYMBOLS;
+  tx_config.flags.with_dma = 1;
+  if (rmt_new_tx_channel (&tx_config, out) == ESP_OK)
+    return ESP_OK;
+  tx_config.mem_block_symbols = WS2812B_MEM_SYMBOLS;
+  tx_config.flags.with_dma = 0;
+#endif
+  return rmt_new_tx_channel (&tx_config, out);
+}
+
+static void
+tx_task (void *arg)
+{
+  ws2812b_strip_t *s = arg;
+  rmt_transmit_config_t transmit_config = {
+    .loop_count = 0,
+  };
+  uint32_t bits = 0;
+
+  for (;;)
+    {
+      xTaskNotifyWait (0, UINT32_MAX, &bits, portMAX_DELAY);
+      if (bits & WS2812B_NOTIFY_STOP)
+        break;
+      if (!(bits & WS2812B_NOTIFY_SHOW))
+        continue;
+      s->busy = true;
+      xSemaphoreTake (s_lock, portMAX_DELAY);
+      s->pending = false;
+      for (size_t i = 0; i < s->count * 3; i++)
+        s->front[i] = s_lut[s->back[i]];
+      xSemaphoreGive (s_lock);
+      /* shows arriving from here on set the bit again for the next lap */
+      if (rmt_transmit (s->chan, s->enc, s->front, s->count * 3,
+                        &transmit_config)
+          == ESP_OK)
+        {
+          /* the front buffer is not touched again until the frame is out */
+          rmt_tx_wait_all_done (s->chan, -1);
+          s->stats.shown++;
+        }
+      else
+        s->stats.errors++;
+      s->busy = false;
+    }
+  xSemaphoreGive (s->done);
+  vTaskDelete (NULL);
+}
+
+/* Runs on the esp_timer task: render every running animation into the
+   back buffer and show it. Skips the frame while the last one is still
+   being sent, so animations never queue up behind a long strip. */
+static void
+anim_tick (void *arg)
+{
+  ws2812b_strip_t *s = &s_strip;
+  int64_t now = esp_timer_get_time ();
+  bool any = false, drew = false;
+  (void)arg;
+
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  for (int i = 0; i < WS2812B_ANIMS; i++)
+    {
+      ws2812b_anim_t *a = &s_anims[i];
+      if (!a->active)
+        continue;
+      if (!s->task || a->first + a->n > s->count)
+        {
+          a->active = false;
+          continue;
+        }
+      any = true;
+      if (s->busy)
+        continue;
+      a->active = lhos_fx_render (&a->fx,
+                                  (uint32_t)((now - a->start_us) / 1000),
+                                  s->back + a->first * 3, a->n);
+      drew = true;
+    }
+  if (!any)
+    esp_timer_stop (s_timer);
+  xSemaphoreGive (s_lock);
+  if (drew)
+    lhos_ws2812b_show ();
+}
 
-  ESP_ERROR_CHECK (rmt_new_tx_channel (&tx_config, &tx_channel));
+static void
+anims_stop (void)
+{
+  for (int i = 0; i < WS2812B_ANIMS; i++)
+    s_anims[i].active = false;
+  if (s_timer)
+    esp_timer_stop (s_timer);
+}
 
-  rmt_copy_encoder_config_t copy_encoder_config = {};
-  ESP_ERROR_CHECK (rmt_new_copy_encoder (&copy_encoder_config, &copy_encoder));
+void
+lhos_ws2812b_strip_deinit (void)
+{
+  ws2812b_strip_t *s = &s_strip;
+  if (!s_lock)
+    return;
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  anims_stop ();
+  /* from here on show() sees no task and never notifies a dying one */
+  TaskHandle_t task = s->task;
+  s->task = NULL;
+  xSemaphoreGive (s_lock);
+  if (task)
+    {
+      xTaskNotify (task, WS2812B_NOTIFY_STOP, eSetBits);
+      xSemaphoreTake (s->done, portMAX_DELAY);
+    }
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  if (s->chan)
+    {
+      rmt_disable (s->chan);
+      rmt_del_channel (s->chan);
+    }
+  if (s->enc)
+    rmt_del_encoder (s->enc);
+  if (s->done)
+    vSemaphoreDelete (s->done);
+  free (s->back);
+  heap_caps_free (s->front);
+  memset (s, 0, sizeof (*s));
+  xSemaphoreGive (s_lock);
+}
 
+esp_err_t
+lhos_ws2812b_strip_init (int gpio, size_t count)
+{
+  ws2812b_strip_t *s = &s_strip;
+  if (count == 0 || count > WS2812B_MAX_LEDS)
+    return ESP_ERR_INVALID_SIZE;
+  if (!s_lock)
+    {
+      s_lock = xSemaphoreCreateMutex ();
+      if (!s_lock)
+        return ESP_ERR_NO_MEM;
+      lhos_fx_build_lut (s_lut, s_gamma, s_brightness);
+      for (int i = 0; i < 256; i++)
+        put (s_palette + i * 3, lhos_fx_hsv ((uint8_t)i, 255, 255));
+    }
+  lhos_ws2812b_strip_deinit ();
+
+  ESP_LOGI (TAG, "Initializing %u WS2812B on GPIO %d", (unsigned)count,
+            gpio);
+  s->count = count;
+  s->back = calloc (count, 3);
+  /* read from the RMT interrupt, so keep it out of PSRAM */
+  s->front
+      = heap_caps_calloc (count, 3, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  s->done = xSemaphoreCreateBinary ();
+  esp_err_t rc = ESP_ERR_NO_MEM;
+  if (!s->back || !s->front || !s->done)
+    goto fail;
+  rc = channel_new (gpio, &s->chan);
+  if (rc == ESP_OK)
+    rc = encoder_new (&s->enc);
+  if (rc == ESP_OK)
+    rc = rmt_enable (s->chan);
+  if (rc != ESP_OK)
+    goto fail;
+  if (xTaskCreate (tx_task, "lhos_ws2812b", WS2812B_TASK_STACK, s,
+                   WS2812B_TASK_PRIO, &s->task)
+      != pdPASS)
+    {
+      s->task = NULL;
+      rc = ESP_ERR_NO_MEM;
+      goto fail;
+    }
   // Initialize to off
-  return lhos_ws2812b_off ();
+  return lhos_ws2812b_show ();
+
+fail:
+  ESP_LOGE (TAG, "init failed: %s", esp_err_to_name (rc));
+  lhos_ws2812b_strip_deinit ();
+  return rc;
+}
+
+size_t
+lhos_ws2812b_count (void)
+{
+  return s_strip.count;
 }
 
 esp_err_t
-lhos_ws2812b_set_color (uint8_t r, uint8_t g, uint8_t b)
+lhos_ws2812b_set_pixel (size_t index, uint8_t r, uint8_t g, uint8_t b)
 {
-  // WS2812B uses GRB order
-  uint32_t grb = (g << 16) | (r << 8) | b;
+  return lhos_ws2812b_fill (index, 1, r, g, b);
+}
+
+esp_err_t
+lhos_ws2812b_get_pixel (size_t index, uint8_t *r, uint8_t *g, uint8_t *b)
+{
+  ws2812b_strip_t *s = &s_strip;
+  if (!s->task)
+    return ESP_ERR_INVALID_STATE;
+  if (index >= s->count)
+    return ESP_ERR_INVALID_ARG;
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  const uint8_t *p = s->back + index * 3;
+  *g = p[0];
+  *r = p[1];
+  *b = p[2];
+  xSemaphoreGive (s_lock);
+  return ESP_OK;
+}
+
+esp_err_t
+lhos_ws2812b_fill (size_t first, size_t n, uint8_t r, uint8_t g, uint8_t b)
+{
+  ws2812b_strip_t *s = &s_strip;
+  if (!s->task)
+    return ESP_ERR_INVALID_STATE;
+  if (first > s->count || n > s->count - first)
+    return ESP_ERR_INVALID_ARG;
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  uint32_t rgb = (uint32_t)r << 16 | (uint32_t)g << 8 | b;
+  for (uint8_t *p = s->back + first * 3, *end = p + n * 3; p < end; p += 3)
+    put (p, rgb);
+  xSemaphoreGive (s_lock);
+  return ESP_OK;
+}
+
+esp_err_t
+lhos_ws2812b_set_range (size_t first, const uint32_t *rgb, size_t n)
+{
+  ws2812b_strip_t *s = &s_strip;
+  if (!s->task)
+    return ESP_ERR_INVALID_STATE;
+  if (first > s->count || n > s->count - first)
+    return ESP_ERR_INVALID_ARG;
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  uint8_t *p = s->back + first * 3;
+  for (size_t i = 0; i < n; i++, p += 3)
+    put (p, rgb[i]);
+  xSemaphoreGive (s_lock);
+  return ESP_OK;
+}
+
+esp_err_t
+lhos_ws2812b_write (size_t first, const uint8_t *data, size_t n,
+                    lhos_fx_format_t fmt)
+{
+  ws2812b_strip_t *s = &s_strip;
+  if (!s->task)
+    return ESP_ERR_INVALID_STATE;
+  if (!data || fmt > LHOS_FX_INDEX || first > s->count
+      || n > s->count - first)
+    return ESP_ERR_INVALID_ARG;
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  lhos_fx_convert (s->back + first * 3, data, n, fmt, s_palette);
+  xSemaphoreGive (s_lock);
+  return lhos_ws2812b_show ();
+}
 
-  // Convert 24-bit GRB to RMT symbols
-  for (int i = 0; i < 24; i++)
+esp_err_t
+lhos_ws2812b_set_palette (size_t first, const uint32_t *rgb, size_t n)
+{
+  if (!rgb || first > 256 || n > 256 - first)
+    return ESP_ERR_INVALID_ARG;
+  if (!s_lock)
+    return ESP_ERR_INVALID_STATE;
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  for (size_t i = 0; i < n; i++)
+    put (s_palette + (first + i) * 3, rgb[i]);
+  xSemaphoreGive (s_lock);
+  return ESP_OK;
+}
+
+esp_err_t
+lhos_ws2812b_show (void)
+{
+  ws2812b_strip_t *s = &s_strip;
+  if (!s_lock)
+    return ESP_ERR_INVALID_STATE;
+  /* strip_deinit clears the strip under the lock */
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  esp_err_t rc = ESP_ERR_INVALID_STATE;
+  if (s->task)
     {
-      if (grb & (1 << (23 - i)))
-        {
-          // Bit 1: T1H + T1L
-          led_data[i].level0 = 1;
-          led_data[i].duration0 = WS2812B_T1H;
-          led_data[i].level1 = 0;
-          led_data[i].duration1 = WS2812B_T1L;
-        }
-      else
+      if (s->pending)
+        s->stats.merged++;
+      s->pending = true;
+      xTaskNotify (s->task, WS2812B_NOTIFY_SHOW, eSetBits);
+      rc = ESP_OK;
+    }
+  xSemaphoreGive (s_lock);
+  return rc;
+}
+
+esp_err_t
+lhos_ws2812b_wait (uint32_t timeout_ms)
+{
+  ws2812b_strip_t *s = &s_strip;
+  TickType_t start = xTaskGetTickCount ();
+  while (s->task && (s->pending || s->busy))
+    {
+      if (xTaskGetTickCount () - start > pdMS_TO_TICKS (timeout_ms))
+        return ESP_ERR_TIMEOUT;
+      vTaskDelay (1);
+    }
+  return ESP_OK;
+}
+
+void
+lhos_ws2812b_get_stats (ws2812b_stats_t *out)
+{
+  *out = s_strip.stats;
+}
+
+esp_err_t
+lhos_ws2812b_animate (size_t first, size_t n, const lhos_fx_t *fx, int *id)
+{
+  ws2812b_strip_t *s = &s_strip;
+  if (!s->task)
+    return ESP_ERR_INVALID_STATE;
+  if (!fx || n == 0 || first > s->count || n > s->count - first
+      || lhos_fx_cycle_ms (fx, n) == 0)
+    return ESP_ERR_INVALID_ARG;
+  if (!s_timer)
+    {
+      esp_timer_create_args_t args = {
+        .callback = anim_tick,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "lhos_ws2812b",
+        .skip_unhandled_events = true,
+      };
+      esp_err_t rc = esp_timer_create (&args, &s_timer);
+      if (rc != ESP_OK)
+        return rc;
+    }
+
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  /* a new animation on the same LEDs replaces the old one */
+  int slot = -1;
+  for (int i = 0; i < WS2812B_ANIMS; i++)
+    {
+      ws2812b_anim_t *a = &s_anims[i];
+      if (a->active && a->first == first && a->n == n)
         {
-          // Bit 0: T0H + T0L
-          led_data[i].level0 = 1;
-          led_data[i].duration0 = WS2812B_T0H;
-          led_data[i].level1 = 0;
-          led_data[i].duration1 = WS2812B_T0L;
+          slot = i;
+          break;
         }
+      if (!a->active && slot < 0)
+        slot = i;
     }
+  esp_err_t rc = ESP_ERR_NO_MEM;
+  if (slot >= 0)
+    {
+      ws2812b_anim_t *a = &s_anims[slot];
+      a->first = first;
+      a->n = n;
+      a->fx = *fx;
+      a->start_us = esp_timer_get_time ();
+      a->active = true;
+      rc = ESP_OK;
+      if (!esp_timer_is_active (s_timer))
+        rc = esp_timer_start_periodic (s_timer, WS2812B_FRAME_MS * 1000);
+      if (rc != ESP_OK)
+        a->active = false;
+    }
+  xSemaphoreGive (s_lock);
+  if (rc == ESP_OK && id)
+    *id = slot;
+  return rc;
+}
 
-  // Reset pulse
-  led_data[24].level0 = 0;
-  led_data[24].duration0 = WS2812B_RESET;
-  led_data[24].level1 = 0;
-  led_data[24].duration1 = 0;
+esp_err_t
+lhos_ws2812b_stop (int id)
+{
+  if (id >= WS2812B_ANIMS)
+    return ESP_ERR_INVALID_ARG;
+  if (!s_lock)
+    return ESP_OK;
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  if (id < 0)
+    anims_stop ();
+  else
+    s_anims[id].active = false;
+  xSemaphoreGive (s_lock);
+  return ESP_OK;
+}
 
-  rmt_transmit_config_t transmit_config = {
-    .loop_count = 0,
-  };
+static esp_err_t
+lut_update (void)
+{
+  if (!s_lock)
+    return ESP_OK; /* built at init */
+  xSemaphoreTake (s_lock, portMAX_DELAY);
+  lhos_fx_build_lut (s_lut, s_gamma, s_brightness);
+  xSemaphoreGive (s_lock);
+  return s_strip.task ? lhos_ws2812b_show () : ESP_OK;
+}
 
-  ESP_ERROR_CHECK (rmt_transmit (tx_channel, copy_encoder, led_data,
-                                 sizeof (led_data), &transmit_config));
-  ESP_ERROR_CHECK (rmt_tx_wait_all_done (tx_channel, -1));
-  ESP_LOGI (TAG, "WS2812B set to R:%d G:%d B:%d", r, g, b);
+esp_err_t
+lhos_ws2812b_set_brightness (uint8_t brightness)
+{
+  s_brightness = brightness;
+  return lut_update ();
+}
 
-  return ESP_OK;
+esp_err_t
+lhos_ws2812b_set_gamma (float gamma)
+{
+  if (!(gamma >= 0.1f && gamma <= 5.0f))
+    return ESP_ERR_INVALID_ARG;
+  s_gamma = gamma;
+  return lut_update ();
+}
+
+esp_err_t
+lhos_ws2812b_init (void)
+{
+  return lhos_ws2812b_strip_init (WS2812B_GPIO_PIN, WS2812B_LED_COUNT);
+}
+
+esp_err_t
+lhos_ws2812b_set_color (uint8_t r, uint8_t g, uint8_t b)
+{
+  esp_err_t rc = lhos_ws2812b_fill (0, s_strip.count, r, g, b);
+  if (rc != ESP_OK)
+    return rc;
+  return lhos_ws2812b_show ();
 }
 
 esp_err_t
@@ -156,14 +688,15 @@ lhos_ws2812b_set_color_enum (int color_index)
 esp_err_t
 lhos_ws2812b_flash (uint8_t flashes, uint32_t on_ms, uint32_t off_ms)
 {
-  for (uint8_t i = 0; i < flashes; i++)
-    {
-      // Turn on red
-      lhos_ws2812b_set_color (255, 0, 0);
-      vTaskDelay (pdMS_TO_TICKS (on_ms));
-      // Turn off
-      lhos_ws2812b_off ();
-      vTaskDelay (pdMS_TO_TICKS (off_ms));
-    }
-  return ESP_OK;
-}
\ No newline at end of file
+  // Red blinks on the whole strip, run by the animation timer
+  lhos_fx_t fx = {
+    .type = LHOS_FX_BLINK,
+    .color = 0xFF0000,
+    .on_ms = on_ms,
+    .off_ms = off_ms,
+    .repeat = flashes,
+  };
+  if (flashes == 0)
+    return ESP_OK;
+  return lhos_ws2812b_animate (0, s_strip.count, &fx, NULL);
+}
@@ -1,11 +1,17 @@
 #ifndef LHOS_WS2812B_H
 #define LHOS_WS2812B_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "esp_err.h"
+#include "lhos_ws2812b_fx.h"
 
 // WS2812B LED configuration
 #define WS2812B_LED_COUNT 1 // Single LED
 #define WS2812B_GPIO_PIN 48 // GPIO pin for data (using LHOS_GPIO_LED)
+#define WS2812B_MAX_LEDS 2048
+#define WS2812B_ANIMS 4 // animations running at once
 
 // Color structure for WS2812B (GRB order)
 typedef struct
@@ -15,6 +21,76 @@ typedef struct
   uint8_t b;
 } ws2812b_color_t;
 
+/* Strip engine
+ * Pixels are drawn into a back buffer (GRB, as sent on the wire) that the
+ * caller owns. lhos_ws2812b_show() only wakes the strip's TX task, which
+ * copies the back buffer into the front buffer and hands that to the RMT
+ * channel; a bytes encoder turns it into pulses as it goes, so no symbol
+ * array is built in memory. Frames shown while one is still on the wire
+ * are merged: the next transmission carries the latest picture. Drawing
+ * functions may be called from any task.
+ */
+
+typedef struct
+{
+  uint32_t shown;  /* frames sent */
+  uint32_t merged; /* show() calls folded into a later frame */
+  uint32_t errors; /* rmt_transmit failures */
+} ws2812b_stats_t;
+
+// Initialize a strip of `count` LEDs on `gpio` (replaces the current one)
+esp_err_t lhos_ws2812b_strip_init (int gpio, size_t count);
+
+// Stop the strip and free its channel and buffers
+void lhos_ws2812b_strip_deinit (void);
+
+// Number of LEDs, 0 before init
+size_t lhos_ws2812b_count (void);
+
+// Back buffer drawing; nothing reaches the LEDs until show()
+esp_err_t lhos_ws2812b_set_pixel (size_t index, uint8_t r, uint8_t g,
+                                  uint8_t b);
+esp_err_t lhos_ws2812b_get_pixel (size_t index, uint8_t *r, uint8_t *g,
+                                  uint8_t *b);
+esp_err_t lhos_ws2812b_fill (size_t first, size_t n, uint8_t r, uint8_t g,
+                             uint8_t b);
+// `rgb` holds 0xRRGGBB values for LEDs first..first+n-1
+esp_err_t lhos_ws2812b_set_range (size_t first, const uint32_t *rgb,
+                                  size_t n);
+
+/* Convert `n` packed pixels (lhos_fx_format_size(fmt) bytes each) into
+   LEDs first..first+n-1 under one lock, then show() */
+esp_err_t lhos_ws2812b_write (size_t first, const uint8_t *data, size_t n,
+                              lhos_fx_format_t fmt);
+
+/* Replace palette entries first..first+n-1 (0xRRGGBB) used by
+   LHOS_FX_INDEX data; after the first strip init */
+esp_err_t lhos_ws2812b_set_palette (size_t first, const uint32_t *rgb,
+                                    size_t n);
+
+// Queue a refresh with the back buffer; never waits for the wire
+esp_err_t lhos_ws2812b_show (void);
+
+// Wait until the frames queued so far are out
+esp_err_t lhos_ws2812b_wait (uint32_t timeout_ms);
+
+void lhos_ws2812b_get_stats (ws2812b_stats_t *out);
+
+/* Animations run in C on an esp_timer and draw into the back buffer of
+   LEDs first..first+n-1, so the caller returns at once. Starting one on
+   the same LEDs as a running one replaces it; finished ones leave their
+   last frame. `*id` (optional) identifies it for lhos_ws2812b_stop. */
+esp_err_t lhos_ws2812b_animate (size_t first, size_t n, const lhos_fx_t *fx,
+                                int *id);
+
+// Stop animation `id`, or all of them with -1; the LEDs keep their colors
+esp_err_t lhos_ws2812b_stop (int id);
+
+/* Output correction through a 256-entry table rebuilt on change. Pixels
+   keep their drawn values; defaults are gamma 1 and brightness 255. */
+esp_err_t lhos_ws2812b_set_brightness (uint8_t brightness);
+esp_err_t lhos_ws2812b_set_gamma (float gamma);
+
 // Initialize WS2812B LED
 esp_err_t lhos_ws2812b_init (void);
 
@@ -27,8 +103,8 @@ esp_err_t lhos_ws2812b_off (void);
 // Set predefined color
 esp_err_t lhos_ws2812b_set_color_enum (int color_index);
 
-// Flash the LED a number of times
+// Flash the LED a number of times (an animation, returns at once)
 esp_err_t lhos_ws2812b_flash (uint8_t flashes, uint32_t on_ms,
                               uint32_t off_ms);
 
-#endif // LHOS_WS2812B_H
\ No newline at end of file
+#endif // LHOS_WS2812B_H
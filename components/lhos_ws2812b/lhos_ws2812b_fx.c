@@ -0,0 +1,210 @@
+#include "lhos_ws2812b_fx.h"
+
+#include <math.h>
+#include <string.h>
+
+static void
+put (uint8_t *p, uint32_t rgb)
+{
+  p[0] = (uint8_t)(rgb >> 8);
+  p[1] = (uint8_t)(rgb >> 16);
+  p[2] = (uint8_t)rgb;
+}
+
+static void
+fill (uint8_t *grb, size_t n, uint32_t rgb)
+{
+  for (size_t i = 0; i < n; i++)
+    put (grb + i * 3, rgb);
+}
+
+/* a at level 0, b at level 255 */
+static uint32_t
+mix (uint32_t a, uint32_t b, uint32_t level)
+{
+  uint32_t out = 0;
+  for (int shift = 0; shift <= 16; shift += 8)
+    {
+      int ca = (int)((a >> shift) & 0xFF);
+      int cb = (int)((b >> shift) & 0xFF);
+      int c = ca + ((cb - ca) * (int)level + (cb >= ca ? 127 : -127)) / 255;
+      out |= (uint32_t)c << shift;
+    }
+  return out;
+}
+
+uint32_t
+lhos_fx_cycle_ms (const lhos_fx_t *fx, size_t n)
+{
+  uint32_t sum = 0;
+  switch (fx->type)
+    {
+    case LHOS_FX_BLINK:
+      return fx->on_ms + fx->off_ms;
+    case LHOS_FX_BREATHE:
+    case LHOS_FX_FADE:
+      return fx->period_ms;
+    case LHOS_FX_CHASE:
+      if (n == 0 || fx->period_ms > UINT32_MAX / n)
+        return 0;
+      return fx->period_ms * (uint32_t)n;
+    case LHOS_FX_SEQUENCE:
+      for (uint8_t i = 0; i < fx->nkeys && i < LHOS_FX_KEYS_MAX; i++)
+        sum += fx->keys[i].ms;
+      return sum;
+    }
+  return 0;
+}
+
+static void
+render_sequence (const lhos_fx_t *fx, uint32_t p, uint8_t *grb, size_t n)
+{
+  uint8_t k = 0;
+  while (k + 1 < fx->nkeys && p >= fx->keys[k].ms)
+    p -= fx->keys[k++].ms;
+  uint32_t rgb = fx->keys[k].color;
+  if (fx->smooth && fx->keys[k].ms)
+    {
+      uint32_t next = fx->keys[(k + 1) % fx->nkeys].color;
+      rgb = mix (rgb, next, (uint32_t)((uint64_t)p * 255 / fx->keys[k].ms));
+    }
+  fill (grb, n, rgb);
+}
+
+bool
+lhos_fx_render (const lhos_fx_t *fx, uint32_t t_ms, uint8_t *grb, size_t n)
+{
+  uint32_t cycle = lhos_fx_cycle_ms (fx, n);
+  uint32_t repeat = fx->repeat;
+  if (fx->type == LHOS_FX_FADE && repeat == 0)
+    repeat = 1;
+  if (cycle == 0 || (repeat && (uint64_t)t_ms >= (uint64_t)cycle * repeat))
+    {
+      if (fx->type == LHOS_FX_SEQUENCE && fx->nkeys)
+        fill (grb, n, fx->keys[fx->nkeys - 1].color);
+      else
+        fill (grb, n, fx->color2);
+      return false;
+    }
+
+  uint32_t p = t_ms % cycle;
+  uint32_t half;
+  switch (fx->type)
+    {
+    case LHOS_FX_BLINK:
+      fill (grb, n, p < fx->on_ms ? fx->color : fx->color2);
+      break;
+    case LHOS_FX_BREATHE:
+      half = cycle / 2;
+      fill (grb, n,
+            mix (fx->color2, fx->color,
+                 p < half ? p * 255 / half
+                          : (cycle - p) * 255 / (cycle - half)));
+      break;
+    case LHOS_FX_FADE:
+      fill (grb, n,
+            mix (fx->color, fx->color2,
+                 (uint32_t)((uint64_t)p * 255 / cycle)));
+      break;
+    case LHOS_FX_CHASE:
+      {
+        size_t step = p / fx->period_ms;
+        for (size_t i = 0; i < n; i++)
+          put (grb + i * 3,
+               (i + n - step) % n < fx->width ? fx->color : fx->color2);
+      }
+      break;
+    case LHOS_FX_SEQUENCE:
+      render_sequence (fx, p, grb, n);
+      break;
+    }
+  return true;
+}
+
+/* Source offsets of the G, R and B bytes for each channel order. */
+static const uint8_t k_order[][3] = {
+  [LHOS_FX_RGB] = { 1, 0, 2 }, [LHOS_FX_GRB] = { 0, 1, 2 },
+  [LHOS_FX_BRG] = { 2, 1, 0 }, [LHOS_FX_RBG] = { 2, 0, 1 },
+  [LHOS_FX_GBR] = { 0, 2, 1 }, [LHOS_FX_BGR] = { 1, 2, 0 },
+};
+
+size_t
+lhos_fx_format_size (lhos_fx_format_t fmt)
+{
+  return fmt == LHOS_FX_INDEX ? 1 : 3;
+}
+
+uint32_t
+lhos_fx_hsv (uint8_t h, uint8_t s, uint8_t v)
+{
+  /* six sectors of 43 hue steps; `f` is the position inside one */
+  uint32_t sector = h / 43;
+  uint32_t f = (uint32_t)(h - sector * 43) * 6;
+  uint8_t p = (uint8_t)((v * (255 - s)) / 255);
+  uint8_t q = (uint8_t)((v * (255 - (s * f) / 255)) / 255);
+  uint8_t t = (uint8_t)((v * (255 - (s * (255 - f)) / 255)) / 255);
+  uint8_t r, g, b;
+  switch (sector)
+    {
+    case 0:
+      r = v, g = t, b = p;
+      break;
+    case 1:
+      r = q, g = v, b = p;
+      break;
+    case 2:
+      r = p, g = v, b = t;
+      break;
+    case 3:
+      r = p, g = q, b = v;
+      break;
+    case 4:
+      r = t, g = p, b = v;
+      break;
+    default:
+      r = v, g = p, b = q;
+      break;
+    }
+  return (uint32_t)r << 16 | (uint32_t)g << 8 | b;
+}
+
+void
+lhos_fx_convert (uint8_t *grb, const uint8_t *src, size_t n,
+                 lhos_fx_format_t fmt, const uint8_t *palette)
+{
+  switch (fmt)
+    {
+    case LHOS_FX_GRB:
+      memcpy (grb, src, n * 3);
+      return;
+    case LHOS_FX_HSV:
+      for (size_t i = 0; i < n; i++, src += 3)
+        put (grb + i * 3, lhos_fx_hsv (src[0], src[1], src[2]));
+      return;
+    case LHOS_FX_INDEX:
+      for (size_t i = 0; i < n; i++)
+        memcpy (grb + i * 3, palette + src[i] * 3, 3);
+      return;
+    default:
+      break;
+    }
+  const uint8_t *o = k_order[fmt];
+  for (size_t i = 0; i < n; i++, src += 3, grb += 3)
+    {
+      grb[0] = src[o[0]];
+      grb[1] = src[o[1]];
+      grb[2] = src[o[2]];
+    }
+}
+
+void
+lhos_fx_build_lut (uint8_t lut[256], float gamma, uint8_t brightness)
+{
+  if (!(gamma > 0.0f))
+    gamma = 1.0f;
+  for (int i = 0; i < 256; i++)
+    {
+      float v = powf ((float)i / 255.0f, gamma) * (float)brightness;
+      lut[i] = (uint8_t)(v + 0.5f);
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef LHOS_WS2812B_FX_H
+#define LHOS_WS2812B_FX_H
+
+/* WS2812B effects: animation frames and output lookup tables.
+ * Colors are 0xRRGGBB; frames are written in the strip's GRB order.
+ *
+ * A frame depends only on the effect and the time since it started, so the
+ * renderer keeps no state: a late or skipped tick never makes an effect
+ * drift, and any frame can be rendered again. Gamma and brightness are not
+ * applied here; the driver runs finished frames through the lookup table.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LHOS_FX_KEYS_MAX 16
+
+typedef enum
+{
+  LHOS_FX_BLINK = 0, /* color for on_ms, color2 for off_ms */
+  LHOS_FX_BREATHE,   /* color2 -> color -> color2 every period_ms */
+  LHOS_FX_FADE,      /* color -> color2 over period_ms */
+  LHOS_FX_CHASE,     /* `width` LEDs of color move one LED per period_ms */
+  LHOS_FX_SEQUENCE,  /* keyframes, held or blended into the next one */
+} lhos_fx_type_t;
+
+typedef struct
+{
+  uint32_t color;
+  uint32_t ms;
+} lhos_fx_key_t;
+
+typedef struct
+{
+  lhos_fx_type_t type;
+  uint32_t color;
+  uint32_t color2; /* background, off or target color */
+  uint32_t on_ms;
+  uint32_t off_ms;
+  uint32_t period_ms;
+  uint16_t repeat; /* cycles to run, 0: forever (fade: once) */
+  uint16_t width;  /* chase */
+  bool smooth;     /* sequence: blend into the next key */
+  uint8_t nkeys;
+  lhos_fx_key_t keys[LHOS_FX_KEYS_MAX];
+} lhos_fx_t;
+
+/* Length of one cycle on `n` LEDs in ms (a chase cycle is one lap); 0 if
+   the effect is malformed. */
+uint32_t lhos_fx_cycle_ms (const lhos_fx_t *fx, size_t n);
+
+/* Render the effect `t_ms` after its start into `n` LEDs at `grb`.
+   Returns false once it has finished; the final frame (color2, or the last
+   key of a sequence) is rendered then. */
+bool lhos_fx_render (const lhos_fx_t *fx, uint32_t t_ms, uint8_t *grb,
+                     size_t n);
+
+/* Layout of packed pixel data handed to lhos_fx_convert. */
+typedef enum
+{
+  LHOS_FX_RGB = 0,
+  LHOS_FX_GRB, /* wire order: copied as is */
+  LHOS_FX_BRG,
+  LHOS_FX_RBG,
+  LHOS_FX_GBR,
+  LHOS_FX_BGR,
+  LHOS_FX_HSV,   /* hue 0-255 for the full circle, saturation, value */
+  LHOS_FX_INDEX, /* one byte per pixel into a 256-entry palette */
+} lhos_fx_format_t;
+
+/* Bytes per pixel of `fmt`. */
+size_t lhos_fx_format_size (lhos_fx_format_t fmt);
+
+/* Convert `n` pixels from `src` into GRB at `grb`. `palette` (GRB, 256
+   entries) is only read for LHOS_FX_INDEX. */
+void lhos_fx_convert (uint8_t *grb, const uint8_t *src, size_t n,
+                      lhos_fx_format_t fmt, const uint8_t *palette);
+
+/* HSV with hue 0-255 around the circle to 0xRRGGBB, integer only. */
+uint32_t lhos_fx_hsv (uint8_t h, uint8_t s, uint8_t v);
+
+/* out = in ^ gamma, scaled by brightness/255, rounded. gamma 1 and
+   brightness 255 give the identity. */
+void lhos_fx_build_lut (uint8_t lut[256], float gamma, uint8_t brightness);
+
+#endif // LHOS_WS2812B_FX_H
@@ -1,5 +1,4 @@
 #include "driver/gpio.h"
-#include "esp_adc/adc_oneshot.h"
 #include "esp_littlefs.h"
 #include "esp_log.h"
 #include "esp_vfs.h"
@@ -9,6 +8,7 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "lhos.h"
+#include "lhos_adc.h"
 #include "lhos_config.h"
 #include "lhos_lua.h"
 #include "lhos_ws2812b.h"
@@ -16,7 +16,6 @@
 
 static const char *TAG = "LHOS_APP";
 
-adc_oneshot_unit_handle_t adc1_handle;
 
 typedef struct
 {
@@ -79,26 +78,11 @@ app_main (void)
   ESP_LOGI (TAG, "Initializing lhOS...");
   lhos_init ();
 
-  /* Configure ADC for sensor on GPIO 1 */
+  /* Configure ADC for sensor on GPIO 1 (ADC1 channel 0). lhos_adc owns
+     the unit and lends it to the continuous driver while Lua samples. */
   ESP_LOGI (TAG, "Configuring ADC for sensor on GPIO 1...");
-  adc_oneshot_unit_init_cfg_t init_config1 = {
-    .unit_id = ADC_UNIT_1,
-  };
-  esp_err_t adc_err = adc_oneshot_new_unit (&init_config1, &adc1_handle);
-  if (adc_err != ESP_OK)
-    {
-      ESP_LOGE (TAG, "Failed to initialize ADC: %s",
-                esp_err_to_name (adc_err));
-    }
-  else
-    {
-      adc_oneshot_chan_cfg_t config = {
-        .atten = ADC_ATTEN_DB_12,
-        .bitwidth = ADC_BITWIDTH_DEFAULT,
-      };
-      adc_oneshot_config_channel (adc1_handle, ADC_CHANNEL_0, &config);
-      ESP_LOGI (TAG, "ADC configured for sensor on GPIO 1");
-    }
+  if (lhos_adc_init (0) == ESP_OK)
+    ESP_LOGI (TAG, "ADC configured for sensor on GPIO 1");
   /* Start Lua VM on a dedicated task pinned to core 1 so initialization
      (which may perform heavy allocations) doesn't block the main task
      and trigger the Task WDT. */
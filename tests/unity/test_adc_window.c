@@ -0,0 +1,135 @@
+#include "unity.h"
+
+#include "lhos_adc_source.h"
+#include "lhos_adc_window.h"
+
+#include <math.h>
+#include <string.h>
+
+#define MAX_FRAMES 16
+
+static lhos_adc_frame_t frames[MAX_FRAMES];
+static int nframes;
+
+static void
+collect (const lhos_adc_frame_t *f, void *ctx)
+{
+  (void)ctx;
+  if (nframes < MAX_FRAMES)
+    frames[nframes] = *f;
+  nframes++;
+}
+
+void
+setUp (void)
+{
+  memset (frames, 0, sizeof (frames));
+  nframes = 0;
+}
+
+void
+tearDown (void)
+{
+}
+
+void
+test_window_rejects_bad_config (void)
+{
+  lhos_adc_window_t w;
+  lhos_adc_window_config_t none = { .samples = 0 };
+  lhos_adc_window_config_t long_trace
+      = { .samples = 1000, .decimate = 10 }; /* 100 points */
+  TEST_ASSERT_FALSE (lhos_adc_window_init (&w, &none));
+  TEST_ASSERT_FALSE (lhos_adc_window_init (&w, &long_trace));
+}
+
+void
+test_window_constant_signal (void)
+{
+  lhos_adc_window_t w;
+  lhos_adc_window_config_t cfg = { .samples = 100, .decimate = 10 };
+  uint16_t s[250];
+  for (int i = 0; i < 250; i++)
+    s[i] = 1234;
+  TEST_ASSERT_TRUE (lhos_adc_window_init (&w, &cfg));
+
+  TEST_ASSERT_EQUAL_UINT (2, lhos_adc_window_feed (&w, s, 250, collect, NULL));
+  TEST_ASSERT_EQUAL_INT (2, nframes);
+  TEST_ASSERT_EQUAL_UINT32 (0, frames[0].seq);
+  TEST_ASSERT_EQUAL_UINT32 (1, frames[1].seq);
+  TEST_ASSERT_EQUAL_UINT32 (100, frames[0].count);
+  TEST_ASSERT_EQUAL_UINT16 (1234, frames[0].min);
+  TEST_ASSERT_EQUAL_UINT16 (1234, frames[0].max);
+  TEST_ASSERT_EQUAL_DOUBLE (1234.0, lhos_adc_frame_mean (&frames[0]));
+  TEST_ASSERT_EQUAL_DOUBLE (1234.0, lhos_adc_frame_rms (&frames[0]));
+  TEST_ASSERT_EQUAL_DOUBLE (0.0, lhos_adc_frame_stddev (&frames[0]));
+  TEST_ASSERT_EQUAL_UINT16 (10, frames[0].npoints);
+  TEST_ASSERT_EQUAL_UINT16 (1234, frames[0].points[9]);
+
+  /* the remaining 50 samples complete the next frame */
+  TEST_ASSERT_EQUAL_UINT (1, lhos_adc_window_feed (&w, s, 50, collect, NULL));
+  TEST_ASSERT_EQUAL_UINT32 (2, frames[2].seq);
+}
+
+void
+test_window_decimation_is_boxcar_mean (void)
+{
+  lhos_adc_window_t w;
+  lhos_adc_window_config_t cfg = { .samples = 8, .decimate = 4 };
+  uint16_t s[8] = { 0, 10, 20, 30, 100, 100, 100, 104 };
+  TEST_ASSERT_TRUE (lhos_adc_window_init (&w, &cfg));
+  lhos_adc_window_feed (&w, s, 8, collect, NULL);
+  TEST_ASSERT_EQUAL_INT (1, nframes);
+  TEST_ASSERT_EQUAL_UINT16 (2, frames[0].npoints);
+  TEST_ASSERT_EQUAL_UINT16 (15, frames[0].points[0]);
+  TEST_ASSERT_EQUAL_UINT16 (101, frames[0].points[1]);
+  TEST_ASSERT_EQUAL_UINT16 (0, frames[0].min);
+  TEST_ASSERT_EQUAL_UINT16 (104, frames[0].max);
+}
+
+void
+test_simulated_sine_statistics (void)
+{
+  lhos_adc_sim_t sim;
+  lhos_adc_window_t w;
+  /* 50 Hz at 10 kHz: a 1000-sample window holds exactly 5 periods */
+  lhos_adc_window_config_t cfg = { .samples = 1000, .decimate = 20 };
+  uint16_t buf[256];
+  lhos_adc_sim_init (&sim, 50.0f, 1000.0f, 2048, 0, 1);
+  TEST_ASSERT_EQUAL_INT (0, sim.base.start (&sim.base, 0, 10000));
+  TEST_ASSERT_TRUE (lhos_adc_window_init (&w, &cfg));
+
+  for (int k = 0; k < 12; k++)
+    {
+      int n = sim.base.read (&sim.base, buf, 256, 0);
+      TEST_ASSERT_EQUAL_INT (256, n);
+      lhos_adc_window_feed (&w, buf, (size_t)n, collect, NULL);
+    }
+  TEST_ASSERT_EQUAL_INT (3, nframes);
+  for (int i = 0; i < 3; i++)
+    {
+      TEST_ASSERT_DOUBLE_WITHIN (1.0, 2048.0, lhos_adc_frame_mean (&frames[i]));
+      /* a sine of amplitude A has an AC RMS of A / sqrt(2) */
+      TEST_ASSERT_DOUBLE_WITHIN (2.0, 1000.0 / sqrt (2.0),
+                                 lhos_adc_frame_stddev (&frames[i]));
+      TEST_ASSERT_UINT16_WITHIN (1, 1048, frames[i].min);
+      TEST_ASSERT_UINT16_WITHIN (1, 3048, frames[i].max);
+      TEST_ASSERT_EQUAL_UINT16 (50, frames[i].npoints);
+    }
+}
+
+void
+test_simulated_noise_is_bounded_and_reproducible (void)
+{
+  lhos_adc_sim_t a, b;
+  uint16_t sa[512], sb[512];
+  lhos_adc_sim_init (&a, 0.0f, 0.0f, 100, 8, 42);
+  lhos_adc_sim_init (&b, 0.0f, 0.0f, 100, 8, 42);
+  a.base.start (&a.base, 0, 1000);
+  b.base.start (&b.base, 0, 1000);
+  a.base.read (&a.base, sa, 512, 0);
+  b.base.read (&b.base, sb, 512, 0);
+  TEST_ASSERT_EQUAL_UINT16_ARRAY (sa, sb, 512);
+  for (int i = 0; i < 512; i++)
+    TEST_ASSERT_UINT16_WITHIN (8, 100, sa[i]);
+}
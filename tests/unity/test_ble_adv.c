@@ -0,0 +1,112 @@
+#include "unity.h"
+
+#include "lhos_ble_adv.h"
+
+#include <string.h>
+
+static lhos_ble_scan_state_t st;
+static const uint8_t addr_a[6] = { 1, 2, 3, 4, 5, 6 };
+static const uint8_t addr_b[6] = { 6, 5, 4, 3, 2, 1 };
+
+/* flags, complete name "lhos-7", 16-bit services 0x180F and 0x181A */
+static const uint8_t adv[] = { 2,    0x01, 0x06, 7,    0x09, 'l', 'h',
+                               'o',  's',  '-',  '7',  5,    0x03, 0x0F,
+                               0x18, 0x1A, 0x18 };
+
+void
+setUp (void)
+{
+  lhos_ble_scan_reset (&st, NULL);
+}
+
+void
+tearDown (void)
+{
+}
+
+static bool
+accept (const uint8_t *addr, uint8_t kind, int8_t rssi, uint32_t now)
+{
+  return lhos_ble_scan_accept (&st, addr, 0, kind, rssi, adv, sizeof (adv),
+                               now);
+}
+
+void
+test_adv_find_walks_structures (void)
+{
+  size_t n = 0;
+  const uint8_t *p = lhos_ble_adv_find (adv, sizeof (adv), 0x09, &n);
+  TEST_ASSERT_NOT_NULL (p);
+  TEST_ASSERT_EQUAL (6, n);
+  TEST_ASSERT_EQUAL_MEMORY ("lhos-7", p, 6);
+  TEST_ASSERT_NULL (lhos_ble_adv_find (adv, sizeof (adv), 0xFF, &n));
+  /* a length running past the end stops the walk */
+  TEST_ASSERT_NULL (lhos_ble_adv_find (adv, 12, 0x03, &n));
+}
+
+void
+test_duplicates_are_dropped_once_reported (void)
+{
+  TEST_ASSERT_TRUE (accept (addr_a, LHOS_BLE_ADV_IND, -50, 0));
+  TEST_ASSERT_FALSE (accept (addr_a, LHOS_BLE_ADV_IND, -40, 10));
+  TEST_ASSERT_TRUE (accept (addr_b, LHOS_BLE_ADV_IND, -50, 20));
+  /* scan responses carry other data and are tracked apart */
+  TEST_ASSERT_TRUE (accept (addr_a, LHOS_BLE_ADV_SCAN_RSP, -50, 30));
+  TEST_ASSERT_FALSE (accept (addr_a, LHOS_BLE_ADV_SCAN_RSP, -50, 40));
+  TEST_ASSERT_EQUAL_UINT32 (5, st.received);
+  TEST_ASSERT_EQUAL_UINT32 (3, st.reported);
+  TEST_ASSERT_EQUAL_UINT32 (2, st.duplicates);
+}
+
+void
+test_refresh_reports_device_again (void)
+{
+  lhos_ble_scan_filter_t f = { .rssi_min = -128, .refresh_ms = 1000 };
+  lhos_ble_scan_reset (&st, &f);
+  TEST_ASSERT_TRUE (accept (addr_a, LHOS_BLE_ADV_IND, -50, 0xFFFFFF00u));
+  TEST_ASSERT_FALSE (accept (addr_a, LHOS_BLE_ADV_IND, -50, 0xFFFFFFF0u));
+  /* across the tick counter wrap */
+  TEST_ASSERT_TRUE (accept (addr_a, LHOS_BLE_ADV_IND, -50, 0x300));
+}
+
+void
+test_filters_run_before_dedup (void)
+{
+  lhos_ble_scan_filter_t f = { .rssi_min = -70,
+                               .kinds = 1u << LHOS_BLE_ADV_IND,
+                               .uuid16 = 0x181A,
+                               .name = "lhos" };
+  lhos_ble_scan_reset (&st, &f);
+  TEST_ASSERT_FALSE (accept (addr_a, LHOS_BLE_ADV_IND, -80, 0));
+  TEST_ASSERT_FALSE (accept (addr_a, LHOS_BLE_ADV_NONCONN_IND, -50, 0));
+  /* a filtered report must not mark the device as seen */
+  TEST_ASSERT_TRUE (accept (addr_a, LHOS_BLE_ADV_IND, -50, 0));
+  TEST_ASSERT_EQUAL_UINT32 (2, st.filtered);
+
+  strcpy (st.filter.name, "other");
+  TEST_ASSERT_FALSE (accept (addr_b, LHOS_BLE_ADV_IND, -50, 0));
+  strcpy (st.filter.name, "lhos");
+  st.filter.uuid16 = 0x2A00;
+  TEST_ASSERT_FALSE (accept (addr_b, LHOS_BLE_ADV_IND, -50, 0));
+}
+
+void
+test_forget_and_full_table (void)
+{
+  TEST_ASSERT_TRUE (accept (addr_a, LHOS_BLE_ADV_IND, -50, 0));
+  lhos_ble_scan_forget (&st, addr_a, 0, LHOS_BLE_ADV_IND);
+  TEST_ASSERT_EQUAL_UINT32 (0, st.reported);
+  TEST_ASSERT_TRUE (accept (addr_a, LHOS_BLE_ADV_IND, -50, 1));
+  TEST_ASSERT_FALSE (accept (addr_a, LHOS_BLE_ADV_IND, -50, 2));
+
+  /* more devices than slots: the table recycles, it never refuses */
+  uint8_t a[6] = { 0 };
+  for (unsigned i = 0; i < 4 * LHOS_BLE_SEEN_SLOTS; i++)
+    {
+      a[0] = (uint8_t)i;
+      a[1] = (uint8_t)(i >> 8);
+      TEST_ASSERT_TRUE (accept (a, LHOS_BLE_ADV_IND, -50, 10 + i));
+    }
+  /* the most recent device is still known */
+  TEST_ASSERT_FALSE (accept (a, LHOS_BLE_ADV_IND, -50, 5000));
+}
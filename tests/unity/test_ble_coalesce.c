@@ -0,0 +1,103 @@
+#include "unity.h"
+
+#include "lhos_ble_coalesce.h"
+
+#include <string.h>
+
+/* Records what would have been notified */
+typedef struct
+{
+  size_t lens[16];
+  uint8_t first[16];
+  int n;
+  int fail_rc;
+} sink_t;
+
+static sink_t sink;
+static lhos_ble_coalesce_t co;
+
+static int
+emit (void *ctx, const uint8_t *data, size_t len)
+{
+  sink_t *s = ctx;
+  if (s->fail_rc)
+    return s->fail_rc;
+  s->lens[s->n] = len;
+  s->first[s->n++] = data[0];
+  return 0;
+}
+
+void
+setUp (void)
+{
+  memset (&sink, 0, sizeof (sink));
+  lhos_ble_coalesce_reset (&co);
+}
+
+void
+tearDown (void)
+{
+}
+
+static int
+add (uint8_t tag, size_t len, size_t limit)
+{
+  uint8_t rec[LHOS_BLE_COALESCE_MAX + 1];
+  memset (rec, tag, sizeof (rec));
+  return lhos_ble_coalesce_add (&co, rec, len, limit, emit, &sink);
+}
+
+void
+test_updates_share_one_notification (void)
+{
+  for (uint8_t i = 0; i < 5; i++)
+    TEST_ASSERT_EQUAL (0, add (i, 4, 22));
+  TEST_ASSERT_EQUAL (0, sink.n);
+  TEST_ASSERT_EQUAL (0, add (5, 4, 22)); /* 24 > 22: the first five go */
+  TEST_ASSERT_EQUAL (1, sink.n);
+  TEST_ASSERT_EQUAL (20, sink.lens[0]);
+  TEST_ASSERT_EQUAL (0, sink.first[0]);
+  TEST_ASSERT_EQUAL (1, co.records);
+  TEST_ASSERT_EQUAL (0, lhos_ble_coalesce_flush (&co, emit, &sink));
+  TEST_ASSERT_EQUAL (2, sink.n);
+  TEST_ASSERT_EQUAL (4, sink.lens[1]);
+  TEST_ASSERT_EQUAL (5, sink.first[1]);
+}
+
+void
+test_full_buffer_goes_at_once (void)
+{
+  TEST_ASSERT_EQUAL (0, add (1, 10, 20));
+  TEST_ASSERT_EQUAL (0, add (2, 10, 20));
+  TEST_ASSERT_EQUAL (1, sink.n);
+  TEST_ASSERT_EQUAL (0, co.len);
+}
+
+void
+test_records_are_never_split (void)
+{
+  TEST_ASSERT_EQUAL (0, add (1, 7, 20));
+  TEST_ASSERT_EQUAL (0, add (2, 7, 20));
+  TEST_ASSERT_EQUAL (0, add (3, 7, 20));
+  TEST_ASSERT_EQUAL (1, sink.n);
+  TEST_ASSERT_EQUAL (14, sink.lens[0]);
+  TEST_ASSERT_EQUAL (LHOS_BLE_COALESCE_TOO_BIG, add (4, 21, 20));
+  /* the MTU caps the limit */
+  TEST_ASSERT_EQUAL (LHOS_BLE_COALESCE_TOO_BIG,
+                     add (4, LHOS_BLE_COALESCE_MAX + 1, 512));
+  TEST_ASSERT_EQUAL (7, co.len);
+}
+
+void
+test_failed_emit_keeps_pending (void)
+{
+  TEST_ASSERT_EQUAL (0, add (1, 12, 20));
+  sink.fail_rc = 6;
+  TEST_ASSERT_EQUAL (6, add (2, 12, 20));
+  TEST_ASSERT_EQUAL (12, co.len);
+  TEST_ASSERT_EQUAL (1, co.records);
+  sink.fail_rc = 0;
+  TEST_ASSERT_EQUAL (0, add (2, 12, 20));
+  TEST_ASSERT_EQUAL (1, sink.n);
+  TEST_ASSERT_EQUAL (12, co.len);
+}
@@ -0,0 +1,101 @@
+#include "unity.h"
+
+#include "lhos_ble_db.h"
+
+#include <string.h>
+
+static lhos_ble_db_t db;
+
+void
+setUp (void)
+{
+  lhos_ble_db_reset (&db);
+}
+
+void
+tearDown (void)
+{
+}
+
+static const uint8_t *
+u16 (uint16_t v)
+{
+  static uint8_t u[4][16];
+  static int n;
+  uint8_t *p = u[n++ & 3];
+  lhos_ble_uuid_from16 (p, v);
+  return p;
+}
+
+void
+test_uuid_parse_and_format (void)
+{
+  uint8_t a[16], b[16];
+  char s[LHOS_BLE_UUID_STR];
+  TEST_ASSERT_TRUE (lhos_ble_uuid_parse ("180f", a));
+  TEST_ASSERT_TRUE (lhos_ble_uuid_parse (
+      "0000180F-0000-1000-8000-00805F9B34FB", b));
+  TEST_ASSERT_EQUAL_MEMORY (a, b, 16);
+  TEST_ASSERT_EQUAL_HEX8 (0x0F, a[12]);
+  lhos_ble_uuid_format (a, s);
+  TEST_ASSERT_EQUAL_STRING ("180F", s);
+
+  const char *nus = "6E400001-B5A3-F393-E0A9-E50E24DCCA9E";
+  TEST_ASSERT_TRUE (lhos_ble_uuid_parse (nus, a));
+  TEST_ASSERT_EQUAL_HEX8 (0x9E, a[0]);
+  lhos_ble_uuid_format (a, s);
+  TEST_ASSERT_EQUAL_STRING (nus, s);
+
+  TEST_ASSERT_FALSE (lhos_ble_uuid_parse ("18F", a));
+  TEST_ASSERT_FALSE (lhos_ble_uuid_parse ("xyzw", a));
+  TEST_ASSERT_FALSE (lhos_ble_uuid_parse (
+      "6E400001+B5A3-F393-E0A9-E50E24DCCA9E", a));
+}
+
+void
+test_find_by_uuid_and_service (void)
+{
+  TEST_ASSERT_TRUE (lhos_ble_db_add_svc (&db, u16 (0x180F), 1, 5));
+  TEST_ASSERT_TRUE (lhos_ble_db_add_svc (&db, u16 (0x181A), 6, 20));
+  TEST_ASSERT_TRUE (lhos_ble_db_add_chr (&db, u16 (0x2A19), 2, 3, 0x12));
+  TEST_ASSERT_TRUE (lhos_ble_db_add_chr (&db, u16 (0x2A6E), 7, 8, 0x12));
+  TEST_ASSERT_TRUE (lhos_ble_db_add_chr (&db, u16 (0x2A19), 10, 11, 0x02));
+
+  const lhos_ble_chr_t *c = lhos_ble_db_find (&db, u16 (0x2A19), NULL);
+  TEST_ASSERT_NOT_NULL (c);
+  TEST_ASSERT_EQUAL (3, c->val_handle);
+  c = lhos_ble_db_find (&db, u16 (0x2A19), u16 (0x181A));
+  TEST_ASSERT_NOT_NULL (c);
+  TEST_ASSERT_EQUAL (11, c->val_handle);
+  TEST_ASSERT_EQUAL (1, c->svc);
+  TEST_ASSERT_NULL (lhos_ble_db_find (&db, u16 (0x2A00), NULL));
+
+  /* descriptors of a characteristic end before the next declaration */
+  TEST_ASSERT_EQUAL (5, lhos_ble_db_chr_end (&db, 0));
+  TEST_ASSERT_EQUAL (9, lhos_ble_db_chr_end (&db, 1));
+  TEST_ASSERT_EQUAL (20, lhos_ble_db_chr_end (&db, 2));
+}
+
+void
+test_blob_validation (void)
+{
+  lhos_ble_db_add_svc (&db, u16 (0x180F), 1, 5);
+  lhos_ble_db_add_chr (&db, u16 (0x2A19), 2, 3, 0x12);
+  size_t n = lhos_ble_db_size (&db);
+  TEST_ASSERT_TRUE (n < sizeof (db));
+  TEST_ASSERT_TRUE (lhos_ble_db_valid (&db, n));
+  TEST_ASSERT_FALSE (lhos_ble_db_valid (&db, n - 1));
+  db.version++;
+  TEST_ASSERT_FALSE (lhos_ble_db_valid (&db, n));
+  db.version--;
+  db.chrs[0].svc = 3;
+  TEST_ASSERT_FALSE (lhos_ble_db_valid (&db, n));
+}
+
+void
+test_full_table (void)
+{
+  for (int i = 0; i < LHOS_BLE_DB_CHRS; i++)
+    TEST_ASSERT_TRUE (lhos_ble_db_add_chr (&db, u16 (0x2A00), 1, 2, 0));
+  TEST_ASSERT_FALSE (lhos_ble_db_add_chr (&db, u16 (0x2A00), 1, 2, 0));
+}
@@ -0,0 +1,135 @@
+#include "unity.h"
+
+#include "lhos_ble_gatt.h"
+
+#include <string.h>
+
+/* Stand-in for the NimBLE host: records what was started and finished,
+   fails starts on request. */
+typedef struct
+{
+  uint32_t started[32];
+  int nstarted;
+  uint32_t done[32];
+  int status[32];
+  int ndone;
+  int fail_rc;             /* returned by start() */
+  lhos_gatt_queue_t *echo; /* complete synchronously inside start() */
+} fake_stack_t;
+
+static fake_stack_t st;
+static lhos_gatt_queue_t q;
+
+static int
+fake_start (void *ctx, lhos_gatt_req_t *req)
+{
+  fake_stack_t *s = ctx;
+  s->started[s->nstarted++] = req->id;
+  if (s->fail_rc)
+    return s->fail_rc;
+  if (s->echo && req->op != LHOS_GATT_WRITE_NO_RSP)
+    lhos_gatt_complete (s->echo, req->id, 0, NULL);
+  return 0;
+}
+
+static void
+fake_done (void *ctx, lhos_gatt_req_t *req, int status, void *result)
+{
+  fake_stack_t *s = ctx;
+  (void)result;
+  s->done[s->ndone] = req->id;
+  s->status[s->ndone++] = status;
+}
+
+static const lhos_gatt_ops_t fake_ops = { fake_start, fake_done };
+
+void
+setUp (void)
+{
+  memset (&st, 0, sizeof (st));
+  lhos_gatt_queue_init (&q, &fake_ops, &st);
+}
+
+void
+tearDown (void)
+{
+}
+
+static bool
+submit (uint32_t id, lhos_gatt_op_t op)
+{
+  lhos_gatt_req_t r = { .id = id, .conn = 1, .attr = 0x10, .op = op };
+  return lhos_gatt_submit (&q, &r);
+}
+
+void
+test_one_request_in_flight_per_link (void)
+{
+  TEST_ASSERT_TRUE (submit (1, LHOS_GATT_READ));
+  TEST_ASSERT_TRUE (submit (2, LHOS_GATT_WRITE));
+  TEST_ASSERT_EQUAL (1, st.nstarted);
+  /* completions for anything but the request in flight are ignored */
+  TEST_ASSERT_FALSE (lhos_gatt_complete (&q, 2, 0, NULL));
+  TEST_ASSERT_TRUE (lhos_gatt_complete (&q, 1, 0, NULL));
+  TEST_ASSERT_EQUAL (2, st.nstarted);
+  TEST_ASSERT_EQUAL_UINT32 (2, st.started[1]);
+  TEST_ASSERT_TRUE (lhos_gatt_complete (&q, 2, 7, NULL));
+  TEST_ASSERT_EQUAL (2, st.ndone);
+  TEST_ASSERT_EQUAL (7, st.status[1]);
+  TEST_ASSERT_TRUE (lhos_gatt_idle (&q));
+}
+
+void
+test_writes_without_response_do_not_wait (void)
+{
+  TEST_ASSERT_TRUE (submit (1, LHOS_GATT_WRITE_NO_RSP));
+  TEST_ASSERT_TRUE (submit (2, LHOS_GATT_WRITE_NO_RSP));
+  TEST_ASSERT_TRUE (submit (3, LHOS_GATT_READ));
+  TEST_ASSERT_TRUE (submit (4, LHOS_GATT_WRITE_NO_RSP));
+  /* both commands went out and completed, the read holds the fourth */
+  TEST_ASSERT_EQUAL (3, st.nstarted);
+  TEST_ASSERT_EQUAL (2, st.ndone);
+  TEST_ASSERT_TRUE (lhos_gatt_complete (&q, 3, 0, NULL));
+  TEST_ASSERT_EQUAL (4, st.ndone);
+  TEST_ASSERT_EQUAL_UINT32 (4, st.done[3]);
+}
+
+void
+test_failed_start_reports_and_moves_on (void)
+{
+  st.fail_rc = 6;
+  TEST_ASSERT_TRUE (submit (1, LHOS_GATT_READ));
+  TEST_ASSERT_EQUAL (1, st.ndone);
+  TEST_ASSERT_EQUAL (6, st.status[0]);
+  st.fail_rc = 0;
+  TEST_ASSERT_TRUE (submit (2, LHOS_GATT_READ));
+  TEST_ASSERT_EQUAL (2, st.nstarted);
+  TEST_ASSERT_FALSE (lhos_gatt_idle (&q));
+}
+
+void
+test_full_queue_and_flush (void)
+{
+  for (uint32_t i = 1; i <= LHOS_GATT_QUEUE_LEN; i++)
+    TEST_ASSERT_TRUE (submit (i, LHOS_GATT_READ));
+  TEST_ASSERT_FALSE (submit (99, LHOS_GATT_READ));
+  lhos_gatt_flush (&q, 7);
+  /* queued ones fail in order; the one in flight stays the stack's */
+  TEST_ASSERT_EQUAL (LHOS_GATT_QUEUE_LEN - 1, st.ndone);
+  TEST_ASSERT_EQUAL_UINT32 (2, st.done[0]);
+  TEST_ASSERT_EQUAL_UINT32 (LHOS_GATT_QUEUE_LEN, st.done[st.ndone - 1]);
+  TEST_ASSERT_TRUE (lhos_gatt_complete (&q, 1, 7, NULL));
+  TEST_ASSERT_TRUE (lhos_gatt_idle (&q));
+}
+
+void
+test_completion_inside_start (void)
+{
+  st.echo = &q;
+  TEST_ASSERT_TRUE (submit (1, LHOS_GATT_READ));
+  TEST_ASSERT_TRUE (submit (2, LHOS_GATT_WRITE));
+  TEST_ASSERT_EQUAL (2, st.nstarted);
+  TEST_ASSERT_EQUAL (2, st.ndone);
+  TEST_ASSERT_EQUAL_UINT32 (2, st.done[1]);
+  TEST_ASSERT_TRUE (lhos_gatt_idle (&q));
+}
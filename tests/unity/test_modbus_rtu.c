@@ -0,0 +1,97 @@
+#include "unity.h"
+
+#include "lhos_modbus_rtu.h"
+
+#include <string.h>
+
+void
+setUp (void)
+{
+}
+
+void
+tearDown (void)
+{
+}
+
+/* bit-by-bit reference for the table */
+static uint16_t
+crc16_ref (const uint8_t *p, size_t n)
+{
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < n; i++)
+    {
+      crc ^= p[i];
+      for (int b = 0; b < 8; b++)
+        crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+  return crc;
+}
+
+void
+test_crc_matches_reference (void)
+{
+  uint8_t buf[256];
+  for (size_t i = 0; i < sizeof (buf); i++)
+    buf[i] = (uint8_t)(i * 37 + 11);
+  TEST_ASSERT_EQUAL_HEX16 (0x4B37,
+                           lhos_modbus_crc16 ((const uint8_t *)"123456789", 9));
+  TEST_ASSERT_EQUAL_HEX16 (crc16_ref (buf, sizeof (buf)),
+                           lhos_modbus_crc16 (buf, sizeof (buf)));
+}
+
+void
+test_build_read_holding (void)
+{
+  const uint8_t expect[] = { 0x01, 0x03, 0x00, 0x00, 0x00, 0x0A, 0xC5, 0xCD };
+  uint8_t req[LHOS_MODBUS_READ_REQ_LEN];
+  TEST_ASSERT_EQUAL_UINT (8, lhos_modbus_build_read (
+                                 req, 1, LHOS_MODBUS_FC_READ_HOLDING, 0, 10));
+  TEST_ASSERT_EQUAL_HEX8_ARRAY (expect, req, sizeof (expect));
+}
+
+static size_t
+seal (uint8_t *f, size_t n)
+{
+  uint16_t crc = lhos_modbus_crc16 (f, n);
+  f[n] = (uint8_t)crc;
+  f[n + 1] = (uint8_t)(crc >> 8);
+  return n + 2;
+}
+
+void
+test_parse_read_response (void)
+{
+  uint8_t f[16] = { 0x11, 0x03, 0x04, 0x02, 0x2B, 0x00, 0x64 };
+  uint16_t v[2] = { 0 };
+  size_t n = seal (f, 7);
+  TEST_ASSERT_EQUAL_INT (LHOS_MODBUS_RTU_OK,
+                         lhos_modbus_parse_read (f, n, 0x11, 0x03, 2, v,
+                                                 NULL));
+  TEST_ASSERT_EQUAL_UINT16 (0x022B, v[0]);
+  TEST_ASSERT_EQUAL_UINT16 (100, v[1]);
+
+  /* wrong slave, wrong count, corrupted byte */
+  TEST_ASSERT_EQUAL_INT (LHOS_MODBUS_RTU_MISMATCH,
+                         lhos_modbus_parse_read (f, n, 0x12, 0x03, 2, v,
+                                                 NULL));
+  TEST_ASSERT_EQUAL_INT (LHOS_MODBUS_RTU_MISMATCH,
+                         lhos_modbus_parse_read (f, n, 0x11, 0x03, 3, v,
+                                                 NULL));
+  f[4] ^= 0x40;
+  TEST_ASSERT_EQUAL_INT (LHOS_MODBUS_RTU_CRC,
+                         lhos_modbus_parse_read (f, n, 0x11, 0x03, 2, v,
+                                                 NULL));
+}
+
+void
+test_parse_exception (void)
+{
+  uint8_t f[8] = { 0x0A, 0x83, 0x02 };
+  uint8_t ex = 0;
+  size_t n = seal (f, 3);
+  TEST_ASSERT_EQUAL_INT (LHOS_MODBUS_RTU_EXCEPTION,
+                         lhos_modbus_parse_read (f, n, 0x0A, 0x03, 1, NULL,
+                                                 &ex));
+  TEST_ASSERT_EQUAL_UINT8 (2, ex);
+}
@@ -0,0 +1,166 @@
+#include "unity.h"
+
+#include "lhos_stream.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char path[] = "/tmp/lhos_stream_XXXXXX";
+static int fd;
+static uint8_t buf[16];
+static lhos_stream_t st;
+
+void
+setUp (void)
+{
+  strcpy (path + sizeof (path) - 7, "XXXXXX");
+  fd = mkstemp (path);
+  TEST_ASSERT_TRUE (fd >= 0);
+  lhos_stream_init (&st, fd, buf, sizeof (buf));
+}
+
+void
+tearDown (void)
+{
+  if (st.fd >= 0)
+    close (st.fd);
+  unlink (path);
+}
+
+static void
+put_file (const char *text)
+{
+  TEST_ASSERT_EQUAL ((ssize_t)strlen (text),
+                     pwrite (fd, text, strlen (text), 0));
+}
+
+static off_t
+file_size (void)
+{
+  struct stat sb;
+  fstat (fd, &sb);
+  return sb.st_size;
+}
+
+/* what lhos_lua_posix does for file:read_line() */
+static size_t
+read_line (char *out, size_t cap)
+{
+  size_t n = 0;
+  const uint8_t *p;
+  ssize_t avail;
+  while ((avail = lhos_stream_peek (&st, &p)) > 0)
+    {
+      const uint8_t *nl = memchr (p, '\n', (size_t)avail);
+      size_t take = nl ? (size_t)(nl - p) + 1 : (size_t)avail;
+      TEST_ASSERT_TRUE (n + take < cap);
+      memcpy (out + n, p, take);
+      n += take;
+      lhos_stream_consume (&st, take);
+      if (nl)
+        break;
+    }
+  out[n] = '\0';
+  return n;
+}
+
+void
+test_lines_span_refills (void)
+{
+  put_file ("a=1\nlonger_key=some value\n\nlast");
+  char line[64];
+  read_line (line, sizeof (line));
+  TEST_ASSERT_EQUAL_STRING ("a=1\n", line);
+  read_line (line, sizeof (line));
+  TEST_ASSERT_EQUAL_STRING ("longer_key=some value\n", line);
+  read_line (line, sizeof (line));
+  TEST_ASSERT_EQUAL_STRING ("\n", line);
+  read_line (line, sizeof (line));
+  TEST_ASSERT_EQUAL_STRING ("last", line);
+  TEST_ASSERT_EQUAL (0, read_line (line, sizeof (line)));
+}
+
+void
+test_reads_any_size (void)
+{
+  char text[100];
+  for (int i = 0; i < 99; i++)
+    text[i] = (char)('a' + i % 26);
+  text[99] = '\0';
+  put_file (text);
+  char out[100] = { 0 };
+  TEST_ASSERT_EQUAL (3, lhos_stream_read (&st, out, 3));
+  TEST_ASSERT_EQUAL (40, lhos_stream_read (&st, out + 3, 40)); /* direct */
+  TEST_ASSERT_EQUAL (5, lhos_stream_read (&st, out + 43, 5));
+  TEST_ASSERT_EQUAL (48, lhos_stream_tell (&st));
+  TEST_ASSERT_EQUAL (51, lhos_stream_read (&st, out + 48, 60));
+  TEST_ASSERT_EQUAL_STRING (text, out);
+  TEST_ASSERT_EQUAL (0, lhos_stream_read (&st, out, 1));
+}
+
+void
+test_writes_wait_for_flush (void)
+{
+  TEST_ASSERT_EQUAL (4, lhos_stream_write (&st, "abcd", 4));
+  TEST_ASSERT_EQUAL (4, lhos_stream_write (&st, "efgh", 4));
+  TEST_ASSERT_EQUAL (0, file_size ());
+  TEST_ASSERT_EQUAL (8, lhos_stream_tell (&st));
+  /* filling the buffer sends it */
+  TEST_ASSERT_EQUAL (10, lhos_stream_write (&st, "0123456789", 10));
+  TEST_ASSERT_EQUAL (16, file_size ());
+  TEST_ASSERT_EQUAL (0, lhos_stream_flush (&st));
+  TEST_ASSERT_EQUAL (18, file_size ());
+  char out[19] = { 0 };
+  TEST_ASSERT_EQUAL (18, pread (fd, out, 18, 0));
+  TEST_ASSERT_EQUAL_STRING ("abcdefgh0123456789", out);
+}
+
+void
+test_direction_switch_keeps_position (void)
+{
+  put_file ("0123456789");
+  char out[4] = { 0 };
+  TEST_ASSERT_EQUAL (3, lhos_stream_read (&st, out, 3));
+  /* the whole file was read ahead; the write lands after "012" */
+  TEST_ASSERT_EQUAL (2, lhos_stream_write (&st, "XY", 2));
+  TEST_ASSERT_EQUAL (5, lhos_stream_tell (&st));
+  TEST_ASSERT_EQUAL (3, lhos_stream_read (&st, out, 3));
+  TEST_ASSERT_EQUAL_STRING ("567", out);
+  TEST_ASSERT_EQUAL (0, lhos_stream_seek (&st, 0, SEEK_SET));
+  char all[11] = { 0 };
+  TEST_ASSERT_EQUAL (10, lhos_stream_read (&st, all, 10));
+  TEST_ASSERT_EQUAL_STRING ("012XY56789", all);
+  TEST_ASSERT_EQUAL (0, lhos_stream_close (&st));
+}
+
+void
+test_short_write_defers_error (void)
+{
+  /* the file size limit cuts a direct write short, then fails it */
+  struct rlimit old, lim;
+  TEST_ASSERT_EQUAL (0, getrlimit (RLIMIT_FSIZE, &old));
+  lim = old;
+  lim.rlim_cur = 20;
+  signal (SIGXFSZ, SIG_IGN);
+  TEST_ASSERT_EQUAL (0, setrlimit (RLIMIT_FSIZE, &lim));
+  char data[40];
+  memset (data, 'x', sizeof (data));
+  ssize_t w = lhos_stream_write (&st, data, sizeof (data));
+  int again = (int)lhos_stream_write (&st, "y", 1);
+  int err = errno;
+  setrlimit (RLIMIT_FSIZE, &old);
+  signal (SIGXFSZ, SIG_DFL);
+  TEST_ASSERT_EQUAL (20, w);
+  TEST_ASSERT_EQUAL (-1, again);
+  TEST_ASSERT_EQUAL (EFBIG, err);
+  TEST_ASSERT_EQUAL (20, file_size ());
+  /* reported once */
+  TEST_ASSERT_EQUAL (1, lhos_stream_write (&st, "y", 1));
+}
@@ -0,0 +1,162 @@
+#include "unity.h"
+
+#include "lhos_uart_frame.h"
+
+#include <string.h>
+
+#define MAX_FRAMES 8
+
+static char frames[MAX_FRAMES][64];
+static size_t lens[MAX_FRAMES];
+static int nframes;
+
+static void
+collect (const uint8_t *frame, size_t len, void *ctx)
+{
+  (void)ctx;
+  if (nframes < MAX_FRAMES && len < sizeof (frames[0]))
+    {
+      memcpy (frames[nframes], frame, len);
+      lens[nframes] = len;
+    }
+  nframes++;
+}
+
+static size_t
+feed_str (lhos_uart_framer_t *f, const char *s)
+{
+  return lhos_uart_framer_feed (f, (const uint8_t *)s, strlen (s), collect,
+                                NULL);
+}
+
+void
+setUp (void)
+{
+  memset (frames, 0, sizeof (frames));
+  memset (lens, 0, sizeof (lens));
+  nframes = 0;
+}
+
+void
+tearDown (void)
+{
+}
+
+void
+test_framer_rejects_bad_config (void)
+{
+  lhos_uart_framer_t f;
+  uint8_t buf[4];
+  lhos_uart_frame_config_t none = { .mode = LHOS_UART_FRAME_NONE };
+  lhos_uart_frame_config_t delim = { .mode = LHOS_UART_FRAME_DELIM };
+  lhos_uart_frame_config_t len3
+      = { .mode = LHOS_UART_FRAME_LENGTH, .len_size = 3 };
+  lhos_uart_frame_config_t big_hdr
+      = { .mode = LHOS_UART_FRAME_LENGTH, .len_offset = 4, .len_size = 1 };
+  TEST_ASSERT_FALSE (lhos_uart_framer_init (&f, &none, buf, sizeof (buf)));
+  TEST_ASSERT_FALSE (lhos_uart_framer_init (&f, &delim, buf, sizeof (buf)));
+  TEST_ASSERT_FALSE (lhos_uart_framer_init (&f, &len3, buf, sizeof (buf)));
+  TEST_ASSERT_FALSE (lhos_uart_framer_init (&f, &big_hdr, buf, sizeof (buf)));
+}
+
+void
+test_delimiter_splits_across_chunks (void)
+{
+  lhos_uart_framer_t f;
+  uint8_t buf[32];
+  lhos_uart_frame_config_t cfg
+      = { .mode = LHOS_UART_FRAME_DELIM, .delim = "\r\n", .delim_len = 2 };
+  TEST_ASSERT_TRUE (lhos_uart_framer_init (&f, &cfg, buf, sizeof (buf)));
+
+  TEST_ASSERT_EQUAL_UINT (0, feed_str (&f, "OK\r"));
+  TEST_ASSERT_EQUAL_UINT (3, feed_str (&f, "\n+CSQ: 20\r\n\r\nAT"));
+  TEST_ASSERT_EQUAL_INT (3, nframes);
+  TEST_ASSERT_EQUAL_STRING ("OK", frames[0]);
+  TEST_ASSERT_EQUAL_STRING ("+CSQ: 20", frames[1]);
+  TEST_ASSERT_EQUAL_UINT (0, lens[2]); /* empty line */
+  TEST_ASSERT_EQUAL_UINT32 (3, f.frames);
+}
+
+void
+test_delimiter_drops_oversized_frame_and_resyncs (void)
+{
+  lhos_uart_framer_t f;
+  uint8_t buf[8];
+  lhos_uart_frame_config_t cfg
+      = { .mode = LHOS_UART_FRAME_DELIM, .delim = "\r\n", .delim_len = 2 };
+  TEST_ASSERT_TRUE (lhos_uart_framer_init (&f, &cfg, buf, sizeof (buf)));
+
+  /* the delimiter straddles the point where the buffer fills up */
+  feed_str (&f, "0123456\r\nabc\r\n");
+  TEST_ASSERT_EQUAL_INT (1, nframes);
+  TEST_ASSERT_EQUAL_STRING ("abc", frames[0]);
+  TEST_ASSERT_EQUAL_UINT32 (1, f.dropped);
+}
+
+void
+test_length_prefix_with_trailer (void)
+{
+  lhos_uart_framer_t f;
+  uint8_t buf[16];
+  /* [0xAA][len][payload...][crc] */
+  lhos_uart_frame_config_t cfg = { .mode = LHOS_UART_FRAME_LENGTH,
+                                   .len_offset = 1,
+                                   .len_size = 1,
+                                   .len_adjust = 1 };
+  const uint8_t in[] = { 0xAA, 3, 'a', 'b', 'c', 0x55, 0xAA, 0, 0x66,
+                         0xAA, 20 };
+  TEST_ASSERT_TRUE (lhos_uart_framer_init (&f, &cfg, buf, sizeof (buf)));
+
+  TEST_ASSERT_EQUAL_UINT (
+      2, lhos_uart_framer_feed (&f, in, sizeof (in), collect, NULL));
+  TEST_ASSERT_EQUAL_UINT (6, lens[0]);
+  TEST_ASSERT_EQUAL_MEMORY (in, frames[0], 6);
+  TEST_ASSERT_EQUAL_UINT (3, lens[1]);
+
+  /* 0xAA 20 announces 23 bytes: skipped without storing, then in sync */
+  uint8_t skip[21] = { 0 };
+  lhos_uart_framer_feed (&f, skip, sizeof (skip), collect, NULL);
+  TEST_ASSERT_EQUAL_UINT32 (1, f.dropped);
+  const uint8_t next[] = { 0xAA, 1, 'z', 0x11 };
+  lhos_uart_framer_feed (&f, next, sizeof (next), collect, NULL);
+  TEST_ASSERT_EQUAL_INT (3, nframes);
+  TEST_ASSERT_EQUAL_UINT8 ('z', frames[2][2]);
+}
+
+void
+test_length_prefix_16bit_little_endian (void)
+{
+  lhos_uart_framer_t f;
+  uint8_t buf[300];
+  uint8_t in[2 + 260];
+  lhos_uart_frame_config_t cfg
+      = { .mode = LHOS_UART_FRAME_LENGTH, .len_size = 2, .len_le = true };
+  memset (in, 'x', sizeof (in));
+  in[0] = 260 & 0xff;
+  in[1] = 260 >> 8;
+  TEST_ASSERT_TRUE (lhos_uart_framer_init (&f, &cfg, buf, sizeof (buf)));
+  TEST_ASSERT_EQUAL_UINT (
+      1, lhos_uart_framer_feed (&f, in, sizeof (in), NULL, NULL));
+  TEST_ASSERT_EQUAL_UINT32 (1, f.frames);
+}
+
+void
+test_gap_framing_emits_on_flush (void)
+{
+  lhos_uart_framer_t f;
+  uint8_t buf[8];
+  lhos_uart_frame_config_t cfg = { .mode = LHOS_UART_FRAME_GAP };
+  TEST_ASSERT_TRUE (lhos_uart_framer_init (&f, &cfg, buf, sizeof (buf)));
+
+  TEST_ASSERT_EQUAL_UINT (0, feed_str (&f, "\x01\x03"));
+  TEST_ASSERT_EQUAL_UINT (0, feed_str (&f, "\x02\x05"));
+  TEST_ASSERT_EQUAL_UINT (1, lhos_uart_framer_flush (&f, collect, NULL));
+  TEST_ASSERT_EQUAL_UINT (4, lens[0]);
+  TEST_ASSERT_EQUAL_UINT (0, lhos_uart_framer_flush (&f, collect, NULL));
+
+  /* longer than the buffer: dropped at the gap */
+  feed_str (&f, "0123456789");
+  TEST_ASSERT_EQUAL_UINT (0, lhos_uart_framer_flush (&f, collect, NULL));
+  TEST_ASSERT_EQUAL_UINT32 (1, f.dropped);
+  TEST_ASSERT_EQUAL_INT (1, nframes);
+}
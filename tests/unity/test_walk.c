@@ -0,0 +1,195 @@
+#include "unity.h"
+
+#include "lhos_walk.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char root[64];
+static char path[128];
+
+/* what a walk saw */
+typedef struct
+{
+  int files, dirs, deepest;
+  off_t bytes;
+  const char *skip; /* directory name to prune */
+  int stop_after;   /* entries before stopping with -7, 0 = never */
+} seen_t;
+
+static seen_t seen;
+
+static void
+make_file (const char *rel, size_t size)
+{
+  char p[128];
+  snprintf (p, sizeof (p), "%s/%s", root, rel);
+  int fd = open (p, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  TEST_ASSERT_TRUE (fd >= 0);
+  static const char data[16] = "0123456789abcdef";
+  TEST_ASSERT_EQUAL ((ssize_t)size, write (fd, data, size));
+  close (fd);
+}
+
+static void
+make_dir (const char *rel)
+{
+  char p[128];
+  snprintf (p, sizeof (p), "%s/%s", root, rel);
+  TEST_ASSERT_EQUAL (0, mkdir (p, 0755));
+}
+
+void
+setUp (void)
+{
+  strcpy (root, "/tmp/lhos_walk_XXXXXX");
+  TEST_ASSERT_NOT_NULL (mkdtemp (root));
+  make_file ("a.txt", 3);
+  make_dir ("sub");
+  make_file ("sub/b.bin", 5);
+  make_dir ("sub/deep");
+  make_file ("sub/deep/c", 1);
+  make_dir ("empty");
+  strcpy (path, root);
+  memset (&seen, 0, sizeof (seen));
+}
+
+void
+tearDown (void)
+{
+  char cmd[96];
+  snprintf (cmd, sizeof (cmd), "rm -rf %s", root);
+  system (cmd);
+}
+
+static int
+count (void *ctx, const char *p, const lhos_dirent_t *e, int depth)
+{
+  seen_t *s = ctx;
+  (void)p;
+  if (e->type == LHOS_DIRENT_FILE)
+    {
+      s->files++;
+      s->bytes += e->size;
+    }
+  else if (e->type == LHOS_DIRENT_DIR)
+    s->dirs++;
+  if (depth > s->deepest)
+    s->deepest = depth;
+  if (s->stop_after && s->files + s->dirs == s->stop_after)
+    return -7;
+  if (s->skip && strcmp (e->name, s->skip) == 0)
+    return LHOS_WALK_SKIP;
+  return 0;
+}
+
+void
+test_dir_lists_types_and_sizes (void)
+{
+  DIR *d = opendir (root);
+  TEST_ASSERT_NOT_NULL (d);
+  size_t base = strlen (path);
+  path[base++] = '/';
+  lhos_dirent_t e;
+  int n = 0, rc;
+  while ((rc = lhos_dir_next (d, path, base, sizeof (path), &e, NULL)) > 0)
+    {
+      n++;
+      if (strcmp (e.name, "a.txt") == 0)
+        {
+          TEST_ASSERT_EQUAL (LHOS_DIRENT_FILE, e.type);
+          TEST_ASSERT_EQUAL (3, e.size);
+        }
+      else
+        TEST_ASSERT_EQUAL (LHOS_DIRENT_DIR, e.type);
+    }
+  closedir (d);
+  TEST_ASSERT_EQUAL (0, rc);
+  TEST_ASSERT_EQUAL (3, n);
+}
+
+void
+test_walk_sums_the_tree (void)
+{
+  TEST_ASSERT_EQUAL (0, lhos_walk (path, sizeof (path), 16, count, &seen,
+                                   NULL));
+  TEST_ASSERT_EQUAL (3, seen.files);
+  TEST_ASSERT_EQUAL (3, seen.dirs);
+  TEST_ASSERT_EQUAL (9, seen.bytes);
+  TEST_ASSERT_EQUAL (2, seen.deepest);
+  TEST_ASSERT_EQUAL_STRING (root, path);
+}
+
+void
+test_walk_prunes_and_limits (void)
+{
+  lhos_walk_missed_t missed;
+  seen.skip = "deep";
+  TEST_ASSERT_EQUAL (0, lhos_walk (path, sizeof (path), 16, count, &seen,
+                                   &missed));
+  TEST_ASSERT_EQUAL (2, seen.files);
+  TEST_ASSERT_EQUAL (1, seen.deepest);
+  TEST_ASSERT_EQUAL (0, missed.deep); /* pruned, not missed */
+  memset (&seen, 0, sizeof (seen));
+  TEST_ASSERT_EQUAL (0, lhos_walk (path, sizeof (path), 0, count, &seen,
+                                   &missed));
+  TEST_ASSERT_EQUAL (1, seen.files);
+  TEST_ASSERT_EQUAL (2, seen.dirs);
+  TEST_ASSERT_EQUAL (2, missed.deep);
+  TEST_ASSERT_EQUAL (0, missed.unreadable);
+}
+
+void
+test_walk_stops_and_reports (void)
+{
+  seen.stop_after = 2;
+  TEST_ASSERT_EQUAL (-7, lhos_walk (path, sizeof (path), 16, count, &seen,
+                                    NULL));
+  TEST_ASSERT_EQUAL (2, seen.files + seen.dirs);
+  TEST_ASSERT_EQUAL_STRING (root, path);
+  /* no room for the names below */
+  TEST_ASSERT_EQUAL (-1, lhos_walk (path, strlen (root) + 4, 16, count,
+                                    &seen, NULL));
+  strcat (path, "/missing");
+  TEST_ASSERT_EQUAL (-1, lhos_walk (path, sizeof (path), 16, count, &seen,
+                                    NULL));
+}
+
+void
+test_walk_goes_past_unreadable_dirs (void)
+{
+  char sub[128];
+  snprintf (sub, sizeof (sub), "%s/sub", root);
+  TEST_ASSERT_EQUAL (0, chmod (sub, 0));
+  lhos_walk_missed_t missed;
+  int rc = lhos_walk (path, sizeof (path), 16, count, &seen, &missed);
+  chmod (sub, 0755);
+  TEST_ASSERT_EQUAL (0, rc);
+  /* root can open anything; then nothing is missed */
+  if (missed.unreadable)
+    {
+      TEST_ASSERT_EQUAL (1, missed.unreadable);
+      TEST_ASSERT_EQUAL (1, seen.files);
+      TEST_ASSERT_EQUAL (2, seen.dirs);
+    }
+  else
+    TEST_ASSERT_EQUAL (3, seen.files);
+}
+
+void
+test_walk_goes_past_entries_it_cannot_stat (void)
+{
+  char link[128];
+  snprintf (link, sizeof (link), "%s/sub/dangling", root);
+  TEST_ASSERT_EQUAL (0, symlink ("nowhere", link));
+  lhos_walk_missed_t missed;
+  TEST_ASSERT_EQUAL (0, lhos_walk (path, sizeof (path), 16, count, &seen,
+                                   &missed));
+  TEST_ASSERT_EQUAL (1, missed.unreadable);
+  TEST_ASSERT_EQUAL (3, seen.files);
+  TEST_ASSERT_EQUAL (3, seen.dirs);
+}
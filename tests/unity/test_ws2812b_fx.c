@@ -0,0 +1,143 @@
+#include "unity.h"
+
+#include "lhos_ws2812b_fx.h"
+
+#include <string.h>
+
+static uint8_t px[8 * 3];
+
+void
+setUp (void)
+{
+  memset (px, 0xAA, sizeof (px));
+}
+
+void
+tearDown (void)
+{
+}
+
+static uint32_t
+rgb_at (size_t i)
+{
+  return (uint32_t)px[i * 3 + 1] << 16 | (uint32_t)px[i * 3] << 8
+         | px[i * 3 + 2];
+}
+
+void
+test_blink_repeats_then_ends_off (void)
+{
+  lhos_fx_t fx = { .type = LHOS_FX_BLINK, .color = 0xFF0000,
+                   .on_ms = 100, .off_ms = 50, .repeat = 2 };
+  TEST_ASSERT_TRUE (lhos_fx_render (&fx, 0, px, 2));
+  TEST_ASSERT_EQUAL_HEX32 (0xFF0000, rgb_at (1));
+  /* GRB on the wire */
+  TEST_ASSERT_EQUAL_HEX8 (0x00, px[0]);
+  TEST_ASSERT_EQUAL_HEX8 (0xFF, px[1]);
+  TEST_ASSERT_TRUE (lhos_fx_render (&fx, 120, px, 2));
+  TEST_ASSERT_EQUAL_HEX32 (0, rgb_at (0));
+  TEST_ASSERT_TRUE (lhos_fx_render (&fx, 160, px, 2));
+  TEST_ASSERT_EQUAL_HEX32 (0xFF0000, rgb_at (0));
+  TEST_ASSERT_FALSE (lhos_fx_render (&fx, 300, px, 2));
+  TEST_ASSERT_EQUAL_HEX32 (0, rgb_at (0));
+}
+
+void
+test_breathe_and_fade_levels (void)
+{
+  lhos_fx_t fx = { .type = LHOS_FX_BREATHE, .color = 0x00FF00,
+                   .period_ms = 1000 };
+  lhos_fx_render (&fx, 0, px, 1);
+  TEST_ASSERT_EQUAL_HEX32 (0, rgb_at (0));
+  lhos_fx_render (&fx, 500, px, 1);
+  TEST_ASSERT_EQUAL_HEX32 (0x00FF00, rgb_at (0));
+  lhos_fx_render (&fx, 1250, px, 1);
+  TEST_ASSERT_EQUAL_HEX32 (0x007F00, rgb_at (0));
+
+  fx = (lhos_fx_t){ .type = LHOS_FX_FADE, .color = 0xFFFFFF,
+                    .color2 = 0x000010, .period_ms = 100 };
+  TEST_ASSERT_TRUE (lhos_fx_render (&fx, 50, px, 1));
+  TEST_ASSERT_EQUAL_HEX32 (0x808088, rgb_at (0));
+  /* a fade runs once and holds its target */
+  TEST_ASSERT_FALSE (lhos_fx_render (&fx, 100, px, 1));
+  TEST_ASSERT_EQUAL_HEX32 (0x000010, rgb_at (0));
+}
+
+void
+test_chase_wraps_around (void)
+{
+  lhos_fx_t fx = { .type = LHOS_FX_CHASE, .color = 0x0000FF,
+                   .color2 = 0x010101, .period_ms = 10, .width = 2 };
+  TEST_ASSERT_EQUAL_UINT32 (80, lhos_fx_cycle_ms (&fx, 8));
+  lhos_fx_render (&fx, 75, px, 8);
+  TEST_ASSERT_EQUAL_HEX32 (0x0000FF, rgb_at (7));
+  TEST_ASSERT_EQUAL_HEX32 (0x0000FF, rgb_at (0));
+  TEST_ASSERT_EQUAL_HEX32 (0x010101, rgb_at (1));
+  TEST_ASSERT_EQUAL_HEX32 (0x010101, rgb_at (6));
+}
+
+void
+test_sequence_holds_or_blends_keys (void)
+{
+  lhos_fx_t fx = { .type = LHOS_FX_SEQUENCE, .repeat = 1, .nkeys = 3,
+                   .keys = { { 0xFF0000, 100 }, { 0x00FF00, 100 },
+                             { 0x0000FF, 100 } } };
+  lhos_fx_render (&fx, 150, px, 1);
+  TEST_ASSERT_EQUAL_HEX32 (0x00FF00, rgb_at (0));
+  fx.smooth = true;
+  lhos_fx_render (&fx, 150, px, 1);
+  TEST_ASSERT_EQUAL_HEX32 (0x00807F, rgb_at (0));
+  TEST_ASSERT_FALSE (lhos_fx_render (&fx, 300, px, 1));
+  TEST_ASSERT_EQUAL_HEX32 (0x0000FF, rgb_at (0));
+  fx.nkeys = 0;
+  TEST_ASSERT_EQUAL_UINT32 (0, lhos_fx_cycle_ms (&fx, 1));
+}
+
+void
+test_lut_gamma_and_brightness (void)
+{
+  uint8_t lut[256];
+  lhos_fx_build_lut (lut, 1.0f, 255);
+  for (int i = 0; i < 256; i++)
+    TEST_ASSERT_EQUAL_UINT8 (i, lut[i]);
+  lhos_fx_build_lut (lut, 2.2f, 255);
+  TEST_ASSERT_EQUAL_UINT8 (0, lut[0]);
+  TEST_ASSERT_EQUAL_UINT8 (255, lut[255]);
+  TEST_ASSERT_EQUAL_UINT8 (56, lut[128]);
+  lhos_fx_build_lut (lut, 1.0f, 128);
+  TEST_ASSERT_EQUAL_UINT8 (128, lut[255]);
+  TEST_ASSERT_EQUAL_UINT8 (64, lut[128]);
+}
+
+void
+test_convert_channel_orders (void)
+{
+  const uint8_t rgb[] = { 0x11, 0x22, 0x33, 0x44, 0x55, 0x66 };
+  const uint8_t bgr[] = { 0x33, 0x22, 0x11, 0x66, 0x55, 0x44 };
+  const uint8_t expect[] = { 0x22, 0x11, 0x33, 0x55, 0x44, 0x66 };
+  lhos_fx_convert (px, rgb, 2, LHOS_FX_RGB, NULL);
+  TEST_ASSERT_EQUAL_HEX8_ARRAY (expect, px, sizeof (expect));
+  memset (px, 0, sizeof (px));
+  lhos_fx_convert (px, bgr, 2, LHOS_FX_BGR, NULL);
+  TEST_ASSERT_EQUAL_HEX8_ARRAY (expect, px, sizeof (expect));
+  lhos_fx_convert (px, expect, 2, LHOS_FX_GRB, NULL);
+  TEST_ASSERT_EQUAL_HEX8_ARRAY (expect, px, sizeof (expect));
+}
+
+void
+test_hsv_and_palette (void)
+{
+  uint8_t palette[256 * 3] = { 0 };
+  const uint8_t idx[] = { 0, 255 };
+  TEST_ASSERT_EQUAL_HEX32 (0xFF0000, lhos_fx_hsv (0, 255, 255));
+  TEST_ASSERT_EQUAL_HEX32 (0x0000FF, lhos_fx_hsv (172, 255, 255));
+  TEST_ASSERT_EQUAL_HEX32 (0x808080, lhos_fx_hsv (99, 0, 128));
+  TEST_ASSERT_EQUAL_HEX32 (0, lhos_fx_hsv (42, 255, 0));
+
+  palette[255 * 3] = 0xAB; /* green of entry 255 */
+  lhos_fx_convert (px, idx, 2, LHOS_FX_INDEX, palette);
+  TEST_ASSERT_EQUAL_HEX32 (0, rgb_at (0));
+  TEST_ASSERT_EQUAL_HEX32 (0x00AB00, rgb_at (1));
+  TEST_ASSERT_EQUAL_UINT (1, lhos_fx_format_size (LHOS_FX_INDEX));
+  TEST_ASSERT_EQUAL_UINT (3, lhos_fx_format_size (LHOS_FX_HSV));
+}